@@ -41,6 +41,7 @@ Functions:
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/un.h>
 #include <netdb.h>
 
@@ -87,6 +88,10 @@ Args:
       if (connect(sockfd, res->ai_addr, res->ai_addrlen) < 0) 
       { perror("Error opening INET socket: wrong port or server unreachable"); exit(-1); }
       freeaddrinfo(res);
+
+      // sends the small messages of the protocol without delay
+      int flag = 1;
+      setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
    }
    else
    {  
@@ -96,7 +101,7 @@ Args:
       memset(&serv_addr, 0, sizeof(serv_addr));
       serv_addr.sun_family = AF_UNIX;
       strcpy(serv_addr.sun_path, "/tmp/ipi_");
-      strcpy(serv_addr.sun_path+9, host);
+      strncpy(serv_addr.sun_path+9, host, sizeof(serv_addr.sun_path)-10);
       // creates a unix socket
   
       // creates the socket
@@ -121,12 +126,19 @@ Args:
 */
 
 {
-   int n;
+   int n, nw;
    int sockfd=psockfd;
    int len=plen;
 
-   n = write(sockfd,data,len);
-   if (n < 0) { perror("Error writing to socket: server has quit or connection broke"); exit(-1); }
+   // a write can send only part of the data, so it is repeated until all
+   // of it is sent
+   n = 0;
+   while (n < len)
+   {
+      nw = write(sockfd,&data[n],len-n);
+      if (nw < 0) { perror("Error writing to socket: server has quit or connection broke"); exit(-1); }
+      n += nw;
+   }
 }
 
 
@@ -149,7 +161,7 @@ Args:
    while (nr>0 && n<len )
    {  nr=read(sockfd,&data[n],len-n); n+=nr; }
 
-   if (n == 0) { perror("Error reading from socket: server has quit or connection broke"); exit(-1); }
+   if (n < len) { perror("Error reading from socket: server has quit or connection broke"); exit(-1); }
 }
 
 
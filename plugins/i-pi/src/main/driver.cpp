@@ -7,6 +7,16 @@
 #include <cstring>
 #include <stdexcept>
 #include <cstdlib>
+#include <unistd.h>
+#include <map>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <algorithm>
+
+#ifdef _OPENMP
+# include <omp.h>
+#endif
 
 #include "io_tools/read_nrg.h"
 #include "io_tools/write_nrg.h"
@@ -21,6 +31,47 @@ namespace {
 
 static std::vector<bblock::System> systems;
 
+// System of a bead (replica) of the path integral, with its box. A bead
+// is served by one client at a time, so the history of its induced
+// dipoles follows the bead whichever client evaluates it
+struct Bead {
+  bblock::System sys;
+  std::vector<double> box;
+  std::mutex mutex;
+};
+
+// Beads by replica index, created from systems[0] when first requested
+std::map<int, std::unique_ptr<Bead> > beads;
+std::mutex beads_mutex;
+
+// File with the dipole history (iel) of bead rid. Bead 0 uses the file
+// passed with -r, so a single bead run keeps the same file
+std::string HistoryFile(const std::string &hist_file, int rid) {
+  if (rid == 0) return hist_file;
+  return hist_file + "." + std::to_string(rid);
+}
+
+// Bead rid, created with the dipole history of its file if there is one
+Bead &GetBead(int rid, const std::string &hist_file) {
+  std::lock_guard<std::mutex> lock(beads_mutex);
+  std::unique_ptr<Bead> &b = beads[rid];
+  if (!b) {
+    b.reset(new Bead);
+    b->sys = systems[0];
+    if (hist_file != "") {
+      std::ifstream ifs(HistoryFile(hist_file, rid).c_str(),
+                        std::ios::binary);
+      if (ifs) {
+        std::vector<double> hist;
+        double h;
+        while (ifs.read((char*) &h, sizeof(double))) hist.push_back(h);
+        b->sys.SetDipoleHistory(hist);
+      }
+    }
+  }
+  return *b;
+}
+
 } // namespace
 
 const int LENMSG = 12;
@@ -33,169 +84,288 @@ const std::string GETFORCE   = "GETFORCE    ";
 const std::string POSDATA    = "POSDATA     ";
 const std::string FORCEREADY = "FORCEREADY  ";
 const std::string INIT       = "INIT        ";
+const std::string EXIT       = "EXIT        ";
 
-////////////////////////////////////////////////////////////////////////////////
-
-int main(int argc, char** argv)
-{
-
-  if (argc != 4) {
-    std::cerr << "Usage: " << argv[0] << " <input.nrg> <port> <host>"
-              << std::endl;
-    return 0;
-  }
-
-  try {
-    std::ifstream ifs(argv[1]);
-
-    if (!ifs){
-      throw std::runtime_error("could not open the NRG file");
-    }
+// Units of i-PI (atomic units) in the units of the system
+const double BOHR = 1.8897259886;   // bohr per angstrom
+const double HARTREE = 627.509;     // kcal/mol per hartree
 
-    tools::ReadNrg(argv[1], systems);
-  } catch (const std::exception& e) {
-    std::cerr << " ** Error ** : " << e.what() << std::endl;
-    return 1;
-  }
+////////////////////////////////////////////////////////////////////////////////
 
-  // Initialize defaults
+// Serves the forces of the beads to i-PI through a socket, until i-PI
+// sends EXIT. If use_pbc is true, the system is periodic with the cell
+// of each step
+void Client(int inet, int port, const char* host, bool use_pbc,
+            const std::string &hist_file, bool verbose) {
   int socket = 0;
-  int inet = 0;
-  int port = atoi(argv[2]);
-  char * host = argv[3];
-  
-
   open_socket(&socket, &inet, &port, host);
 
   // Variables needed for MD loop
   char init_buffer[LENINIT + 1];
   char header[LENMSG + 1];
-  std::vector<double> box = {100, 0, 0, 0, 100, 0, 0, 0, 100};
-  std::vector<double> boxi = {100, 0, 0, 0, 100, 0, 0, 0, 100};
-  std::vector<double> virial = {0, 0, 0, 0, 0, 0, 0, 0, 0};
-  int rid;
-  int rid_old = 0;
+  std::vector<double> cell(9), celli(9), box(9);
+  std::vector<double> virial(9, 0.0);
+  int rid = 0;
   int cbuf;
   int buffl = LENMSG;
   bool isinit = false;
   bool hasdata = false;
 
-  // Set method to aspc (by default) for now
-  systems[0].SetDipoleMethod("aspc");
-//  systems[0].SetDipoleMethod("cg");
-
   int nat = int(systems[0].GetNumRealSites());
   double energy = 0.0;
   int bsize = 0;
   std::vector<double> buffer;
-  
-  try {
-  
+
+  while (true) {
+
     while (true) {
-       
-      while (true) {
-  
-        buffl = LENMSG;
-        if (!hasdata) {
-          readbuffer(socket,header,buffl);
-        } else {
-          throw std::runtime_error("Wrapper did not ask for data yet");
-        }
-  
-        if (strncmp(header,STATUS.data(),STATUS.length()) == 0) {
-          if (!isinit) {
-            writebuffer(socket,NEEDINIT.data(),NEEDINIT.length());
-          } else {
-            writebuffer(socket,READY.data(),READY.length());
-          }
-        } else if (strncmp(header,INIT.data(),INIT.length()) == 0) {
-          readbuffer(socket, (char*) &rid, sizeof(int));
-          readbuffer(socket, (char*) &cbuf, sizeof(int));
-          readbuffer(socket,init_buffer,cbuf);
-          isinit = true;
-        } else {
-          break;
-        }
+
+      buffl = LENMSG;
+      if (!hasdata) {
+        readbuffer(socket,header,buffl);
+      } else {
+        throw std::runtime_error("Wrapper did not ask for data yet");
       }
-  
-      if (strncmp(header,POSDATA.data(),POSDATA.length()) == 0) {
-        readbuffer(socket, (char*) box.data(), 9*sizeof(double));
-        readbuffer(socket, (char*) boxi.data(), 9*sizeof(double));
-        readbuffer(socket, (char*) &nat, sizeof(int));
-  
-        if (bsize == 0) {
-          bsize = 3*nat;
-          buffer = std::vector<double>(3*nat);
-        } else if (bsize != 3*nat) {
-          throw std::runtime_error("Number of atoms has changed.");
+
+      if (strncmp(header,STATUS.data(),STATUS.length()) == 0) {
+        if (!isinit) {
+          writebuffer(socket,NEEDINIT.data(),NEEDINIT.length());
+        } else {
+          writebuffer(socket,READY.data(),READY.length());
         }
-  
-        readbuffer(socket, (char*) buffer.data(), bsize*sizeof(double));
-  
+      } else if (strncmp(header,INIT.data(),INIT.length()) == 0) {
+        readbuffer(socket, (char*) &rid, sizeof(int));
+        readbuffer(socket, (char*) &cbuf, sizeof(int));
+        readbuffer(socket,init_buffer,cbuf);
+        isinit = true;
       } else {
-        throw std::runtime_error("Wrapper did not send the positions");
+        break;
       }
-  
-      // Get forces here and store them in buffer
-      for (size_t i = 0; i < buffer.size(); i++) {
-        buffer[i] /= 1.8897259886;
+    }
+
+    if (strncmp(header,EXIT.data(),EXIT.length()) == 0) {
+      close(socket);
+      return;
+    }
+
+    if (strncmp(header,POSDATA.data(),POSDATA.length()) == 0) {
+      readbuffer(socket, (char*) cell.data(), 9*sizeof(double));
+      readbuffer(socket, (char*) celli.data(), 9*sizeof(double));
+      readbuffer(socket, (char*) &nat, sizeof(int));
+
+      if (bsize == 0) {
+        bsize = 3*nat;
+        buffer = std::vector<double>(3*nat);
+      } else if (bsize != 3*nat) {
+        throw std::runtime_error("Number of atoms has changed.");
       }
 
-      if (rid != rid_old) {
-        systems[0].ResetDipoleHistory();
+      readbuffer(socket, (char*) buffer.data(), bsize*sizeof(double));
+
+    } else {
+      throw std::runtime_error("Wrapper did not send the positions");
+    }
+
+    // Get forces here and store them in buffer
+    for (size_t i = 0; i < buffer.size(); i++) {
+      buffer[i] /= BOHR;
+    }
+
+    // The cell matrix has the cell vectors as columns, and the box of the
+    // system has them as rows
+    for (size_t i = 0; i < 3; i++) {
+      for (size_t j = 0; j < 3; j++) {
+        box[3*i + j] = cell[3*j + i] / BOHR;
       }
-      
-      rid_old = rid;
-      systems[0].SetRealXyz(buffer);
-      energy = systems[0].Energy(true) / 627.509;
-      buffer = systems[0].GetRealGrads();
-      for (size_t i = 0; i < buffer.size(); i++) {
-//        buffer[i] = -buffer[i] / 627.509;
-        buffer[i] = -buffer[i] / 1.8897259886 / 627.509;
+    }
+
+    Bead &bead = GetBead(rid, hist_file);
+    {
+      std::lock_guard<std::mutex> lock(bead.mutex);
+      if (use_pbc && box != bead.box) {
+        bead.sys.SetPBC(true, box);
+        bead.box = box;
       }
-      // TODO check virial
-      virial = std::vector<double>(9,0.0);
-  
-      hasdata = true;
-      header[0] = '\0';
-  
-      while (true) {
-        buffl = LENMSG;
-        if (hasdata) {
-          readbuffer(socket,header,buffl);
-        } else {
-          throw std::runtime_error("No data to sent to wrapper");
-        }
-  
-        if (strncmp(header,STATUS.data(),STATUS.length()) == 0) {
-          writebuffer(socket,HAVEDATA.data(),HAVEDATA.length());
-        } else {
-          break;
-        }
+
+      bead.sys.SetRealXyz(buffer);
+      energy = bead.sys.Energy(true) / HARTREE;
+      bead.sys.GetRealGrads(buffer.data());
+      virial = bead.sys.GetVirial();
+
+      if (verbose) {
+        std::cerr << "Bead " << rid << " dipoles: iterations = "
+                  << bead.sys.GetDipoleIterations()
+                  << " residual = " << std::scientific
+                  << bead.sys.GetDipoleResidual() << std::endl;
+      }
+
+      // Save the dipole history for restarts
+      if (hist_file != "") {
+        std::vector<double> hist = bead.sys.GetDipoleHistory();
+        std::ofstream ofs(HistoryFile(hist_file, rid).c_str(),
+                          std::ios::binary);
+        ofs.write((char*) hist.data(), hist.size() * sizeof(double));
+      }
+    }
+
+    for (size_t i = 0; i < buffer.size(); i++) {
+      buffer[i] = -buffer[i] / BOHR / HARTREE;
+    }
+    for (size_t i = 0; i < virial.size(); i++) {
+      virial[i] /= HARTREE;
+    }
+
+    hasdata = true;
+    header[0] = '\0';
+
+    while (true) {
+      buffl = LENMSG;
+      if (hasdata) {
+        readbuffer(socket,header,buffl);
+      } else {
+        throw std::runtime_error("No data to sent to wrapper");
       }
-  
-      if (strncmp(header,GETFORCE.data(),GETFORCE.length()) == 0) {
-        writebuffer(socket, FORCEREADY.data(), FORCEREADY.length());
-        writebuffer(socket,(char*) &energy,sizeof(double));
-        writebuffer(socket,(char*) &nat,sizeof(int));
-        writebuffer(socket,(char*) buffer.data(), bsize*sizeof(double));
-        writebuffer(socket,(char*) virial.data(),9*sizeof(double));
-        nat=0;
-        writebuffer(socket,(char*) &nat,sizeof(int));
-  
+
+      if (strncmp(header,STATUS.data(),STATUS.length()) == 0) {
+        writebuffer(socket,HAVEDATA.data(),HAVEDATA.length());
       } else {
-        throw std::runtime_error("Wrapper did not ask for forces");
+        break;
       }
-      
-      hasdata = false;
-      isinit = false;
-      
     }
 
+    if (strncmp(header,GETFORCE.data(),GETFORCE.length()) == 0) {
+      writebuffer(socket, FORCEREADY.data(), FORCEREADY.length());
+      writebuffer(socket,(char*) &energy,sizeof(double));
+      writebuffer(socket,(char*) &nat,sizeof(int));
+      writebuffer(socket,(char*) buffer.data(), bsize*sizeof(double));
+      writebuffer(socket,(char*) virial.data(),9*sizeof(double));
+      int nextra = 0;
+      writebuffer(socket,(char*) &nextra,sizeof(int));
+
+    } else {
+      throw std::runtime_error("Wrapper did not ask for forces");
+    }
+
+    hasdata = false;
+    isinit = false;
+
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char** argv)
+{
+
+  // Optional arguments
+  // -m Method to compute the induced dipoles (iter, cg, aspc, iel)
+  // -r File with the dipole history (iel), read at the beginning if it
+  //    exists and written after every step to allow restarts. Bead n > 0
+  //    uses the file with the extension .n
+  // -k Order of the ASPC predictor (0 to 4)
+  // -c Maximum number of ASPC corrector steps and tolerance (maxit,tol)
+  // -i Connects through an internet socket, to host and port, instead of
+  //    the UNIX domain socket /tmp/ipi_<host> (the port is ignored)
+  // -p Periodic boundary conditions, with the cell sent by i-PI
+  // -n Number of clients, each one in a thread with its own connection,
+  //    to evaluate several beads at once
+  // -v Prints the iterations and residual of the dipoles at each step
+  std::string dip_method = "aspc";
+  std::string hist_file = "";
+  int k_aspc = 4;
+  int maxit_aspc = 1;
+  double tol_aspc = 1E-16;
+  int inet = 0;
+  bool use_pbc = false;
+  int nclients = 1;
+  bool verbose = false;
+  bool bad_args = false;
+  int opt;
+  while (!bad_args && (opt = getopt(argc, argv, "m:r:k:c:ipn:v")) != -1) {
+    if (opt == 'm') {
+      dip_method = optarg;
+    } else if (opt == 'r') {
+      hist_file = optarg;
+    } else if (opt == 'k') {
+      bad_args = sscanf(optarg, "%d", &k_aspc) != 1;
+    } else if (opt == 'c') {
+      bad_args = sscanf(optarg, "%d,%lf", &maxit_aspc, &tol_aspc) != 2;
+    } else if (opt == 'i') {
+      inet = 1;
+    } else if (opt == 'p') {
+      use_pbc = true;
+    } else if (opt == 'n') {
+      bad_args = sscanf(optarg, "%d", &nclients) != 1;
+    } else if (opt == 'v') {
+      verbose = true;
+    } else {
+      bad_args = true;
+    }
+  }
+
+  if (bad_args || argc - optind != 3 || k_aspc < 0 || maxit_aspc < 1
+      || nclients < 1) {
+    std::cerr << "Usage: " << argv[0]
+              << " [-m dipole_method] [-r dipole_history_file]"
+              << " [-k aspc_order] [-c aspc_maxit,aspc_tol] [-i] [-p]"
+              << " [-n nclients] [-v]"
+              << " <input.nrg> <port> <host>"
+              << std::endl;
+    return 1;
+  }
+
+  char * nrg_file = argv[optind];
+
+  try {
+    std::ifstream ifs(nrg_file);
+
+    if (!ifs){
+      throw std::runtime_error("could not open the NRG file");
+    }
+
+    tools::ReadNrg(nrg_file, systems);
   } catch (const std::exception& e) {
     std::cerr << " ** Error ** : " << e.what() << std::endl;
     return 1;
   }
-  
-  return 0;
+
+  int port = atoi(argv[optind + 1]);
+  char * host = argv[optind + 2];
+
+  // Set method to aspc by default. The beads are copies of systems[0]
+  systems[0].SetDipoleMethod(dip_method);
+  try {
+    systems[0].SetAspcOrder(k_aspc);
+    systems[0].SetAspcCorrector(maxit_aspc, tol_aspc);
+  } catch (const std::exception& e) {
+    std::cerr << " ** Error ** : " << e.what() << std::endl;
+    return 1;
+  }
+
+  // The threads are shared between the clients
+  int nthreads = 1;
+# ifdef _OPENMP
+  nthreads = std::max(1, omp_get_max_threads() / nclients);
+# endif
+
+  int exit_code = 0;
+  std::mutex exit_mutex;
+  std::vector<std::thread> clients;
+  for (int i = 0; i < nclients; i++) {
+    clients.push_back(std::thread([&] {
+#     ifdef _OPENMP
+      omp_set_num_threads(nthreads);
+#     endif
+      try {
+        Client(inet, port, host, use_pbc, hist_file, verbose);
+      } catch (const std::exception& e) {
+        std::lock_guard<std::mutex> lock(exit_mutex);
+        std::cerr << " ** Error ** : " << e.what() << std::endl;
+        exit_code = 1;
+      }
+    }));
+  }
+  for (size_t i = 0; i < clients.size(); i++) clients[i].join();
+
+  return exit_code;
 }
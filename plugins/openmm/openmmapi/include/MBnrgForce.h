@@ -109,8 +109,37 @@ public:
      * your force.
      */
     bool usesPeriodicBoundaryConditions() const {
-        return false;
+        return periodic;
     }
+    /**
+     * Set whether the force uses periodic boundary conditions. If it does, the periodic box vectors of the
+     * Context are passed to the MB-nrg system at every step. The default is false.
+     *
+     * @param periodic  true to use periodic boundary conditions
+     */
+    void setUsesPeriodicBoundaryConditions(bool periodic) {
+        this->periodic = periodic;
+    }
+    /**
+     * Set the method used to compute the induced dipoles (iter, cg, aspc or iel). The default, aspc, predicts
+     * the dipoles from the previous steps, so it is only meant for dynamics; use cg for unrelated configurations
+     * (minimization, finite differences, Monte Carlo).
+     *
+     * @param method    the method for the induced dipoles
+     */
+    void setDipoleMethod(const std::string& method) {
+        dipoleMethod = method;
+    }
+    const std::string& getDipoleMethod() const {
+        return dipoleMethod;
+    }
+    /**
+     * Get the virial of the last force evaluation in a Context, as -dE/d(strain) in kJ/mol (9 components,
+     * element 3*a+b is -sum_i g_ia x_ib). Its trace over 3V is the contribution of this force to the pressure.
+     *
+     * @param context   the Context in which the force was evaluated
+     */
+    std::vector<double> getVirial(OpenMM::Context& context);
 
     std::vector<std::string> mbnrg_monomer_names;
     std::vector<int> sites;
@@ -119,6 +148,8 @@ public:
 protected:
     OpenMM::ForceImpl* createImpl() const;
 private:
+    bool periodic;
+    std::string dipoleMethod;
 //    class BondInfo;
 //    std::vector<BondInfo> bonds;
 };
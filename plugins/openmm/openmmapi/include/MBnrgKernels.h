@@ -37,6 +37,7 @@
 #include "openmm/Platform.h"
 #include "openmm/System.h"
 #include <string>
+#include <vector>
 
 namespace MBnrgPlugin {
 
@@ -73,6 +74,12 @@ public:
      * @param force      the MBnrgForce to copy the parameters from
      */
     virtual void copyParametersToContext(OpenMM::ContextImpl& context, const MBnrgForce& force) = 0;
+    /**
+     * Get the virial of the last call to execute() with forces, as -dE/d(strain) in kJ/mol.
+     *
+     * @return the 9 components of the virial
+     */
+    virtual std::vector<double> getVirial() = 0;
 };
 
 } // namespace MBnrgPlugin
@@ -65,6 +65,7 @@ public:
     std::vector<std::string> getKernelNames();
 //    std::vector<std::pair<int, int> > getBondedParticles() const;
     void updateParametersInContext(OpenMM::ContextImpl& context);
+    std::vector<double> getVirial();
 private:
     const MBnrgForce& owner;
     OpenMM::Kernel kernel;
@@ -38,7 +38,7 @@ using namespace MBnrgPlugin;
 using namespace OpenMM;
 using namespace std;
 
-MBnrgForce::MBnrgForce() {
+MBnrgForce::MBnrgForce() : periodic(false), dipoleMethod("aspc") {
 }
 
 //int MBnrgForce::addBond(int particle1, int particle2, double length, double k) {
@@ -97,3 +97,7 @@ ForceImpl* MBnrgForce::createImpl() const {
 void MBnrgForce::updateParametersInContext(Context& context) {
     dynamic_cast<MBnrgForceImpl&>(getImplInContext(context)).updateParametersInContext(getContextImpl(context));
 }
+
+std::vector<double> MBnrgForce::getVirial(Context& context) {
+    return dynamic_cast<MBnrgForceImpl&>(getImplInContext(context)).getVirial();
+}
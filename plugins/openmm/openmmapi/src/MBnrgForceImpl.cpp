@@ -81,3 +81,7 @@ std::vector<std::string> MBnrgForceImpl::getKernelNames() {
 void MBnrgForceImpl::updateParametersInContext(ContextImpl& context) {
     kernel.getAs<CalcMBnrgForceKernel>().copyParametersToContext(context, owner);
 }
+
+std::vector<double> MBnrgForceImpl::getVirial() {
+    return kernel.getAs<CalcMBnrgForceKernel>().getVirial();
+}
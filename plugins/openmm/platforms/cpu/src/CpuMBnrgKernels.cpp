@@ -0,0 +1,151 @@
+/* -------------------------------------------------------------------------- *
+ *                                   OpenMM                                   *
+ * -------------------------------------------------------------------------- *
+ * This is part of the OpenMM molecular simulation toolkit originating from   *
+ * Simbios, the NIH National Center for Physics-Based Simulation of           *
+ * Biological Structures at Stanford, funded under the NIH Roadmap for        *
+ * Medical Research, grant U54 GM072970. See https://simtk.org.               *
+ *                                                                            *
+ * Portions copyright (c) 2014 Stanford University and the Authors.           *
+ * Authors: Peter Eastman                                                     *
+ * Contributors:                                                              *
+ *                                                                            *
+ * Permission is hereby granted, free of charge, to any person obtaining a    *
+ * copy of this software and associated documentation files (the "Software"), *
+ * to deal in the Software without restriction, including without limitation  *
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,   *
+ * and/or sell copies of the Software, and to permit persons to whom the      *
+ * Software is furnished to do so, subject to the following conditions:       *
+ *                                                                            *
+ * The above copyright notice and this permission notice shall be included in *
+ * all copies or substantial portions of the Software.                        *
+ *                                                                            *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR *
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   *
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    *
+ * THE AUTHORS, CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,    *
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR      *
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE  *
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "CpuMBnrgKernels.h"
+#include "MBnrgForce.h"
+#include "openmm/OpenMMException.h"
+#include "openmm/internal/ContextImpl.h"
+#include "openmm/reference/ReferencePlatform.h"
+
+#ifdef _OPENMP
+# include <omp.h>
+#endif
+
+using namespace MBnrgPlugin;
+using namespace OpenMM;
+using namespace std;
+
+// Units of OpenMM (nm, kJ/mol) in the units of MB-nrg (angstrom, kcal/mol)
+static const double NM_TO_ANG = 10.0;
+static const double KCAL_TO_KJ = 4.184;
+
+// The CPU platform keeps the positions and forces in the data of the
+// reference platform
+static vector<Vec3>& extractPositions(ContextImpl& context) {
+    ReferencePlatform::PlatformData* data = reinterpret_cast<ReferencePlatform::PlatformData*>(context.getPlatformData());
+    return *((vector<Vec3>*) data->positions);
+}
+
+static vector<Vec3>& extractForces(ContextImpl& context) {
+    ReferencePlatform::PlatformData* data = reinterpret_cast<ReferencePlatform::PlatformData*>(context.getPlatformData());
+    return *((vector<Vec3>*) data->forces);
+}
+
+void CpuCalcMBnrgForceKernel::initialize(const System& system, const MBnrgForce& force) {
+    // The particles of monomer i are its force.atoms[i] atoms, followed
+    // by its virtual sites, up to force.sites[i]
+    size_t pos = 0;
+    realParticles.clear();
+    for (size_t i = 0; i < force.mbnrg_monomer_names.size(); i++) {
+        std::vector<double> coords(3*force.atoms[i], 0.0);
+        mbnrg_system.AddMonomer(coords, force.at_names[i], force.mbnrg_monomer_names[i]);
+        for (int j = 0; j < force.atoms[i]; j++)
+            realParticles.push_back(pos + j);
+        pos += force.sites[i];
+    }
+    numParticles = pos;
+    if (system.getNumParticles() != numParticles)
+        throw OpenMMException("MBnrgForce: the monomers do not match the number of particles");
+
+    mbnrg_system.Initialize();
+    mbnrg_system.SetDipoleMethod(force.getDipoleMethod());
+
+    xyz.assign(3*realParticles.size(), 0.0);
+    grad.assign(3*realParticles.size(), 0.0);
+    box.assign(9, 0.0);
+    virial.assign(9, 0.0);
+    usePbc = force.usesPeriodicBoundaryConditions();
+}
+
+double CpuCalcMBnrgForceKernel::execute(ContextImpl& context, bool includeForces, bool includeEnergy) {
+    vector<Vec3>& pos = extractPositions(context);
+    vector<Vec3>& force = extractForces(context);
+
+    // Only the real sites are passed to MB-nrg, the virtual sites are
+    // built by the system
+    for (size_t i = 0; i < realParticles.size(); i++) {
+        const Vec3& p = pos[realParticles[i]];
+        xyz[3*i + 0] = p[0] * NM_TO_ANG;
+        xyz[3*i + 1] = p[1] * NM_TO_ANG;
+        xyz[3*i + 2] = p[2] * NM_TO_ANG;
+    }
+
+    // The box only changes with a barostat, so the system is only updated
+    // when it does
+    if (usePbc) {
+        Vec3 a, b, c;
+        context.getPeriodicBoxVectors(a, b, c);
+        Vec3 vectors[3] = {a, b, c};
+        bool changed = !hasBox;
+        for (size_t i = 0; i < 3; i++) {
+            for (size_t j = 0; j < 3; j++) {
+                double l = vectors[i][j] * NM_TO_ANG;
+                if (l != box[3*i + j]) changed = true;
+                box[3*i + j] = l;
+            }
+        }
+        if (changed) {
+            mbnrg_system.SetPBC(true, box);
+            hasBox = true;
+        }
+    }
+
+    mbnrg_system.SetRealXyz(xyz.data());
+
+#   ifdef _OPENMP
+    omp_set_num_threads(numThreads);
+#   endif
+    double energy = mbnrg_system.Energy(includeForces) * KCAL_TO_KJ;
+
+    if (includeForces) {
+        // Gradients in kcal/mol/A to forces in kJ/mol/nm, added to the
+        // forces of the other forces of the context
+        const double gradToForce = -KCAL_TO_KJ * NM_TO_ANG;
+        mbnrg_system.GetRealGrads(grad.data());
+        for (size_t i = 0; i < realParticles.size(); i++) {
+            Vec3& f = force[realParticles[i]];
+            f[0] += grad[3*i + 0] * gradToForce;
+            f[1] += grad[3*i + 1] * gradToForce;
+            f[2] += grad[3*i + 2] * gradToForce;
+        }
+        virial = mbnrg_system.GetVirial();
+        for (size_t i = 0; i < virial.size(); i++)
+            virial[i] *= KCAL_TO_KJ;
+    }
+
+    return energy;
+}
+
+void CpuCalcMBnrgForceKernel::copyParametersToContext(ContextImpl& context, const MBnrgForce& force) { }
+
+std::vector<double> CpuCalcMBnrgForceKernel::getVirial() {
+    return virial;
+}
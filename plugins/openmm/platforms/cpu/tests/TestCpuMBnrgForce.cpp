@@ -0,0 +1,167 @@
+/* -------------------------------------------------------------------------- *
+ *                                   OpenMM                                   *
+ * -------------------------------------------------------------------------- *
+ * This is part of the OpenMM molecular simulation toolkit originating from   *
+ * Simbios, the NIH National Center for Physics-Based Simulation of           *
+ * Biological Structures at Stanford, funded under the NIH Roadmap for        *
+ * Medical Research, grant U54 GM072970. See https://simtk.org.               *
+ *                                                                            *
+ * Portions copyright (c) 2014 Stanford University and the Authors.           *
+ * Authors: Peter Eastman                                                     *
+ * Contributors:                                                              *
+ *                                                                            *
+ * Permission is hereby granted, free of charge, to any person obtaining a    *
+ * copy of this software and associated documentation files (the "Software"), *
+ * to deal in the Software without restriction, including without limitation  *
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,   *
+ * and/or sell copies of the Software, and to permit persons to whom the      *
+ * Software is furnished to do so, subject to the following conditions:       *
+ *                                                                            *
+ * The above copyright notice and this permission notice shall be included in *
+ * all copies or substantial portions of the Software.                        *
+ *                                                                            *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR *
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   *
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    *
+ * THE AUTHORS, CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,    *
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR      *
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE  *
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.                                     *
+ * -------------------------------------------------------------------------- */
+
+/**
+ * This tests the CPU implementation of MBnrgForce.
+ */
+
+#include "MBnrgForce.h"
+#include "openmm/internal/AssertionUtilities.h"
+#include "openmm/Context.h"
+#include "openmm/HarmonicBondForce.h"
+#include "openmm/Platform.h"
+#include "openmm/System.h"
+#include "openmm/VerletIntegrator.h"
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+using namespace MBnrgPlugin;
+using namespace OpenMM;
+using namespace std;
+
+extern "C" OPENMM_EXPORT void registerMBnrgCpuKernelFactories();
+
+// Water trimer of tests/water3.pdb, in nm. The M sites are not used
+vector<Vec3> trimerPositions() {
+    const double xyz[12][3] = {{-1.516, -0.202,  1.455}, {-0.622, -0.601,  1.572},
+                               {-2.018, -0.419,  2.240}, { 0.000,  0.000,  0.000},
+                               {-1.763, -0.381, -1.300}, {-1.903, -0.493, -0.345},
+                               {-2.527, -0.761, -1.733}, { 0.000,  0.000,  0.000},
+                               {-0.559,  2.007, -0.139}, {-0.941,  1.541,  0.616},
+                               {-0.985,  1.567, -0.883}, { 0.000,  0.000,  0.000}};
+    vector<Vec3> positions(12);
+    for (int i = 0; i < 12; i++)
+        positions[i] = Vec3(xyz[i][0], xyz[i][1], xyz[i][2]) * 0.1;
+    return positions;
+}
+
+MBnrgForce* trimerForce(System& system) {
+    for (int i = 0; i < 12; i++)
+        system.addParticle(i % 4 == 3 ? 0.0 : 1.0);
+    MBnrgForce* force = new MBnrgForce();
+    force->addMonomerList(vector<string>(3, "HOH"));
+    // The configurations of the finite differences are unrelated
+    force->setDipoleMethod("cg");
+    system.addForce(force);
+    return force;
+}
+
+void testForce() {
+    vector<Vec3> positions = trimerPositions();
+    System system;
+    trimerForce(system);
+
+    // A second force, whose forces must be kept
+    HarmonicBondForce* bond = new HarmonicBondForce();
+    bond->addBond(0, 4, 0.3, 100.0);
+    system.addForce(bond);
+
+    VerletIntegrator integ(1.0);
+    Platform& platform = Platform::getPlatformByName("CPU");
+    Context context(system, integ, platform);
+    context.setPositions(positions);
+    State state = context.getState(State::Energy | State::Forces);
+
+    // Energy of the trimer, plus the bond
+    double r = sqrt((positions[0]-positions[4]).dot(positions[0]-positions[4]));
+    double expectedEnergy = -36.7729332953 + 0.5*100.0*(r-0.3)*(r-0.3);
+    ASSERT_EQUAL_TOL(expectedEnergy, state.getPotentialEnergy(), 1e-6);
+
+    // Validate the forces of the real sites by moving each particle along
+    // each axis, and see if the energy changes by the correct amount.
+    double offset = 1e-5;
+    for (int i = 0; i < 12; i++) {
+        if (i % 4 == 3) {
+            ASSERT_EQUAL_VEC(Vec3(), state.getForces()[i], 1e-10);
+            continue;
+        }
+        for (int j = 0; j < 3; j++) {
+            vector<Vec3> offsetPos = positions;
+            offsetPos[i][j] = positions[i][j]-offset;
+            context.setPositions(offsetPos);
+            double e1 = context.getState(State::Energy).getPotentialEnergy();
+            offsetPos[i][j] = positions[i][j]+offset;
+            context.setPositions(offsetPos);
+            double e2 = context.getState(State::Energy).getPotentialEnergy();
+            ASSERT_EQUAL_TOL(state.getForces()[i][j], (e1-e2)/(2*offset), 1e-3);
+        }
+    }
+}
+
+void testPeriodicVirial() {
+    vector<Vec3> positions = trimerPositions();
+    System system;
+    MBnrgForce* force = trimerForce(system);
+    force->setUsesPeriodicBoundaryConditions(true);
+    const double box = 2.0;
+    system.setDefaultPeriodicBoxVectors(Vec3(box, 0, 0), Vec3(0, box, 0), Vec3(0, 0, box));
+
+    VerletIntegrator integ(1.0);
+    Platform& platform = Platform::getPlatformByName("CPU");
+    Context context(system, integ, platform);
+    context.setPositions(positions);
+    context.getState(State::Forces);
+    vector<double> virial = force->getVirial(context);
+
+    // Each diagonal component is -dE/d(strain), with the box and the
+    // positions scaled along one axis
+    double strain = 1e-5;
+    for (int a = 0; a < 3; a++) {
+        double e[2];
+        for (int s = 0; s < 2; s++) {
+            double scale = 1.0 + (s == 0 ? strain : -strain);
+            vector<Vec3> scaledPos = positions;
+            for (int i = 0; i < 12; i++)
+                scaledPos[i][a] *= scale;
+            Vec3 vectors[3] = {Vec3(box, 0, 0), Vec3(0, box, 0), Vec3(0, 0, box)};
+            vectors[a][a] *= scale;
+            context.setPeriodicBoxVectors(vectors[0], vectors[1], vectors[2]);
+            context.setPositions(scaledPos);
+            e[s] = context.getState(State::Energy).getPotentialEnergy();
+        }
+        ASSERT_EQUAL_TOL(-(e[0]-e[1])/(2*strain), virial[4*a], 1e-4);
+    }
+}
+
+int main() {
+    try {
+        registerMBnrgCpuKernelFactories();
+        testForce();
+        testPeriodicVirial();
+    }
+    catch(const std::exception& e) {
+        std::cout << "exception: " << e.what() << std::endl;
+        return 1;
+    }
+    std::cout << "Done" << std::endl;
+    return 0;
+}
@@ -44,7 +44,13 @@ extern "C" OPENMM_EXPORT void registerPlatforms() {
 extern "C" OPENMM_EXPORT void registerKernelFactories() {
     for (int i = 0; i < Platform::getNumPlatforms(); i++) {
         Platform& platform = Platform::getPlatform(i);
+        // The CPU platform derives from the reference one. It has its own
+        // kernel if it is built
+#ifdef MBNRG_BUILD_CPU_LIB
+        if (dynamic_cast<ReferencePlatform*>(&platform) != NULL && platform.getName() == "Reference") {
+#else
         if (dynamic_cast<ReferencePlatform*>(&platform) != NULL) {
+#endif
             ReferenceMBnrgKernelFactory* factory = new ReferenceMBnrgKernelFactory();
             platform.registerKernelFactory(CalcMBnrgForceKernel::Name(), factory);
         }
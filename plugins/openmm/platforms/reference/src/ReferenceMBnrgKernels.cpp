@@ -52,9 +52,9 @@ static vector<RealVec>& extractForces(ContextImpl& context) {
 
 void ReferenceCalcMBnrgForceKernel::initialize(const System& system, const MBnrgForce& force) {
 
-    // Can do nothing here (MB-nrg)
-
     mbnrg_initialize(force);
+    if (system.getNumParticles() != numParticles)
+        throw OpenMMException("MBnrgForce: the monomers do not match the number of particles");
     mbsys_initialized = true;
 
 }
@@ -63,6 +63,46 @@ double ReferenceCalcMBnrgForceKernel::execute(ContextImpl& context, bool include
     vector<RealVec>& pos = extractPositions(context);
     vector<RealVec>& force = extractForces(context);
 
+#ifdef MBNRG_BUILD_CPU_LIB
+    // Only the real sites are passed to MB-nrg, the virtual sites are
+    // built by the system
+    double nmtoang = 10.0;
+    for (size_t i = 0; i < realParticles.size(); i++) {
+      xyz[3*i + 0] = pos[realParticles[i]][0] * nmtoang;
+      xyz[3*i + 1] = pos[realParticles[i]][1] * nmtoang;
+      xyz[3*i + 2] = pos[realParticles[i]][2] * nmtoang;
+    }
+
+    if (usePbc) {
+      Vec3 a, b, c;
+      context.getPeriodicBoxVectors(a, b, c);
+      std::vector<double> box = {a[0], a[1], a[2], b[0], b[1], b[2],
+                                 c[0], c[1], c[2]};
+      for (size_t i = 0; i < box.size(); i++) box[i] *= nmtoang;
+      mbnrg_system.SetPBC(true, box);
+    }
+
+    mbnrg_system.SetRealXyz(xyz.data());
+
+    double kcaltokj = 4.184;
+    double kcalperAngtokjpernm = kcaltokj*10;
+    double energy = mbnrg_system.Energy(includeForces) * kcaltokj;
+
+    if (includeForces) {
+      mbnrg_system.GetRealGrads(grad.data());
+      for (size_t i = 0; i < realParticles.size(); i++) {
+        force[realParticles[i]][0] -= grad[3*i + 0]*kcalperAngtokjpernm;
+        force[realParticles[i]][1] -= grad[3*i + 1]*kcalperAngtokjpernm;
+        force[realParticles[i]][2] -= grad[3*i + 2]*kcalperAngtokjpernm;
+      }
+      virial = mbnrg_system.GetVirial();
+      for (size_t i = 0; i < virial.size(); i++) virial[i] *= kcaltokj;
+    }
+#else
+    // Until the kernels are checked against an OpenMM build, the default
+    // one keeps the original behaviour: all the particles, virtual sites
+    // included, are passed to MB-nrg, and the forces of the context are
+    // overwritten
     double nmtoang = 10.0;
     std::vector<double> xyz_context(3*pos.size());
     for (size_t i = 0; i < pos.size(); i++) {
@@ -71,34 +111,50 @@ double ReferenceCalcMBnrgForceKernel::execute(ContextImpl& context, bool include
       xyz_context[3*i + 2] = pos[i][2] * nmtoang;
     }
 
+    mbnrg_system.SetXyz(xyz_context);
 
-    mbnrg_system.SetOriginalOrderSysXyz(xyz_context);
-    
     double kcaltokj = 4.184;
     double kcalperAngtokjpernm = kcaltokj*10;
-    std::vector<double> grad(3*force.size(),0.0);
-    double energy = mbnrg_system.Energy(grad,true) * kcaltokj;
-    
+    double energy = mbnrg_system.Energy(true) * kcaltokj;
+    std::vector<double> grad_context = mbnrg_system.GetGrads();
+
     for (size_t i = 0; i < force.size(); i++) {
-      force[i][0] = -grad[3*i + 0]*kcalperAngtokjpernm;
-      force[i][1] = -grad[3*i + 1]*kcalperAngtokjpernm;
-      force[i][2] = -grad[3*i + 2]*kcalperAngtokjpernm;
+      force[i][0] = -grad_context[3*i + 0]*kcalperAngtokjpernm;
+      force[i][1] = -grad_context[3*i + 1]*kcalperAngtokjpernm;
+      force[i][2] = -grad_context[3*i + 2]*kcalperAngtokjpernm;
     }
+    virial = mbnrg_system.GetVirial();
+    for (size_t i = 0; i < virial.size(); i++) virial[i] *= kcaltokj;
+#endif
 
     return energy;
 }
 
 void ReferenceCalcMBnrgForceKernel::copyParametersToContext(ContextImpl& context, const MBnrgForce& force) { }
 
+std::vector<double> ReferenceCalcMBnrgForceKernel::getVirial() {
+    return virial;
+}
+
 void ReferenceCalcMBnrgForceKernel::mbnrg_initialize(const MBnrgForce& force) {
 
+    // The particles of monomer i are its force.atoms[i] atoms, followed
+    // by its virtual sites, up to force.sites[i]
     size_t pos = 0;
+    realParticles.clear();
     for (size_t i = 0; i < force.mbnrg_monomer_names.size(); i++) {
       size_t num_coords = force.atoms[i]*3;
       std::vector<double> coords(num_coords,0.0);
       mbnrg_system.AddMonomer(coords, force.at_names[i], force.mbnrg_monomer_names[i]);
-      pos += force.sites[i]*3;
+      for (int j = 0; j < force.atoms[i]; j++) realParticles.push_back(pos + j);
+      pos += force.sites[i];
     }
-    
+    numParticles = pos;
+    xyz.assign(3*realParticles.size(), 0.0);
+    grad.assign(3*realParticles.size(), 0.0);
+    virial.assign(9, 0.0);
+    usePbc = force.usesPeriodicBoundaryConditions();
+
     mbnrg_system.Initialize();
+    mbnrg_system.SetDipoleMethod(force.getDipoleMethod());
 }
@@ -69,11 +69,23 @@ public:
      * @param force      the MBnrgForce to copy the parameters from
      */
     void copyParametersToContext(OpenMM::ContextImpl& context, const MBnrgForce& force);
+    /**
+     * Get the virial of the last call to execute() with forces, in kJ/mol.
+     */
+    std::vector<double> getVirial();
 private:
 
     void mbnrg_initialize(const MBnrgForce& force);
     bblock::System mbnrg_system;
     bool mbsys_initialized;
+    bool usePbc;
+    int numParticles;
+    // Particles of the real sites, in the order of the system, and their
+    // coordinates (angstrom) and gradients (kcal/mol/A)
+    std::vector<int> realParticles;
+    std::vector<double> xyz;
+    std::vector<double> grad;
+    std::vector<double> virial;
 
 //    int numBonds;
 //    std::vector<int> particle1, particle2;
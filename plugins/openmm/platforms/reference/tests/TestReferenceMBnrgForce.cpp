@@ -77,6 +77,8 @@ void testForce() {
         system.addParticle(1.0);
     }
     MBnrgForce* force = new MBnrgForce();
+    force->addMonomerList(vector<string>(4, "HOH"));
+    force->setDipoleMethod("cg");
     system.addForce(force);
     
     // Compute the forces and energy.
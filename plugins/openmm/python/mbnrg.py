@@ -63,6 +63,10 @@ class MBnrgForceGenerator:
 
 #        force.setNonbondedMethod(methodMap[nonbondedMethod])
 
+#       Periodic systems pass the box of the context to MB-nrg
+        force.setUsesPeriodicBoundaryConditions(
+            nonbondedMethod in (app.PME, app.Ewald, app.CutoffPeriodic))
+
 #       Add monomer information to python pair list
         residue_index_pair = []
         for i in data.atoms:
@@ -43,6 +43,11 @@ public:
 
     void updateParametersInContext(OpenMM::Context& context);
     int addMonomerList(std::vector<std::string> openmmMonomers);
+    bool usesPeriodicBoundaryConditions() const;
+    void setUsesPeriodicBoundaryConditions(bool periodic);
+    void setDipoleMethod(const std::string& method);
+    const std::string& getDipoleMethod() const;
+    std::vector<double> getVirial(OpenMM::Context& context);
 
     /*
      * The reference parameters to this function are output values.
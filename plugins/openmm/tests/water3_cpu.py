@@ -0,0 +1,59 @@
+# Molecular dynamics of water3.pdb with the CPU platform. The energy and
+# forces are compared with the Reference platform first, and the speed of
+# the dynamics is reported in ns/day. Needs the plugin configured with
+# -DMBNRG_BUILD_CPU_LIB=ON, otherwise both platforms use the reference
+# kernel
+
+from simtk.openmm import app, System
+import simtk.openmm as mm
+from simtk import unit
+import sys
+import time
+import mbnrg
+
+nsteps = 1000
+timestep = 0.2*unit.femtoseconds
+
+pdb = app.PDBFile("water3.pdb")
+
+forcefield = app.ForceField(mbnrg.__file__.replace('mbnrg.py', 'mbnrg.xml'))
+
+system = forcefield.createSystem(pdb.topology)
+
+# Energy and forces in both platforms
+states = {}
+for name in ['Reference', 'CPU']:
+    integrator = mm.VerletIntegrator(timestep)
+    platform = mm.Platform.getPlatformByName(name)
+    simulation = app.Simulation(pdb.topology, system, integrator, platform)
+    simulation.context.setPositions(pdb.positions)
+    states[name] = simulation.context.getState(getForces=True, getEnergy=True)
+
+kilocalorie_per_mole_per_angstrom = unit.kilocalorie_per_mole/unit.angstrom
+e_ref = states['Reference'].getPotentialEnergy().value_in_unit(unit.kilocalorie_per_mole)
+e_cpu = states['CPU'].getPotentialEnergy().value_in_unit(unit.kilocalorie_per_mole)
+max_df = 0.0
+for f_ref, f_cpu in zip(states['Reference'].getForces(), states['CPU'].getForces()):
+    df = (f_ref - f_cpu).value_in_unit(kilocalorie_per_mole_per_angstrom)
+    max_df = max(max_df, max(abs(x) for x in df))
+
+print("Energy Reference: %.8f CPU: %.8f kcal/mol" % (e_ref, e_cpu))
+print("Maximum force difference: %.2e kcal/mol/A" % max_df)
+if abs(e_ref - e_cpu) > 1e-6 or max_df > 1e-6:
+    print("CPU and Reference platforms differ")
+    sys.exit(1)
+
+# Dynamics with the CPU platform (the last simulation)
+simulation.context.setVelocitiesToTemperature(300*unit.kelvin)
+simulation.step(10)
+
+simulation.reporters.append(app.StateDataReporter(sys.stdout, nsteps//10, step=True,
+    potentialEnergy=True, totalEnergy=True, temperature=True, speed=True,
+    separator='\t'))
+
+start = time.time()
+simulation.step(nsteps)
+elapsed = time.time() - start
+
+ns = nsteps*timestep.value_in_unit(unit.nanoseconds)
+print("%d steps in %.3f s: %.3f ns/day" % (nsteps, elapsed, ns/elapsed*86400.0))
@@ -1,69 +1,220 @@
+#include "bblock/external_call.h"
+
+#include <vector>
+#include <string>
+#include <iostream>
+#include <exception>
+#include <mutex>
+#include <memory>
+#include <algorithm>
+
 #include "bblock/system.h"
+#include "tools/custom_exceptions.h"
 
-extern "C" {
-void energyf90_(double* coords, int * nat_monomers, char at_names[][5], 
-                 char monomers[][5], int * nmon, double* pot) {
+namespace {
+
+// System of a handle, with its monomers, so a new call with the same
+// monomers only needs to update the coordinates
+struct ExternalSystem {
+  bblock::System sys;
+  std::vector<int> nat;
+  std::vector<std::string> at_names;
+  std::vector<std::string> monomers;
+};
+
+// Systems of the handles. Released handles are null, and reused
+std::vector<std::unique_ptr<ExternalSystem> > handles;
+std::mutex handles_mutex;
 
-  bblock::System s;
+// System of the calls to energyf90_ and energyf90g_
+ExternalSystem last_system;
+bool last_system_ready = false;
+std::mutex last_system_mutex;
+
+// Builds and initializes es with the nmon monomers in coords
+void BuildSystem(double* coords, int * nat_monomers, char at_names[][5],
+                 char monomers[][5], int nmon, ExternalSystem &es) {
+  es.sys = bblock::System();
+  es.nat.assign(nat_monomers, nat_monomers + nmon);
+  es.at_names.clear();
+  es.monomers.clear();
   int count = 0;
-  for (int i = 0; i < *nmon; i++) {
-    std::vector<double> xyz(3*nat_monomers[i]);
-    std::vector<std::string> vAtNames(nat_monomers[i]);
-
-    std::copy(coords + 3*count, 
-              coords + 3*(count + nat_monomers[i]), 
-              xyz.begin());
-    std::copy(at_names + count, 
-              at_names + count + nat_monomers[i], 
-              vAtNames.begin()); 
+  for (int i = 0; i < nmon; i++) {
+    std::vector<double> xyz(coords + 3*count,
+                            coords + 3*(count + nat_monomers[i]));
+    std::vector<std::string> vAtNames(at_names + count,
+                                      at_names + count + nat_monomers[i]);
     std::string id = monomers[i];
-    s.AddMonomer(xyz, vAtNames, id);
+    es.sys.AddMonomer(xyz, vAtNames, id);
+    es.sys.AddMolecule(std::vector<size_t>(1, i));
+    es.at_names.insert(es.at_names.end(), vAtNames.begin(), vAtNames.end());
+    es.monomers.push_back(id);
     count += nat_monomers[i];
   }
+  es.sys.Initialize();
+}
+
+// True if the monomers are the ones of es
+bool SameMonomers(int * nat_monomers, char at_names[][5],
+                  char monomers[][5], int nmon, const ExternalSystem &es) {
+  if (size_t(nmon) != es.monomers.size() ||
+      !std::equal(es.nat.begin(), es.nat.end(), nat_monomers))
+    return false;
+  for (int i = 0; i < nmon; i++) {
+    if (es.monomers[i] != monomers[i]) return false;
+  }
+  for (size_t i = 0; i < es.at_names.size(); i++) {
+    if (es.at_names[i] != at_names[i]) return false;
+  }
+  return true;
+}
+
+// Sets coords in the system of es
+void SetCoordinates(double* coords, ExternalSystem &es) {
+  es.sys.SetRealXyz(coords);
+}
+
+// System of handle
+ExternalSystem &GetSystem(int handle) {
+  std::lock_guard<std::mutex> lock(handles_mutex);
+  if (handle < 0 || size_t(handle) >= handles.size() || !handles[handle]) {
+    std::string text = "Handle " + std::to_string(handle)
+                     + " is not a valid system";
+    throw CUException(__func__,__FILE__,__LINE__,text);
+  }
+  return *handles[handle];
+}
+
+// Writes the gradients of the real sites of es, in input order, to grad
+void GetGradients(ExternalSystem &es, double* grad) {
+  es.sys.GetRealGrads(grad);
+}
+
+// Runs call, and sets ierr to CU_EXTERNAL_OK if it succeeds. Exceptions
+// must not reach a C or Fortran caller, so they are reported, and set
+// ierr to CU_EXTERNAL_ERROR
+template <typename Call>
+void CatchAll(int * ierr, Call call) {
+  try {
+    call();
+    *ierr = CU_EXTERNAL_OK;
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    *ierr = CU_EXTERNAL_ERROR;
+  } catch (...) {
+    std::cerr << "** ERROR ** Unknown exception in the external interface"
+              << std::endl;
+    *ierr = CU_EXTERNAL_ERROR;
+  }
+}
+
+// Prepares the system of the calls to energyf90_ and energyf90g_. Each
+// call is independent of the previous ones, so the dipole history is
+// reset
+bblock::System &LastSystem(double* coords, int * nat_monomers,
+                           char at_names[][5], char monomers[][5],
+                           int nmon) {
+  if (last_system_ready &&
+      SameMonomers(nat_monomers, at_names, monomers, nmon, last_system)) {
+    SetCoordinates(coords, last_system);
+    last_system.sys.ResetDipoleHistory();
+  } else {
+    last_system_ready = false;
+    BuildSystem(coords, nat_monomers, at_names, monomers, nmon, last_system);
+    last_system_ready = true;
+  }
+  return last_system.sys;
+}
 
-  s.Initialize();
+} // namespace
+
+////////////////////////////////////////////////////////////////////////////////
+
+extern "C" {
+void energyf90_(double* coords, int * nat_monomers, char at_names[][5],
+                 char monomers[][5], int * nmon, double* pot) {
+  std::lock_guard<std::mutex> lock(last_system_mutex);
+  bblock::System &s = LastSystem(coords, nat_monomers, at_names, monomers,
+                                 *nmon);
 
   *pot = s.Energy(false);
 }
 
 void energyf90g_(double* coords, int * nat_monomers, char at_names[][5],
                  char monomers[][5], int * nmon, double* grad, double* pot) {
+  std::lock_guard<std::mutex> lock(last_system_mutex);
+  bblock::System &s = LastSystem(coords, nat_monomers, at_names, monomers,
+                                 *nmon);
 
-  bblock::System s;
-  int count = 0;
-  for (int i = 0; i < *nmon; i++) {
-    std::vector<double> xyz(3*nat_monomers[i]);
-    std::vector<std::string> vAtNames(nat_monomers[i]);
-
-    std::copy(coords + 3*count,
-              coords + 3*(count + nat_monomers[i]), 
-              xyz.begin());
-    std::copy(at_names + count, 
-              at_names + count + nat_monomers[i], 
-              vAtNames.begin());
-    std::string id = monomers[i];
-    s.AddMonomer(xyz, vAtNames, id);
-    count += nat_monomers[i];
-  }
+  *pot = s.Energy(true);
+  s.GetRealGrads(grad);
+}
+
+void initsystemf90_(double* coords, int * nat_monomers, char at_names[][5],
+                    char monomers[][5], int * nmon, int * handle,
+                    int * ierr) {
+  *handle = -1;
+  CatchAll(ierr, [&] {
+    std::unique_ptr<ExternalSystem> es(new ExternalSystem);
+    BuildSystem(coords, nat_monomers, at_names, monomers, *nmon, *es);
 
-  s.Initialize();
+    std::lock_guard<std::mutex> lock(handles_mutex);
+    size_t h = 0;
+    while (h < handles.size() && handles[h]) h++;
+    if (h == handles.size()) handles.push_back(nullptr);
+    handles[h] = std::move(es);
+    *handle = h;
+  });
+}
 
-  double energy = s.Energy(true);
+void setboxf90_(int * handle, double* box, int * ierr) {
+  CatchAll(ierr, [&] {
+    ExternalSystem &es = GetSystem(*handle);
+    std::vector<double> vbox(box, box + 9);
+    bool use_pbc = std::any_of(vbox.begin(), vbox.end(),
+                               [](double b) {return b != 0.0;});
+    es.sys.SetPBC(use_pbc, vbox);
+  });
+}
 
-  std::vector<double> gradv = s.GetGrads();
+void setxyzf90_(int * handle, double* coords, int * ierr) {
+  CatchAll(ierr, [&] {
+    SetCoordinates(coords, GetSystem(*handle));
+  });
+}
 
-  std::vector<std::string> newNames = s.GetAtomNames();
-  int count2 = 0;
-  for (size_t i = 0; i < s.GetNumSites(); i++) {
-    if (newNames[i] != "virt") {
-      for (size_t j = 0; j < 3; j++) {
-        grad[count2 + j] = gradv[3*i + j];
-      }
-      count2 += 3;
-    }
-  }
+void energysysf90_(int * handle, double* pot, int * ierr) {
+  CatchAll(ierr, [&] {
+    *pot = GetSystem(*handle).sys.Energy(false);
+  });
+}
+
+void energysysf90g_(int * handle, double* grad, double* pot, int * ierr) {
+  CatchAll(ierr, [&] {
+    ExternalSystem &es = GetSystem(*handle);
+    *pot = es.sys.Energy(true);
+    GetGradients(es, grad);
+  });
+}
+
+void energysysf90gv_(int * handle, double* grad, double* virial,
+                     double* pot, int * ierr) {
+  CatchAll(ierr, [&] {
+    ExternalSystem &es = GetSystem(*handle);
+    *pot = es.sys.Energy(true);
+    GetGradients(es, grad);
+    std::vector<double> vir = es.sys.GetVirial();
+    std::copy(vir.begin(), vir.end(), virial);
+  });
+}
 
-  *pot = energy;
+void finalizesystemf90_(int * handle, int * ierr) {
+  CatchAll(ierr, [&] {
+    GetSystem(*handle);
+    std::lock_guard<std::mutex> lock(handles_mutex);
+    handles[*handle].reset();
+    *handle = -1;
+  });
 }
 
 } // extern C
@@ -0,0 +1,81 @@
+#ifndef EXTERNAL_CALL_H
+#define EXTERNAL_CALL_H
+
+////////////////////////////////////////////////////////////////////////////////
+
+// C and Fortran interface. All the arguments are passed by reference, so
+// the functions can be called from Fortran without an interface block
+// (as energyf90(...)). Names (at_names and monomers) are null terminated,
+// in arrays of 5 characters.
+//
+// energyf90 and energyf90g compute the energy of the system in coords.
+// The system is kept between calls, and only its coordinates are updated
+// if the monomers are the same as in the previous call.
+//
+// The persistent interface keeps a system per handle, for callers that
+// evaluate the same system many times (as an MD code, once per step):
+//   initsystemf90(coords, nat_monomers, at_names, monomers, nmon, handle,
+//                 ierr)
+//   setboxf90(handle, box, ierr)     (optional, periodic boundary conditions)
+//   setxyzf90(handle, coords, ierr)  (every step)
+//   energysysf90g(handle, grad, pot, ierr) or
+//   energysysf90gv(handle, grad, virial, pot, ierr)
+//   finalizesystemf90(handle, ierr)
+// Coordinates and gradients are in the order of the monomers passed to
+// initsystemf90. The history of the induced dipoles is kept between the
+// calls of a handle. A handle must not be used by two threads at once.
+//
+// The functions of the persistent interface do not throw: ierr is set to
+// CU_EXTERNAL_OK if the call succeeds, and to CU_EXTERNAL_ERROR if it
+// fails (an invalid handle, unknown monomers, a wrong box, dipoles that
+// do not converge...), with the message written to the standard error.
+// The outputs of a failed call are undefined, except the handle of
+// initsystemf90, which is set to -1.
+
+// Values of ierr
+#define CU_EXTERNAL_OK 0
+#define CU_EXTERNAL_ERROR 1
+
+extern "C" {
+
+// Energy (pot) of the nmon monomers in coords (xyzxyz...). Monomer i has
+// nat_monomers[i] atoms, and id monomers[i].
+void energyf90_(double* coords, int * nat_monomers, char at_names[][5],
+                char monomers[][5], int * nmon, double* pot);
+
+// As energyf90_, and the gradients of the atoms in grad.
+void energyf90g_(double* coords, int * nat_monomers, char at_names[][5],
+                 char monomers[][5], int * nmon, double* grad, double* pot);
+
+// Creates a system with the nmon monomers in coords, as energyf90_, and
+// sets handle to its handle.
+void initsystemf90_(double* coords, int * nat_monomers, char at_names[][5],
+                    char monomers[][5], int * nmon, int * handle,
+                    int * ierr);
+
+// Sets periodic boundary conditions with the box (9 components) in the
+// system of handle. A box of zeros removes them.
+void setboxf90_(int * handle, double* box, int * ierr);
+
+// Sets the coordinates of the system of handle.
+void setxyzf90_(int * handle, double* coords, int * ierr);
+
+// Energy (pot) of the system of handle.
+void energysysf90_(int * handle, double* pot, int * ierr);
+
+// Energy (pot) and gradients (grad) of the system of handle.
+void energysysf90g_(int * handle, double* grad, double* pot, int * ierr);
+
+// Energy (pot), gradients (grad) and virial (9 components, -dE/d(strain),
+// see System::GetVirial) of the system of handle.
+void energysysf90gv_(int * handle, double* grad, double* virial,
+                     double* pot, int * ierr);
+
+// Releases the system of handle, and sets handle to -1.
+void finalizesystemf90_(int * handle, int * ierr);
+
+} // extern C
+
+////////////////////////////////////////////////////////////////////////////////
+
+#endif // EXTERNAL_CALL_H
@@ -225,6 +225,26 @@ void FixMonomerCoordinates(std::vector<double> &xyz,
   }
 }
 
+// Moves the nat sites of the monomer at xyz by the box vectors that bring
+// its first site closest to the first site at ref. box2 is half the box
+void MoveToCloseImage(const std::vector<double> &box,
+                      const std::vector<double> &box2, const double * ref,
+                      size_t nat, double * xyz) {
+  for (size_t k = 0; k < 3; k++) {
+    double di = xyz[k] - ref[k];
+    double shift = 0.0;
+    if (di > box2[3*k + k]) {
+      shift = -box[3*k + k];
+    } else if (di <= -box2[3*k + k]) {
+      shift = box[3*k + k];
+    }
+    if (shift == 0.0) continue;
+    for (size_t j = 0; j < nat; j++) {
+      xyz[3*j + k] += shift;
+    }
+  }
+}
+
 void GetCloseDimerImage(std::vector<double> box,
                         size_t nat1, size_t nat2, size_t nd,
                         double * xyz1, double * xyz2) {
@@ -239,23 +259,10 @@ void GetCloseDimerImage(std::vector<double> box,
   for (size_t i = 0; i < box.size(); i++)
     box2[i] *= 0.5;
 
-  // Move every dimer to the right place
+  // Move every dimer to the right place. The whole monomer 2 is moved
+  // with its first site, so it is not split between images
   for (size_t i = 0; i < nd; i++) {
-    for (size_t j = 0; j < nat2; j++) {
-      size_t j3 = j*3;
-      for (size_t k = 0; k < 3; k++) {
-        double di = xyz2[shift2 + j3 + k] - xyz1[shift1 + k];
-// here
-        if (di > box2[3*k + k]) {
-// here
-          xyz2[shift2 + j3 + k] -= box[3*k + k];
-// here
-        } else if (di <= -box2[3*k + k]) {
-// here
-          xyz2[shift2 + j3 + k] += box[3*k + k];
-        }
-      }
-    }
+    MoveToCloseImage(box, box2, xyz1 + shift1, nat2, xyz2 + shift2);
     shift1 += coords1;
     shift2 += coords2;
   }
@@ -279,39 +286,9 @@ void GetCloseTrimerImage(std::vector<double> box,
     box2[i] *= 0.5;
 
   for (size_t i = 0; i < nt; i++) {
-    // Moving (if necessary) monomer in xyz2
-    for (size_t j = 0; j < nat2; j++) {
-      size_t j3 = j*3;
-      for (size_t k = 0; k < 3; k++) {
-        double di = xyz2[shift2 + j3 + k] - xyz1[shift1 + k];
-// here
-        if (di > box2[3*k + k]) {
-// here
-          xyz2[shift2 + j3 + k] -= box[3*k + k];
-// here
-        } else if (di <= -box2[3*k + k]) {
-// here
-          xyz2[shift2 + j3 + k] += box[3*k + k];
-        }
-      }
-    }
-
-    // Moving (if necessary) monomer in xyz3
-    for (size_t j = 0; j < nat3; j++) {
-      size_t j3 = j*3;
-      for (size_t k = 0; k < 3; k++) {
-        double di = xyz3[shift3 + j3 + k] - xyz1[shift1 + k];
-// here
-        if (di > box2[3*k + k]) {
-// here
-          xyz3[shift3 + j3 + k] -= box[3*k + k];
-// here
-        } else if (di <= -box2[3*k + k]) {
-// here
-          xyz3[shift3 + j3 + k] += box[3*k + k];
-        }
-      }
-    }
+    // Moving (if necessary) monomers in xyz2 and xyz3
+    MoveToCloseImage(box, box2, xyz1 + shift1, nat2, xyz2 + shift2);
+    MoveToCloseImage(box, box2, xyz1 + shift1, nat3, xyz3 + shift3);
     shift1 += coords1;
     shift2 += coords2;
     shift3 += coords3;
@@ -515,39 +492,40 @@ double GetAdd(bool is12, bool is13, bool is14, std::string mon) {
   return aDD;
 }
 
-std::vector<double> ResetOrder3N(std::vector<double> coords,
-    std::vector<std::pair<size_t,size_t> > original_order, 
-    std::vector<size_t> first_index,
-    std::vector<size_t> sites) {
+std::vector<double> ResetOrder3N(const std::vector<double> &coords,
+    const std::vector<std::pair<size_t,size_t> > &original_order, 
+    const std::vector<size_t> &first_index,
+    const std::vector<size_t> &sites) {
   
   std::vector<double> new_coords(coords.size());
-  for (size_t i = 0; i < sites.size(); i++) {
-    size_t ini = 3*first_index[i];
-    size_t fin = ini + 3*sites[i];
-    size_t ini_orig = 3*original_order[i].second;
-    std::copy(coords.begin() + ini, coords.begin() + fin, 
-              new_coords.begin() + ini_orig);
-  }
+  ResetOrder3N(coords, original_order, first_index, sites, new_coords.data());
 
   return new_coords;
 }
 
-std::vector<double> ResetOrderReal3N(std::vector<double> coords,
-    std::vector<std::pair<size_t,size_t> > original_order,
+std::vector<double> ResetOrderReal3N(const std::vector<double> &coords,
+    const std::vector<std::pair<size_t,size_t> > &original_order,
     size_t numats,
-    std::vector<size_t> first_index,
-    std::vector<size_t> nats) {
+    const std::vector<size_t> &first_index,
+    const std::vector<size_t> &nats) {
 
   std::vector<double> new_coords(3*numats);
-  for (size_t i = 0; i < nats.size(); i++) {
+  ResetOrder3N(coords, original_order, first_index, nats, new_coords.data());
+
+  return new_coords;
+}
+
+void ResetOrder3N(const std::vector<double> &coords,
+    const std::vector<std::pair<size_t,size_t> > &original_order,
+    const std::vector<size_t> &first_index,
+    const std::vector<size_t> &sites, double* out) {
+
+  for (size_t i = 0; i < sites.size(); i++) {
     size_t ini = 3*first_index[i];
-    size_t fin = ini + 3*nats[i];
+    size_t fin = ini + 3*sites[i];
     size_t ini_orig = 3*original_order[i].second;
-    std::copy(coords.begin() + ini, coords.begin() + fin,
-              new_coords.begin() + ini_orig);
+    std::copy(coords.begin() + ini, coords.begin() + fin, out + ini_orig);
   }
-
-  return new_coords;
 }
 
 void SetVSites (std::vector<double> &xyz, std::string mon_id,
@@ -597,7 +575,7 @@ void SetVSites (std::vector<double> &xyz, std::string mon_id,
   }
 }
 
-void SetCharges (std::vector<double> xyz, std::vector<double> &charges,
+void SetCharges (const std::vector<double> &xyz, std::vector<double> &charges,
          std::string mon_id, size_t n_mon, size_t nsites, size_t fst_ind, 
          std::vector<double> &chg_der) {
 
@@ -621,70 +599,31 @@ void SetCharges (std::vector<double> xyz, std::vector<double> &charges,
   // Note, for now, assuming only water has site dependant charges
   } else if (mon_id == "h2o") {
 
-    // chgtmp = M, H1, H2 according to ttm4.cpp
-    std::vector<double> chgtmp;
     size_t fstind_3 = 3*fst_ind;
-    
-    chg_der = std::vector <double> (27*n_mon, 0.0);
 
-    // Calculate individual monomer's charges
-    for (size_t nv = 0; nv < n_mon; nv++) {
+    // Only reallocated if the number of waters changed
+    chg_der.resize(27*n_mon);
 
-      size_t ns3 = nsites*3;
-      size_t shift = 27*nv;
-      
-      // Getting front and end of xyz vector of 1 monomer in system
-      std::vector<double> atomcoords(xyz);
-      std::vector<double> chgtmpnv((nsites-1));
-
-      // Calculating charge
-      ps::dms_nasa (0.0, 0.0, 0.0, atomcoords.data() + (nv*ns3)+fstind_3, 
-                    chgtmpnv.data(), chg_der.data() + shift, false);
-      // Inserting the found charges into chgtmp vector before calculating
-      // new charge values
-      chgtmp.insert (chgtmp.end(), chgtmpnv.begin(), chgtmpnv.end());
-    }
+    // Calculate the charges of all the monomers at once. The M, H1 and H2
+    // charges according to ttm4.cpp are left in the O, H1 and H2 slots
+    ps::dms_nasa(xyz.data() + fstind_3, charges.data() + fst_ind,
+                 chg_der.data(), n_mon, 3*nsites, nsites);
 
-
-    // Creating vector with contiguous data
-    std::vector<double> chg2(n_mon*nsites,0.0);
-
-    // TODO Multiversioning
-    // Reorganizing sites
-    for (size_t nv = 0; nv < n_mon; nv++) {
-      // looping over sites -- H1 and H2
-      for (size_t i = 1; i < nsites - 1; i++) {
-        chg2[nv + i*n_mon] = chgtmp[i+nv*(nsites-1)];
-      }
-
-      // looping over M
-      chg2[nv + 3*n_mon] = chgtmp[nv*3];
-    }
-
-    std::vector<double> chg2temp = chg2;
-
-    // calculating charge
+    // calculating charge, in place
     for (size_t nv = 0; nv < n_mon; nv++) {
-      size_t hy1 = n_mon + nv;
-      size_t hy2 = 2*n_mon + nv;
-      size_t msite = 3*n_mon + nv;
+      size_t first = fst_ind + nv*nsites;
+      const double m = charges[first];
+      const double h1 = charges[first + 1];
+      const double h2 = charges[first + 2];
 
+      // Oxygen
+      charges[first] = 0.0;
       // Hydrogen1
-      chg2[hy1] = CHARGECON*(chg2temp[hy1] + 
-                             gamma21*(chg2temp[hy1]+chg2temp[hy2]));
+      charges[first + 1] = CHARGECON*(h1 + gamma21*(h1 + h2));
       // Hydrogen2
-      chg2[hy2] = CHARGECON*(chg2temp[hy2] +
-                             gamma21*(chg2temp[hy1]+chg2temp[hy2]));
+      charges[first + 2] = CHARGECON*(h2 + gamma21*(h1 + h2));
       // M
-      chg2[msite] = CHARGECON*(chg2temp[msite]/(1.0-gammaM));
-    }
-
-    // TODO multiversioning
-    // Return all coordinates to the original vector
-    for (size_t nv = 0; nv < n_mon; nv++) {
-      for (size_t j = 0; j < nsites; j++) {
-        charges[nv*nsites + j + fst_ind] = chg2[nv + n_mon*j];
-      }
+      charges[first + 3] = CHARGECON*(m/(1.0-gammaM));
     }
   }
 }
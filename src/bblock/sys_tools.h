@@ -119,6 +119,22 @@ void FixMonomerCoordinates(std::vector<double> &xyz,
                            std::vector<size_t> nat,
                            std::vector<size_t> first_index);                           
 
+/**
+ * @brief Moves a monomer to the image closest to a reference site.
+ *
+ * All the sites of the monomer are moved by the same box vectors, the ones
+ * that bring its first site closest to the reference site, so the monomer
+ * is never split between images. Assumes an orthorhombic box.
+ * @param[in] box Vector of 9 component with the 3 vectors of the box
+ * @param[in] box2 Half of box
+ * @param[in] ref Coordinates of the reference site
+ * @param[in] nat Number of sites of the monomer
+ * @param[in,out] xyz Coordinates of the monomer
+ */
+void MoveToCloseImage(const std::vector<double> &box,
+                      const std::vector<double> &box2, const double * ref,
+                      size_t nat, double * xyz);
+
 /**
  * @brief This function finds the monomer 2 mirror image that is closer to 
  * the monomer 1 image.
@@ -290,10 +306,10 @@ double GetAdd(bool is12, bool is13, bool is14, std::string mon);
  * @param[in] sites Vector with the number of sites of each monomer
  * @return The reordered vector that includes ALL sites
  */
-std::vector<double> ResetOrder3N(std::vector<double> coords,
-    std::vector<std::pair<size_t,size_t> > original_order, 
-    std::vector<size_t> first_index,
-    std::vector<size_t> sites);
+std::vector<double> ResetOrder3N(const std::vector<double> &coords,
+    const std::vector<std::pair<size_t,size_t> > &original_order, 
+    const std::vector<size_t> &first_index,
+    const std::vector<size_t> &sites);
 
 /**
  * @brief Reorders a vector of 3N coordinates, where N is the number
@@ -311,11 +327,33 @@ std::vector<double> ResetOrder3N(std::vector<double> coords,
  * @param[in] nats Vector with the number of real atoms of each monomer
  * @return The reordered vector that includes only the real sites
  */
-std::vector<double> ResetOrderReal3N(std::vector<double> coords,
-    std::vector<std::pair<size_t,size_t> > original_order,
+std::vector<double> ResetOrderReal3N(const std::vector<double> &coords,
+    const std::vector<std::pair<size_t,size_t> > &original_order,
     size_t numats,
-    std::vector<size_t> first_index,
-    std::vector<size_t> nats);
+    const std::vector<size_t> &first_index,
+    const std::vector<size_t> &nats);
+
+/**
+ * @brief Reorders a vector of 3N elements from the system order to the
+ * input order, writing the result in a buffer of the caller
+ *
+ * Same as ResetOrder3N and ResetOrderReal3N, without allocating the
+ * result. With the number of sites of each monomer in sites, the buffer
+ * has all the sites; with the number of real atoms, only the real ones.
+ * @param[in] coords Vector of 3N doubles in the system order
+ * @param[in] original_order Vector of pairs with the input order 
+ * of the monomers in the system order (the one of all sites or the one
+ * of real sites, as sites)
+ * @param[in] first_index Contains the position of the first atom
+ * of a monomer in the system atom list
+ * @param[in] sites Vector with the number of sites (or real atoms) of
+ * each monomer
+ * @param[out] out Buffer with space for 3 doubles per site (or real atom)
+ */
+void ResetOrder3N(const std::vector<double> &coords,
+    const std::vector<std::pair<size_t,size_t> > &original_order,
+    const std::vector<size_t> &first_index,
+    const std::vector<size_t> &sites, double* out);
 
 /**
  * @brief Reorders a vector of N elements, where N is the number
@@ -333,10 +371,10 @@ std::vector<double> ResetOrderReal3N(std::vector<double> coords,
  * @return The reordered vector that includes ALL sites
  */
 template <typename T>
-std::vector<T> ResetOrderN(std::vector<T> vector_T,
-    std::vector<std::pair<size_t,size_t> > original_order,
-    std::vector<size_t> first_index,
-    std::vector<size_t> sites) {
+std::vector<T> ResetOrderN(const std::vector<T> &vector_T,
+    const std::vector<std::pair<size_t,size_t> > &original_order,
+    const std::vector<size_t> &first_index,
+    const std::vector<size_t> &sites) {
 
   std::vector<T> new_vector_T(vector_T.size());
   for (size_t i = 0; i < sites.size(); i++) {
@@ -367,11 +405,11 @@ std::vector<T> ResetOrderN(std::vector<T> vector_T,
  * @return The reordered vector that includes only the real sites
  */
 template <typename T>
-std::vector<T> ResetOrderRealN(std::vector<T> vector_T,
-    std::vector<std::pair<size_t,size_t> > original_order,
+std::vector<T> ResetOrderRealN(const std::vector<T> &vector_T,
+    const std::vector<std::pair<size_t,size_t> > &original_order,
     size_t numats,
-    std::vector<size_t> first_index,
-    std::vector<size_t> nats) {
+    const std::vector<size_t> &first_index,
+    const std::vector<size_t> &nats) {
 
   std::vector<T> new_vector_T(numats);
   for (size_t i = 0; i < nats.size(); i++) {
@@ -385,6 +423,39 @@ std::vector<T> ResetOrderRealN(std::vector<T> vector_T,
   return new_vector_T;
 }
 
+/**
+ * @brief Reorders a vector of N elements from the system order to the
+ * input order, writing the result in a buffer of the caller
+ *
+ * Same as ResetOrderN and ResetOrderRealN, without allocating the
+ * result. With the number of sites of each monomer in sites, the buffer
+ * has all the sites; with the number of real atoms, only the real ones.
+ * @param[in] vector_T Vector of N elements in the system order
+ * @param[in] original_order Vector of pairs with the input order 
+ * of the monomers in the system order (the one of all sites or the one
+ * of real sites, as sites)
+ * @param[in] first_index Contains the position of the first atom
+ * of a monomer in the system atom list
+ * @param[in] sites Vector with the number of sites (or real atoms) of
+ * each monomer
+ * @param[out] out Buffer with space for one element per site (or real
+ * atom)
+ */
+template <typename T>
+void ResetOrderN(const std::vector<T> &vector_T,
+    const std::vector<std::pair<size_t,size_t> > &original_order,
+    const std::vector<size_t> &first_index,
+    const std::vector<size_t> &sites, T* out) {
+
+  for (size_t i = 0; i < sites.size(); i++) {
+    size_t ini = first_index[i];
+    size_t fin = ini + sites[i];
+    size_t ini_orig = original_order[i].second;
+    std::copy(vector_T.begin() + ini, vector_T.begin() + fin,
+              out + ini_orig);
+  }
+}
+
 // TODO continue documentation here
 /**
  * @brief Calculates the coordinates of the virtual site of a monomer when
@@ -395,8 +466,9 @@ void SetVSites(std::vector<double> &xyz, std::string mon_id,
                size_t n_mon, size_t nsites, size_t fst_ind);
 
 // Calculates the charges of all the sites in a monomer using its xyz
-// coordinates
-void SetCharges(std::vector<double> xyz, std::vector<double> &charges,
+// coordinates. Works in place: nothing is allocated once chg_der has
+// 27*n_mon elements for water
+void SetCharges(const std::vector<double> &xyz, std::vector<double> &charges,
                 std::string mon_id, size_t n_mon, size_t nsites, 
                 size_t fst_ind, std::vector<double> &chg_der);
 void SetPolfac (std::vector<double> &polfac, std::string mon_id,
@@ -19,7 +19,13 @@ namespace bblock { // Building Block :: System
 
 ////////////////////////////////////////////////////////////////////////////////
 
-System::System() {initialized_ = false;}
+System::System() {
+  initialized_ = false;
+  use_pbc_ = false;
+  dirtyXyz_ = true;
+  dirtyBox_ = true;
+  dirtyParams_ = true;
+}
 System::~System() {}
 
 size_t System::GetNumMol() {return nummol;}
@@ -124,6 +130,24 @@ std::vector<double> System::GetRealGrads() {
                                     numat_, first_index_, nat_);
 }
 
+void System::GetXyz(double* xyz) {
+  systools::ResetOrder3N(xyz_, initial_order_, first_index_, sites_, xyz);
+}
+
+void System::GetRealXyz(double* xyz) {
+  systools::ResetOrder3N(xyz_, initial_order_realSites_, first_index_, nat_,
+                         xyz);
+}
+
+void System::GetGrads(double* grad) {
+  systools::ResetOrder3N(grad_, initial_order_, first_index_, sites_, grad);
+}
+
+void System::GetRealGrads(double* grad) {
+  systools::ResetOrder3N(grad_, initial_order_realSites_, first_index_, nat_,
+                         grad);
+}
+
 std::vector<double> System::GetCharges() {
   return systools::ResetOrderN(chg_, initial_order_, 
                                first_index_, sites_);
@@ -154,6 +178,33 @@ std::vector<double> System::GetRealPolarizabilityFactors() {
                                    numat_, first_index_, nat_);
 }
 
+void System::GetCharges(double* chg) {
+  systools::ResetOrderN(chg_, initial_order_, first_index_, sites_, chg);
+}
+
+void System::GetRealCharges(double* chg) {
+  systools::ResetOrderN(chg_, initial_order_realSites_, first_index_, nat_,
+                        chg);
+}
+
+void System::GetPolarizabilities(double* pol) {
+  systools::ResetOrderN(pol_, initial_order_, first_index_, sites_, pol);
+}
+
+void System::GetRealPolarizabilities(double* pol) {
+  systools::ResetOrderN(pol_, initial_order_realSites_, first_index_, nat_,
+                        pol);
+}
+
+void System::GetAtomNames(std::string* names) {
+  systools::ResetOrderN(atoms_, initial_order_, first_index_, sites_, names);
+}
+
+void System::GetRealAtomNames(std::string* names) {
+  systools::ResetOrderN(atoms_, initial_order_realSites_, first_index_, nat_,
+                        names);
+}
+
 std::string System::GetMonId(size_t n) {
   size_t current_pos = original2current_order_[n];
   return monomers_[current_pos];
@@ -168,6 +219,41 @@ void System::SetNMaxEval3b(size_t nmax) {maxNTriEval_ = nmax;}
 void System::SetDipoleTol(double tol) {diptol_ = tol;}
 void System::SetDipoleMaxIt(size_t maxit) {maxItDip_ = maxit;}
 void System::SetDipoleMethod(std::string method) {dipole_method_ = method;}
+void System::SetAspcOrder(size_t k) {
+  kAspc_ = k;
+  electrostaticE_.SetAspcParameters(kAspc_);
+}
+void System::SetAspcCorrector(size_t maxit, double tol) {
+  maxItAspc_ = maxit;
+  tolAspc_ = tol;
+  electrostaticE_.SetAspcCorrector(maxItAspc_, tolAspc_);
+}
+size_t System::GetDipoleIterations() {
+  return electrostaticE_.GetDipoleIterations();
+}
+double System::GetDipoleResidual() {
+  return electrostaticE_.GetDipoleResidual();
+}
+std::vector<double> System::GetDipoleResidualTrace() {
+  return electrostaticE_.GetDipoleResidualTrace();
+}
+std::vector<double> System::GetDipoleCGTimings() {
+  return electrostaticE_.GetCGTimings();
+}
+void System::SetDipoleTensorMaxMemory(double max_mem) {
+  maxMemDipTensor_ = max_mem;
+  electrostaticE_.SetDipoleTensorMaxMemory(maxMemDipTensor_);
+}
+void System::SetDipoleInvMaxSize(size_t max_size) {
+  maxSizeInv_ = max_size;
+  electrostaticE_.SetDipoleInvMaxSize(maxSizeInv_);
+}
+void System::SetDipoleTensorMixedPrecision(bool mixed_precision, 
+                                           double tol_switch) {
+  mixedPrecision_ = mixed_precision;
+  tolMixed_ = tol_switch;
+  electrostaticE_.SetTensorMixedPrecision(mixedPrecision_, tolMixed_);
+}
 
 void System::SetPBC(bool use_pbc, 
                     std::vector<double> box = {1000.0,0.0,0.0,
@@ -182,23 +268,41 @@ void System::SetPBC(bool use_pbc,
   } 
 
   // Set the box and the bool to use or not pbc
+  if (use_pbc != use_pbc_ || box != box_) dirtyBox_ = true;
   use_pbc_ = use_pbc;
   box_ = box;
 
   // If we use PBC, we need to make sure that the monomer atoms are all
   // close to the central atom (1st atom of each monomer)
-  if (use_pbc_) {
-    // Fix monomer coordinates
-    systools::FixMonomerCoordinates(xyz_,box_,nat_,first_index_);
-    // Reset the virtual site positions, charges, pols and polfacs
-    SetVSites();
-    SetCharges();
-    SetPols();
-    SetPolfacs();
+  if (use_pbc_) UpdateSiteProperties();
+}
+
+void System::SetDispersionLongRange(std::string method) {
+  if (method != "none" && method != "tail" && method != "pme") {
+    std::string text = "Long range dispersion method " + method
+                     + " is not known. Use none, tail or pme.";
+    throw CUException(__func__,__FILE__,__LINE__,text);
   }
+  dispLongRange_ = method;
 }
 
-void System::SetXyz(std::vector<double> xyz) {
+void System::SetDispersionPmeParameters(double beta, double grid_spacing,
+                                        size_t order) {
+  dispPmeBeta_ = beta;
+  dispPmeSpacing_ = grid_spacing;
+  dispPmeOrder_ = order;
+}
+
+double System::GetDispersionLongRangeEnergy() {return dispLrEnergy_;}
+
+std::vector<double> System::GetDispersionLongRangeVirial() {
+  return dispLrVirial_;
+}
+std::vector<double> System::GetVirial() {
+  return virial_;
+}
+
+void System::SetXyz(const std::vector<double> &xyz) {
   // Make sure that the xyz of input has the right size
   if (xyz.size() != 3*numsites_) {
     std::string text = "Sizes " + std::to_string(xyz.size()) 
@@ -207,18 +311,10 @@ void System::SetXyz(std::vector<double> xyz) {
     throw CUException(__func__,__FILE__,__LINE__,text);
   }
 
-  // Copy each coordinate in the apropriate place in the internal
-  // xyz vector
-  for (size_t i = 0; i < sites_.size(); i++) {
-    size_t ini = 3*initial_order_[i].second;
-    size_t fin = ini + 3*sites_[i];
-    size_t ini_new = 3*first_index_[i];
-    std::copy(xyz.begin() + ini, xyz.begin() + fin,
-              xyz_.begin() + ini_new);
-  } 
+  SetXyz(xyz.data());
 }
 
-void System::SetRealXyz(std::vector<double> xyz) {
+void System::SetRealXyz(const std::vector<double> &xyz) {
   // Make sure that the xyz of input has the right size
   if (xyz.size() != 3*numat_) {
     std::string text = "Sizes " + std::to_string(xyz.size())
@@ -227,14 +323,34 @@ void System::SetRealXyz(std::vector<double> xyz) {
     throw CUException(__func__,__FILE__,__LINE__,text);
   }
 
+  SetRealXyz(xyz.data());
+}
+
+void System::SetXyz(const double* xyz) {
   // Copy each coordinate in the apropriate place in the internal
-  // xyz vector
+  // xyz vector. Only a change in the coordinates marks them as dirty
+  for (size_t i = 0; i < sites_.size(); i++) {
+    size_t ini = 3*initial_order_[i].second;
+    size_t fin = ini + 3*sites_[i];
+    size_t ini_new = 3*first_index_[i];
+    if (!std::equal(xyz + ini, xyz + fin, xyz_.begin() + ini_new)) {
+      std::copy(xyz + ini, xyz + fin, xyz_.begin() + ini_new);
+      dirtyXyz_ = true;
+    }
+  } 
+}
+
+void System::SetRealXyz(const double* xyz) {
+  // Copy each coordinate in the apropriate place in the internal
+  // xyz vector. Only a change in the coordinates marks them as dirty
   for (size_t i = 0; i < nat_.size(); i++) {
     size_t ini = 3*initial_order_realSites_[i].second;
     size_t fin = ini + 3*nat_[i];
     size_t ini_new = 3*first_index_[i];
-    std::copy(xyz.begin() + ini, xyz.begin() + fin,
-              xyz_.begin() + ini_new);
+    if (!std::equal(xyz + ini, xyz + fin, xyz_.begin() + ini_new)) {
+      std::copy(xyz + ini, xyz + fin, xyz_.begin() + ini_new);
+      dirtyXyz_ = true;
+    }
   }
 }
 
@@ -314,6 +430,97 @@ void System::Initialize() {
   nummol = molecules_.size();
   nummon_ = monomers_.size();
 
+  ////////////////
+  // DISPERSION //
+  ////////////////
+
+  // Type of each monomer, as position in mon_type_count_
+  size_t ntypes = mon_type_count_.size();
+  mon_type_index_ = std::vector<size_t>(nummon_, 0);
+  for (size_t i = 0; i < nummon_; i++) {
+    for (size_t k = 0; k < ntypes; k++) {
+      if (monomers_[i] == mon_type_count_[k].first) {
+        mon_type_index_[i] = k;
+        break;
+      }
+    }
+  }
+
+  // Dispersion parameters of each pair of monomer types
+  disp_params_.clear();
+  for (size_t k1 = 0; k1 < ntypes; k1++) {
+    for (size_t k2 = 0; k2 < ntypes; k2++) {
+      disp_params_.push_back(
+          disp::GetDispersionParameters(mon_type_count_[k1].first,
+                                        mon_type_count_[k2].first));
+    }
+  }
+
+  // Dispersion type of each atom: first, one per atom of each monomer type
+  std::vector<size_t> type_offset(1, 0);
+  std::vector<size_t> type_first_mon;
+  for (size_t k = 0, m = 0; k < ntypes; k++) {
+    type_first_mon.push_back(m);
+    type_offset.push_back(type_offset.back() + nat_[m]);
+    m += mon_type_count_[k].second;
+  }
+  size_t nraw = type_offset[ntypes];
+  std::vector<double> c6raw(nraw*nraw, 0.0);
+  for (size_t k1 = 0; k1 < ntypes; k1++) {
+    for (size_t k2 = 0; k2 < ntypes; k2++) {
+      const disp::DispersionParameters &par = disp_params_[k1*ntypes + k2];
+      if (par.nat1 == 0 || par.nat2 == 0) continue;
+      for (size_t a = 0; a < par.nat1; a++) {
+        for (size_t b = 0; b < par.nat2; b++) {
+          c6raw[(type_offset[k1] + a)*nraw + type_offset[k2] + b] = 
+              par.C6[par.types1[a]*par.nt2 + par.types2[b]];
+        }
+      }
+    }
+  }
+
+  // Then, merge the types with the same C6 with all the others
+  std::vector<size_t> merged(nraw);
+  std::vector<size_t> representative;
+  for (size_t a = 0; a < nraw; a++) {
+    merged[a] = representative.size();
+    for (size_t r = 0; r < representative.size(); r++) {
+      if (std::equal(c6raw.begin() + a*nraw, c6raw.begin() + (a + 1)*nraw,
+                     c6raw.begin() + representative[r]*nraw)) {
+        merged[a] = r;
+        break;
+      }
+    }
+    if (merged[a] == representative.size()) representative.push_back(a);
+  }
+  size_t ng = representative.size();
+  disp_c6_ = std::vector<double>(ng*ng);
+  for (size_t a = 0; a < ng; a++) {
+    for (size_t b = 0; b < ng; b++) {
+      disp_c6_[a*ng + b] = c6raw[representative[a]*nraw + representative[b]];
+    }
+  }
+  disp_site_type_.clear();
+  disp_type_count_ = std::vector<double>(ng, 0.0);
+  for (size_t k = 0; k < ntypes; k++) {
+    for (size_t i = 0; i < mon_type_count_[k].second; i++) {
+      for (size_t a = 0; a < nat_[type_first_mon[k]]; a++) {
+        size_t t = merged[type_offset[k] + a];
+        disp_site_type_.push_back(t);
+        disp_type_count_[t] += 1.0;
+      }
+    }
+  }
+
+  // No long range dispersion by default
+  dispLongRange_ = "none";
+  dispPmeBeta_ = 0.0;
+  dispPmeSpacing_ = 0.0;
+  dispPmeOrder_ = 6;
+  dispLrEnergy_ = 0.0;
+  dispLrVirial_ = std::vector<double>(9, 0.0);
+  virial_ = std::vector<double>(9, 0.0);
+
   ////////////////////
   // ELECTROSTATICS //
   ////////////////////
@@ -326,15 +533,25 @@ void System::Initialize() {
   maxItDip_ = 100;
   // Sets the default method to calculate induced dipoles to ASPC
   dipole_method_ = "aspc";
-
-  // Sets the position of the virtual sites if any
-  SetVSites();
-  // Sets the charges of the system, even the position dependent ones
-  SetCharges();
-  // Sets the polarizabilities of the system
-  SetPols();
-  // Sets the polarizability factors of the system
-  SetPolfacs();
+  // Sets the maximum memory (MB) to store the dipole tensor
+  maxMemDipTensor_ = 512.0;
+  // Sets the largest system (3 * number of sites) solved directly by inv
+  maxSizeInv_ = 1500;
+  // Dipoles are computed in double precision
+  mixedPrecision_ = false;
+  tolMixed_ = 1E-12;
+  // Sets the ASPC order and a single corrector step (standard ASPC)
+  kAspc_ = 4;
+  maxItAspc_ = 1;
+  tolAspc_ = diptol_;
+
+  // Sets the position of the virtual sites if any, the charges of the
+  // system, even the position dependent ones, the polarizabilities and
+  // the polarizability factors
+  dirtyXyz_ = true;
+  dirtyBox_ = true;
+  dirtyParams_ = true;
+  UpdateSiteProperties();
 
   // With the information previously set, we initialize the 
   // electrostatics class
@@ -342,6 +559,11 @@ void System::Initialize() {
   electrostaticE_.Initialize(chg_, chggrad_, polfac_, 
                 pol_, xyz_, monomers_, sites_, first_index_, 
                 mon_type_count_, true, diptol_, maxItDip_, dipole_method_);
+  electrostaticE_.SetDipoleTensorMaxMemory(maxMemDipTensor_);
+  electrostaticE_.SetDipoleInvMaxSize(maxSizeInv_);
+  electrostaticE_.SetTensorMixedPrecision(mixedPrecision_, tolMixed_);
+  electrostaticE_.SetAspcParameters(kAspc_);
+  electrostaticE_.SetAspcCorrector(maxItAspc_, tolAspc_);
 
   // We are done. Setting initialized_ to true
   initialized_ = true;
@@ -485,19 +707,13 @@ double System::Energy(bool do_grads) {
     throw CUException(__func__,__FILE__,__LINE__,text);
   }
 
-  // Reset energy and grads in system to 0
+  // Reset energy, grads and virial in system to 0
   energy_ = 0.0;
   std::fill(grad_.begin(), grad_.end(), 0.0);
+  std::fill(virial_.begin(), virial_.end(), 0.0);
 
-  // Reset the charges, pols, polfacs and new Vsite
-  if (use_pbc_) {
-    SetPBC(use_pbc_,box_);
-  } else {
-    SetVSites();
-    SetCharges();
-    SetPols();
-    SetPolfacs();
-  }
+  // Update the Vsites and charges, if the coordinates or box changed
+  UpdateSiteProperties();
 
   // Get the NB contributions
 
@@ -511,6 +727,7 @@ double System::Energy(bool do_grads) {
   // If monomers are too distorted, skip 2b and 3b calculation
   // Return only 
   if (!allMonGood_) {
+    if (do_grads) AddSitesVirial();
     return e1b;
   }
 
@@ -540,6 +757,10 @@ double System::Energy(bool do_grads) {
   // Set up energy with the new value
   energy_ = e1b + e2b + e3b + Eelec;
 
+  // The virial of the interactions between images was added by the 2B
+  // and 3B, and the one of the long range dispersion by its own term
+  if (do_grads) AddSitesVirial();
+
 # ifdef DEBUG
   std::cerr << "1B = " << e1b << std::endl
             << "2B = " << e2b << std::endl
@@ -654,6 +875,7 @@ double System::TwoBodyEnergy(bool do_grads) {
   // Reset energy and gradients
   energy_ = 0.0;
   std::fill(grad_.begin(), grad_.end(), 0.0);
+  std::fill(virial_.begin(), virial_.end(), 0.0);
 
   // Calculate the 2b energy
   energy_ = Get2B(do_grads);
@@ -668,6 +890,14 @@ double System::Get2B(bool do_grads) {
   double e2b_t = 0.0;
   double edisp_t = 0.0;
 
+  // Without long range dispersion, the dispersion is shifted to zero at
+  // the cutoff. With PME, only its short range part is computed here.
+  bool disp_shift = !use_pbc_ || dispLongRange_ == "none";
+  double disp_beta = 0.0;
+  if (use_pbc_ && dispLongRange_ == "pme") {
+    disp_beta = dispPmeBeta_ > 0.0 ? dispPmeBeta_ : 4.0 / cutoff2b_;
+  }
+
   // Variables needed for OMP
   size_t step = 1;
   int num_threads = 1;
@@ -695,6 +925,8 @@ double System::Get2B(bool do_grads) {
   std::vector<double> edisp_pool(num_threads,0.0);
   std::vector<std::vector<double>> grad_pool
        (num_threads,std::vector<double>(3*numsites_,0.0));
+  std::vector<std::vector<double>> virial_pool
+       (num_threads,std::vector<double>(9,0.0));
 
 # ifdef _OPENMP
 # pragma omp parallel for schedule(dynamic) private(rank)
@@ -797,15 +1029,28 @@ double System::Get2B(bool do_grads) {
                              nd, xyz1.data(), xyz2.data());
         }
 
+        // Dispersion parameters of this pair of monomer types
+        const disp::DispersionParameters &dpar = disp_params_[
+            mon_type_index_[dimers[nd_tot * 2]] * mon_type_count_.size()
+            + mon_type_index_[dimers[nd_tot * 2 + 1]]];
+
         if (do_grads) {
           // POLYNOMIALS
           e2b_pool[rank] += e2b::get_2b_energy(m1, m2, nd, xyz1, xyz2, grad1, grad2);
 
           // DISPERSION
-          edisp_pool[rank] += disp::GetDispersion(m1, m2, nd, do_grads,
-                                     xyz1, xyz2, grad1, grad2, cutoff2b_, use_pbc_);
+          edisp_pool[rank] += disp::GetDispersion(dpar, nd, do_grads,
+                                     xyz1.data(), xyz2.data(), grad1.data(),
+                                     grad2.data(), cutoff2b_, use_pbc_,
+                                     disp_shift, disp_beta);
           // Update gradients in system
           size_t i0 = nd_tot * 2;
+          if (use_pbc_) {
+            AddImageVirial(dimers, i0, 2, 0, nd, xyz1.data(),
+                           grad1.data(), virial_pool[rank].data());
+            AddImageVirial(dimers, i0, 2, 1, nd, xyz2.data(),
+                           grad2.data(), virial_pool[rank].data());
+          }
           for (size_t k = 0; k < nd ; k++) {
             // Monomer 1
             for (size_t j = 0; j < 3*nat_[dimers[i0 + 2*k]]; j++) {
@@ -822,8 +1067,10 @@ double System::Get2B(bool do_grads) {
           // POLYNOMIALS
           e2b_pool[rank] += e2b::get_2b_energy(m1, m2, nd, xyz1, xyz2);
           // DISPERSION
-          edisp_pool[rank] += disp::GetDispersion(m1, m2, nd, do_grads,
-                                     xyz1, xyz2, grad1, grad2, cutoff2b_, use_pbc_);
+          edisp_pool[rank] += disp::GetDispersion(dpar, nd, do_grads,
+                                     xyz1.data(), xyz2.data(), grad1.data(),
+                                     grad2.data(), cutoff2b_, use_pbc_,
+                                     disp_shift, disp_beta);
         }
        
         // Update loop variables and clear other temporary variable
@@ -865,13 +1112,22 @@ double System::Get2B(bool do_grads) {
 } // parallel   
 # endif
 
-  // Condensate energy
+  // Condensate energy and virial
   for (int i = 0; i < num_threads; i++) {
     e2b_t += e2b_pool[i];
     edisp_t += edisp_pool[i];
+    for (size_t k = 0; k < 9; k++) virial_[k] += virial_pool[i][k];
   }
 
 
+  // Long range dispersion
+  dispLrEnergy_ = 0.0;
+  std::fill(dispLrVirial_.begin(), dispLrVirial_.end(), 0.0);
+  if (use_pbc_ && dispLongRange_ != "none") {
+    dispLrEnergy_ = GetDispersionLongRange(do_grads);
+    edisp_t += dispLrEnergy_;
+  }
+
 # ifdef DEBUG
   std::cerr << "disp = " << edisp_t << "    2b = " << e2b_t << std::endl;
 # endif
@@ -879,6 +1135,63 @@ double System::Get2B(bool do_grads) {
   return e2b_t + edisp_t;
 }
 
+double System::GetDispersionLongRange(bool do_grads) {
+  const double volume = box_[0] * box_[4] * box_[8];
+  const size_t ng = disp_type_count_.size();
+
+  if (dispLongRange_ == "tail") {
+    double etail = disp::DispersionTail(disp_c6_, disp_type_count_, ng,
+                                        volume, cutoff2b_);
+    dispLrVirial_[0] = 2.0 * etail;
+    dispLrVirial_[4] = 2.0 * etail;
+    dispLrVirial_[8] = 2.0 * etail;
+    for (size_t k = 0; k < 9; k++) virial_[k] += dispLrVirial_[k];
+    return etail;
+  }
+
+  // PME. Ewald parameter and grid spacing, if not given: the real space
+  // screening is 2E-05 at the cutoff, and the grid resolves the
+  // reciprocal space terms with b = pi |m| / beta up to 4
+  double beta = dispPmeBeta_ > 0.0 ? dispPmeBeta_ : 4.0 / cutoff2b_;
+  double spacing = dispPmeSpacing_ > 0.0 ? dispPmeSpacing_ 
+                                         : M_PI / (8.0 * beta);
+  dispPme_.Initialize(disp_c6_, ng, beta, spacing, dispPmeOrder_);
+
+  // Real sites and first site of each monomer
+  std::vector<double> xyz(3 * numat_);
+  std::vector<size_t> mon_first(nummon_ + 1, 0);
+  for (size_t m = 0; m < nummon_; m++) {
+    std::copy(xyz_.begin() + 3 * first_index_[m],
+              xyz_.begin() + 3 * (first_index_[m] + nat_[m]),
+              xyz.begin() + 3 * mon_first[m]);
+    mon_first[m + 1] = mon_first[m] + nat_[m];
+  }
+
+  std::vector<double> grad(3 * numat_, 0.0);
+  double elr = dispPme_.Energy(xyz, disp_site_type_, mon_first, box_,
+                               do_grads, grad, dispLrVirial_);
+
+  if (do_grads) {
+    for (size_t m = 0; m < nummon_; m++) {
+      for (size_t j = 0; j < 3 * nat_[m]; j++) {
+        grad_[3 * first_index_[m] + j] += grad[3 * mon_first[m] + j];
+      }
+    }
+    // The virial of the system adds -sum g x for all the gradients, so
+    // it is removed here from the virial of the PME
+    for (size_t k = 0; k < 9; k++) virial_[k] += dispLrVirial_[k];
+    for (size_t i = 0; i < numat_; i++) {
+      for (size_t a = 0; a < 3; a++) {
+        for (size_t b = 0; b < 3; b++) {
+          virial_[3*a + b] += grad[3*i + a] * xyz[3*i + b];
+        }
+      }
+    }
+  }
+
+  return elr;
+}
+
 double System::ThreeBodyEnergy(bool do_grads) {
   // Check if system has been initialized
   // If not, throw exception
@@ -890,6 +1203,7 @@ double System::ThreeBodyEnergy(bool do_grads) {
 
   energy_ = 0.0;
   std::fill(grad_.begin(), grad_.end(), 0.0);
+  std::fill(virial_.begin(), virial_.end(), 0.0);
 
   energy_ = Get3B(do_grads);
 
@@ -925,6 +1239,7 @@ double System::Get3B(bool do_grads) {
   // serial and parallel implementation
   std::vector<double> e3b_pool(num_threads,0.0);
   std::vector<std::vector<double>> grad_pool(num_threads,std::vector<double>(3*numsites_,0.0));
+  std::vector<std::vector<double>> virial_pool(num_threads,std::vector<double>(9,0.0));
 
 # ifdef _OPENMP
 # pragma omp parallel for schedule(dynamic) private(rank)
@@ -1041,6 +1356,14 @@ double System::Get3B(bool do_grads) {
 
           // Update gradients
           size_t i0 = nt_tot * 3;
+          if (use_pbc_) {
+            AddImageVirial(trimers, i0, 3, 0, nt, xyz1.data(),
+                           grad1.data(), virial_pool[rank].data());
+            AddImageVirial(trimers, i0, 3, 1, nt, xyz2.data(),
+                           grad2.data(), virial_pool[rank].data());
+            AddImageVirial(trimers, i0, 3, 2, nt, xyz3.data(),
+                           grad3.data(), virial_pool[rank].data());
+          }
           for (size_t k = 0; k < nt ; k++) {
             // Monomer 1
             for (size_t j = 0; j < 3*nat_[trimers[i0 + 3*k]]; j++) {
@@ -1101,9 +1424,10 @@ double System::Get3B(bool do_grads) {
 } // parallel   
 # endif
 
-  // Condensate energy
+  // Condensate energy and virial
   for (int i = 0; i < num_threads; i++) {
     e3b_t += e3b_pool[i];
+    for (size_t k = 0; k < 9; k++) virial_[k] += virial_pool[i][k];
   }
 
   return e3b_t;
@@ -1111,6 +1435,38 @@ double System::Get3B(bool do_grads) {
 
 ////////////////////////////////////////////////////////////////////////////////
 
+void System::AddImageVirial(const std::vector<size_t> &clusters, size_t i0,
+                            size_t ncl, size_t pos, size_t n, 
+                            const double *x, const double *g, double *vir) {
+  for (size_t k = 0; k < n; k++) {
+    size_t mon = clusters[i0 + ncl*k + pos];
+    const double *x0 = xyz_.data() + 3*first_index_[mon];
+    for (size_t j = 0; j < 3*nat_[mon]; j += 3) {
+      for (size_t b = 0; b < 3; b++) {
+        double d = x[j + b] - x0[j + b];
+        if (d == 0.0) continue;
+        for (size_t a = 0; a < 3; a++) {
+          vir[3*a + b] -= g[j + a] * d;
+        }
+      }
+    }
+    x += 3*nat_[mon];
+    g += 3*nat_[mon];
+  }
+}
+
+void System::AddSitesVirial() {
+  for (size_t i = 0; i < numsites_; i++) {
+    for (size_t a = 0; a < 3; a++) {
+      for (size_t b = 0; b < 3; b++) {
+        virial_[3*a + b] -= grad_[3*i + a] * xyz_[3*i + b];
+      }
+    }
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 void System::SetCharges() {
   // Set charges for each monomer type
   size_t fi_mon = 0;
@@ -1118,6 +1474,13 @@ void System::SetCharges() {
     std::string mon = mon_type_count_[k].first;
     size_t nmon = mon_type_count_[k].second;
     size_t nsites = sites_[fi_mon];
+
+    // Only water has position dependent charges. The ones of the ions
+    // are only set with the parameters
+    if (!dirtyParams_ && mon != "h2o") {
+      fi_mon += nmon;
+      continue;
+    }
     
     systools::SetCharges(xyz_, chg_, mon, nmon, nsites, 
                 first_index_[fi_mon], chggrad_);
@@ -1157,6 +1520,30 @@ void System::SetPolfacs() {
 
 ////////////////////////////////////////////////////////////////////////////////
 
+void System::UpdateSiteProperties() {
+  // If the coordinates or the box changed, the monomers need to be made
+  // whole again, and the virtual sites and charges follow the geometry
+  if (dirtyXyz_ || dirtyBox_ || dirtyParams_) {
+    if (use_pbc_) {
+      systools::FixMonomerCoordinates(xyz_,box_,nat_,first_index_);
+    }
+    SetVSites();
+    SetCharges();
+  }
+
+  // Polarizabilities and polfacs only depend on the monomer types
+  if (dirtyParams_) {
+    SetPols();
+    SetPolfacs();
+  }
+
+  dirtyXyz_ = false;
+  dirtyBox_ = false;
+  dirtyParams_ = false;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 void System::SetVSites() {
   // Set virtual sites for each monomer type
   size_t fi_mon = 0;
@@ -1185,6 +1572,9 @@ double System::Electrostatics(bool do_grads) {
   energy_ = 0.0;
   std::fill(grad_.begin(), grad_.end(), 0.0);
 
+  // Update the Vsites and charges, if the coordinates or box changed
+  UpdateSiteProperties();
+
   energy_ = GetElectrostatics(do_grads);
 
   return energy_;
@@ -1202,6 +1592,19 @@ double System::GetElectrostatics(bool do_grads) {
 
 void System::ResetDipoleHistory() {
   electrostaticE_.ResetAspcHistory();
+  electrostaticE_.ResetIelHistory();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+std::vector<double> System::GetDipoleHistory() {
+  return electrostaticE_.GetIelHistory();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void System::SetDipoleHistory(const std::vector<double> &hist) {
+  electrostaticE_.SetIelHistory(hist);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -24,6 +24,7 @@
 #include "potential/3b/energy3b.h"
 // DISPERSION
 #include "potential/dispersion/dispersion2b.h"
+#include "potential/dispersion/dispersion_lr.h"
 // ELECTROSTATICS
 #include "potential/electrostatics/electrostatics.h"
 
@@ -159,6 +160,25 @@ class System {
    */
   std::vector<double> GetRealGrads();
 
+  /**
+   * Writes the coordinates of the system in the input order, as GetXyz()
+   * and GetRealXyz(), in a buffer of the caller, without allocations.
+   * @param[out] xyz Buffer with space for the coordinates of all the sites
+   * (GetXyz) or of the real sites (GetRealXyz)
+   */
+  void GetXyz(double* xyz);
+  void GetRealXyz(double* xyz);
+
+  /**
+   * Writes the gradients of the last energy call in the input order, as
+   * GetGrads() and GetRealGrads(), in a buffer of the caller, without
+   * allocations. Meant to be called after every step of a simulation.
+   * @param[out] grad Buffer with space for the gradients of all the sites
+   * (GetGrads) or of the real sites (GetRealGrads)
+   */
+  void GetGrads(double* grad);
+  void GetRealGrads(double* grad);
+
   /**
    * Gets the charges of the system. It includes the charges of ALL sites, 
    * including the virtual sites such as the M-sites
@@ -203,6 +223,22 @@ class System {
    */
   std::vector<double> GetRealPolarizabilityFactors();
 
+  /**
+   * Writes the charges and polarizabilities of the system in the input
+   * order, as GetCharges(), GetRealCharges(), GetPolarizabilities() and
+   * GetRealPolarizabilities(), in a buffer of the caller, without
+   * allocations.
+   * @param[out] chg Buffer with space for the charges of all the sites
+   * (GetCharges) or of the real sites (GetRealCharges)
+   * @param[out] pol Buffer with space for the polarizabilities of all
+   * the sites (GetPolarizabilities) or of the real sites
+   * (GetRealPolarizabilities)
+   */
+  void GetCharges(double* chg);
+  void GetRealCharges(double* chg);
+  void GetPolarizabilities(double* pol);
+  void GetRealPolarizabilities(double* pol);
+
   /** 
    * Get the atom names in the same order as inputed. 
    * Will get an array of all the atoma names. 
@@ -221,6 +257,16 @@ class System {
    */
   std::vector<std::string> GetRealAtomNames();
 
+  /**
+   * Writes the atom names in the input order, as GetAtomNames() and
+   * GetRealAtomNames(), in a buffer of the caller. The strings of the
+   * buffer are assigned, so they keep their memory between calls.
+   * @param[out] names Buffer with space for the names of all the sites
+   * (GetAtomNames) or of the real sites (GetRealAtomNames)
+   */
+  void GetAtomNames(std::string* names);
+  void GetRealAtomNames(std::string* names);
+
   /** 
    * Gets the id string of the n-th monomer
    * @param[in] n The index of the monomer which ID is wanted
@@ -238,7 +284,7 @@ class System {
    * @param[in] xyz Is a vector of doubles that contains the coordinates of
    * the whole system as x1y1z1x2y2z2x3y3z3..., including the virtual sites
    */
-  void SetXyz(std::vector<double> xyz);
+  void SetXyz(const std::vector<double> &xyz);
 
   /**
    * Sets the xyz of the system. It assumes that only the real coordinates 
@@ -246,7 +292,28 @@ class System {
    * @param[in] xyz Is a vector of doubles that contains the coordinates of
    * the real atoms as x1y1z1x2y2z2x3y3z3...
    */
-  void SetRealXyz(std::vector<double> xyz);
+  void SetRealXyz(const std::vector<double> &xyz);
+
+  /**
+   * Sets the xyz of the system from a buffer of the caller, as SetXyz()
+   * and SetRealXyz(), without allocations. The size is not checked: the
+   * buffer must have the coordinates of all the sites (SetXyz) or of
+   * the real sites (SetRealXyz).
+   * @param[in] xyz Buffer with the coordinates as x1y1z1x2y2z2...
+   */
+  void SetXyz(const double* xyz);
+  void SetRealXyz(const double* xyz);
+
+  /**
+   * Brings the site properties up to date with what changed since the
+   * last call. If the coordinates or the box changed, fixes the monomer
+   * coordinates (PBC), and sets the virtual sites and the position
+   * dependent charges. Polarizabilities, polarizability factors and the
+   * constant charges are only set if the parameters changed. The energy
+   * functions call it; after SetXyz() or SetRealXyz(), call it before
+   * GetXyz(), GetCharges() and the like to get the updated properties.
+   */
+  void UpdateSiteProperties();
 
   // TODO Keep in mind that the order must be consistent with
   // the database!!
@@ -340,16 +407,127 @@ class System {
 
   /** 
    * Sets the iterative dipole method. See documentation for available methods
-   * @param[in] method String with the method abbreviation (iter, cg or aspc)
+   * @param[in] method String with the method abbreviation (iter, cg, aspc,
+   * iel, diis or inv). iel is the inertial extended Lagrangian (iEL/0-SCF), 
+   * meant to be used in MD, in which the dipoles are propagated with
+   * the nuclei and only one dipole field evaluation is done per step.
+   * diis is the fixed point iteration accelerated with DIIS (Pulay) 
+   * extrapolation over the last dipoles, meant for single points.
+   * inv solves the dipoles directly with a Cholesky factorization of
+   * the polarization matrix. It is meant for small clusters, and larger
+   * systems (see SetDipoleInvMaxSize) are solved with cg.
    */
   void SetDipoleMethod(std::string method);
 
   /**
-   * Resets the dipole history when using ASPC. If other method is used,
-   * this function does nothing.
+   * Sets the maximum memory that can be used to store the dipole-dipole
+   * interaction tensor. If the tensor fits, it is computed once per
+   * configuration and the iterations of the dipole solvers become
+   * matrix-vector products. Otherwise it is computed on the fly.
+   * @param[in] max_mem Maximum memory, in MB. A value of 0 disables it.
+   */
+  void SetDipoleTensorMaxMemory(double max_mem);
+
+  /**
+   * Sets the size of the largest system whose dipoles are solved 
+   * directly with the inv method. Larger systems, or systems whose 
+   * dipole tensor does not fit in memory, are solved with cg.
+   * @param[in] max_size Maximum number of dipole components 
+   * (3 times the number of polarizable sites). Default is 1500.
+   */
+  void SetDipoleInvMaxSize(size_t max_size);
+
+  /**
+   * Enables or disables the single precision copy of the stored dipole
+   * tensor. Only applies when the tensor is stored (see 
+   * SetDipoleTensorMaxMemory): the cg, iter and diis iterations then use
+   * the single precision copy, accumulating in double precision, until 
+   * the residual is below tol_switch, and continue in double precision
+   * until the dipole tolerance is reached, so the final dipoles are the
+   * same. Systems whose tensor is computed on the fly, and the ASPC
+   * predictor, always run in double precision. With ASPC and iel, it 
+   * only applies to the initial cg steps. The copy is only kept when it
+   * fits in the tensor memory together with the double precision tensor;
+   * whether the tensor is stored does not depend on this option. 
+   * @param[in] mixed_precision If true, the single precision tensor is 
+   * used. Default is false.
+   * @param[in] tol_switch Residual at which the solvers switch to double
+   * precision. Default is 1E-12.
+   */
+  void SetDipoleTensorMixedPrecision(bool mixed_precision, 
+                                     double tol_switch = 1E-12);
+
+  /**
+   * Sets the order of the ASPC predictor. Resets the ASPC history.
+   * @param[in] k Order of the predictor, from 0 to 4. Default is 4.
+   */
+  void SetAspcOrder(size_t k);
+
+  /**
+   * Sets the corrector of the ASPC method. The corrector is applied until
+   * the squared change of the dipoles is smaller than the tolerance,
+   * or the maximum number of corrector steps is reached. 
+   * @param[in] maxit Maximum number of corrector steps. Default is 1
+   * (standard ASPC)
+   * @param[in] tol Tolerance in the squared change of the dipoles
+   */
+  void SetAspcCorrector(size_t maxit, double tol);
+
+  /**
+   * Gets the number of iterations needed to get the induced dipoles in
+   * the last energy calculation. For ASPC are the corrector steps.
+   * @return Number of iterations of the last dipole calculation
+   */
+  size_t GetDipoleIterations();
+
+  /**
+   * Gets the residual of the induced dipoles in the last energy 
+   * calculation. For CG, it is the squared norm of the residual. 
+   * For the iterative method, the maximum squared change of a dipole.
+   * For DIIS, the maximum squared residual of a dipole.
+   * For ASPC and iel, the squared norm of the change of the dipoles in
+   * the last correction.
+   * @return Residual of the last dipole calculation
+   */
+  double GetDipoleResidual();
+
+  /**
+   * Gets the residual of the induced dipoles at each iteration of the
+   * last energy calculation, as defined in GetDipoleResidual. 
+   * Only filled by the iter, cg and diis methods.
+   * @return Vector with the residual at each iteration
+   */
+  std::vector<double> GetDipoleResidualTrace();
+
+  /**
+   * Gets the wall time spent in the last conjugate gradient solve of the
+   * induced dipoles (cg method, or the other methods when they use it).
+   * @return Vector with the total time, the time in the dipole field
+   * evaluations and the time in the vector updates, in seconds
+   */
+  std::vector<double> GetDipoleCGTimings();
+
+  /**
+   * Resets the dipole history when using ASPC or the extended Lagrangian. 
+   * If other method is used, this function does nothing.
    */
   void ResetDipoleHistory();
 
+  /**
+   * Gets the state of the auxiliary dipoles of the extended Lagrangian 
+   * (iel) method, so it can be stored in a checkpoint.
+   * @return Vector of doubles with the auxiliary dipole history. It is
+   * only meaningful for a system with the same monomers in the same order.
+   */
+  std::vector<double> GetDipoleHistory();
+
+  /**
+   * Sets the state of the auxiliary dipoles of the extended Lagrangian 
+   * (iel) method, to restart a simulation from a checkpoint.
+   * @param[in] hist Vector of doubles as returned by GetDipoleHistory()
+   */
+  void SetDipoleHistory(const std::vector<double> &hist);
+
   /** 
    * Tells the system if we are in Periodic Boundary Conditions (PBC)
    * or not. If the box is not passed as argument, it is set to 
@@ -359,6 +537,57 @@ class System {
    * the three main vectors of the cell: {v1x v1y v1z v2x v2y v2z v3x v3y v3z}
    */
   void SetPBC(bool use_pbc, std::vector<double> box);
+
+  /**
+   * Sets the long range treatment of the 2B dispersion in periodic
+   * systems. It has no effect without PBC.
+   * "none" truncates the dispersion at the 2B cutoff and shifts it to
+   * zero there. "tail" truncates it and adds the isotropic correction
+   * beyond the cutoff, assuming a uniform density. "pme" adds the long 
+   * range part of the C6 terms with the smooth particle mesh Ewald 
+   * method, so the result does not depend on the cutoff. 
+   * Default is "none".
+   * @param[in] method Long range dispersion method
+   */
+  void SetDispersionLongRange(std::string method);
+
+  /**
+   * Sets the parameters of the dispersion PME. Only orthorhombic boxes
+   * are supported.
+   * @param[in] beta Ewald parameter, in 1/angstrom. If 0 (default), it is
+   * set to 4 over the 2B cutoff
+   * @param[in] grid_spacing Maximum spacing of the grid, in angstrom. 
+   * If 0 (default), it is set from beta
+   * @param[in] order Order of the B-splines. Default is 6
+   */
+  void SetDispersionPmeParameters(double beta, double grid_spacing,
+                                  size_t order);
+
+  /**
+   * Returns the long range dispersion energy of the last energy call:
+   * the tail correction, or the reciprocal space, self and 
+   * intramonomer terms of the PME. It is already included in the
+   * 2B energy.
+   * @return Long range dispersion energy, in kcal/mol
+   */
+  double GetDispersionLongRangeEnergy();
+
+  /**
+   * Returns the virial of the long range dispersion energy of the last
+   * energy call, as -dE/d(strain) (9 components, kcal/mol). The 
+   * contribution to the pressure is its trace over 3V.
+   * @return Virial of the long range dispersion
+   */
+  std::vector<double> GetDispersionLongRangeVirial();
+
+  /**
+   * Returns the virial of the last call to Energy with gradients, as
+   * -dE/d(strain) (9 components, kcal/mol): element 3a + b is 
+   * -sum_i g_ia x_ib, with the interactions between periodic images 
+   * taken into account. The pressure is (N kT + trace/3) / V.
+   * @return Virial of the system
+   */
+  std::vector<double> GetVirial();
   
   /////////////////////////////////////////////////////////////////////////////
   // Energy Functions /////////////////////////////////////////////////////////
@@ -487,6 +716,15 @@ class System {
    */
   double Get2B(bool do_grads);
 
+  /**
+   * Private function to internally get the long range dispersion energy
+   * in periodic systems. Gradients of the system will be updated.
+   * @param[in] do_grads Boolean. If true, gradients will be computed. 
+   * If false, gradients won't be computed.
+   * @return  Long range dispersion energy of the system
+   */
+  double GetDispersionLongRange(bool do_grads);
+
   /**
    * Private function to internally get the 3b energy.
    * Gradients of the system will be updated.
@@ -496,6 +734,29 @@ class System {
    */
   double Get3B(bool do_grads);
 
+  /**
+   * Private function that adds to vir the virial of the shift of the n
+   * clusters of a batch to their closest images: -sum_i g_ia d_ib, with 
+   * d the shift of each site.
+   * @param[in] clusters Monomers of the clusters, ncl per cluster
+   * @param[in] i0 Index in clusters of the first monomer of the batch
+   * @param[in] ncl Number of monomers per cluster
+   * @param[in] pos Position of the monomer in the clusters
+   * @param[in] n Number of clusters in the batch
+   * @param[in] x Coordinates of the monomer pos of the n clusters
+   * @param[in] g Gradients of the monomer pos of the n clusters
+   * @param[in,out] vir Virial (9 components)
+   */
+  void AddImageVirial(const std::vector<size_t> &clusters, size_t i0,
+                      size_t ncl, size_t pos, size_t n, const double *x,
+                      const double *g, double *vir);
+
+  /**
+   * Private function that adds -sum_i g_ia x_ib, over all the sites, to
+   * the virial of the system.
+   */
+  void AddSitesVirial();
+
   /**
    * Private function to internally get the electrostatic energy.
    * Gradients of the system will be updated.
@@ -554,6 +815,45 @@ class System {
    */
   double diptol_; 
 
+  /**
+   * Maximum memory, in MB, that the electrostatics can use to store 
+   * the dipole-dipole interaction tensor
+   */
+  double maxMemDipTensor_;
+
+  /**
+   * Largest number of dipole components that is solved directly 
+   * with the inv method
+   */
+  size_t maxSizeInv_;
+
+  /**
+   * If true, the dipole solvers start with the single precision copy
+   * of the stored dipole tensor
+   */
+  bool mixedPrecision_;
+
+  /**
+   * Residual at which the mixed precision solvers switch to double
+   */
+  double tolMixed_;
+
+  /**
+   * Order of the ASPC predictor
+   */
+  size_t kAspc_;
+
+  /**
+   * Maximum number of corrector steps in ASPC
+   */
+  size_t maxItAspc_;
+
+  /**
+   * Tolerance in the squared change of the dipoles to stop the 
+   * ASPC corrector
+   */
+  double tolAspc_;
+
   /**
    * Cutoff in the search for clusters for the dimers. 
    * Molecules which first atoms are at a larger distance than this cutoff
@@ -587,6 +887,15 @@ class System {
    */
   bool use_pbc_;   
 
+  /**
+   * Change tracking for UpdateSiteProperties. dirtyXyz_ is set when the
+   * coordinates change, dirtyBox_ when the box or use_pbc_ change, and
+   * dirtyParams_ when the site parameters need to be set (Initialize)
+   */
+  bool dirtyXyz_;
+  bool dirtyBox_;
+  bool dirtyParams_;
+
   /**
    * This variable is set to false when one of the monomer energies is larger 
    * than 60 kcal/mol. Due to their construction, the polynomials do not 
@@ -707,6 +1016,75 @@ class System {
    */
   std::vector<std::pair<std::string,size_t> > mon_type_count_;  
 
+  /**
+   * Position in mon_type_count_ of the type of each monomer, in the
+   * internal order of the system
+   */
+  std::vector<size_t> mon_type_index_;
+
+  /**
+   * 2B dispersion parameters of each pair of monomer types. The pair
+   * (t1,t2) of types in mon_type_count_ is at t1*mon_type_count_.size() + t2.
+   * Resolved once in Initialize, so the 2B loop does no string matching.
+   */
+  std::vector<disp::DispersionParameters> disp_params_;
+
+  /**
+   * Dispersion type of each real site, in the internal order. Sites with
+   * the same C6 with all the others (e.g. the two H of water) share a type
+   */
+  std::vector<size_t> disp_site_type_;
+
+  /**
+   * Number of sites of each dispersion type
+   */
+  std::vector<double> disp_type_count_;
+
+  /**
+   * C6 between dispersion types, as a square matrix
+   */
+  std::vector<double> disp_c6_;
+
+  /**
+   * Long range dispersion method: "none", "tail" or "pme"
+   */
+  std::string dispLongRange_;
+
+  /**
+   * Ewald parameter of the dispersion PME. If 0, 4 over the 2B cutoff
+   */
+  double dispPmeBeta_;
+
+  /**
+   * Maximum grid spacing of the dispersion PME. If 0, set from beta
+   */
+  double dispPmeSpacing_;
+
+  /**
+   * Order of the B-splines of the dispersion PME
+   */
+  size_t dispPmeOrder_;
+
+  /**
+   * Dispersion PME
+   */
+  disp::DispersionPme dispPme_;
+
+  /**
+   * Long range dispersion energy of the last energy call
+   */
+  double dispLrEnergy_;
+
+  /**
+   * Virial of the long range dispersion energy of the last energy call
+   */
+  std::vector<double> dispLrVirial_;
+
+  /**
+   * Virial of the last energy call with gradients
+   */
+  std::vector<double> virial_;
+
   /**
    * Vector that contains the relation between the input monomer
    * order and the internal monomer order. The position i of this
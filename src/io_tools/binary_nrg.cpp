@@ -0,0 +1,446 @@
+#include "binary_nrg.h"
+#include "read_nrg.h"
+
+namespace {
+
+const char bnrg_magic[8] = {'C', 'U', 'N', 'R', 'G', 'B', 'I', 'N'};
+const uint32_t bnrg_version = 1;
+const uint32_t bnrg_bom = 0x01020304;
+// Alignment of the first frame
+const size_t bnrg_align = 64;
+
+void WriteBytes(FILE* f, const void* p, size_t n) {
+  if (n > 0 && std::fwrite(p, 1, n, f) != n)
+    throw std::runtime_error("could not write the binary NRG file");
+}
+
+void WriteU64(FILE* f, uint64_t x) {
+  WriteBytes(f, &x, sizeof(x));
+}
+
+void WriteString(FILE* f, const std::string &s) {
+  WriteU64(f, s.size());
+  WriteBytes(f, s.data(), s.size());
+}
+
+long Tell(FILE* f) {
+  long pos = std::ftell(f);
+  if (pos < 0)
+    throw std::runtime_error("could not get the position in the binary NRG"
+                             " file");
+  return pos;
+}
+
+void Seek(FILE* f, long pos, int whence) {
+  if (std::fseek(f, pos, whence) != 0)
+    throw std::runtime_error("could not seek in the binary NRG file");
+}
+
+// Sequential reads from the mapping, with bounds checks
+struct Cursor {
+  const char* p;
+  const char* end;
+
+  void Read(void* out, size_t n) {
+    if (size_t(end - p) < n)
+      throw std::runtime_error("truncated binary NRG file");
+    std::memcpy(out, p, n);
+    p += n;
+  }
+  uint64_t U64() {
+    uint64_t x;
+    Read(&x, sizeof(x));
+    return x;
+  }
+  std::string String() {
+    uint64_t n = U64();
+    if (uint64_t(end - p) < n)
+      throw std::runtime_error("truncated binary NRG file");
+    std::string s(p, n);
+    p += n;
+    return s;
+  }
+};
+
+// Topology of sys in input order: monomer ids, real atom names of each
+// monomer, and molecules
+void GetTopology(bblock::System &sys, std::vector<std::string> &ids,
+                 std::vector<std::vector<std::string> > &atoms,
+                 std::vector<std::vector<size_t> > &molecules) {
+  std::vector<std::string> names = sys.GetRealAtomNames();
+  size_t first = 0;
+  ids.clear();
+  atoms.clear();
+  molecules.clear();
+  for (size_t m = 0; m < sys.GetNumMon(); m++) {
+    size_t nat = sys.GetMonNumAt(m);
+    ids.push_back(sys.GetMonId(m));
+    atoms.push_back(std::vector<std::string>(names.begin() + first,
+                                             names.begin() + first + nat));
+    first += nat;
+  }
+  for (size_t k = 0; k < sys.GetNumMol(); k++) {
+    molecules.push_back(sys.GetMolecule(k));
+  }
+}
+
+} // namespace
+
+namespace tools {
+
+////////////////////////////////////////////////////////////////////////////////
+
+BinaryNrgWriter::BinaryNrgWriter(const char* filename, bblock::System &sys,
+                                 uint64_t flags)
+  : file_(0), flags_(flags), nat_(sys.GetNumRealSites()), xyz_(3*nat_),
+    grads_(flags & BNRG_GRADS ? 3*nat_ : 0) {
+  assert(filename);
+  file_ = std::fopen(filename, "wb");
+  if (!file_)
+    throw std::runtime_error("could not open binary NRG file for writing");
+
+  std::vector<std::string> ids;
+  std::vector<std::vector<std::string> > atoms;
+  std::vector<std::vector<size_t> > molecules;
+  GetTopology(sys, ids, atoms, molecules);
+
+  try {
+    // Header. The offset of the first frame is known after the topology
+    WriteBytes(file_, bnrg_magic, sizeof(bnrg_magic));
+    WriteBytes(file_, &bnrg_version, sizeof(bnrg_version));
+    WriteBytes(file_, &bnrg_bom, sizeof(bnrg_bom));
+    WriteU64(file_, flags_);
+    WriteU64(file_, ids.size());
+    WriteU64(file_, nat_);
+    WriteU64(file_, molecules.size());
+    long offset_pos = Tell(file_);
+    WriteU64(file_, 0);
+
+    // Topology
+    for (size_t m = 0; m < ids.size(); m++) {
+      WriteString(file_, ids[m]);
+      WriteU64(file_, atoms[m].size());
+      for (size_t i = 0; i < atoms[m].size(); i++)
+        WriteString(file_, atoms[m][i]);
+    }
+    for (size_t k = 0; k < molecules.size(); k++) {
+      WriteU64(file_, molecules[k].size());
+      for (size_t i = 0; i < molecules[k].size(); i++)
+        WriteU64(file_, molecules[k][i]);
+    }
+
+    // Pad to the first frame, and go back to write its offset
+    long pos = Tell(file_);
+    size_t first_frame = ((pos + bnrg_align - 1) / bnrg_align) * bnrg_align;
+    std::vector<char> pad(first_frame - pos, 0);
+    WriteBytes(file_, pad.data(), pad.size());
+    Seek(file_, offset_pos, SEEK_SET);
+    WriteU64(file_, first_frame);
+    Seek(file_, 0, SEEK_END);
+  } catch (...) {
+    std::fclose(file_);
+    file_ = 0;
+    throw;
+  }
+}
+
+BinaryNrgWriter::~BinaryNrgWriter() {
+  if (file_) std::fclose(file_);
+}
+
+void BinaryNrgWriter::Close() {
+  if (!file_) return;
+  FILE* f = file_;
+  file_ = 0;
+  if (std::fclose(f) != 0)
+    throw std::runtime_error("could not close the binary NRG file");
+}
+
+void BinaryNrgWriter::WriteFrame(const double* xyz, const double* box,
+                                 double energy, const double* grads) {
+  if (!file_)
+    throw std::runtime_error("binary NRG file is closed");
+  if (flags_ & BNRG_BOX) {
+    if (!box)
+      throw std::runtime_error("binary NRG frame needs a box");
+    WriteBytes(file_, box, 9*sizeof(double));
+  }
+  if (flags_ & BNRG_ENERGY) WriteBytes(file_, &energy, sizeof(double));
+  WriteBytes(file_, xyz, 3*nat_*sizeof(double));
+  if (flags_ & BNRG_GRADS) {
+    if (!grads)
+      throw std::runtime_error("binary NRG frame needs the gradients");
+    WriteBytes(file_, grads, 3*nat_*sizeof(double));
+  }
+}
+
+void BinaryNrgWriter::WriteFrame(bblock::System &sys,
+                                 const std::vector<double> &box,
+                                 double energy) {
+  sys.GetRealXyz(xyz_.data());
+  if (flags_ & BNRG_GRADS) sys.GetRealGrads(grads_.data());
+  WriteFrame(xyz_.data(), box.size() == 9 ? box.data() : 0, energy,
+             grads_.data());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+BinaryNrgReader::BinaryNrgReader(const char* filename)
+  : fd_(-1), data_(0), size_(0), flags_(0), nat_(0), frame_size_(0),
+    nframes_(0), first_frame_(0) {
+  assert(filename);
+  fd_ = open(filename, O_RDONLY);
+  if (fd_ < 0)
+    throw std::runtime_error("could not open binary NRG file for reading");
+  struct stat st;
+  if (fstat(fd_, &st) != 0) {
+    close(fd_);
+    throw std::runtime_error("could not stat the binary NRG file");
+  }
+  size_ = st.st_size;
+  if (size_ > 0) {
+    void* p = mmap(0, size_, PROT_READ, MAP_SHARED, fd_, 0);
+    if (p == MAP_FAILED) {
+      close(fd_);
+      throw std::runtime_error("could not map the binary NRG file");
+    }
+    data_ = static_cast<const char*>(p);
+  }
+
+  try {
+    Cursor c = {data_, data_ + size_};
+    char magic[8];
+    uint32_t version, bom;
+    c.Read(magic, sizeof(magic));
+    if (std::memcmp(magic, bnrg_magic, sizeof(magic)) != 0)
+      throw std::runtime_error("not a binary NRG file");
+    c.Read(&version, sizeof(version));
+    c.Read(&bom, sizeof(bom));
+    if (bom != bnrg_bom)
+      throw std::runtime_error("binary NRG file with another byte order");
+    if (version != bnrg_version) {
+      throw std::runtime_error("binary NRG version "
+                               + std::to_string(version)
+                               + " is not supported");
+    }
+    flags_ = c.U64();
+    size_t nmon = c.U64();
+    nat_ = c.U64();
+    size_t nmol = c.U64();
+    first_frame_ = c.U64();
+
+    size_t nat = 0;
+    for (size_t m = 0; m < nmon; m++) {
+      mon_ids_.push_back(c.String());
+      mon_first_.push_back(nat);
+      size_t n = c.U64();
+      mon_atoms_.push_back(std::vector<std::string>());
+      for (size_t i = 0; i < n; i++) mon_atoms_.back().push_back(c.String());
+      nat += n;
+    }
+    for (size_t k = 0; k < nmol; k++) {
+      size_t n = c.U64();
+      molecules_.push_back(std::vector<size_t>());
+      for (size_t i = 0; i < n; i++) {
+        size_t m = c.U64();
+        if (m >= nmon)
+          throw std::runtime_error("corrupted binary NRG topology");
+        molecules_.back().push_back(m);
+      }
+    }
+    if (nat != nat_ || size_t(c.p - data_) > first_frame_
+        || first_frame_ > size_)
+      throw std::runtime_error("corrupted binary NRG topology");
+
+    frame_size_ = 3*nat_*sizeof(double);
+    if (flags_ & BNRG_BOX) frame_size_ += 9*sizeof(double);
+    if (flags_ & BNRG_ENERGY) frame_size_ += sizeof(double);
+    if (flags_ & BNRG_GRADS) frame_size_ += 3*nat_*sizeof(double);
+    nframes_ = frame_size_ > 0 ? (size_ - first_frame_) / frame_size_ : 0;
+    if (first_frame_ + nframes_*frame_size_ != size_) {
+      throw std::runtime_error("binary NRG file ends with a partial frame"
+                               " after frame "
+                               + std::to_string(nframes_));
+    }
+  } catch (...) {
+    if (data_) munmap(const_cast<char*>(data_), size_);
+    close(fd_);
+    throw;
+  }
+}
+
+BinaryNrgReader::~BinaryNrgReader() {
+  if (data_) munmap(const_cast<char*>(data_), size_);
+  if (fd_ >= 0) close(fd_);
+}
+
+const char* BinaryNrgReader::Frame(size_t n) const {
+  if (n >= nframes_) {
+    throw std::runtime_error("frame " + std::to_string(n)
+                             + " is not in the binary NRG file");
+  }
+  return data_ + first_frame_ + n*frame_size_;
+}
+
+const double* BinaryNrgReader::GetBox(size_t n) const {
+  if (!(flags_ & BNRG_BOX)) return 0;
+  return reinterpret_cast<const double*>(Frame(n));
+}
+
+double BinaryNrgReader::GetEnergy(size_t n) const {
+  if (!(flags_ & BNRG_ENERGY)) return 0.0;
+  const char* p = Frame(n);
+  if (flags_ & BNRG_BOX) p += 9*sizeof(double);
+  return *reinterpret_cast<const double*>(p);
+}
+
+const double* BinaryNrgReader::GetXyz(size_t n) const {
+  const char* p = Frame(n);
+  if (flags_ & BNRG_BOX) p += 9*sizeof(double);
+  if (flags_ & BNRG_ENERGY) p += sizeof(double);
+  return reinterpret_cast<const double*>(p);
+}
+
+const double* BinaryNrgReader::GetGrads(size_t n) const {
+  if (!(flags_ & BNRG_GRADS)) return 0;
+  return GetXyz(n) + 3*nat_;
+}
+
+void BinaryNrgReader::BuildSystem(bblock::System &sys, size_t n) {
+  const double* xyz = GetXyz(n);
+  for (size_t m = 0; m < mon_ids_.size(); m++) {
+    size_t nat = mon_atoms_[m].size();
+    sys.AddMonomer(std::vector<double>(xyz, xyz + 3*nat), mon_atoms_[m],
+                   mon_ids_[m]);
+    xyz += 3*nat;
+  }
+  for (size_t k = 0; k < molecules_.size(); k++) {
+    sys.AddMolecule(molecules_[k]);
+  }
+  sys.Initialize();
+  if (flags_ & BNRG_BOX) {
+    const double* box = GetBox(n);
+    sys.SetPBC(true, std::vector<double>(box, box + 9));
+  }
+}
+
+void BinaryNrgReader::SetFrame(bblock::System &sys, size_t n) {
+  sys.SetRealXyz(GetXyz(n));
+  if (flags_ & BNRG_BOX) {
+    const double* box = GetBox(n);
+    box_.assign(box, box + 9);
+    sys.SetPBC(true, box_);
+  }
+}
+
+void BinaryNrgReader::ReleaseFrames(size_t n) {
+  if (n > nframes_) n = nframes_;
+  const size_t page = sysconf(_SC_PAGESIZE);
+  size_t upto = ((first_frame_ + n*frame_size_) / page) * page;
+  if (upto > 0) madvise(const_cast<char*>(data_), upto, MADV_DONTNEED);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void NrgToBinary(char* nrg_file, const char* bin_file, bool do_grads) {
+  NrgFile nrg(nrg_file);
+  const char* begin;
+  const char* end;
+  size_t lineno;
+
+  BinaryNrgWriter* writer = 0;
+  std::vector<std::string> ids, ids_k;
+  std::vector<std::vector<std::string> > atoms, atoms_k;
+  std::vector<std::vector<size_t> > molecules, molecules_k;
+  std::vector<double> no_box;
+
+  try {
+    size_t k = 0;
+    while (nrg.NextSystem(begin, end, lineno)) {
+      bblock::System sys;
+      ParseNrgSystem(begin, end, lineno, sys);
+
+      if (k == 0) {
+        GetTopology(sys, ids, atoms, molecules);
+        uint64_t flags = do_grads ? BNRG_ENERGY | BNRG_GRADS : 0;
+        writer = new BinaryNrgWriter(bin_file, sys, flags);
+      } else {
+        GetTopology(sys, ids_k, atoms_k, molecules_k);
+        if (ids_k != ids || atoms_k != atoms || molecules_k != molecules) {
+          throw std::runtime_error("the SYSTEM in line "
+                                   + std::to_string(lineno)
+                                   + " of the NRG file has another topology");
+        }
+      }
+
+      double energy = do_grads ? sys.Energy(true) : 0.0;
+      writer->WriteFrame(sys, no_box, energy);
+      nrg.Release(end);
+      k++;
+    }
+    if (k == 0)
+      throw std::runtime_error("No SYSTEM found in the NRG file");
+    writer->Close();
+  } catch (...) {
+    delete writer;
+    throw;
+  }
+  delete writer;
+}
+
+void BinaryToNrg(const char* bin_file, const char* nrg_file) {
+  BinaryNrgReader reader(bin_file);
+  FILE* f = std::fopen(nrg_file, "w");
+  if (!f)
+    throw std::runtime_error("could not open NRG file for writting");
+
+  // Coordinates with 17 significant digits, so they are read back exactly
+  const std::vector<std::string> &ids = reader.GetMonIds();
+  const std::vector<std::vector<std::string> > &atoms = reader.GetMonAtoms();
+  const std::vector<size_t> &first = reader.GetMonFirst();
+  const std::vector<std::vector<size_t> > &molecules = reader.GetMolecules();
+  for (size_t n = 0; n < reader.GetNumFrames(); n++) {
+    const double* xyz = reader.GetXyz(n);
+    std::fprintf(f, "SYSTEM %zu\n", n);
+    for (size_t k = 0; k < molecules.size(); k++) {
+      std::fprintf(f, "MOLECULE %zu.%zu\n", n, k);
+      for (size_t i = 0; i < molecules[k].size(); i++) {
+        size_t m = molecules[k][i];
+        std::fprintf(f, "MONOMER %s\n", ids[m].c_str());
+        for (size_t a = 0; a < atoms[m].size(); a++) {
+          const double* r = xyz + 3*(first[m] + a);
+          std::fprintf(f, "%-5s %24.16e %24.16e %24.16e\n",
+                       atoms[m][a].c_str(), r[0], r[1], r[2]);
+        }
+        std::fprintf(f, "ENDMON \n");
+      }
+      std::fprintf(f, "ENDMOL \n");
+    }
+    std::fprintf(f, "ENDSYS \n");
+  }
+  if (std::ferror(f)) {
+    std::fclose(f);
+    throw std::runtime_error("could not write the NRG file");
+  }
+  if (std::fclose(f) != 0)
+    throw std::runtime_error("could not close the NRG file");
+}
+
+bool IsBinaryNrg(const char* filename) {
+  // Reading the magic of a pipe would consume it, so only regular files
+  // are checked
+  struct stat st;
+  if (stat(filename, &st) != 0 || !S_ISREG(st.st_mode)) return false;
+
+  char magic[8];
+  FILE* f = std::fopen(filename, "rb");
+  if (!f) return false;
+  bool is_bin = std::fread(magic, 1, sizeof(magic), f) == sizeof(magic)
+                && std::memcmp(magic, bnrg_magic, sizeof(magic)) == 0;
+  std::fclose(f);
+  return is_bin;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+} // namespace tools
@@ -0,0 +1,177 @@
+#ifndef CU_INCLUDE_TOOLS_BINARYNRG_H
+#define CU_INCLUDE_TOOLS_BINARYNRG_H
+
+#include <vector>
+#include <string>
+#include <stdexcept>
+#include <cassert>
+#include <cstring>
+#include <cstdio>
+#include <cstdint>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "bblock/system.h"
+
+////////////////////////////////////////////////////////////////////////////////
+namespace tools {
+////////////////////////////////////////////////////////////////////////////////
+
+// Binary configuration/trajectory format (version 1). All the integers
+// are uint64 and all the reals are doubles, in the byte order of the
+// machine that wrote the file (checked with the byte order mark).
+//
+// Header:
+//   char[8] magic "CUNRGBIN", uint32 version, uint32 byte order mark
+//   0x01020304, uint64 flags (BNRG_BOX | BNRG_ENERGY | BNRG_GRADS),
+//   uint64 number of monomers, real sites and molecules, uint64 offset
+//   of the first frame
+// Topology, in the input order of the system:
+//   per monomer: uint64 length + id, uint64 number of atoms, and per
+//   atom uint64 length + name
+//   per molecule: uint64 number of monomers + monomer indices
+// Frames, from the offset of the first frame (64 byte aligned), all with
+// the same size, so the number of frames follows from the file size:
+//   [box, 9 doubles] [energy, 1 double] xyz (3 * real sites doubles,
+//   input order) [gradients, 3 * real sites doubles]
+
+// Flags of the optional fields of the frames
+const uint64_t BNRG_BOX = 1;
+const uint64_t BNRG_ENERGY = 2;
+const uint64_t BNRG_GRADS = 4;
+
+// Writes a binary trajectory, one frame at a time
+class BinaryNrgWriter {
+ public:
+  // Creates filename, and writes the header and the topology of sys.
+  // flags tells which optional fields are stored in each frame
+  BinaryNrgWriter(const char* filename, bblock::System &sys, uint64_t flags);
+  ~BinaryNrgWriter();
+
+  // Appends a frame. xyz has the real sites in input order (GetRealXyz).
+  // box (9 components), energy and grads (as GetRealGrads) are only
+  // written if they are in the flags
+  void WriteFrame(const double* xyz, const double* box = 0,
+                  double energy = 0.0, const double* grads = 0);
+
+  // Appends a frame with the coordinates of sys. box is written if it is
+  // in the flags, and the energy and the gradients of the last
+  // evaluation of sys if they are
+  void WriteFrame(bblock::System &sys, const std::vector<double> &box,
+                  double energy);
+
+  // Closes the file, and throws if the frames could not be written. The
+  // destructor closes the file without checking it
+  void Close();
+
+ private:
+  BinaryNrgWriter(const BinaryNrgWriter&);
+  BinaryNrgWriter& operator=(const BinaryNrgWriter&);
+
+  // Output file
+  FILE* file_;
+  // Optional fields of the frames
+  uint64_t flags_;
+  // Number of real sites
+  size_t nat_;
+  // Coordinates and gradients of a frame, reused by WriteFrame
+  std::vector<double> xyz_;
+  std::vector<double> grads_;
+};
+
+// Reads a binary trajectory. The file is memory mapped, and the frames
+// are used in place, without parsing
+class BinaryNrgReader {
+ public:
+  // Maps filename and reads its header and topology. Throws if the file
+  // ends with a partial frame
+  BinaryNrgReader(const char* filename);
+  ~BinaryNrgReader();
+
+  // Number of frames and real sites, and optional fields of the frames
+  size_t GetNumFrames() const {return nframes_;}
+  size_t GetNumRealSites() const {return nat_;}
+  bool HasBox() const {return flags_ & BNRG_BOX;}
+  bool HasEnergy() const {return flags_ & BNRG_ENERGY;}
+  bool HasGrads() const {return flags_ & BNRG_GRADS;}
+
+  // Topology: id and atom names of each monomer, first real site of each
+  // monomer, and monomers of each molecule
+  const std::vector<std::string> &GetMonIds() const {return mon_ids_;}
+  const std::vector<std::vector<std::string> > &GetMonAtoms() const {
+    return mon_atoms_;
+  }
+  const std::vector<size_t> &GetMonFirst() const {return mon_first_;}
+  const std::vector<std::vector<size_t> > &GetMolecules() const {
+    return molecules_;
+  }
+
+  // Pointers to the fields of frame n, in the mapping. GetBox and
+  // GetGrads return a null pointer if the field is not stored
+  const double* GetXyz(size_t n) const;
+  const double* GetBox(size_t n) const;
+  const double* GetGrads(size_t n) const;
+  double GetEnergy(size_t n) const;
+
+  // Adds the monomers and molecules of the topology to sys, with the
+  // coordinates of frame n, and initializes it. If the frames have a
+  // box, PBC are set with the box of frame n
+  void BuildSystem(bblock::System &sys, size_t n = 0);
+
+  // Sets the coordinates of frame n in sys, which was built by
+  // BuildSystem, and its box if the frames have one
+  void SetFrame(bblock::System &sys, size_t n);
+
+  // Tells the kernel that the frames before n are not needed anymore
+  void ReleaseFrames(size_t n);
+
+ private:
+  BinaryNrgReader(const BinaryNrgReader&);
+  BinaryNrgReader& operator=(const BinaryNrgReader&);
+
+  // Address of frame n
+  const char* Frame(size_t n) const;
+
+  // Mapping of the file
+  int fd_;
+  const char* data_;
+  size_t size_;
+  // Optional fields of the frames
+  uint64_t flags_;
+  // Number of real sites, size of a frame in bytes, number of frames,
+  // and offset of the first frame
+  size_t nat_;
+  size_t frame_size_;
+  size_t nframes_;
+  size_t first_frame_;
+  // Topology: monomer ids, atom names, first real sites and molecules
+  std::vector<std::string> mon_ids_;
+  std::vector<std::vector<std::string> > mon_atoms_;
+  std::vector<size_t> mon_first_;
+  std::vector<std::vector<size_t> > molecules_;
+  // Box of a frame, reused by SetFrame. The coordinates are set from the
+  // mapping
+  std::vector<double> box_;
+};
+
+// Converts an NRG file to the binary format. All the systems must have
+// the same topology. If do_grads is true, the energies and gradients of
+// the systems are computed and stored too
+void NrgToBinary(char* nrg_file, const char* bin_file, bool do_grads);
+
+// Converts a binary trajectory to NRG, one SYSTEM per frame
+void BinaryToNrg(const char* bin_file, const char* nrg_file);
+
+// True if filename is a regular file that starts with the magic of the
+// binary format. Pipes and other files that cannot be read twice are
+// never taken as binary, so their first bytes are not consumed
+bool IsBinaryNrg(const char* filename);
+
+////////////////////////////////////////////////////////////////////////////////
+} // namespace tools
+////////////////////////////////////////////////////////////////////////////////
+#endif // CU_INCLUDE_TOOLS_BINARYNRG_H
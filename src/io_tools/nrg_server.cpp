@@ -0,0 +1,594 @@
+#include "nrg_server.h"
+#include "read_nrg.h"
+
+#include <cerrno>
+
+namespace {
+
+// Size of the header in doubles. The messages are built in buffers of
+// doubles, with the header first, so the reals of the payload are
+// aligned and a message is written at once
+const size_t header_words = sizeof(tools::ServerHeader) / sizeof(double);
+static_assert(sizeof(tools::ServerHeader) == 24,
+              "the header of the server protocol must have 24 bytes");
+
+// Largest reply accepted by the client, so a corrupted header does not
+// allocate without bound
+const uint64_t max_reply = uint64_t(1) << 32;
+
+// Writes n bytes of p to fd. A client that has gone away does not raise
+// SIGPIPE, and one that does not read fails after the send timeout of fd
+void WriteAll(int fd, const void* p, size_t n) {
+  const char* c = static_cast<const char*>(p);
+  while (n > 0) {
+    ssize_t k = send(fd, c, n, MSG_NOSIGNAL);
+    if (k < 0 && errno == ENOTSOCK) k = write(fd, c, n);
+    if (k < 0 && errno == EINTR) continue;
+    if (k < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      throw std::runtime_error("the client did not read its replies");
+    if (k <= 0) throw std::runtime_error("could not write to the client");
+    c += k;
+    n -= k;
+  }
+}
+
+// Reads n bytes from fd into p. Returns false if the channel is closed
+// before the first byte, and throws if it is closed in the middle
+bool ReadAll(int fd, void* p, size_t n) {
+  char* c = static_cast<char*>(p);
+  size_t done = 0;
+  while (done < n) {
+    ssize_t k = read(fd, c + done, n - done);
+    if (k < 0 && errno == EINTR) continue;
+    if (k < 0) throw std::runtime_error("could not read from the channel");
+    if (k == 0) {
+      if (done == 0) return false;
+      throw std::runtime_error("truncated message");
+    }
+    done += k;
+  }
+  return true;
+}
+
+// Reads and drops n bytes from fd. Throws if the channel is closed
+// before
+void Discard(int fd, uint64_t n) {
+  char chunk[65536];
+  while (n > 0) {
+    size_t k = std::min(n, uint64_t(sizeof(chunk)));
+    if (!ReadAll(fd, chunk, k)) throw std::runtime_error("truncated message");
+    n -= k;
+  }
+}
+
+// Number of doubles that hold n bytes
+inline size_t Words(size_t n) {
+  return (n + sizeof(double) - 1) / sizeof(double);
+}
+
+// Monomers, atoms and molecules of sys, in input order, as a string
+std::string TopologyKey(bblock::System &sys) {
+  std::vector<std::string> names = sys.GetRealAtomNames();
+  std::string key;
+  size_t first = 0;
+  for (size_t m = 0; m < sys.GetNumMon(); m++) {
+    key += sys.GetMonId(m) + ":";
+    for (size_t a = 0; a < sys.GetMonNumAt(m); a++)
+      key += names[first + a] + " ";
+    first += sys.GetMonNumAt(m);
+    key += "\n";
+  }
+  for (size_t k = 0; k < sys.GetNumMol(); k++) {
+    std::vector<size_t> molec = sys.GetMolecule(k);
+    key += "mol";
+    for (size_t i = 0; i < molec.size(); i++)
+      key += " " + std::to_string(molec[i]);
+    key += "\n";
+  }
+  return key;
+}
+
+} // namespace
+
+namespace tools {
+
+////////////////////////////////////////////////////////////////////////////////
+
+EnergyServer::EnergyServer(size_t nworkers, size_t nthreads,
+                           double send_timeout)
+  : nthreads_(nthreads == 0 ? 1 : nthreads), send_timeout_(send_timeout),
+    stop_workers_(false),
+    shutdown_(false), listen_fd_(-1) {
+  if (nworkers == 0) nworkers = 1;
+  for (size_t i = 0; i < nworkers; i++)
+    workers_.push_back(std::thread(&EnergyServer::Worker, this));
+}
+
+EnergyServer::~EnergyServer() {
+  {
+    std::lock_guard<std::mutex> lock(tasks_mutex_);
+    stop_workers_ = true;
+  }
+  cv_task_.notify_all();
+  for (size_t i = 0; i < workers_.size(); i++) workers_[i].join();
+}
+
+void EnergyServer::Serve(int fd_in, int fd_out) {
+  std::shared_ptr<Connection> conn(new Connection);
+  conn->fd_out = fd_out;
+  conn->broken = false;
+  conn->pending = 0;
+
+  // A reply to a socket waits send_timeout_ seconds at most. Other
+  // channels, as the standard output, have a single client, that only
+  // blocks itself
+  timeval tv;
+  tv.tv_sec = time_t(send_timeout_);
+  tv.tv_usec = suseconds_t(1E6 * (send_timeout_ - double(tv.tv_sec)));
+  setsockopt(fd_out, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  {
+    std::lock_guard<std::mutex> lock(shutdown_mutex_);
+    if (shutdown_) return;
+    inputs_.push_back(fd_in);
+  }
+
+  std::string error;
+  std::vector<double> reply;
+  try {
+    while (true) {
+      Task t;
+      if (!ReadAll(fd_in, &t.header, sizeof(t.header))) break;
+      t.conn = conn;
+      {
+        std::unique_lock<std::mutex> lock(conn->pending_mutex);
+        conn->cv_pending.wait(lock, [&conn] {
+          return conn->pending < SRV_MAX_PENDING;
+        });
+        conn->pending++;
+      }
+
+      // A request with a wrong size is answered here, and the connection
+      // goes on with the next one, unless it can not be read
+      std::string request_error;
+      try {
+        request_error = ReadPayload(fd_in, t);
+      } catch (const std::exception &e) {
+        ReplyError(*conn, t.header, e.what(), reply);
+        throw;
+      }
+      if (!request_error.empty()) {
+        ReplyError(*conn, t.header, request_error, reply);
+        continue;
+      }
+
+      // The shutdown is answered once the other requests of the
+      // connection are
+      if (t.header.type == SRV_SHUTDOWN) {
+        Shutdown();
+        {
+          std::unique_lock<std::mutex> lock(conn->pending_mutex);
+          conn->cv_pending.wait(lock, [&conn] {return conn->pending == 1;});
+        }
+        reply.resize(header_words);
+        Reply(*conn, t.header, SRV_OK, reply, 0);
+        break;
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(tasks_mutex_);
+        tasks_.push_back(std::move(t));
+      }
+      cv_task_.notify_one();
+    }
+  } catch (const std::exception &e) {
+    error = e.what();
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(shutdown_mutex_);
+    inputs_.erase(std::find(inputs_.begin(), inputs_.end(), fd_in));
+  }
+  {
+    std::unique_lock<std::mutex> lock(conn->pending_mutex);
+    conn->cv_pending.wait(lock, [&conn] {return conn->pending == 0;});
+  }
+  if (!error.empty()) throw std::runtime_error(error);
+}
+
+void EnergyServer::Listen(const char* path) {
+  sockaddr_un addr;
+  std::memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (std::strlen(path) >= sizeof(addr.sun_path))
+    throw std::runtime_error("socket path is too long");
+  std::strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) throw std::runtime_error("could not open the socket");
+  unlink(path);
+  if (bind(fd, (sockaddr*) &addr, sizeof(addr)) != 0
+      || listen(fd, SOMAXCONN) != 0) {
+    close(fd);
+    throw std::runtime_error("could not listen on " + std::string(path));
+  }
+  bool stopped;
+  {
+    std::lock_guard<std::mutex> lock(shutdown_mutex_);
+    stopped = shutdown_;
+    if (!stopped) listen_fd_ = fd;
+  }
+
+  // Each connection is read by its own thread, and its requests are
+  // evaluated by the workers shared by all the connections. A shutdown
+  // makes accept fail
+  std::vector<std::thread> connections;
+  while (!stopped) {
+    int c = accept(fd, 0, 0);
+    if (c < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      break;
+    }
+    connections.push_back(std::thread([this, c] {
+      try {
+        Serve(c, c);
+      } catch (const std::exception &e) {
+        std::cerr << " ** Error ** : " << e.what() << std::endl;
+      }
+      close(c);
+    }));
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(shutdown_mutex_);
+    listen_fd_ = -1;
+  }
+  close(fd);
+  unlink(path);
+  for (size_t i = 0; i < connections.size(); i++) connections[i].join();
+}
+
+size_t EnergyServer::GetNumTopologies() {
+  std::lock_guard<std::mutex> lock(topologies_mutex_);
+  return topologies_.size();
+}
+
+void EnergyServer::Worker() {
+  // The requests are evaluated in parallel, one per worker, each one
+  // with nthreads_ threads
+# ifdef _OPENMP
+  omp_set_num_threads(nthreads_);
+# endif
+  // Copies of the topologies evaluated by this worker, and the buffer of
+  // the replies
+  std::map<uint64_t, WorkerSystem> systems;
+  std::vector<double> reply;
+  while (true) {
+    Task t;
+    {
+      std::unique_lock<std::mutex> lock(tasks_mutex_);
+      cv_task_.wait(lock, [this] {return !tasks_.empty() || stop_workers_;});
+      if (tasks_.empty()) return;
+      t = std::move(tasks_.front());
+      tasks_.pop_front();
+    }
+
+    // The type and the size of the request were checked by its reader
+    try {
+      size_t size;
+      if (t.header.type == SRV_TOPOLOGY) {
+        size = AddTopology(t.header, t.payload, reply);
+      } else {
+        size = Evaluate(t.header, t.payload, systems, reply);
+      }
+      Reply(*t.conn, t.header, SRV_OK, reply, size);
+    } catch (const std::exception &e) {
+      ReplyError(*t.conn, t.header, e.what(), reply);
+    }
+  }
+}
+
+std::string EnergyServer::ReadPayload(int fd_in, Task &t) {
+  const ServerHeader &h = t.header;
+  std::string error;
+  uint64_t id = 0;
+  uint64_t done = 0;
+  if (h.type == SRV_TOPOLOGY) {
+    if (h.size > SRV_MAX_TOPOLOGY) {
+      error = "topology of " + std::to_string(h.size)
+            + " bytes is too large (largest is "
+            + std::to_string(SRV_MAX_TOPOLOGY) + ")";
+    }
+  } else if (h.type == SRV_ENERGY) {
+    // The size follows from the topology, so its id is read first
+    if (h.size < sizeof(id)) {
+      error = "energy request without topology";
+    } else {
+      if (!ReadAll(fd_in, &id, sizeof(id)))
+        throw std::runtime_error("truncated message");
+      done = sizeof(id);
+      size_t nat = 0;
+      bool known;
+      {
+        std::lock_guard<std::mutex> lock(topologies_mutex_);
+        known = id < topologies_.size();
+        if (known) nat = topologies_[id]->nat;
+      }
+      const size_t nbox = (h.flags & SRV_BOX) ? 9 : 0;
+      const uint64_t expected = sizeof(double) * (1 + nbox + 3*nat);
+      if (!known) {
+        error = "topology " + std::to_string(id) + " is not known";
+      } else if (h.size != expected) {
+        error = "energy request of topology " + std::to_string(id)
+              + " has " + std::to_string(h.size) + " bytes instead of "
+              + std::to_string(expected);
+      }
+    }
+  } else if (h.type == SRV_SHUTDOWN) {
+    if (h.size != 0) error = "shutdown request with a payload";
+  } else {
+    error = "unknown request type " + std::to_string(h.type);
+  }
+
+  // A payload too large to be dropped ends the connection
+  if (!error.empty()) {
+    if (h.size - done > SRV_MAX_TOPOLOGY)
+      throw std::runtime_error(error + "; closing the connection");
+    Discard(fd_in, h.size - done);
+    return error;
+  }
+  t.payload.resize(Words(h.size));
+  if (done > 0) std::memcpy(t.payload.data(), &id, sizeof(id));
+  if (!ReadAll(fd_in, reinterpret_cast<char*>(t.payload.data()) + done,
+               h.size - done))
+    throw std::runtime_error("truncated message");
+  return error;
+}
+
+size_t EnergyServer::AddTopology(const ServerHeader &header,
+                                 const std::vector<double> &payload,
+                                 std::vector<double> &reply) {
+  const char* begin = reinterpret_cast<const char*>(payload.data());
+  const char* end = begin + header.size;
+  const char* p = begin;
+  while (p < end && std::isspace((unsigned char) *p)) p++;
+  if (end - p < 6 || strncasecmp(p, "system", 6) != 0)
+    throw std::runtime_error("the topology is not an NRG SYSTEM block");
+
+  // The system is initialized outside of the lock, and dropped if
+  // another request registered the same topology meanwhile
+  std::unique_ptr<Topology> topo(new Topology);
+  ParseNrgSystem(p, end, 1, topo->sys);
+  topo->key = TopologyKey(topo->sys);
+  topo->nat = topo->sys.GetNumRealSites();
+
+  uint64_t out[2] = {0, topo->nat};
+  {
+    std::lock_guard<std::mutex> lock(topologies_mutex_);
+    std::map<std::string, uint64_t>::iterator it =
+        topology_ids_.find(topo->key);
+    if (it != topology_ids_.end()) {
+      out[0] = it->second;
+    } else {
+      out[0] = topologies_.size();
+      topology_ids_[topo->key] = out[0];
+      topologies_.push_back(std::move(topo));
+    }
+  }
+
+  reply.resize(header_words + 2);
+  std::memcpy(reply.data() + header_words, out, sizeof(out));
+  return sizeof(out);
+}
+
+size_t EnergyServer::Evaluate(const ServerHeader &header,
+                              const std::vector<double> &payload,
+                              std::map<uint64_t, WorkerSystem> &systems,
+                              std::vector<double> &reply) {
+  uint64_t id;
+  if (header.size < sizeof(id))
+    throw std::runtime_error("energy request without topology");
+  std::memcpy(&id, payload.data(), sizeof(id));
+
+  // The topologies are never removed, so the pointer stays valid
+  Topology* topo;
+  {
+    std::lock_guard<std::mutex> lock(topologies_mutex_);
+    if (id >= topologies_.size())
+      throw std::runtime_error("topology " + std::to_string(id)
+                               + " is not known");
+    topo = topologies_[id].get();
+  }
+
+  const bool use_box = header.flags & SRV_BOX;
+  const bool do_virial = header.flags & SRV_VIRIAL;
+  const bool do_grads = (header.flags & SRV_GRADS) || do_virial;
+  const size_t nbox = use_box ? 9 : 0;
+  const size_t expected = sizeof(double) * (1 + nbox + 3*topo->nat);
+  if (header.size != expected)
+    throw std::runtime_error("energy request of topology "
+                             + std::to_string(id) + " has "
+                             + std::to_string(header.size)
+                             + " bytes instead of "
+                             + std::to_string(expected));
+
+  std::map<uint64_t, WorkerSystem>::iterator it = systems.find(id);
+  if (it == systems.end()) {
+    it = systems.insert(std::make_pair(id, WorkerSystem())).first;
+    it->second.sys = topo->sys;
+    it->second.use_pbc = false;
+    it->second.box.assign(9, 0.0);
+  }
+  WorkerSystem &ws = it->second;
+
+  // The box is only set when it changes
+  const double* box = payload.data() + 1;
+  if (use_box) {
+    if (!ws.use_pbc || !std::equal(box, box + 9, ws.box.begin())) {
+      ws.box.assign(box, box + 9);
+      ws.sys.SetPBC(true, ws.box);
+      ws.use_pbc = true;
+    }
+  } else if (ws.use_pbc) {
+    ws.sys.SetPBC(false, ws.box);
+    ws.use_pbc = false;
+  }
+
+  ws.sys.SetRealXyz(payload.data() + 1 + nbox);
+  ws.sys.ResetDipoleHistory();
+  double energy = ws.sys.Energy(do_grads);
+
+  size_t nout = 1 + ((header.flags & SRV_GRADS) ? 3*topo->nat : 0)
+                  + (do_virial ? 9 : 0);
+  reply.resize(header_words + nout);
+  double* out = reply.data() + header_words;
+  *out++ = energy;
+  if (header.flags & SRV_GRADS) {
+    ws.sys.GetRealGrads(out);
+    out += 3*topo->nat;
+  }
+  if (do_virial) {
+    std::vector<double> virial = ws.sys.GetVirial();
+    std::copy(virial.begin(), virial.end(), out);
+  }
+  return nout * sizeof(double);
+}
+
+void EnergyServer::Reply(Connection &conn, const ServerHeader &request,
+                         uint32_t status, std::vector<double> &reply,
+                         size_t size) {
+  ServerHeader header = {request.type, status, request.tag, size};
+  std::memcpy(reply.data(), &header, sizeof(header));
+  {
+    std::lock_guard<std::mutex> lock(conn.write_mutex);
+    if (!conn.broken) {
+      try {
+        WriteAll(conn.fd_out, reply.data(), sizeof(header) + size);
+      } catch (const std::exception &) {
+        // The client has gone away or does not read. A partial reply may
+        // have been written, so the channel is shut down, and its reader
+        // finds the end of it
+        conn.broken = true;
+        shutdown(conn.fd_out, SHUT_RDWR);
+      }
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(conn.pending_mutex);
+  conn.pending--;
+  conn.cv_pending.notify_all();
+}
+
+void EnergyServer::ReplyError(Connection &conn, const ServerHeader &request,
+                              const std::string &message,
+                              std::vector<double> &reply) {
+  reply.resize(header_words + Words(message.size()));
+  std::memcpy(reply.data() + header_words, message.data(), message.size());
+  Reply(conn, request, SRV_ERROR, reply, message.size());
+}
+
+void EnergyServer::Shutdown() {
+  std::lock_guard<std::mutex> lock(shutdown_mutex_);
+  shutdown_ = true;
+  for (size_t i = 0; i < inputs_.size(); i++)
+    shutdown(inputs_[i], SHUT_RD);
+  if (listen_fd_ >= 0) {
+    shutdown(listen_fd_, SHUT_RDWR);
+    listen_fd_ = -1;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+EnergyClient::EnergyClient(const char* path)
+  : fd_in_(-1), fd_out_(-1), own_fd_(true), tag_(0), reply_size_(0) {
+  sockaddr_un addr;
+  std::memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (std::strlen(path) >= sizeof(addr.sun_path))
+    throw std::runtime_error("socket path is too long");
+  std::strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) throw std::runtime_error("could not open the socket");
+  if (connect(fd, (sockaddr*) &addr, sizeof(addr)) != 0) {
+    close(fd);
+    throw std::runtime_error("could not connect to " + std::string(path));
+  }
+  fd_in_ = fd_out_ = fd;
+}
+
+EnergyClient::EnergyClient(int fd_in, int fd_out)
+  : fd_in_(fd_in), fd_out_(fd_out), own_fd_(false), tag_(0),
+    reply_size_(0) {}
+
+EnergyClient::~EnergyClient() {
+  if (own_fd_) close(fd_in_);
+}
+
+uint64_t EnergyClient::AddTopology(const std::string &nrg_block,
+                                   size_t &nat) {
+  request_.resize(header_words + Words(nrg_block.size()));
+  std::memcpy(request_.data() + header_words, nrg_block.data(),
+              nrg_block.size());
+  Request(SRV_TOPOLOGY, 0, nrg_block.size());
+  uint64_t out[2];
+  if (reply_size_ != sizeof(out))
+    throw std::runtime_error("unexpected reply of the server");
+  std::memcpy(out, reply_.data(), sizeof(out));
+  nat = out[1];
+  return out[0];
+}
+
+double EnergyClient::Energy(uint64_t id, const double* xyz, size_t nat,
+                            double* grad, double* virial,
+                            const double* box) {
+  uint32_t flags = (grad ? SRV_GRADS : 0) | (virial ? SRV_VIRIAL : 0)
+                 | (box ? SRV_BOX : 0);
+  const size_t nbox = box ? 9 : 0;
+  request_.resize(header_words + 1 + nbox + 3*nat);
+  double* p = request_.data() + header_words;
+  std::memcpy(p++, &id, sizeof(id));
+  if (box) p = std::copy(box, box + 9, p);
+  std::copy(xyz, xyz + 3*nat, p);
+  Request(SRV_ENERGY, flags, sizeof(double) * (1 + nbox + 3*nat));
+
+  const size_t nout = 1 + (grad ? 3*nat : 0) + (virial ? 9 : 0);
+  if (reply_size_ != sizeof(double) * nout)
+    throw std::runtime_error("unexpected reply of the server");
+  const double* r = reply_.data();
+  double energy = *r++;
+  if (grad) {
+    std::copy(r, r + 3*nat, grad);
+    r += 3*nat;
+  }
+  if (virial) std::copy(r, r + 9, virial);
+  return energy;
+}
+
+void EnergyClient::Shutdown() {
+  request_.resize(header_words);
+  Request(SRV_SHUTDOWN, 0, 0);
+}
+
+void EnergyClient::Request(uint32_t type, uint32_t flags, size_t size) {
+  ServerHeader header = {type, flags, ++tag_, size};
+  std::memcpy(request_.data(), &header, sizeof(header));
+  WriteAll(fd_out_, request_.data(), sizeof(header) + size);
+
+  if (!ReadAll(fd_in_, &header, sizeof(header)))
+    throw std::runtime_error("the server closed the connection");
+  if (header.tag != tag_ || header.size > max_reply)
+    throw std::runtime_error("unexpected reply of the server");
+  reply_.resize(Words(header.size));
+  if (!ReadAll(fd_in_, reply_.data(), header.size))
+    throw std::runtime_error("the server closed the connection");
+  reply_size_ = header.size;
+  if (header.flags == SRV_ERROR) {
+    throw std::runtime_error(std::string(
+        reinterpret_cast<const char*>(reply_.data()), header.size));
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+} // namespace tools
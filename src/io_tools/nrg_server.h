@@ -0,0 +1,267 @@
+#ifndef CU_INCLUDE_TOOLS_NRGSERVER_H
+#define CU_INCLUDE_TOOLS_NRGSERVER_H
+
+#include <vector>
+#include <string>
+#include <map>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <stdexcept>
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <cctype>
+#include <cstdint>
+
+#include <unistd.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+
+#ifdef _OPENMP
+# include <omp.h>
+#endif
+
+#include "bblock/system.h"
+
+////////////////////////////////////////////////////////////////////////////////
+namespace tools {
+////////////////////////////////////////////////////////////////////////////////
+
+// Protocol of the energy server (version 1). Every message, in both
+// directions, is a header followed by its payload. The integers are
+// uint32 or uint64 and the reals are doubles, in the byte order of the
+// machine (the server only listens on local channels).
+//
+// Header (24 bytes): uint32 type, uint32 flags (requests) or status
+//   (replies), uint64 tag, uint64 size of the payload in bytes.
+//   The tag is chosen by the client and copied to the reply, so a client
+//   can send several requests before reading the replies. With more than
+//   one worker the replies may come in a different order.
+//
+// SRV_TOPOLOGY: the payload is an NRG SYSTEM ... ENDSYS block, of at most
+//   SRV_MAX_TOPOLOGY bytes. The system is parsed and initialized once,
+//   and kept. Reply: uint64 topology id, uint64 number of real sites. A
+//   topology that is already known (same monomers, atoms and molecules,
+//   in the same order) gets its old id.
+// SRV_ENERGY: the payload is uint64 topology id, [box, 9 doubles, if
+//   SRV_BOX], coordinates of the real sites (3 * real sites doubles, in
+//   input order). Reply: double energy, [gradients, 3 * real sites
+//   doubles, if SRV_GRADS], [virial, 9 doubles, if SRV_VIRIAL]. The
+//   requests are independent: the dipole history is not kept between
+//   them. The size of the payload must be the one of its topology,
+//   which must be registered before the request is sent.
+// SRV_SHUTDOWN: no payload. The server stops reading requests, answers
+//   the ones in flight, and returns. The reply has no payload.
+// A reply with status SRV_ERROR has the error message as its payload.
+// The size of a request is checked before its payload is stored: a
+// request with a wrong size gets an error reply and its payload is
+// dropped, or the connection is closed if the payload is larger than
+// SRV_MAX_TOPOLOGY. A connection has at most SRV_MAX_PENDING requests
+// not answered yet; the server stops reading it until one of them is
+// answered. A client must read its replies: on a socket, a reply that
+// can not be written for SRV_SEND_TIMEOUT seconds closes the connection,
+// so the workers shared with the other clients are not blocked.
+
+// Types of the messages
+const uint32_t SRV_TOPOLOGY = 1;
+const uint32_t SRV_ENERGY = 2;
+const uint32_t SRV_SHUTDOWN = 3;
+// Flags of SRV_ENERGY
+const uint32_t SRV_GRADS = 1;
+const uint32_t SRV_BOX = 2;
+const uint32_t SRV_VIRIAL = 4;
+// Status of the replies
+const uint32_t SRV_OK = 0;
+const uint32_t SRV_ERROR = 1;
+// Largest NRG block of a topology, in bytes
+const uint64_t SRV_MAX_TOPOLOGY = uint64_t(16) << 20;
+// Requests of a connection not answered yet, at most
+const size_t SRV_MAX_PENDING = 64;
+// Seconds a reply waits for its client to read, at most
+const double SRV_SEND_TIMEOUT = 30.0;
+
+struct ServerHeader {
+  uint32_t type;
+  uint32_t flags;
+  uint64_t tag;
+  uint64_t size;
+};
+
+// Evaluates the energies of the requests of one or several clients. The
+// initialized systems are kept by topology, so a request only sets the
+// coordinates of a system and evaluates it
+class EnergyServer {
+ public:
+  // Starts nworkers threads that evaluate the requests, each one with
+  // nthreads OpenMP threads. A connection whose client does not read a
+  // reply for send_timeout seconds is closed
+  EnergyServer(size_t nworkers, size_t nthreads = 1,
+               double send_timeout = SRV_SEND_TIMEOUT);
+  ~EnergyServer();
+
+  // Serves the requests read from fd_in, with the replies written to
+  // fd_out, until the end of fd_in or a shutdown request. Returns when
+  // all the replies are written
+  void Serve(int fd_in, int fd_out);
+
+  // Listens on the UNIX domain socket path, and serves each connection
+  // in its own thread, until a shutdown request. Removes the socket
+  // before returning
+  void Listen(const char* path);
+
+  // Number of topologies registered so far
+  size_t GetNumTopologies();
+
+ private:
+  EnergyServer(const EnergyServer&);
+  EnergyServer& operator=(const EnergyServer&);
+
+  // Channel of a client. Its replies are written by the workers, one at
+  // a time. Once a reply can not be written, the channel is shut down and
+  // the next replies are dropped
+  struct Connection {
+    int fd_out;
+    bool broken;
+    std::mutex write_mutex;
+    // Requests of the connection not answered yet, at most
+    // SRV_MAX_PENDING
+    size_t pending;
+    std::mutex pending_mutex;
+    std::condition_variable cv_pending;
+  };
+
+  // Request waiting for a worker. The payload is kept in doubles, so its
+  // reals are aligned
+  struct Task {
+    std::shared_ptr<Connection> conn;
+    ServerHeader header;
+    std::vector<double> payload;
+  };
+
+  // Initialized system of a topology, copied by each worker the first
+  // time it evaluates the topology
+  struct Topology {
+    std::string key;
+    bblock::System sys;
+    size_t nat;
+  };
+
+  // Copy of a topology owned by a worker, with its current box
+  struct WorkerSystem {
+    bblock::System sys;
+    bool use_pbc;
+    std::vector<double> box;
+  };
+
+  void Worker();
+
+  // Reads the payload of the request t, whose header has been read from
+  // fd_in, after checking its type and size. If they are not valid, the
+  // payload is dropped and the error is returned, or the error is thrown
+  // if the payload is too large to be dropped. Returns an empty string
+  // otherwise
+  std::string ReadPayload(int fd_in, Task &t);
+
+  // The request handlers write the payload of the reply after the space
+  // of its header in reply, and return its size in bytes
+
+  // Topology id of the NRG block in the payload, registered if new
+  size_t AddTopology(const ServerHeader &header,
+                     const std::vector<double> &payload,
+                     std::vector<double> &reply);
+
+  // Energy of a SRV_ENERGY request, in the system of the worker
+  size_t Evaluate(const ServerHeader &header,
+                  const std::vector<double> &payload,
+                  std::map<uint64_t, WorkerSystem> &systems,
+                  std::vector<double> &reply);
+
+  // Writes the header of the reply to a request, and the reply with a
+  // payload of size bytes, unless the connection is broken. Marks the
+  // request as answered
+  void Reply(Connection &conn, const ServerHeader &request, uint32_t status,
+             std::vector<double> &reply, size_t size);
+
+  // Replies to a request with the error message, in the buffer reply
+  void ReplyError(Connection &conn, const ServerHeader &request,
+                  const std::string &message, std::vector<double> &reply);
+
+  // Stops reading requests from all the connections
+  void Shutdown();
+
+  size_t nthreads_;
+  double send_timeout_;
+  std::vector<std::thread> workers_;
+
+  // Requests waiting for a worker
+  std::deque<Task> tasks_;
+  bool stop_workers_;
+  std::mutex tasks_mutex_;
+  std::condition_variable cv_task_;
+
+  // Topologies by id, and ids by key
+  std::vector<std::unique_ptr<Topology> > topologies_;
+  std::map<std::string, uint64_t> topology_ids_;
+  std::mutex topologies_mutex_;
+
+  // A shutdown was requested. The input channels being read and the
+  // listening socket are shut down so their readers return
+  bool shutdown_;
+  std::vector<int> inputs_;
+  int listen_fd_;
+  std::mutex shutdown_mutex_;
+};
+
+// Client of an EnergyServer, one request at a time
+class EnergyClient {
+ public:
+  // Client of the server that listens on the UNIX domain socket path
+  EnergyClient(const char* path);
+  // Client that writes the requests to fd_out and reads the replies
+  // from fd_in. The descriptors are not closed by the client
+  EnergyClient(int fd_in, int fd_out);
+  ~EnergyClient();
+
+  // Registers the topology of the NRG SYSTEM ... ENDSYS block, and
+  // returns its id. Sets nat to the number of real sites
+  uint64_t AddTopology(const std::string &nrg_block, size_t &nat);
+
+  // Energy of the topology id with the coordinates xyz (3 per real site).
+  // The gradients are written to grad and the virial (9 components) to
+  // virial if they are not null. If box (9 components) is not null, the
+  // system is periodic with box
+  double Energy(uint64_t id, const double* xyz, size_t nat,
+                double* grad = 0, double* virial = 0,
+                const double* box = 0);
+
+  // Stops the server
+  void Shutdown();
+
+ private:
+  EnergyClient(const EnergyClient&);
+  EnergyClient& operator=(const EnergyClient&);
+
+  // Sends the request in request_, with a payload of size bytes after the
+  // space of its header, and reads the payload of its reply in reply_.
+  // Throws the message of the server if the request failed
+  void Request(uint32_t type, uint32_t flags, size_t size);
+
+  int fd_in_;
+  int fd_out_;
+  bool own_fd_;
+  uint64_t tag_;
+  // Last request and reply, reused, and the size of the reply in bytes
+  std::vector<double> request_;
+  std::vector<double> reply_;
+  size_t reply_size_;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+} // namespace tools
+////////////////////////////////////////////////////////////////////////////////
+#endif // CU_INCLUDE_TOOLS_NRGSERVER_H
@@ -1,34 +1,378 @@
 #include "read_nrg.h" 
 
-namespace tools {
+namespace {
+
+// Reads the line starting at p. Sets [ls, le) to the line without the
+// end of line, and returns the start of the next line
+inline const char* NextLine(const char* p, const char* end,
+                            const char* &ls, const char* &le) {
+  ls = p;
+  const char* nl = static_cast<const char*>(std::memchr(p, '\n', end - p));
+  le = nl ? nl : end;
+  const char* next = nl ? nl + 1 : end;
+  if (le > ls && *(le - 1) == '\r') le--;
+  return next;
+}
 
-void ReadNrg(char * filename, std::vector<bblock::System> & systems ) {
-  assert(filename);
-  std::ifstream ifs(filename);
+inline bool IsBlank(char c) {
+  return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
 
-  if (!ifs)
-    throw std::runtime_error("could not open NRG file for reading");
-  
-  size_t lineno(0);
-  size_t sysno(0);
+// Sets [tb, te) to the next word in [p, end), and returns the end of the
+// word. The word is empty if there is none
+inline const char* NextWord(const char* p, const char* end,
+                            const char* &tb, const char* &te) {
+  while (p < end && IsBlank(*p)) p++;
+  tb = p;
+  while (p < end && !IsBlank(*p)) p++;
+  te = p;
+  return p;
+}
+
+// Case insensitive comparison of the word [tb, te) with the lower case
+// keyword kw
+inline bool IsKeyword(const char* tb, const char* te, const char* kw) {
+  for (; tb < te; tb++, kw++) {
+    if (*kw == '\0' || std::tolower(*tb) != *kw) return false;
+  }
+  return *kw == '\0';
+}
+
+// First word of the line [ls, le) is the keyword kw
+inline bool LineIs(const char* ls, const char* le, const char* kw) {
+  const char* tb;
+  const char* te;
+  NextWord(ls, le, tb, te);
+  return IsKeyword(tb, te, kw);
+}
+
+// Error at line lineno, with the text of the line [ls, le)
+void ThrowAtLine(const std::string &what, size_t lineno,
+                 const char* ls, const char* le) {
+  std::ostringstream oss;
+  oss << what << " in line " << lineno << " of the NRG file:"
+      << std::endl << std::string(ls, le) << std::endl;
+  throw std::runtime_error(oss.str());
+}
+
+// Parses the number in [tb, te). Copies it to a buffer on the stack, so
+// it does not allocate and never reads past the word
+inline bool ParseDouble(const char* tb, const char* te, double &x) {
+  char buf[64];
+  size_t n = te - tb;
+  if (n == 0 || n >= sizeof(buf)) return false;
+  std::memcpy(buf, tb, n);
+  buf[n] = '\0';
+  char* endp;
+  x = std::strtod(buf, &endp);
+  return endp == buf + n;
+}
+
+// Monomers and molecules of a SYSTEM block, in the order of the block
+struct NrgBlock {
+  std::vector<std::string> mon_ids;
+  std::vector<size_t> mon_nat;
+  std::vector<std::string> names;
+  std::vector<double> xyz;
+  std::vector<std::vector<size_t> > molecules;
+
+  void clear() {
+    mon_ids.clear();
+    mon_nat.clear();
+    names.clear();
+    xyz.clear();
+    molecules.clear();
+  }
+};
+
+// Parses the block [begin, end), which starts at line lineno, into block
+void ParseBlock(const char* begin, const char* end, size_t lineno,
+                NrgBlock &block) {
+  const char* ls;
+  const char* le;
+  const char* tb;
+  const char* te;
+
+  block.clear();
 
+  // SYSTEM line, already checked when the block was found
+  const char* p = NextLine(begin, end, ls, le);
+
+  size_t mon_count = 0;
   while (true) {
-    bblock::System sys;
-    ReadSystem(lineno, ifs, sys);
-    
-    systems.push_back(sys);
-    sysno++;
+    if (p >= end)
+      ThrowAtLine("No ENDSYS", lineno, ls, le);
+    p = NextLine(p, end, ls, le);
+    lineno++;
+    if (LineIs(ls, le, "endsys")) break;
+    if (!LineIs(ls, le, "molecule"))
+      ThrowAtLine("No MOLECULE", lineno, ls, le);
+
+    // Monomers of the molecule
+    std::vector<size_t> molec;
+    while (true) {
+      if (p >= end)
+        ThrowAtLine("No ENDMOL", lineno, ls, le);
+      p = NextLine(p, end, ls, le);
+      lineno++;
+      const char* q = NextWord(ls, le, tb, te);
+      if (IsKeyword(tb, te, "endmol")) break;
+      if (!IsKeyword(tb, te, "monomer"))
+        ThrowAtLine("No MONOMER", lineno, ls, le);
+      NextWord(q, le, tb, te);
+      if (tb == te)
+        ThrowAtLine("No MONOMER", lineno, ls, le);
+      std::string mon_name(tb, te);
+      std::transform(mon_name.begin(), mon_name.end(), mon_name.begin(),
+                     ::tolower);
+
+      // Atoms of the monomer
+      size_t nat = 0;
+      while (true) {
+        if (p >= end)
+          ThrowAtLine("No ENDMON found after monomer " + mon_name,
+                      lineno, ls, le);
+        p = NextLine(p, end, ls, le);
+        lineno++;
+        q = NextWord(ls, le, tb, te);
+        if (IsKeyword(tb, te, "endmon")) break;
+        block.names.push_back(std::string(tb, te));
+        for (size_t k = 0; k < 3; k++) {
+          double x;
+          q = NextWord(q, le, tb, te);
+          if (!ParseDouble(tb, te, x))
+            ThrowAtLine("unexpected text", lineno, ls, le);
+          block.xyz.push_back(x);
+        }
+        nat++;
+      }
 
-    std::streampos oldpos = ifs.tellg();
-    std::string line;
-    std::getline(ifs, line);
-    if (ifs.eof() or line.empty()) {
+      block.mon_ids.push_back(mon_name);
+      block.mon_nat.push_back(nat);
+      molec.push_back(mon_count);
+      mon_count++;
+    }
+
+    block.molecules.push_back(molec);
+  }
+}
+
+// Adds the monomers and molecules of block to sys, and initializes it
+void BuildSystem(const NrgBlock &block, bblock::System &sys) {
+  size_t first = 0;
+  for (size_t m = 0; m < block.mon_ids.size(); m++) {
+    size_t nat = block.mon_nat[m];
+    std::vector<double> xyz(block.xyz.begin() + 3*first,
+                            block.xyz.begin() + 3*(first + nat));
+    std::vector<std::string> names(block.names.begin() + first,
+                                   block.names.begin() + first + nat);
+    sys.AddMonomer(xyz, names, block.mon_ids[m]);
+    first += nat;
+  }
+  for (size_t k = 0; k < block.molecules.size(); k++) {
+    sys.AddMolecule(block.molecules[k]);
+  }
+
+  sys.Initialize();
+}
+
+// True if sys has the monomers and molecules of block, in the same order
+bool SameTopology(const NrgBlock &block, bblock::System &sys) {
+  if (sys.GetNumMon() != block.mon_ids.size()
+      || sys.GetNumMol() != block.molecules.size()
+      || sys.GetNumRealSites() != block.names.size())
+    return false;
+  for (size_t m = 0; m < block.mon_ids.size(); m++) {
+    if (sys.GetMonId(m) != block.mon_ids[m]
+        || sys.GetMonNumAt(m) != block.mon_nat[m])
+      return false;
+  }
+  for (size_t k = 0; k < block.molecules.size(); k++) {
+    if (sys.GetMolecule(k) != block.molecules[k]) return false;
+  }
+  return sys.GetRealAtomNames() == block.names;
+}
+
+} // namespace
+
+namespace tools {
+
+NrgFile::NrgFile(const char* filename)
+  : fd_(-1), data_(0), size_(0), pos_(0), released_(0), lineno_(0),
+    nsys_(0), done_(false) {
+  fd_ = open(filename, O_RDONLY);
+  if (fd_ < 0)
+    throw std::runtime_error("could not open NRG file for reading");
+  struct stat st;
+  if (fstat(fd_, &st) != 0) {
+    close(fd_);
+    throw std::runtime_error("could not stat the NRG file");
+  }
+  if (!S_ISREG(st.st_mode)) {
+    // A pipe or a terminal can not be mapped, and has no size
+    char chunk[65536];
+    ssize_t n;
+    while ((n = read(fd_, chunk, sizeof(chunk))) != 0) {
+      if (n < 0) {
+        if (errno == EINTR) continue;
+        close(fd_);
+        throw std::runtime_error("could not read the NRG file");
+      }
+      buffer_.insert(buffer_.end(), chunk, chunk + n);
+    }
+    data_ = buffer_.data();
+    size_ = buffer_.size();
+    return;
+  }
+  size_ = st.st_size;
+  if (size_ > 0) {
+    void* p = mmap(0, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+    if (p == MAP_FAILED) {
+      close(fd_);
+      throw std::runtime_error("could not map the NRG file");
+    }
+    data_ = static_cast<const char*>(p);
+    madvise(p, size_, MADV_SEQUENTIAL);
+  }
+}
+
+NrgFile::~NrgFile() {
+  if (data_ && buffer_.empty()) munmap(const_cast<char*>(data_), size_);
+  if (fd_ >= 0) close(fd_);
+}
+
+bool NrgFile::NextSystem(const char* &begin, const char* &end,
+                         size_t &lineno) {
+  // As with the stream reader, an empty line (or the end of the file)
+  // after an ENDSYS ends the file
+  const char* p = data_ + pos_;
+  const char* fend = data_ + size_;
+  const char* ls;
+  const char* le;
+  const char* tb;
+  const char* te;
+  if (done_ || p >= fend) {
+    done_ = true;
+    return false;
+  }
+
+  const char* next = NextLine(p, fend, ls, le);
+  lineno_++;
+  NextWord(ls, le, tb, te);
+  if (tb == te && nsys_ > 0) {
+    done_ = true;
+    return false;
+  }
+  if (!IsKeyword(tb, te, "system"))
+    ThrowAtLine("No SYSTEM", lineno_, ls, le);
+  begin = ls;
+  lineno = lineno_;
+
+  // Find the ENDSYS. A missing one is reported when parsing the block
+  p = next;
+  end = fend;
+  while (p < fend) {
+    next = NextLine(p, fend, ls, le);
+    lineno_++;
+    p = next;
+    if (LineIs(ls, le, "endsys")) {
+      end = next;
       break;
-    } else {
-      ifs.seekg(oldpos);
     }
   }
-  return;
+
+  pos_ = end - data_;
+  nsys_++;
+  return true;
+}
+
+void NrgFile::Release(const char* upto) {
+  // Only whole pages of a mapping, and only in large chunks
+  if (!buffer_.empty()) return;
+  const size_t page = sysconf(_SC_PAGESIZE);
+  size_t n = ((upto - data_) / page) * page;
+  if (n < released_ + (size_t(64) << 20)) return;
+  madvise(const_cast<char*>(data_) + released_, n - released_, MADV_DONTNEED);
+  released_ = n;
+}
+
+void ParseNrgSystem(const char* begin, const char* end, size_t lineno,
+                    bblock::System &sys) {
+  NrgBlock block;
+  ParseBlock(begin, end, lineno, block);
+  BuildSystem(block, sys);
+}
+
+bool SetNrgCoordinates(const char* begin, const char* end, size_t lineno,
+                       bblock::System &sys) {
+  NrgBlock block;
+  ParseBlock(begin, end, lineno, block);
+  if (!SameTopology(block, sys)) return false;
+  sys.SetRealXyz(block.xyz);
+  return true;
+}
+
+void ReadNrg(char * filename, std::vector<bblock::System> & systems ) {
+  assert(filename);
+  NrgFile file(filename);
+
+  // Find the SYSTEM ... ENDSYS blocks in one pass
+  std::vector<const char*> block_begin;
+  std::vector<const char*> block_end;
+  std::vector<size_t> block_line;
+  const char* begin;
+  const char* end;
+  size_t lineno;
+  while (file.NextSystem(begin, end, lineno)) {
+    block_begin.push_back(begin);
+    block_end.push_back(end);
+    block_line.push_back(lineno);
+  }
+
+  if (block_begin.empty())
+    throw std::runtime_error("No SYSTEM found in the NRG file");
+
+  // Parse the blocks in parallel, directly into their place in systems
+  const size_t nsys = block_begin.size();
+  const size_t first = systems.size();
+  systems.resize(first + nsys);
+  std::vector<std::string> errors(nsys);
+
+  // A system with the topology of the last system built by the same
+  // thread is copied from it, and only its coordinates are set
+# ifdef _OPENMP
+#   pragma omp parallel
+# endif
+  {
+    NrgBlock block;
+    size_t last = nsys;
+#   ifdef _OPENMP
+#     pragma omp for schedule(dynamic, 16)
+#   endif
+    for (size_t i = 0; i < nsys; i++) {
+      try {
+        ParseBlock(block_begin[i], block_end[i], block_line[i], block);
+        bblock::System &sys = systems[first + i];
+        if (last != nsys && SameTopology(block, systems[first + last])) {
+          sys = systems[first + last];
+          sys.SetRealXyz(block.xyz);
+          sys.UpdateSiteProperties();
+        } else {
+          BuildSystem(block, sys);
+          last = i;
+        }
+      } catch (const std::exception &e) {
+        errors[i] = e.what();
+      }
+    }
+  }
+
+  for (size_t i = 0; i < nsys; i++) {
+    if (!errors[i].empty()) {
+      systems.resize(first);
+      throw std::runtime_error(errors[i]);
+    }
+  }
 }
 
 void ReadSystem(size_t& lineno, std::istream& ifs, bblock::System& sys) {
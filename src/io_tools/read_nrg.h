@@ -10,13 +10,80 @@
 #include <iomanip>
 #include <iostream>
 #include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <cctype>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef _OPENMP
+# include <omp.h>
+#endif
 
 #include "bblock/system.h"
 
 ////////////////////////////////////////////////////////////////////////////////
 namespace tools {
 ////////////////////////////////////////////////////////////////////////////////
+// Memory mapped NRG file, read one SYSTEM ... ENDSYS block at a time.
+// Files that cannot be mapped (pipes, /dev/stdin) are read into memory
+class NrgFile {
+ public:
+  NrgFile(const char* filename);
+  ~NrgFile();
+
+  // Finds the next block. Sets [begin, end) to the block and lineno to
+  // its first line. Returns false at the end of the file
+  bool NextSystem(const char* &begin, const char* &end, size_t &lineno);
+
+  // Tells the kernel that the file before upto is not needed anymore, so
+  // the resident memory does not grow with the file. Blocks before upto
+  // must not be used after this call
+  void Release(const char* upto);
+
+ private:
+  NrgFile(const NrgFile&);
+  NrgFile& operator=(const NrgFile&);
+
+  // File descriptor, mapping (or buffer) and its size
+  int fd_;
+  const char* data_;
+  size_t size_;
+  // Contents of a file that is not mapped
+  std::vector<char> buffer_;
+  // Offset of the next block, and of the end of the released pages
+  size_t pos_;
+  size_t released_;
+  // Lines and blocks read so far
+  size_t lineno_;
+  size_t nsys_;
+  // The end of the file has been reached
+  bool done_;
+};
+
+// Parses the block [begin, end) of an NrgFile, which starts at line lineno,
+// into sys, and initializes sys
+void ParseNrgSystem(const char* begin, const char* end, size_t lineno,
+                    bblock::System &sys);
+
+// Parses the block [begin, end) of an NrgFile, which starts at line lineno.
+// If its monomers and molecules are those of sys, in the same order, sets
+// its coordinates in sys and returns true. Otherwise sys is not modified
+// and returns false
+bool SetNrgCoordinates(const char* begin, const char* end, size_t lineno,
+                       bblock::System &sys);
+
+// Appends the systems of the NRG file to systems. The file is memory
+// mapped, the SYSTEM ... ENDSYS blocks are found in one pass, and they
+// are parsed and initialized in parallel, in place in systems. Systems
+// with the topology of a previous system are copied from it instead of
+// being initialized again.
 void ReadNrg(char* filename, std::vector<bblock::System> & systems);
+
 void ReadSystem(size_t& lineno, std::istream& ifs, bblock::System& sys);
 void ReadMolecule(size_t& lineno, std::istream& ifs, 
                   bblock::System& sys, size_t& mon_count);
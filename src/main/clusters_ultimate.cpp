@@ -5,19 +5,244 @@
 #include <iostream>
 #include <fstream>
 #include <cstring>
+#include <cstdlib>
+#include <cctype>
 #include <stdexcept>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include <signal.h>
+
+#ifdef _OPENMP
+# include <omp.h>
+#endif
 
 #include "io_tools/read_nrg.h"
 #include "io_tools/write_nrg.h"
+#include "io_tools/binary_nrg.h"
+#include "io_tools/nrg_server.h"
 
 #include "bblock/system.h"
 
 #define PRINT_GRADS
 //#define NUM_GRADS
+// Corrector of the dipoles predicted from their history (ASPC), iterated
+// until convergence
+#define ASPC_MAXIT 100
+#define ASPC_TOL 1E-08
 namespace {
 
 static std::vector<bblock::System> systems;
 
+// Prints the energy and gradients of system i
+void PrintGradients(std::ostream &os, size_t i, bblock::System &sys,
+                    double energy, const std::vector<double> &grad) {
+  os << std::setprecision(10) << std::scientific
+     << "system["  << std::setfill('.')
+     << std::setw(5) << i << "]= " << std::setfill(' ')
+     << std::setw(20) << std::right << energy
+     << std::setw(12) << std::right << " kcal/mol" 
+     << std::endl << std::endl;
+  std::vector<std::string> atn = sys.GetAtomNames();
+
+  size_t n_sites = sys.GetNumSites();
+
+  os << std::setw(6)  << std::left << "Atom"
+     << std::setw(20) << std::right << "GradientX"
+     << std::setw(20) << std::right << "GradientY"
+     << std::setw(20) << std::right << "GradientZ"
+     << std::endl;
+  for (size_t j = 0; j < n_sites; j++) {
+    if (atn[j] == "virt") continue;
+    os << std::setprecision(10) << std::scientific
+       << std::setw(6) << std::left << atn[j]
+       << std::setw(20) << std::right << grad[3*j]
+       << std::setw(20) << std::right << grad[3*j + 1]
+       << std::setw(20) << std::right << grad[3*j + 2]
+       << std::endl;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Streaming evaluation. A reader thread finds the SYSTEM blocks of the
+// memory mapped file, nworkers threads parse and evaluate them, and the
+// calling thread writes the results in the order of the file. At most
+// window systems are in flight, so the memory does not depend on the
+// size of the file.
+class Pipeline {
+ public:
+  Pipeline(const char* filename, size_t nworkers, bool dipole_history)
+    : file_(filename), nworkers_(nworkers), dipole_history_(dipole_history),
+      window_(16*nworkers),
+      results_(16*nworkers), ready_(16*nworkers, false),
+      read_end_(16*nworkers, (const char*)0), nread_(0), nwritten_(0),
+      reading_done_(false), failed_(false) {}
+
+  // Runs the pipeline. Returns false if any system failed
+  bool Run(std::ostream &os) {
+    std::thread reader(&Pipeline::Reader, this);
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < nworkers_; i++)
+      workers.push_back(std::thread(&Pipeline::Worker, this));
+
+    Writer(os);
+
+    reader.join();
+    for (size_t i = 0; i < nworkers_; i++) workers[i].join();
+    return !failed_;
+  }
+
+ private:
+  // SYSTEM block of the file, and its position in the file
+  struct Task {
+    size_t index;
+    const char* begin;
+    const char* end;
+    size_t lineno;
+  };
+
+  void Reader() {
+    const char* begin;
+    const char* end;
+    size_t lineno;
+    while (true) {
+      bool found;
+      try {
+        found = file_.NextSystem(begin, end, lineno);
+      } catch (const std::exception &e) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::cerr << " ** Error ** : " << e.what() << std::endl;
+        failed_ = true;
+        found = false;
+      }
+
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (!found) {
+        reading_done_ = true;
+        cv_task_.notify_all();
+        cv_result_.notify_all();
+        return;
+      }
+      // Wait for room in the window
+      cv_space_.wait(lock, [this] {return nread_ < nwritten_ + window_;});
+      Task t = {nread_, begin, end, lineno};
+      read_end_[nread_ % window_] = end;
+      tasks_.push_back(t);
+      nread_++;
+      cv_task_.notify_one();
+    }
+  }
+
+  void Worker() {
+    // The systems are evaluated in parallel, one per worker
+#   ifdef _OPENMP
+    omp_set_num_threads(1);
+#   endif
+    // Each worker keeps its last system, and only updates the coordinates
+    // of the next systems with the same topology
+    bblock::System sys;
+    bool have_sys = false;
+    while (true) {
+      Task t;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_task_.wait(lock, [this] {
+          return !tasks_.empty() || reading_done_;
+        });
+        if (tasks_.empty()) return;
+        t = tasks_.front();
+        tasks_.pop_front();
+      }
+
+      std::ostringstream oss;
+      bool ok = true;
+      try {
+        if (!have_sys
+            || !tools::SetNrgCoordinates(t.begin, t.end, t.lineno, sys)) {
+          have_sys = false;
+          sys = bblock::System();
+          tools::ParseNrgSystem(t.begin, t.end, t.lineno, sys);
+          if (dipole_history_) sys.SetAspcCorrector(ASPC_MAXIT, ASPC_TOL);
+          have_sys = true;
+        }
+        if (!dipole_history_) sys.ResetDipoleHistory();
+        double energy = sys.Energy(true);
+        PrintGradients(oss, t.index, sys, energy, sys.GetGrads());
+      } catch (const std::exception &e) {
+        oss.str("");
+        oss << " ** Error ** : system[" << t.index << "]: " << e.what()
+            << std::endl;
+        ok = false;
+      }
+
+      std::lock_guard<std::mutex> lock(mutex_);
+      size_t slot = t.index % window_;
+      results_[slot] = oss.str();
+      ready_[slot] = ok ? 1 : 2;
+      cv_result_.notify_all();
+    }
+  }
+
+  void Writer(std::ostream &os) {
+    while (true) {
+      std::string text;
+      int status;
+      const char* end;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        size_t slot = nwritten_ % window_;
+        cv_result_.wait(lock, [this, slot] {
+          return ready_[slot] || (reading_done_ && nwritten_ == nread_);
+        });
+        if (!ready_[slot]) return;
+        text.swap(results_[slot]);
+        status = ready_[slot];
+        ready_[slot] = 0;
+        end = read_end_[slot];
+        nwritten_++;
+        if (status != 1) failed_ = true;
+        cv_space_.notify_one();
+      }
+      if (status == 1) {
+        os << text;
+      } else {
+        std::cerr << text;
+      }
+      file_.Release(end);
+    }
+  }
+
+  tools::NrgFile file_;
+  size_t nworkers_;
+  // The dipoles of a system are predicted from those of the previous ones
+  bool dipole_history_;
+  // Maximum number of systems in flight
+  size_t window_;
+  // Output of each slot of the window, and its status (0 pending,
+  // 1 done, 2 failed), and the end of the block of each slot
+  std::vector<std::string> results_;
+  std::vector<int> ready_;
+  std::vector<const char*> read_end_;
+  // Blocks waiting for a worker
+  std::deque<Task> tasks_;
+  // Systems read and written so far
+  size_t nread_;
+  size_t nwritten_;
+  bool reading_done_;
+  bool failed_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_task_;
+  std::condition_variable cv_space_;
+  std::condition_variable cv_result_;
+};
+
 } // namespace
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -25,29 +250,143 @@ static std::vector<bblock::System> systems;
 int main(int argc, char** argv)
 {
 
-  if (argc != 2) {
-    std::cerr << "usage: energy h2o_ion.nrg"
+  // Options: --stream [nworkers], --server [nworkers] and
+  // --dipole-history, before the file (or the socket of the server)
+  bool stream = false;
+  bool server = false;
+  bool dipole_history = false;
+  size_t nworkers = std::thread::hardware_concurrency();
+  int arg = 1;
+  for (; arg < argc - 1; arg++) {
+    std::string opt(argv[arg]);
+    if (opt == "--stream" || opt == "--server") {
+      if (opt == "--stream") stream = true;
+      if (opt == "--server") server = true;
+      if (arg + 2 < argc && std::isdigit(argv[arg + 1][0]))
+        nworkers = std::strtoul(argv[++arg], 0, 10);
+    } else if (opt == "--dipole-history") {
+      dipole_history = true;
+    } else {
+      break;
+    }
+  }
+  if (nworkers == 0) nworkers = 1;
+
+  if (arg != argc - 1 || (stream && server)
+      || (dipole_history && (server || (!stream
+                                        && !tools::IsBinaryNrg(argv[arg]))))) {
+    std::cerr << "usage: energy h2o_ion.nrg" << std::endl
+              << "       energy --stream [nworkers] h2o_ion.nrg" << std::endl
+              << "       energy --stream --dipole-history h2o_ion.nrg"
+              << std::endl
+              << "       energy [--dipole-history] trajectory.bnrg"
+              << std::endl
+              << "       energy --server [nworkers] socket_path|-"
               << std::endl;
     return 0;
   }
+  char* filename = argv[arg];
+
+  // Server mode: requests of energies (see io_tools/nrg_server.h) are read
+  // from the UNIX domain socket filename, or from the standard input with
+  // the replies in the standard output if filename is -. The systems are
+  // initialized once per topology, and nworkers requests are evaluated at
+  // once, sharing the OpenMP threads
+  if (server) {
+    signal(SIGPIPE, SIG_IGN);
+    size_t nthreads = 1;
+#   ifdef _OPENMP
+    nthreads = std::max(1, omp_get_max_threads() / int(nworkers));
+#   endif
+    try {
+      tools::EnergyServer energy_server(nworkers, nthreads);
+      if (std::string(filename) == "-") {
+        energy_server.Serve(0, 1);
+      } else {
+        energy_server.Listen(filename);
+      }
+    } catch (const std::exception& e) {
+      std::cerr << " ** Error ** : " << e.what() << std::endl;
+      return 1;
+    }
+    return 0;
+  }
+
+  // Streaming mode: energies and gradients are written as the systems
+  // are read, evaluated by nworkers threads. With the dipole history, the
+  // systems are evaluated in order by a single worker
+  if (stream) {
+    if (dipole_history) nworkers = 1;
+    try {
+      Pipeline pipeline(filename, nworkers, dipole_history);
+      std::cout << "Energies with gradients:" << std::endl;
+      return pipeline.Run(std::cout) ? 0 : 1;
+    } catch (const std::exception& e) {
+      std::cerr << " ** Error ** : " << e.what() << std::endl;
+      return 1;
+    }
+  }
+
+  // Binary trajectory: one system is built with the topology, and only
+  // the coordinates are updated for each frame
+  if (tools::IsBinaryNrg(filename)) {
+    try {
+      tools::BinaryNrgReader reader(filename);
+      if (reader.GetNumFrames() == 0) return 0;
+      bblock::System sys;
+      reader.BuildSystem(sys);
+      if (dipole_history) sys.SetAspcCorrector(ASPC_MAXIT, ASPC_TOL);
+      std::cout << "Energies with gradients:" << std::endl;
+      int exit_code = 0;
+      for (size_t n = 0; n < reader.GetNumFrames(); n++) {
+        reader.SetFrame(sys, n);
+        if (!dipole_history) sys.ResetDipoleHistory();
+        double energy;
+        try {
+          energy = sys.Energy(true);
+        } catch (const std::exception& e) {
+          std::cerr << " ** Error ** : system[" << n << "]: " << e.what()
+                    << std::endl;
+          exit_code = 1;
+          continue;
+        }
+        PrintGradients(std::cout, n, sys, energy, sys.GetGrads());
+      }
+      return exit_code;
+    } catch (const std::exception& e) {
+      std::cerr << " ** Error ** : " << e.what() << std::endl;
+      return 1;
+    }
+  }
 
   try {
-    std::ifstream ifs(argv[1]);
+    std::ifstream ifs(filename);
 
     if (!ifs){
       throw std::runtime_error("could not open the NRG file");
     }
 
-    tools::ReadNrg(argv[1], systems);
+    tools::ReadNrg(filename, systems);
   } catch (const std::exception& e) {
     std::cerr << " ** Error ** : " << e.what() << std::endl;
     return 1;
   }
 
+  // A system that fails (e.g. its dipoles do not converge) is reported,
+  // and the next ones are still evaluated
+  int exit_code = 0;
   std::vector<double> g;
   std::cout << "Energies without gradients:" << std::endl;
   for (size_t i = 0; i < systems.size(); i++) {
-    double energy = systems[i].Energy(false);
+    double energy;
+    try {
+      energy = systems[i].Energy(false);
+    } catch (const std::exception& e) {
+      std::cerr << " ** Error ** : system[" << i << "]: " << e.what()
+                << std::endl;
+      exit_code = 1;
+      continue;
+    }
     std::cout << std::setprecision(10) << std::scientific
               << "system["  << std::setfill('.')
               << std::setw(5) << i << "]= " << std::setfill(' ')
@@ -57,35 +396,21 @@ int main(int argc, char** argv)
 # ifdef PRINT_GRADS
   std::cout << "Energies with gradients:" << std::endl;
   for (size_t i = 0; i < systems.size(); i++) {
-    double energy = systems[i].Energy(true);
+    double energy;
+    try {
+      energy = systems[i].Energy(true);
+    } catch (const std::exception& e) {
+      std::cerr << " ** Error ** : system[" << i << "]: " << e.what()
+                << std::endl;
+      exit_code = 1;
+      continue;
+    }
 
     std::vector<double> grad = systems[i].GetGrads();
-    
-    std::cout << std::setprecision(10) << std::scientific
-              << "system["  << std::setfill('.')
-              << std::setw(5) << i << "]= " << std::setfill(' ')
-              << std::setw(20) << std::right << energy
-              << std::setw(12) << std::right << " kcal/mol" 
-              << std::endl << std::endl;
+    PrintGradients(std::cout, i, systems[i], energy, grad);
+#ifdef NUM_GRADS
     std::vector<std::string> atn = systems[i].GetAtomNames();
-
     size_t n_sites = systems[i].GetNumSites();
-
-    std::cout << std::setw(6)  << std::left << "Atom"
-              << std::setw(20) << std::right << "GradientX"
-              << std::setw(20) << std::right << "GradientY"
-              << std::setw(20) << std::right << "GradientZ"
-              << std::endl;
-    for (size_t j = 0; j < n_sites; j++) {
-      if (atn[j] == "virt") continue;
-      std::cout << std::setprecision(10) << std::scientific
-                << std::setw(6) << std::left << atn[j]
-                << std::setw(20) << std::right << grad[3*j]
-                << std::setw(20) << std::right << grad[3*j + 1]
-                << std::setw(20) << std::right << grad[3*j + 2]
-                << std::endl;
-    }
-#ifdef NUM_GRADS
     std::cout << std::endl << std::setw(6)  << std::left << "Atom"
               << std::setw(20) << std::right << "Analytical"
               << std::setw(20) << std::right << "Numerical"
@@ -123,5 +448,5 @@ int main(int argc, char** argv)
 # endif
   }
 # endif
-  return 0;
+  return exit_code;
 }
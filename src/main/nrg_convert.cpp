@@ -0,0 +1,35 @@
+#include <iostream>
+#include <string>
+#include <stdexcept>
+
+#include "io_tools/binary_nrg.h"
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Converts between NRG and the binary format. The direction follows from
+// the input file. With -g, the energies and gradients of the systems are
+// stored in the binary file
+int main(int argc, char** argv)
+{
+  bool do_grads = argc == 4 && std::string(argv[1]) == "-g";
+  if (argc != 3 && !do_grads) {
+    std::cerr << "usage: nrg_convert [-g] input.nrg output.bnrg" << std::endl
+              << "       nrg_convert input.bnrg output.nrg" << std::endl;
+    return 0;
+  }
+  char* input = argv[argc - 2];
+  char* output = argv[argc - 1];
+
+  try {
+    if (tools::IsBinaryNrg(input)) {
+      tools::BinaryToNrg(input, output);
+    } else {
+      tools::NrgToBinary(input, output, do_grads);
+    }
+  } catch (const std::exception& e) {
+    std::cerr << " ** Error ** : " << e.what() << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
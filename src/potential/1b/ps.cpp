@@ -1,6 +1,7 @@
 #include <cmath>
 #include <cassert>
 #include <cstddef>
+#include <algorithm>
 
 #include "ps.h"
 #include "tools/macros.h"
@@ -477,12 +478,25 @@ const double c0 = 1.0099e0;
 const double c1 = -0.1801e0;
 const double c2 = 0.0892e0;
 
-static bool c5z_ready = false;
-static double c5z[245];
+// Number of waters in each block of the batched dms_nasa
+const size_t dms_block = 64;
 
-//#ifdef _OPENMP
-//#  pragma omp threadprivate(c5z_ready,c5z)
-//#endif
+// Coefficients of the fit, combined once. The initialization of a
+// function-local static is thread safe, so concurrent energy calls can
+// share the table
+struct C5zTable {
+    double c[245];
+    C5zTable() {
+        for (size_t i = 0; i < 245; ++i)
+            c[i] = f5z*c5zA[i] + fbasis*cbasis[i]
+                 + fcore*ccore[i] + frest*crest[i];
+    }
+};
+
+const double* GetC5z() {
+    static const C5zTable table;
+    return table.c;
+}
 
 } // namespace
 
@@ -559,13 +573,7 @@ std::vector<double> pot_nasa(const double* rr, double* dr, size_t nw) {
                      / (dROH1[nv] * dROH2[nv]);
     }
 
-    // Untouched
-    if (!c5z_ready) {
-        for (size_t i = 0; i < 245; ++i)
-            c5z[i] = f5z*c5zA[i] + fbasis*cbasis[i]
-                   + fcore*ccore[i] + frest*crest[i];
-        c5z_ready = true;
-    }
+    const double* c5z = GetC5z();
 
     const double deoh = f5z*deohA;
     const double phh1 = f5z*phh1A*std::exp(phh2);
@@ -747,12 +755,7 @@ double pot_nasa(const double* RESTRICT rr, double* RESTRICT dr)
     const double costh =
         (ROH1[0]*ROH2[0] + ROH1[1]*ROH2[1] + ROH1[2]*ROH2[2])/(dROH1*dROH2);
 
-    if (!c5z_ready) {
-        for (size_t i = 0; i < 245; ++i)
-            c5z[i] = f5z*c5zA[i] + fbasis*cbasis[i]
-                   + fcore*ccore[i] + frest*crest[i];
-        c5z_ready = true;
-    }
+    const double* c5z = GetC5z();
 
     const double deoh = f5z*deohA;
     const double phh1 = f5z*phh1A*std::exp(phh2);
@@ -1078,4 +1081,211 @@ void dms_nasa
 #endif
 }
 
+// Batched dipole moment surface, for nw waters with the coordinates of
+// water nv (O, H1, H2) at rr + nv*stride. The waters are processed in
+// blocks of dms_block waters, laid out as structures of arrays, so the loops
+// over the waters vectorize. The blocks are distributed among the threads.
+// Same as dms_nasa(0.0, 0.0, 0.0, rr + nv*stride, q3 + nv*q3_stride,
+// dq3 + 27*nv, false) for each water.
+void dms_nasa(const double* RESTRICT rr, double* RESTRICT q3,
+              double* RESTRICT dq3, size_t nw, size_t stride,
+              size_t q3_stride)
+{
+    const double costhe = -0.24780227221366464506;
+    const double xx = constants::Bohr_A;
+    const double xx2 = xx*xx;
+
+    const size_t nblocks = (nw + dms_block - 1)/dms_block;
+
+#   ifdef _OPENMP
+#     pragma omp parallel for schedule(static)
+#   endif
+    for (size_t ib = 0; ib < nblocks; ++ib) {
+        const size_t first = ib*dms_block;
+        const size_t n = std::min(dms_block, nw - first);
+
+        double ROH1[3][dms_block], ROH2[3][dms_block];
+        double dROH1[dms_block], dROH2[dms_block], costh[dms_block];
+        double efac[dms_block], pw1[dms_block], pw2[dms_block];
+        double fmat[3][16][dms_block];
+
+        // Gather the block as structure of arrays
+        for (size_t nv = 0; nv < n; ++nv) {
+            const double* r = rr + (first + nv)*stride;
+            for (size_t i = 0; i < 3; ++i) {
+                ROH1[i][nv] = r[3 + i] - r[i]; // H1 - O
+                ROH2[i][nv] = r[6 + i] - r[i]; // H2 - O
+            }
+        }
+
+#       ifdef _OPENMP
+#         pragma omp simd
+#       endif
+        for (size_t nv = 0; nv < n; ++nv) {
+            const double r1 = std::sqrt(ROH1[0][nv]*ROH1[0][nv]
+                                      + ROH1[1][nv]*ROH1[1][nv]
+                                      + ROH1[2][nv]*ROH1[2][nv]);
+            const double r2 = std::sqrt(ROH2[0][nv]*ROH2[0][nv]
+                                      + ROH2[1][nv]*ROH2[1][nv]
+                                      + ROH2[2][nv]*ROH2[2][nv]);
+            dROH1[nv] = r1;
+            dROH2[nv] = r2;
+            costh[nv] = (ROH1[0][nv]*ROH2[0][nv] + ROH1[1][nv]*ROH2[1][nv]
+                       + ROH1[2][nv]*ROH2[2][nv])/(r1*r2);
+
+            fmat[0][0][nv] = 0.0;
+            fmat[1][0][nv] = 0.0;
+            fmat[2][0][nv] = 0.0;
+            fmat[0][1][nv] = 1.0;
+            fmat[1][1][nv] = 1.0;
+            fmat[2][1][nv] = 1.0;
+        }
+
+        // Transcendental functions, not vectorized without fast math
+        for (size_t nv = 0; nv < n; ++nv) {
+            efac[nv] = std::exp(-b1D*(std::pow((dROH1[nv] - reoh), 2)
+                                    + std::pow((dROH2[nv] - reoh), 2)));
+            pw1[nv] = std::pow(dROH1[nv], b);
+            pw2[nv] = std::pow(dROH2[nv], b);
+        }
+
+        for (size_t j = 2; j < 16; ++j) {
+#           ifdef _OPENMP
+#             pragma omp simd
+#           endif
+            for (size_t nv = 0; nv < n; ++nv) {
+                fmat[0][j][nv] = fmat[0][j - 1][nv]*(dROH1[nv] - reoh)/reoh;
+                fmat[1][j][nv] = fmat[1][j - 1][nv]*(dROH2[nv] - reoh)/reoh;
+                fmat[2][j][nv] = fmat[2][j - 1][nv]*(costh[nv] - costhe);
+            }
+        }
+
+        double p1[dms_block], p2[dms_block];
+        double dp1dr1[dms_block], dp1dr2[dms_block], dp1dcabc[dms_block];
+        double dp2dr1[dms_block], dp2dr2[dms_block], dp2dcabc[dms_block];
+        std::fill(p1, p1 + n, 0.0);
+        std::fill(p2, p2 + n, 0.0);
+        std::fill(dp1dr1, dp1dr1 + n, 0.0);
+        std::fill(dp1dr2, dp1dr2 + n, 0.0);
+        std::fill(dp1dcabc, dp1dcabc + n, 0.0);
+        std::fill(dp2dr1, dp2dr1 + n, 0.0);
+        std::fill(dp2dr2, dp2dr2 + n, 0.0);
+        std::fill(dp2dcabc, dp2dcabc + n, 0.0);
+
+        // Dipole moment polynomials
+        for (size_t j = 1; j < 84; ++j) {
+            const size_t inI = idxD0[j];
+            const size_t inJ = idxD1[j];
+            const size_t inK = idxD2[j];
+            const double c = coefD[j];
+
+#           ifdef _OPENMP
+#             pragma omp simd
+#           endif
+            for (size_t nv = 0; nv < n; ++nv) {
+                p1[nv] += c*fmat[0][inI][nv]*fmat[1][inJ][nv]*fmat[2][inK][nv];
+                p2[nv] += c*fmat[0][inJ][nv]*fmat[1][inI][nv]*fmat[2][inK][nv];
+            }
+
+            if (dq3 == 0) // skip derivatives
+                continue;
+
+#           ifdef _OPENMP
+#             pragma omp simd
+#           endif
+            for (size_t nv = 0; nv < n; ++nv) {
+                dp1dr1[nv] += c*(inI - 1)*fmat[0][inI - 1][nv]
+                              *fmat[1][inJ][nv]*fmat[2][inK][nv];
+                dp1dr2[nv] += c*(inJ - 1)*fmat[0][inI][nv]
+                              *fmat[1][inJ - 1][nv]*fmat[2][inK][nv];
+                dp1dcabc[nv] += c*(inK - 1)*fmat[0][inI][nv]
+                                *fmat[1][inJ][nv]*fmat[2][inK - 1][nv];
+                dp2dr1[nv] += c*(inJ - 1)*fmat[0][inJ - 1][nv]
+                              *fmat[1][inI][nv]*fmat[2][inK][nv];
+                dp2dr2[nv] += c*(inI - 1)*fmat[0][inJ][nv]
+                              *fmat[1][inI - 1][nv]*fmat[2][inK][nv];
+                dp2dcabc[nv] += c*(inK - 1)*fmat[0][inJ][nv]
+                                *fmat[1][inI][nv]*fmat[2][inK - 1][nv];
+            }
+        }
+
+        // Charges
+#       ifdef _OPENMP
+#         pragma omp simd
+#       endif
+        for (size_t nv = 0; nv < n; ++nv) {
+            const double pl1 = costh[nv];
+            const double pl2 = 0.5*(3*pl1*pl1 - 1.0);
+            const double pc0 = a*(pw1[nv] + pw2[nv])*(c0 + pl1*c1 + pl2*c2);
+
+            const double q1 = coefD[0] + p1[nv]*efac[nv] + pc0*xx;
+            const double q2 = coefD[0] + p2[nv]*efac[nv] + pc0*xx;
+
+            q3[(first + nv)*q3_stride] = -(q1 + q2); // Oxygen
+            q3[(first + nv)*q3_stride + 1] = q1; // Hydrogen-1
+            q3[(first + nv)*q3_stride + 2] = q2; // Hydrogen-2
+        }
+
+        if (dq3 == 0)
+            continue;
+
+        // Derivatives of the charges
+#       ifdef _OPENMP
+#         pragma omp simd
+#       endif
+        for (size_t nv = 0; nv < n; ++nv) {
+            const double r1 = dROH1[nv];
+            const double r2 = dROH2[nv];
+            const double ct = costh[nv];
+            const double pl1 = ct;
+            const double pl2 = 0.5*(3*pl1*pl1 - 1.0);
+            const double pc = c0 + pl1*c1 + pl2*c2;
+
+            const double dpc0dr1 = a*b*pw1[nv]/r1*pc*xx2;
+            const double dpc0dr2 = a*b*pw2[nv]/r2*pc*xx2;
+            const double dpc0dcabc =
+                a*(pw1[nv] + pw2[nv])*(c1 + 0.5*(6.0*pl1)*c2)*xx;
+
+            const double defacdr1 = -2.0*b1D*(r1 - reoh)*efac[nv]*xx;
+            const double defacdr2 = -2.0*b1D*(r2 - reoh)*efac[nv]*xx;
+
+            const double d11 = (dp1dr1[nv]*xx/reoh*efac[nv]
+                                + p1[nv]*defacdr1 + dpc0dr1)/xx;
+            const double d12 = (dp1dr2[nv]*xx/reoh*efac[nv]
+                                + p1[nv]*defacdr2 + dpc0dr2)/xx;
+            const double d1c = dp1dcabc[nv]*efac[nv] + dpc0dcabc;
+            const double d21 = (dp2dr1[nv]*xx/reoh*efac[nv]
+                                + p2[nv]*defacdr1 + dpc0dr1)/xx;
+            const double d22 = (dp2dr2[nv]*xx/reoh*efac[nv]
+                                + p2[nv]*defacdr2 + dpc0dr2)/xx;
+            const double d2c = dp2dcabc[nv]*efac[nv] + dpc0dcabc;
+
+            const double f1q1r13 = (d11 - (d1c*ct/r1))/r1;
+            const double f1q1r23 = d1c/(r1*r2);
+            const double f2q1r23 = (d12 - (d1c*ct/r2))/r2;
+            const double f2q1r13 = d1c/(r2*r1);
+            const double f1q2r13 = (d21 - (d2c*ct/r1))/r1;
+            const double f1q2r23 = d2c/(r1*r2);
+            const double f2q2r23 = (d22 - (d2c*ct/r2))/r2;
+            const double f2q2r13 = d2c/(r2*r1);
+
+            double* RESTRICT g = dq3 + 27*(first + nv);
+            for (size_t k = 0; k < 3; ++k) {
+                const double ra = ROH1[k][nv];
+                const double rb = ROH2[k][nv];
+                // GRADQ(i,j,k) = g[k + 3*(j + 3*i)], as in dms_nasa
+                g[k] = f1q1r13*ra + f1q1r23*rb;
+                g[k + 9] = f2q1r13*ra + f2q1r23*rb;
+                g[k + 18] = -(g[k] + g[k + 9]);
+                g[k + 3] = f1q2r13*ra + f1q2r23*rb;
+                g[k + 12] = f2q2r13*ra + f2q2r23*rb;
+                g[k + 21] = -(g[k + 3] + g[k + 12]);
+                g[k + 6] = -(g[k] + g[k + 3]);
+                g[k + 15] = -(g[k + 9] + g[k + 12]);
+                g[k + 24] = -(g[k + 18] + g[k + 21]);
+            }
+        }
+    }
+}
+
 } // namespace ttm::ps
@@ -10,6 +10,12 @@ double pot_nasa(const double*, double*);
 void dms_nasa(const double&, const double&, const double&,
               const double*, double* q3, double* dq3, bool ttm3);
 std::vector<double> pot_nasa(const double*, double*, size_t);
+// Batched dms_nasa without the TTM3 modification, for nw waters. The
+// coordinates of water nv start at rr + nv*stride. Charges go to
+// q3 + nv*q3_stride and, if dq3 is not null, their derivatives to
+// dq3 + 27*nv.
+void dms_nasa(const double* rr, double* q3, double* dq3, size_t nw,
+              size_t stride = 9, size_t q3_stride = 3);
 
 // r1 = r2 = 0.9587, \theta = 104.3850
 const double e_zero = 0.0; // TODO: fix this
@@ -2,22 +2,13 @@
 
 namespace disp {
 
-double GetDispersion(std::string m1, std::string m2, size_t nm, bool do_grads,
-                     std::vector<double> xyz1, std::vector<double> xyz2,
-                     std::vector<double> &grd1, std::vector<double> &grd2,
-                     double cutoff, bool use_cutoff) {
-  // Order the two monomer names and corresponding xyz
+DispersionParameters GetDispersionParameters(std::string m1, std::string m2) {
+  // Order the two monomer names
   bool swaped = false;
   if (m2 < m1) {
     std::string tmp = std::move(m1);
     m1 = std::move(m2);
     m2 = std::move(tmp);
-    std::vector<double> tmp2 = std::move(xyz1);
-    xyz1 = std::move(xyz2);
-    xyz2 = std::move(tmp2);
-    tmp2 = std::move(grd1);
-    grd1 = std::move(grd2);
-    grd2 = std::move(tmp2);
     swaped = true;
   }
 
@@ -29,8 +20,6 @@ double GetDispersion(std::string m1, std::string m2, size_t nm, bool do_grads,
 
   size_t nt2 = 0;
 
-  double disp = 0.0;
-    
   std::vector<double> C6, d6;
 
   if (m1 == "h2o" and m2 == "h2o") {
@@ -256,57 +245,123 @@ double GetDispersion(std::string m1, std::string m2, size_t nm, bool do_grads,
     d6.push_back(3.028640000000000e+00); // A^(-1)
     d6.push_back(3.271530000000000e+00); // A^(-1)
   } else {
-    return 0.0;
+    return DispersionParameters();
+  }
+
+  DispersionParameters par;
+  par.nat1 = nat1;
+  par.nat2 = nat2;
+  par.types1 = types1;
+  par.types2 = types2;
+  par.nt2 = nt2;
+  par.C6 = C6;
+  par.d6 = d6;
+
+  // Back to the order of the arguments: swap the monomers and
+  // transpose the type pair matrices
+  if (swaped) {
+    size_t nt1 = *std::max_element(types1.begin(), types1.end()) + 1;
+    std::swap(par.nat1, par.nat2);
+    std::swap(par.types1, par.types2);
+    par.nt2 = nt1;
+    for (size_t ti = 0; ti < nt1; ti++) {
+      for (size_t tj = 0; tj < nt2; tj++) {
+        par.C6[tj*nt1 + ti] = C6[ti*nt2 + tj];
+        par.d6[tj*nt1 + ti] = d6[ti*nt2 + tj];
+      }
+    }
+  }
+
+  return par;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+double GetDispersion(const DispersionParameters &par, size_t nm, 
+                     bool do_grads, const double *xyz1, const double *xyz2,
+                     double *grd1, double *grd2,
+                     double cutoff, bool use_cutoff,
+                     bool shift, double beta) {
+  const size_t nat1 = par.nat1;
+  const size_t nat2 = par.nat2;
+  if (nat1 == 0 || nat2 == 0 || nm == 0) return 0.0;
+
+  // Coordinates of each atom of all the dimers, in xxx...yyy...zzz...
+  // The atom i of monomer 1 starts at p1 + 3*nm*i
+  const size_t nm3 = 3*nm;
+  double p1[nat1*nm3], p2[nat2*nm3];
+  for (size_t k = 0; k < nm; k++) {
+    for (size_t i = 0; i < nat1; i++) {
+      for (size_t l = 0; l < 3; l++) {
+        p1[nm3*i + nm*l + k] = xyz1[3*(nat1*k + i) + l];
+      }
+    }
+    for (size_t j = 0; j < nat2; j++) {
+      for (size_t l = 0; l < 3; l++) {
+        p2[nm3*j + nm*l + k] = xyz2[3*(nat2*k + j) + l];
+      }
+    }
   }
 
+  double disp = 0.0;
+  const size_t nt2 = par.nt2;
+
+  if (!do_grads) {
+    // Going over pairs:
+    for (size_t i = 0; i < nat1; i++) {
+      size_t ti = par.types1[i];
+      for (size_t j = 0; j < nat2; j++) {
+        size_t tj = par.types2[j];
+        disp += disp6_soa(par.C6[ti*nt2 + tj], par.d6[ti*nt2 + tj],
+                          p1 + nm3*i, p2 + nm3*j, nm, cutoff, use_cutoff,
+                          shift, beta);
+      }
+    }
+    return disp;
+  }
+
+  double g1[nat1*nm3], g2[nat2*nm3];
+  std::fill(g1, g1 + nat1*nm3, 0.0);
+  std::fill(g2, g2 + nat2*nm3, 0.0);
+
   // Going over pairs:
   for (size_t i = 0; i < nat1; i++) {
-    size_t i3 = 3*i;
-    size_t ti = types1[i];
+    size_t ti = par.types1[i];
     for (size_t j = 0; j < nat2; j++) {
-      size_t j3 = 3*j;
-      size_t tj = types2[j];
-      double c1[3*nm], c2[3*nm];
-      
-      // For each pair, go over all monomers
-      for (size_t k = 0; k < nm; k++) {
-        size_t k3 = 3*k;
-        size_t nat1k3 = nat1*k3;
-        size_t nat2k3 = nat2*k3;
-        for (size_t l = 0; l < 3; l++) {
-          c1[k3 + l] = xyz1[nat1k3 + i3 + l];
-          c2[k3 + l] = xyz2[nat2k3 + j3 + l];
-        }
+      size_t tj = par.types2[j];
+      disp += disp6_soa(par.C6[ti*nt2 + tj], par.d6[ti*nt2 + tj],
+                        p1 + nm3*i, p2 + nm3*j, g1 + nm3*i, g2 + nm3*j,
+                        nm, cutoff, use_cutoff, shift, beta);
+    }
+  }
+
+  // Back to the layout of the input
+  for (size_t k = 0; k < nm; k++) {
+    for (size_t i = 0; i < nat1; i++) {
+      for (size_t l = 0; l < 3; l++) {
+        grd1[3*(nat1*k + i) + l] += g1[nm3*i + nm*l + k];
       }
-      if (!do_grads) {
-        disp += disp6(C6[ti*nt2 +tj], d6[ti*nt2 +tj], c1, c2, nm, cutoff, use_cutoff);
-      } else {
-        double g1[3*nm], g2[3*nm];
-        std::fill(g1, g1 + 3*nm, 0.0);
-        std::fill(g2, g2 + 3*nm, 0.0);
-        disp += disp6(C6[ti*nt2 +tj], d6[ti*nt2 +tj], c1, c2, g1, g2, nm, cutoff, use_cutoff);
-        for (size_t k = 0; k < nm; k++) {
-          size_t k3 = 3*k;
-          size_t nat1k3 = nat1*k3;
-          size_t nat2k3 = nat2*k3;
-          for (size_t l = 0; l < 3; l++) {
-            grd1[nat1k3 + i3 + l] += g1[k3 + l];
-            grd2[nat2k3 + j3 + l] += g2[k3 + l];
-          }
-        }
+    }
+    for (size_t j = 0; j < nat2; j++) {
+      for (size_t l = 0; l < 3; l++) {
+        grd2[3*(nat2*k + j) + l] += g2[nm3*j + nm*l + k];
       }
     }
   }
 
-  if (swaped) {
-    std::vector<double> tmp2 = std::move(grd2);
-    grd2 = std::move(grd1);
-    grd1 = std::move(tmp2);
-  }
-  
-  
   return disp;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+
+double GetDispersion(std::string m1, std::string m2, size_t nm, bool do_grads,
+                     std::vector<double> xyz1, std::vector<double> xyz2,
+                     std::vector<double> &grd1, std::vector<double> &grd2,
+                     double cutoff, bool use_cutoff) {
+  DispersionParameters par = GetDispersionParameters(m1, m2);
+  return GetDispersion(par, nm, do_grads, xyz1.data(), xyz2.data(),
+                       grd1.data(), grd2.data(), cutoff, use_cutoff,
+                       true, 0.0);
+}
 
 }  // namespace disp
@@ -10,6 +10,41 @@
 
 namespace disp {
 
+// Parameters of the 2B dispersion between two monomer types, in the
+// order in which the monomers are given to GetDispersionParameters
+struct DispersionParameters {
+  // Number of atoms of each monomer. Zero if the pair has no dispersion
+  size_t nat1 = 0;
+  size_t nat2 = 0;
+  // Type of each atom of each monomer
+  std::vector<size_t> types1;
+  std::vector<size_t> types2;
+  // Number of different types in the second monomer
+  size_t nt2 = 0;
+  // C6 (kcal/mol * A^(-6)) and d6 (A^(-1)) for the type pair (ti,tj),
+  // at ti*nt2 + tj
+  std::vector<double> C6;
+  std::vector<double> d6;
+};
+
+// Returns the dispersion parameters of the pair m1 - m2. Meant to be
+// called once per pair of monomer types, when the system is set up.
+DispersionParameters GetDispersionParameters(std::string m1, std::string m2);
+
+// Dispersion energy of nm dimers with the parameters par. xyz1 and xyz2
+// are the coordinates of the monomers of each dimer, one after the other.
+// If do_grads is true, the gradients are added to grd1 and grd2, which
+// have the same layout. No string matching or heap allocation is done.
+// If use_cutoff and shift are true, the pair energies are shifted to zero
+// at the cutoff. If beta > 0, only the short range part of the dispersion
+// Ewald sum is computed.
+double GetDispersion(const DispersionParameters &par, size_t nm, 
+                     bool do_grads, const double *xyz1, const double *xyz2,
+                     double *grd1, double *grd2,
+                     double cutoff, bool use_cutoff,
+                     bool shift, double beta);
+
+// Same as above, looking up the parameters of m1 - m2 first
 double GetDispersion(std::string m1, std::string m2,size_t nm, bool do_grads, 
                      std::vector<double> xyz1, std::vector<double> xyz2,
                      std::vector<double> &grd1, std::vector<double> &grd2,
@@ -0,0 +1,409 @@
+#include "potential/dispersion/dispersion_lr.h"
+
+////////////////////////////////////////////////////////////////////////////////
+
+namespace disp {
+
+double DispersionTail(const std::vector<double> &C6,
+                      const std::vector<double> &count,
+                      size_t ng, double volume, double cutoff) {
+  // E_tail = - 1/2 sum_ab N_a N_b / V 4 pi int_rc^inf C6_ab / r^6 r^2 dr
+  double c6sum = 0.0;
+  for (size_t a = 0; a < ng; a++) {
+    for (size_t b = 0; b < ng; b++) {
+      c6sum += count[a] * count[b] * C6[a*ng + b];
+    }
+  }
+  const double rc3 = cutoff*cutoff*cutoff;
+  return -2.0*M_PI*c6sum / (3.0*volume*rc3);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+DispersionPme::DispersionPme() {
+  ng_ = 0;
+  beta_ = 0.0;
+  spacing_ = 1.0;
+  order_ = 6;
+  for (size_t d = 0; d < 3; d++) nk_[d] = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void DispersionPme::Initialize(const std::vector<double> &C6, size_t ng,
+                               double beta, double grid_spacing,
+                               size_t order) {
+  if (beta <= 0.0 || grid_spacing <= 0.0 || order < 3) {
+    std::string text = "PME parameters must be positive and the order of "
+                       "the B-splines at least 3";
+    throw CUException(__func__, __FILE__, __LINE__, text);
+  }
+
+  // Keep the grids if nothing changed
+  if (ng == ng_ && C6 == c6_ && beta == beta_ && grid_spacing == spacing_ &&
+      order == order_) {
+    return;
+  }
+
+  ng_ = ng;
+  c6_ = C6;
+  beta_ = beta;
+  spacing_ = grid_spacing;
+  order_ = order;
+
+  // Grid will be set up in the first energy call
+  grid_box_.clear();
+  grids_.clear();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void DispersionPme::BSpline(double w, double *m, double *dm) {
+  // Recursion of the cardinal B-splines (Essmann et al.), with m[j]
+  // the weight of the grid point floor(u) - order_ + 1 + j
+  const size_t n = order_;
+  m[n - 1] = 0.0;
+  m[1] = w;
+  m[0] = 1.0 - w;
+  for (size_t k = 3; k < n; k++) {
+    const double div = 1.0 / (k - 1.0);
+    m[k - 1] = div * w * m[k - 2];
+    for (size_t j = 1; j < k - 1; j++) {
+      m[k - j - 1] = div * ((w + j) * m[k - j - 2] + (k - j - w) * m[k - j - 1]);
+    }
+    m[0] = div * (1.0 - w) * m[0];
+  }
+
+  // Derivatives from the spline of order n - 1
+  dm[0] = -m[0];
+  for (size_t j = 1; j < n; j++) dm[j] = m[j - 1] - m[j];
+
+  // Last step of the recursion
+  const double div = 1.0 / (n - 1.0);
+  m[n - 1] = div * w * m[n - 2];
+  for (size_t j = 1; j < n - 1; j++) {
+    m[n - j - 1] = div * ((w + j) * m[n - j - 2] + (n - j - w) * m[n - j - 1]);
+  }
+  m[0] = div * (1.0 - w) * m[0];
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void DispersionPme::SetGrid(const std::vector<double> &box) {
+  if (box[1] != 0.0 || box[2] != 0.0 || box[3] != 0.0 ||
+      box[5] != 0.0 || box[6] != 0.0 || box[7] != 0.0) {
+    std::string text = "Dispersion PME only supports orthorhombic boxes";
+    throw CUException(__func__, __FILE__, __LINE__, text);
+  }
+
+  grid_box_ = box;
+
+  std::vector<double> m(order_), dm(order_);
+  for (size_t d = 0; d < 3; d++) {
+    // Smallest power of 2 with the requested spacing
+    const double len = box[4*d];
+    size_t n = 1;
+    while (n < order_ || len / n > spacing_) n *= 2;
+    nk_[d] = n;
+
+    // Twiddle factors
+    twiddle_[d].resize(n/2);
+    for (size_t j = 0; j < n/2; j++) {
+      twiddle_[d][j] = std::polar(1.0, 2.0*M_PI*j/n);
+    }
+
+    // B-spline moduli
+    BSpline(0.0, m.data(), dm.data());
+    std::vector<double> arr(n, 0.0);
+    for (size_t j = 0; j < order_ && j + 1 < n; j++) arr[j + 1] = m[j];
+    bmod_[d].resize(n);
+    for (size_t k = 0; k < n; k++) {
+      double sc = 0.0;
+      double ss = 0.0;
+      for (size_t j = 0; j < n; j++) {
+        const double arg = 2.0*M_PI*double(j*k % n)/n;
+        sc += arr[j] * std::cos(arg);
+        ss += arr[j] * std::sin(arg);
+      }
+      bmod_[d][k] = sc*sc + ss*ss;
+    }
+    for (size_t k = 0; k < n; k++) {
+      if (bmod_[d][k] < 1.0E-7) {
+        bmod_[d][k] = 0.5 * (bmod_[d][(k + n - 1) % n] + bmod_[d][(k + 1) % n]);
+      }
+    }
+  }
+
+  const size_t ntot = nk_[0] * nk_[1] * nk_[2];
+  grids_ = std::vector<std::vector<std::complex<double> > >(ng_,
+                          std::vector<std::complex<double> >(ntot));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void DispersionPme::Fft1d(std::complex<double> *data, size_t dim,
+                          size_t stride, int sign,
+                          std::complex<double> *work) {
+  const size_t n = nk_[dim];
+
+  // Bit reversed copy into the work array
+  size_t bits = 0;
+  while ((size_t(1) << bits) < n) bits++;
+  for (size_t i = 0; i < n; i++) {
+    size_t r = 0;
+    for (size_t b = 0; b < bits; b++) r |= ((i >> b) & 1) << (bits - 1 - b);
+    work[r] = data[i*stride];
+  }
+
+  // Butterflies
+  const std::vector<std::complex<double> > &tw = twiddle_[dim];
+  for (size_t len = 2; len <= n; len <<= 1) {
+    const size_t half = len / 2;
+    const size_t step = n / len;
+    for (size_t i = 0; i < n; i += len) {
+      for (size_t j = 0; j < half; j++) {
+        const std::complex<double> w = sign > 0 ? tw[j*step]
+                                                : std::conj(tw[j*step]);
+        const std::complex<double> u = work[i + j];
+        const std::complex<double> v = work[i + j + half] * w;
+        work[i + j] = u + v;
+        work[i + j + half] = u - v;
+      }
+    }
+  }
+
+  for (size_t i = 0; i < n; i++) data[i*stride] = work[i];
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void DispersionPme::Fft3d(std::vector<std::complex<double> > &grid,
+                          int sign) {
+  const size_t n0 = nk_[0];
+  const size_t n1 = nk_[1];
+  const size_t n2 = nk_[2];
+  const size_t nmax = std::max(n0, std::max(n1, n2));
+
+  // Grid point (k0,k1,k2) is at (k0*n1 + k1)*n2 + k2
+# ifdef _OPENMP
+# pragma omp parallel
+# endif
+  {
+    std::vector<std::complex<double> > work(nmax);
+#   ifdef _OPENMP
+#   pragma omp for
+#   endif
+    for (size_t l = 0; l < n0*n1; l++) {
+      Fft1d(grid.data() + l*n2, 2, 1, sign, work.data());
+    }
+#   ifdef _OPENMP
+#   pragma omp for
+#   endif
+    for (size_t l = 0; l < n0*n2; l++) {
+      const size_t k0 = l / n2;
+      const size_t k2 = l % n2;
+      Fft1d(grid.data() + k0*n1*n2 + k2, 1, n2, sign, work.data());
+    }
+#   ifdef _OPENMP
+#   pragma omp for
+#   endif
+    for (size_t l = 0; l < n1*n2; l++) {
+      Fft1d(grid.data() + l, 0, n1*n2, sign, work.data());
+    }
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+double DispersionPme::Energy(const std::vector<double> &xyz,
+                             const std::vector<size_t> &type,
+                             const std::vector<size_t> &mon_first,
+                             const std::vector<double> &box, bool do_grads,
+                             std::vector<double> &grad,
+                             std::vector<double> &virial) {
+  if (grid_box_ != box) SetGrid(box);
+
+  const size_t n = type.size();
+  const size_t p = order_;
+  const double len[3] = {box[0], box[4], box[8]};
+  const double volume = len[0]*len[1]*len[2];
+  const size_t n0 = nk_[0];
+  const size_t n1 = nk_[1];
+  const size_t n2 = nk_[2];
+  const size_t ntot = n0*n1*n2;
+
+  std::fill(virial.begin(), virial.end(), 0.0);
+
+  // B-splines of all sites and first grid point in each dimension
+  std::vector<double> theta(3*n*p), dtheta(3*n*p);
+  std::vector<size_t> kstart(3*n);
+  for (size_t i = 0; i < n; i++) {
+    for (size_t d = 0; d < 3; d++) {
+      double s = xyz[3*i + d] / len[d];
+      s -= std::floor(s);
+      const double u = s * nk_[d];
+      const double fu = std::floor(u);
+      BSpline(u - fu, theta.data() + (3*i + d)*p, dtheta.data() + (3*i + d)*p);
+      // floor(u) - p + 1, shifted to be positive
+      kstart[3*i + d] = (size_t(fu) + nk_[d] * p - p + 1) % nk_[d];
+    }
+  }
+
+  // Spread the sites of each type on its grid
+  for (size_t t = 0; t < ng_; t++) {
+    std::fill(grids_[t].begin(), grids_[t].end(), 0.0);
+  }
+  for (size_t i = 0; i < n; i++) {
+    std::vector<std::complex<double> > &q = grids_[type[i]];
+    const double *th0 = theta.data() + 3*i*p;
+    const double *th1 = th0 + p;
+    const double *th2 = th1 + p;
+    for (size_t a = 0; a < p; a++) {
+      const size_t k0 = (kstart[3*i] + a) % n0;
+      for (size_t b = 0; b < p; b++) {
+        const size_t k1 = (kstart[3*i + 1] + b) % n1;
+        const double w01 = th0[a] * th1[b];
+        for (size_t c = 0; c < p; c++) {
+          const size_t k2 = (kstart[3*i + 2] + c) % n2;
+          q[(k0*n1 + k1)*n2 + k2] += w01 * th2[c];
+        }
+      }
+    }
+  }
+
+  for (size_t t = 0; t < ng_; t++) Fft3d(grids_[t], 1);
+
+  // Reciprocal space sum. The grids are replaced by the convolution
+  // G(m) sum_t' C6_tt' F_t'(m), which transforms back to the potential
+  const double pref = -std::pow(M_PI, 1.5) * beta_*beta_*beta_ / volume;
+  const double sqrt_pi = std::sqrt(M_PI);
+  double erec = 0.0;
+  std::vector<std::complex<double> > fm(ng_);
+  for (size_t k = 0; k < ntot; k++) {
+    const size_t k0 = k / (n1*n2);
+    const size_t k1 = (k / n2) % n1;
+    const size_t k2 = k % n2;
+    const double mx = (k0 <= n0/2 ? double(k0) : double(k0) - n0) / len[0];
+    const double my = (k1 <= n1/2 ? double(k1) : double(k1) - n1) / len[1];
+    const double mz = (k2 <= n2/2 ? double(k2) : double(k2) - n2) / len[2];
+    const double m2 = mx*mx + my*my + mz*mz;
+    const double mabs = std::sqrt(m2);
+    const double b = M_PI * mabs / beta_;
+    const double b2 = b*b;
+    const double expb2 = std::exp(-b2);
+    const double erfcb = std::erfc(b);
+    const double f = ((1.0 - 2.0*b2)*expb2 + 2.0*b2*b*sqrt_pi*erfcb) / 3.0;
+    const double g = pref / (bmod_[0][k0] * bmod_[1][k1] * bmod_[2][k2]);
+
+    for (size_t t = 0; t < ng_; t++) fm[t] = grids_[t][k];
+    double s = 0.0;
+    for (size_t t = 0; t < ng_; t++) {
+      std::complex<double> w = 0.0;
+      for (size_t u = 0; u < ng_; u++) w += c6_[t*ng_ + u] * fm[u];
+      s += std::real(w * std::conj(fm[t]));
+      grids_[t][k] = g * f * w;
+    }
+
+    // Energy and virial of this term
+    const double em = 0.5 * g * f * s;
+    erec += em;
+    virial[0] += em;
+    virial[4] += em;
+    virial[8] += em;
+    if (m2 > 0.0) {
+      const double df = 2.0*b*(sqrt_pi*b*erfcb - expb2);
+      const double dem = 0.5 * g * s * df * M_PI / beta_ / mabs;
+      const double mv[3] = {mx, my, mz};
+      for (size_t a = 0; a < 3; a++) {
+        for (size_t c = 0; c < 3; c++) {
+          virial[3*a + c] += dem * mv[a] * mv[c];
+        }
+      }
+    }
+  }
+
+  // Self energy
+  double eself = 0.0;
+  const double beta6 = std::pow(beta_, 6);
+  for (size_t i = 0; i < n; i++) {
+    eself += beta6 / 12.0 * c6_[type[i]*ng_ + type[i]];
+  }
+
+  // Pairs inside a monomer are in the reciprocal space sum, remove them
+  double eexcl = 0.0;
+  const double beta2 = beta_*beta_;
+  for (size_t m = 0; m + 1 < mon_first.size(); m++) {
+    for (size_t i = mon_first[m]; i < mon_first[m + 1]; i++) {
+      for (size_t j = i + 1; j < mon_first[m + 1]; j++) {
+        const double c6 = c6_[type[i]*ng_ + type[j]];
+        const double dx = xyz[3*i] - xyz[3*j];
+        const double dy = xyz[3*i + 1] - xyz[3*j + 1];
+        const double dz = xyz[3*i + 2] - xyz[3*j + 2];
+        const double rsq = dx*dx + dy*dy + dz*dz;
+        const double x2 = beta2 * rsq;
+        const double expx2 = std::exp(-x2);
+        const double inv_r6 = 1.0 / (rsq*rsq*rsq);
+        const double omg = 1.0 - ewald_g6(x2, expx2);
+        eexcl += c6 * omg * inv_r6;
+
+        // (dE/dr)/r
+        const double grd = c6 * (beta6*expx2 - 6.0*omg*inv_r6) / rsq;
+        const double d[3] = {dx, dy, dz};
+        for (size_t a = 0; a < 3; a++) {
+          for (size_t c = 0; c < 3; c++) {
+            virial[3*a + c] -= grd * d[a] * d[c];
+          }
+        }
+        if (do_grads) {
+          for (size_t a = 0; a < 3; a++) {
+            grad[3*i + a] += grd * d[a];
+            grad[3*j + a] -= grd * d[a];
+          }
+        }
+      }
+    }
+  }
+
+  if (do_grads) {
+    // Potential on the grids
+    for (size_t t = 0; t < ng_; t++) Fft3d(grids_[t], -1);
+
+#   ifdef _OPENMP
+#   pragma omp parallel for
+#   endif
+    for (size_t i = 0; i < n; i++) {
+      const std::vector<std::complex<double> > &phi = grids_[type[i]];
+      const double *th0 = theta.data() + 3*i*p;
+      const double *th1 = th0 + p;
+      const double *th2 = th1 + p;
+      const double *dth0 = dtheta.data() + 3*i*p;
+      const double *dth1 = dth0 + p;
+      const double *dth2 = dth1 + p;
+      double g0 = 0.0;
+      double g1 = 0.0;
+      double g2 = 0.0;
+      for (size_t a = 0; a < p; a++) {
+        const size_t k0 = (kstart[3*i] + a) % n0;
+        for (size_t b = 0; b < p; b++) {
+          const size_t k1 = (kstart[3*i + 1] + b) % n1;
+          for (size_t c = 0; c < p; c++) {
+            const size_t k2 = (kstart[3*i + 2] + c) % n2;
+            const double v = std::real(phi[(k0*n1 + k1)*n2 + k2]);
+            g0 += dth0[a] * th1[b] * th2[c] * v;
+            g1 += th0[a] * dth1[b] * th2[c] * v;
+            g2 += th0[a] * th1[b] * dth2[c] * v;
+          }
+        }
+      }
+      grad[3*i] += g0 * n0 / len[0];
+      grad[3*i + 1] += g1 * n1 / len[1];
+      grad[3*i + 2] += g2 * n2 / len[2];
+    }
+  }
+
+  return erec + eself + eexcl;
+}
+
+} // namespace disp
+
+////////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,105 @@
+#ifndef DISPERSION_LR_H
+#define DISPERSION_LR_H
+
+#include <vector>
+#include <string>
+#include <complex>
+#include <cmath>
+#include <cstddef>
+#include <algorithm>
+
+#ifdef _OPENMP
+# include <omp.h>
+#endif
+
+#include "tools/custom_exceptions.h"
+#include "potential/dispersion/disptools.h"
+
+////////////////////////////////////////////////////////////////////////////////
+
+namespace disp {
+
+// Isotropic long range correction of -sum C6/r^6 beyond the cutoff, for
+// a periodic system of volume V with count[t] sites of type t. C6 is the
+// ng x ng matrix of C6 between site types. Assumes a uniform density
+// beyond the cutoff and no damping there.
+// The virial of the correction is 2*E_tail in each diagonal component.
+double DispersionTail(const std::vector<double> &C6,
+                      const std::vector<double> &count,
+                      size_t ng, double volume, double cutoff);
+
+// Real space screening of the dispersion Ewald sum,
+// g(x) = exp(-x^2) (1 + x^2 + x^4/2), with x = beta*r.
+// The short range pair energy is -C6 (TT6 + g - 1)/r^6.
+inline double ewald_g6(double x2, double exp_mx2) {
+  return exp_mx2 * (1.0 + x2 + 0.5*x2*x2);
+}
+
+// Smooth particle mesh Ewald for the long range part of -sum C6/r^6
+// (Essmann et al., J. Chem. Phys. 103, 8577 (1995)). The C6 matrix between
+// site types does not need to factorize: there is one grid per site type,
+// and the types are coupled in reciprocal space.
+// Computes the reciprocal space, self and intramonomer exclusion terms.
+// The short range part is computed with the 2B dispersion, screened
+// with ewald_g6. Only orthorhombic boxes are supported.
+class DispersionPme {
+  public:
+    DispersionPme();
+
+    // Sets the C6 matrix (ng x ng) between the site types, the Ewald
+    // parameter beta (A^-1), the maximum grid spacing (A) and the order
+    // of the B-splines.
+    void Initialize(const std::vector<double> &C6, size_t ng, double beta,
+                    double grid_spacing, size_t order);
+
+    // Energy (kcal/mol) of the n sites at xyz (xyzxyz...), of types type.
+    // Monomer m has the sites mon_first[m] to mon_first[m+1] - 1, and the
+    // pairs inside a monomer are excluded. box has 9 components.
+    // If do_grads is true, the gradients are added to grad. virial (9
+    // components) is set to -dE/d(strain).
+    double Energy(const std::vector<double> &xyz,
+                  const std::vector<size_t> &type,
+                  const std::vector<size_t> &mon_first,
+                  const std::vector<double> &box, bool do_grads,
+                  std::vector<double> &grad, std::vector<double> &virial);
+
+  private:
+    // Sets the grid dimensions and the B-spline moduli for the box
+    void SetGrid(const std::vector<double> &box);
+    // B-spline of order order_ and its derivative at w in [0,1),
+    // for the order_ grid points starting at floor(u) - order_ + 1
+    void BSpline(double w, double *m, double *dm);
+    // In place 3D FFT of grid. Sign is the sign of the exponent
+    void Fft3d(std::vector<std::complex<double> > &grid, int sign);
+    // In place 1D FFT of the n (power of 2) points of data with stride
+    // stride, along dimension dim of the grid. work has n points
+    void Fft1d(std::complex<double> *data, size_t dim, size_t stride,
+               int sign, std::complex<double> *work);
+
+    // Number of site types
+    size_t ng_;
+    // C6 between site types (kcal/mol * A^6)
+    std::vector<double> c6_;
+    // Ewald parameter (A^-1)
+    double beta_;
+    // Maximum grid spacing (A)
+    double spacing_;
+    // Order of the B-splines
+    size_t order_;
+    // Box for which the grid was set
+    std::vector<double> grid_box_;
+    // Grid dimensions (powers of 2)
+    size_t nk_[3];
+    // B-spline moduli |b(m)|^2 in each dimension
+    std::vector<double> bmod_[3];
+    // exp(2 pi i j / nk_) for j < nk_/2 in each dimension
+    std::vector<std::complex<double> > twiddle_[3];
+    // One complex grid per site type
+    std::vector<std::vector<std::complex<double> > > grids_;
+};
+
+} // namespace disp
+
+////////////////////////////////////////////////////////////////////////////////
+
+#endif // DISPERSION_LR_H
@@ -49,10 +49,12 @@ namespace disp {
     const double r = std::sqrt(rsq);
   
     const double d6r = d6*r;
-    const double tt6 = disp::tang_toennies(6, d6r);
+    const double exp6 = std::exp(-d6r);
+    const double tt6 = disp::tang_toennies6(d6r, exp6);
   
     const double d8r = d8*r;
-    const double tt8 = disp::tang_toennies(8, d8r);
+    const double exp8 = std::exp(-d8r);
+    const double tt8 = disp::tang_toennies8(d8r, exp8);
   
   
     const double inv_rsq = 1.0/rsq;
@@ -63,8 +65,8 @@ namespace disp {
     const double e8 = C8*tt8*inv_r8;
   
     const double grd = (6*e6 + 8*e8)*inv_rsq
-        - (C6*std::pow(d6, 7)*if6*std::exp(-d6r)
-        +  C8*std::pow(d8, 9)*if8*std::exp(-d8r))/r;
+        - (C6*std::pow(d6, 7)*if6*exp6
+        +  C8*std::pow(d8, 9)*if8*exp8)/r;
   
     g1[0] += dx*grd;
     g2[0] -= dx*grd;
@@ -92,10 +94,12 @@ namespace disp {
     const double r = std::sqrt(rsq);
   
     const double d6r = d6*r;
-    const double tt6 = disp::tang_toennies(6, d6r);
+    const double exp6 = std::exp(-d6r);
+    const double tt6 = disp::tang_toennies6(d6r, exp6);
   
     const double d8r = d8*r;
-    const double tt8 = disp::tang_toennies(8, d8r);
+    const double exp8 = std::exp(-d8r);
+    const double tt8 = disp::tang_toennies8(d8r, exp8);
   
   
     const double inv_rsq = 1.0/rsq;
@@ -110,29 +114,17 @@ namespace disp {
   
   //----------------------------------------------------------------------------//
   
-  double disp6(const double& C6, const double& d6,
-               const double* p1a, const double* p2a, size_t n,
-               const double cutoff, const bool use_cutoff) {
-  
-    // p1a and p2a are an array of coordinates of the atoms involved xyzxyzxyz...
-    // rearrange them in xxxx...yyyy...zzzz...
-    double p1[3*n], p2[3*n];
-    for (size_t i = 0; i < n; i++) {
-      p1[i] = p1a[3*i];
-      p1[i + n] = p1a[3*i + 1];
-      p1[i + 2*n] = p1a[3*i + 2];
-
-      p2[i] = p2a[3*i];
-      p2[i + n] = p2a[3*i + 1];
-      p2[i + 2*n] = p2a[3*i + 2];
-    }
+  double disp6_soa(const double& C6, const double& d6,
+                   const double* p1, const double* p2, size_t n,
+                   const double cutoff, const bool use_cutoff,
+                   const bool shift, const double beta) {
 
     // Get dispersion at the cutoff distance if requested
     double disp_min = 0.0;
-    if (use_cutoff) {
+    if (use_cutoff && shift) {
       const double r = cutoff;
       const double rsq = r*r;
-      const double tt6 = disp::tang_toennies(6, d6*r);
+      const double tt6 = disp::tang_toennies6(d6*r);
 
       const double inv_rsq = 1.0/rsq;
       const double inv_r6 = inv_rsq*inv_rsq*inv_rsq;
@@ -141,9 +133,12 @@ namespace disp {
 
     // Main loop
     size_t n2 = 2*n;
+    const double beta2 = beta*beta;
     double disp = 0.0;
-    size_t disp_count = 0;
-//    #pragma simd
+    double disp_count = 0.0;
+#ifdef _OPENMP
+#   pragma omp simd reduction(+:disp,disp_count)
+#endif
     for (size_t nv = 0; nv < n; nv++) {
       const double dx = p1[nv] - p2[nv];
       const double dy = p1[nv + n] - p2[nv + n];
@@ -152,22 +147,48 @@ namespace disp {
       const double rsq = dx*dx + dy*dy + dz*dz;
       const double r = std::sqrt(rsq);
 
-      // If using cutoff, check for distances and get proper dispersion
-      if (!use_cutoff || r <= cutoff) {      
+      // If using cutoff, only pairs within the cutoff contribute
+      const double in_cutoff = (!use_cutoff || r <= cutoff) ? 1.0 : 0.0;
+
+      const double d6r = d6*r;
+      const double tt6 = disp::tang_toennies6(d6r, ExpSimd(-d6r));
 
-        const double tt6 = disp::tang_toennies(6, d6*r);
+      // Ewald screening minus one, zero if beta is zero
+      const double x2 = beta2*rsq;
+      const double gm1 = ExpSimd(-x2)*(1.0 + x2 + 0.5*x2*x2) - 1.0;
   
-        const double inv_rsq = 1.0/rsq;
-        const double inv_r6 = inv_rsq*inv_rsq*inv_rsq;
-        disp += C6*tt6*inv_r6;
-        disp_count++;
-      }
+      const double inv_rsq = 1.0/rsq;
+      const double inv_r6 = inv_rsq*inv_rsq*inv_rsq;
+      disp += in_cutoff*C6*(tt6 + gm1)*inv_r6;
+      disp_count += in_cutoff;
     }
 
     // Multiplying that value by the number of equivalent pairs "n"
-    disp_min *= double(disp_count);
+    disp_min *= disp_count;
     disp -= disp_min;
     return -disp;
+  }
+  
+  //----------------------------------------------------------------------------//
+  
+  double disp6(const double& C6, const double& d6,
+               const double* p1a, const double* p2a, size_t n,
+               const double cutoff, const bool use_cutoff) {
+  
+    // p1a and p2a are an array of coordinates of the atoms involved xyzxyzxyz...
+    // rearrange them in xxxx...yyyy...zzzz...
+    double p1[3*n], p2[3*n];
+    for (size_t i = 0; i < n; i++) {
+      p1[i] = p1a[3*i];
+      p1[i + n] = p1a[3*i + 1];
+      p1[i + 2*n] = p1a[3*i + 2];
+
+      p2[i] = p2a[3*i];
+      p2[i + n] = p2a[3*i + 1];
+      p2[i + 2*n] = p2a[3*i + 2];
+    }
+
+    return disp6_soa(C6, d6, p1, p2, n, cutoff, use_cutoff, true, 0.0);
 
     // TODO shift values
 //    double p1[3*n], p2[3*n];
@@ -211,27 +232,18 @@ namespace disp {
   //----------------------------------------------------------------------------//
   
   
-  double disp6(const double& C6, const double& d6,
-               const double* p1a, const double* p2a,
-                     double* g1a,       double* g2a, size_t n,
-               const double cutoff, const bool use_cutoff) {
-    double p1[3*n], p2[3*n];
-    for (size_t i = 0; i < n; i++) {
-      p1[i] = p1a[3*i];
-      p1[i + n] = p1a[3*i + 1];
-      p1[i + 2*n] = p1a[3*i + 2];
+  double disp6_soa(const double& C6, const double& d6,
+                   const double* p1, const double* p2,
+                         double* g1,       double* g2, size_t n,
+                   const double cutoff, const bool use_cutoff,
+                   const bool shift, const double beta) {
 
-      p2[i] = p2a[3*i];
-      p2[i + n] = p2a[3*i + 1];
-      p2[i + 2*n] = p2a[3*i + 2];
-    }
-    
     // Get dispersion at the cutoff distance if requested
     double disp_min = 0.0;
-    if (use_cutoff) {
+    if (use_cutoff && shift) {
       const double r = cutoff;
       const double rsq = r*r;
-      const double tt6 = disp::tang_toennies(6, d6*r);
+      const double tt6 = disp::tang_toennies6(d6*r);
 
       const double inv_rsq = 1.0/rsq;
       const double inv_r6 = inv_rsq*inv_rsq*inv_rsq;
@@ -239,12 +251,14 @@ namespace disp {
     }
 
     size_t n2 = 2*n;
-    size_t disp_count = 0;
+    double disp_count = 0.0;
     double disp = 0.0;
-    double g1[3*n], g2[3*n];
-    std::fill(g1, g1 + 3*n, 0.0);
-    std::fill(g2, g2 + 3*n, 0.0);
-//    #pragma simd
+    const double c6d6_7 = C6*std::pow(d6, 7)*if6;
+    const double beta2 = beta*beta;
+    const double beta6 = beta2*beta2*beta2;
+#ifdef _OPENMP
+#   pragma omp simd reduction(+:disp,disp_count)
+#endif
     for (size_t nv = 0; nv < n; nv++) {
       const double dx = p1[nv] - p2[nv];
       const double dy = p1[nv + n] - p2[nv + n];
@@ -253,34 +267,70 @@ namespace disp {
       const double rsq = dx*dx + dy*dy + dz*dz;
       const double r = std::sqrt(rsq);
 
-      // If using cutoff, check for distances and get proper dispersion
-      if (!use_cutoff || r <= cutoff) {
+      // If using cutoff, only pairs within the cutoff contribute
+      const double in_cutoff = (!use_cutoff || r <= cutoff) ? 1.0 : 0.0;
     
-        const double d6r = d6*r;
-        const double tt6 = disp::tang_toennies(6, d6r);
+      const double d6r = d6*r;
+      const double exp6 = ExpSimd(-d6r);
+      const double tt6 = disp::tang_toennies6(d6r, exp6);
+
+      // Ewald screening minus one, zero if beta is zero
+      const double x2 = beta2*rsq;
+      const double expx2 = ExpSimd(-x2);
+      const double gm1 = expx2*(1.0 + x2 + 0.5*x2*x2) - 1.0;
     
-        const double inv_rsq = 1.0/rsq;
-        const double inv_r6 = inv_rsq*inv_rsq*inv_rsq;
+      const double inv_rsq = 1.0/rsq;
+      const double inv_r6 = inv_rsq*inv_rsq*inv_rsq;
     
-        const double e6 = C6*tt6*inv_r6;
+      const double e6 = in_cutoff*C6*(tt6 + gm1)*inv_r6;
     
-        const double grd = 6*e6*inv_rsq - C6*std::pow(d6, 7)*if6*std::exp(-d6r)/r;
+      const double grd = 6*e6*inv_rsq - in_cutoff*c6d6_7*exp6/r
+                       + in_cutoff*C6*beta6*expx2*inv_rsq;
     
-        g1[nv] += dx*grd;
-        g2[nv] -= dx*grd;
+      g1[nv] += dx*grd;
+      g2[nv] -= dx*grd;
     
-        g1[nv + n] += dy*grd;
-        g2[nv + n] -= dy*grd;
+      g1[nv + n] += dy*grd;
+      g2[nv + n] -= dy*grd;
     
-        g1[nv + n2] += dz*grd;
-        g2[nv + n2] -= dz*grd;
+      g1[nv + n2] += dz*grd;
+      g2[nv + n2] -= dz*grd;
 
-        disp_count++;
+      disp_count += in_cutoff;
     
-        disp -= e6;
-      }
+      disp -= e6;
     }
 
+    disp_min *= disp_count;
+    disp -= disp_min;
+
+    return disp;
+  }
+  
+  //----------------------------------------------------------------------------//
+  
+  double disp6(const double& C6, const double& d6,
+               const double* p1a, const double* p2a,
+                     double* g1a,       double* g2a, size_t n,
+               const double cutoff, const bool use_cutoff) {
+    double p1[3*n], p2[3*n];
+    for (size_t i = 0; i < n; i++) {
+      p1[i] = p1a[3*i];
+      p1[i + n] = p1a[3*i + 1];
+      p1[i + 2*n] = p1a[3*i + 2];
+
+      p2[i] = p2a[3*i];
+      p2[i + n] = p2a[3*i + 1];
+      p2[i + 2*n] = p2a[3*i + 2];
+    }
+
+    double g1[3*n], g2[3*n];
+    std::fill(g1, g1 + 3*n, 0.0);
+    std::fill(g2, g2 + 3*n, 0.0);
+    double disp = disp6_soa(C6, d6, p1, p2, g1, g2, n, cutoff, use_cutoff,
+                            true, 0.0);
+
+    size_t n2 = 2*n;
     for (size_t i = 0; i < n; i++) {
       g1a[3*i] += g1[i];
       g1a[3*i + 1] += g1[i + n];
@@ -291,9 +341,6 @@ namespace disp {
       g2a[3*i + 2] += g2[i + n2];
     }
     
-    disp_min *= double(disp_count);
-    disp -= disp_min;
-
     return disp;
   }
 } // namespace disp
@@ -6,6 +6,8 @@
 #include <cassert>
 #include <cstddef>
 
+#include "tools/math_tools.h"
+
 namespace disp {
 
   template <int N>
@@ -27,7 +29,93 @@ namespace disp {
   
   //----------------------------------------------------------------------------//
   
+  // Reference implementation of the Tang-Toennies damping function of
+  // order n. Not vectorizable, use tang_toennies6 and tang_toennies8 in
+  // the dispersion kernels.
   double tang_toennies(int n, const double& x);
+
+  //----------------------------------------------------------------------------//
+
+  // Below TT_XSERIES, the damping is evaluated with the series of
+  // exp(-x) sum_{k > n} x^k / k!, truncated at TT_NSERIES terms, to avoid
+  // the cancellation in 1 - exp(-x) sum_{k <= n} x^k / k!
+  const double TT_XSERIES = 4.0;
+  const size_t TT_NSERIES = 26;
+
+  // 1/k! for k = 0, ..., 8 + TT_NSERIES
+  static const double tt_ifact[35] = {
+    1.00000000000000000e+00, 1.00000000000000000e+00, 5.00000000000000000e-01,
+    1.66666666666666657e-01, 4.16666666666666644e-02, 8.33333333333333322e-03,
+    1.38888888888888894e-03, 1.98412698412698413e-04, 2.48015873015873016e-05,
+    2.75573192239858925e-06, 2.75573192239858883e-07, 2.50521083854417202e-08,
+    2.08767569878681002e-09, 1.60590438368216133e-10, 1.14707455977297245e-11,
+    7.64716373181981641e-13, 4.77947733238738525e-14, 2.81145725434552060e-15,
+    1.56192069685862253e-16, 8.22063524662432950e-18, 4.11031762331216484e-19,
+    1.95729410633912626e-20, 8.89679139245057408e-22, 3.86817017063068413e-23,
+    1.61173757109611839e-24, 6.44695028438447359e-26, 2.47959626322479759e-27,
+    9.18368986379554601e-29, 3.27988923706983776e-30, 1.13099628864477159e-31,
+    3.76998762881590539e-33, 1.21612504155351789e-34, 3.80039075485474342e-36,
+    1.15163356207719509e-37, 3.38715753552116180e-39
+  };
+
+  // Branch-free Tang-Toennies damping of order N, given exp(-x).
+  // Both branches are computed and blended, so it vectorizes. In simd
+  // loops, exp(-x) must come from ExpSimd for the loop to vectorize.
+  template <int N>
+  inline double tt_damping(double x, double exp_mx) {
+    // Direct sum
+    double sum = tt_ifact[N];
+#if defined(__INTEL_COMPILER)
+#   pragma unroll
+#elif defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 8
+#   pragma GCC unroll 16
+#endif
+    for (int k = N - 1; k >= 0; k--) sum = sum*x + tt_ifact[k];
+    const double tt_direct = 1.0 - sum*exp_mx;
+
+    // Series for small x
+    double ser = tt_ifact[N + TT_NSERIES];
+#if defined(__INTEL_COMPILER)
+#   pragma unroll
+#elif defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 8
+#   pragma GCC unroll 32
+#endif
+    for (int k = N + TT_NSERIES - 1; k > N; k--) ser = ser*x + tt_ifact[k];
+    double xn1 = x;
+#if defined(__INTEL_COMPILER)
+#   pragma unroll
+#elif defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 8
+#   pragma GCC unroll 16
+#endif
+    for (int k = 0; k < N; k++) xn1 *= x;
+    const double tt_series = ser*xn1*exp_mx;
+
+    return x < TT_XSERIES ? tt_series : tt_direct;
+  }
+
+#ifdef _OPENMP
+# pragma omp declare simd
+#endif
+  inline double tang_toennies6(double x, double exp_mx) {
+    return tt_damping<6>(x, exp_mx);
+  }
+
+#ifdef _OPENMP
+# pragma omp declare simd
+#endif
+  inline double tang_toennies8(double x, double exp_mx) {
+    return tt_damping<8>(x, exp_mx);
+  }
+
+  inline double tang_toennies6(double x) {
+    return tang_toennies6(x, ExpSimd(-x));
+  }
+
+  inline double tang_toennies8(double x) {
+    return tang_toennies8(x, ExpSimd(-x));
+  }
+  
+  //----------------------------------------------------------------------------//
   
   double disp68(const double& C6, const double& d6,
                 const double& C8, const double& d8,
@@ -37,6 +125,22 @@ namespace disp {
                 const double& C8, const double& d8,
                 const double* p1, const double* p2);
   
+  // Dispersion of n pairs of atoms with the same C6 and d6.
+  // In disp6, the coordinates (and gradients) are xyzxyz..., in disp6_soa
+  // they are xxx...yyy...zzz... disp6_soa adds to the gradients.
+  // If use_cutoff and shift are true, the energy is shifted to zero at the
+  // cutoff. If beta > 0, only the short range part of the dispersion
+  // Ewald sum is computed (see ewald_g6 in dispersion_lr.h).
+  double disp6_soa(const double& C6, const double& d6,
+                   const double* p1, const double* p2, size_t n,
+                   const double cutoff, const bool use_cutoff,
+                   const bool shift, const double beta);
+  double disp6_soa(const double& C6, const double& d6,
+                   const double* p1, const double* p2,
+                         double* g1,       double* g2, size_t n,
+                   const double cutoff, const bool use_cutoff,
+                   const bool shift, const double beta);
+
   double disp6(const double& C6, const double& d6,
                const double* p1a, const double* p2a, size_t n,
                const double cutoff, const bool use_cutoff);
@@ -72,17 +72,13 @@ void ElectroTensor::CalcT0AndT1WithPolfacNonZero
     v5_[m] = aCC * v3_[m] * v3_[m] / Asqsq;                  // a*(r/A)^4
   }
   
-  // Compute gammq and store result in vector. This loop is not vectorizable
-  for (size_t m = mon2_index_start; m < mon2_index_end; m++) {
-    v6_[m] = gammq(0.75, v5_[m]);                            // gammq
-  }
-
   // Finalize computation of electric field
 #ifdef _OPENMP
   # pragma omp simd
 #endif
   for (size_t m = mon2_index_start; m < mon2_index_end; m++) {
     const double exp1 = std::exp(-v5_[m]);
+    v6_[m] = gammq34(v5_[m], exp1);                          // gammq
 
     // Screening functions
     const double s1r = v4_[m] - exp1 * v4_[m];
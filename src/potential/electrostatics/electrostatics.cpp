@@ -1,5 +1,6 @@
 #include "potential/electrostatics/electrostatics.h"
 #include <iomanip>
+#include <chrono>
 
 //#define DEBUG
 //#define TIMING
@@ -15,7 +16,15 @@
 
 namespace elec {
 
-  Electrostatics::Electrostatics() { };
+  Electrostatics::Electrostatics() {
+    dip_tensor_ready_ = false;
+    max_mem_dip_tensor_ = 512.0;
+    inv_factor_ready_ = false;
+    max_size_inv_ = 1500;
+    mixed_precision_ = false;
+    tol_mixed_ = 1E-12;
+    use_sp_ = false;
+  };
   void Electrostatics::Initialize(
         std::vector<double> &chg,
         std::vector<double> &chg_grad,
@@ -32,12 +41,9 @@ namespace elec {
         std::string dip_method) {
 
     // Copy System data in electrostatics
-    //sys_chg_ = std::vector<double>(chg.begin(),chg.end());
-    sys_chg_ = chg;
     sys_chg_grad_ = chg_grad;
     polfac_ = polfac;
     pol_ = pol;
-    sys_xyz_ = sys_xyz;
     mon_id_ = mon_id;
     sites_ = sites;
     first_ind_ = first_ind;
@@ -48,7 +54,7 @@ namespace elec {
     dip_method_ = dip_method;
 
     // Initialize other variables
-    nsites_ = sys_chg_.size();
+    nsites_ = chg.size();
     size_t nsites3 = nsites_ * 3;
     sys_phi_ = std::vector<double>(nsites_,0.0);
     phi_ = std::vector<double>(nsites_,0.0);
@@ -60,9 +66,22 @@ namespace elec {
     mu_ = std::vector<double>(nsites3, 0.0);
     xyz_ = std::vector<double>(nsites3,0.0);
     grad_ = std::vector<double>(nsites3,0.0);
-    sys_grad_ = std::vector<double>(nsites3,0.0);
     chg_ = std::vector<double>(nsites_,0.0);
     pol_sqrt_ = std::vector<double>(nsites3,0.0);
+    dip_tensor_tmp_ = std::vector<double>(nsites3,0.0);
+    cg_r_ = std::vector<double>(nsites3,0.0);
+    cg_p_ = std::vector<double>(nsites3,0.0);
+    cg_ap_ = std::vector<double>(nsites3,0.0);
+    cg_timings_ = std::vector<double>(3,0.0);
+    dip_tensor_.clear();
+    dip_tensor_ready_ = false;
+    inv_factor_.clear();
+    inv_factor_ready_ = false;
+
+    // Max number of monomers of the same type
+    maxnmon_ = 0;
+    for (size_t mt = 0; mt < mon_type_count_.size(); mt++)
+      maxnmon_ = std::max(maxnmon_, mon_type_count_[mt].second);
 
     aCC_ = 0.4;
     aCD_ = 0.4;
@@ -70,49 +89,73 @@ namespace elec {
     g34_ = std::exp(gammln(0.75));
     aCC1_4_ = std::pow(aCC_,0.25);
 
-    // ASPC parameters
-    hist_num_aspc_ = 0;
-    // TODO k is defaulted to 4 for now
+    // ASPC parameters. Order 4 and a single corrector step by default
     SetAspcParameters(4);
+    SetAspcCorrector(1, tolerance_);
+    dip_iter_ = 0;
+    dip_residual_ = 0.0;
+    dip_residual_trace_.clear();
+    SetDiisSize(6);
     mu_pred_ = std::vector<double>(nsites3, 0.0);
+
+    // Extended Lagrangian parameters
+    hist_num_iel_ = 0;
+    SetIelParameters(5);
+    mu_iel_next_ = std::vector<double>(nsites3, 0.0);
     
-    ReorderData();
+    ReorderData(sys_xyz, chg, pol_);
   }
 
-  void Electrostatics::SetXyzChgPolPolfac(std::vector<double> &xyz,
-                                          std::vector<double> &chg,
-                                          std::vector<double> &chggrad,
-                                          std::vector<double> &pol,
-                                          std::vector<double> &polfac,
-                                          std::string dip_method,
+  void Electrostatics::SetXyzChgPolPolfac(const std::vector<double> &xyz,
+                                          const std::vector<double> &chg,
+                                          const std::vector<double> &chggrad,
+                                          const std::vector<double> &pol,
+                                          const std::vector<double> &polfac,
+                                          const std::string &dip_method,
                                           bool do_grads) {
-    sys_chg_ = chg;
-    sys_chg_grad_ = chggrad;
+    // Same sizes as in Initialize, so the assignments do not reallocate.
+    // The charge derivatives are only needed for the gradients.
+    if (do_grads) sys_chg_grad_ = chggrad;
     polfac_ = polfac;
     pol_ = pol;
-    sys_xyz_ = xyz;
     do_grads_ = do_grads;
     dip_method_ = dip_method;
 
-    size_t nsites3 = nsites_ * 3;
-
-    std::fill(sys_phi_.begin(),sys_phi_.end(),0.0);
+    // Accumulated during the calculation. The rest of the buffers are
+    // fully overwritten before being used.
     std::fill(phi_.begin(),phi_.end(),0.0);
-    std::fill(sys_Efq_.begin(),sys_Efq_.end(), 0.0);
-    std::fill(sys_Efd_.begin(),sys_Efd_.end(), 0.0);
     std::fill(Efq_.begin(),Efq_.end(), 0.0);
     std::fill(Efd_.begin(),Efd_.end(), 0.0);
-    std::fill(sys_mu_.begin(),sys_mu_.end(), 0.0);
     std::fill(mu_.begin(),mu_.end(), 0.0);
-    std::fill(grad_.begin(),grad_.end(),0.0);
-    std::fill(sys_grad_.begin(),sys_grad_.end(),0.0);
 
-    std::fill(mu_pred_.begin(),mu_pred_.end(), 0.0);
+    // Coordinates changed, so the stored dipole tensor is not valid anymore
+    dip_tensor_ready_ = false;
+
+    ReorderData(xyz, chg, pol_);
+  }
+
+  void Electrostatics::SetDipoleTensorMaxMemory(double max_mem) {
+    max_mem_dip_tensor_ = max_mem;
+    // Release the memory if the tensor, or its single precision copy,
+    // does not fit anymore
+    if (!dip_tensor_.empty()
+        && DipoleTensorMemory(false) > max_mem_dip_tensor_) {
+      std::vector<double>().swap(dip_tensor_);
+      std::vector<float>().swap(dip_tensor_sp_);
+      dip_tensor_ready_ = false;
+    } else if (!dip_tensor_sp_.empty()
+               && DipoleTensorMemory(true) > max_mem_dip_tensor_) {
+      std::vector<float>().swap(dip_tensor_sp_);
+    }
+  }
 
-    ReorderData();
+  void Electrostatics::SetDipoleInvMaxSize(size_t max_size) {
+    max_size_inv_ = max_size;
   }
 
-  void Electrostatics::ReorderData() {
+  void Electrostatics::ReorderData(const std::vector<double> &sys_xyz,
+                                   const std::vector<double> &sys_chg,
+                                   const std::vector<double> &sys_pol) {
 ////////////////////////////////////////////////////////////////////////////////
 // DATA ORGANIZATION ///////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
@@ -143,16 +186,17 @@ namespace elec {
           size_t inmon = i*nmon;
           size_t inmon3 = 3*inmon;
           xyz_[inmon3 + m + fi_crd] =
-                 sys_xyz_[fi_crd + mns3 + 3*i];
+                 sys_xyz[fi_crd + mns3 + 3*i];
           xyz_[inmon3 + m + fi_crd + nmon] =
-                 sys_xyz_[fi_crd + mns3 + 3*i + 1];
+                 sys_xyz[fi_crd + mns3 + 3*i + 1];
           xyz_[inmon3 + m + fi_crd + nmon2] =
-                 sys_xyz_[fi_crd + mns3 + 3*i + 2];
+                 sys_xyz[fi_crd + mns3 + 3*i + 2];
           chg_[fi_sites + m + inmon] =
-                 sys_chg_[fi_sites + mns + i];
-          pol_sqrt_[inmon3 + m + fi_crd] = sqrt(pol_[fi_sites + mns + i]);
-          pol_sqrt_[inmon3 + m + fi_crd + nmon] = sqrt(pol_[fi_sites + mns + i]);
-          pol_sqrt_[inmon3 + m + fi_crd + nmon2] = sqrt(pol_[fi_sites + mns + i]);
+                 sys_chg[fi_sites + mns + i];
+          const double psqrt = sqrt(sys_pol[fi_sites + mns + i]);
+          pol_sqrt_[inmon3 + m + fi_crd] = psqrt;
+          pol_sqrt_[inmon3 + m + fi_crd + nmon] = psqrt;
+          pol_sqrt_[inmon3 + m + fi_crd + nmon2] = psqrt;
         }
       }
       fi_mon += nmon;
@@ -400,10 +444,259 @@ namespace elec {
     if (dip_method_ == "iter") CalculateDipolesIterative();
     else if (dip_method_ == "cg") CalculateDipolesCG();
     else if (dip_method_ == "aspc") CalculateDipolesAspc();
+    else if (dip_method_ == "iel") CalculateDipolesIel();
+    else if (dip_method_ == "diis") CalculateDipolesDiis();
+    else if (dip_method_ == "inv") CalculateDipolesInv();
+  }
+
+  double Electrostatics::DipoleTensorMemory(bool with_sp) {
+    // Memory (in MB) needed to store the full 3N x 3N tensor, and its 
+    // single precision copy if with_sp
+    size_t bytes = sizeof(double) + (with_sp ? sizeof(float) : 0);
+    return 9.0 * nsites_ * nsites_ * bytes / 1048576.0;
+  }
+
+  bool Electrostatics::UseDipoleTensor() {
+    // Only the double precision tensor counts: the single precision copy
+    // is left out when both do not fit
+    if (DipoleTensorMemory(false) > max_mem_dip_tensor_) return false;
+
+    if (!dip_tensor_ready_) BuildDipoleTensor();
+    return true;
+  }
+
+  bool Electrostatics::UseSinglePrecisionTensor() {
+    return mixed_precision_ && UseDipoleTensor() && !dip_tensor_sp_.empty();
+  }
+
+  void Electrostatics::BuildDipoleTensor() {
+    // Parallelization
+    size_t nthreads = 1;
+#   ifdef _OPENMP
+#     pragma omp parallel // omp_get_num_threads() needs to be inside 
+                          // parallel region to get number of threads
+      {
+        if (omp_get_thread_num() == 0)
+          nthreads = omp_get_num_threads();
+      }
+#   endif
+
+    size_t nsites3 = 3 * nsites_;
+    // Reuses the memory if the tensor was already allocated
+    dip_tensor_.assign(nsites3 * nsites3, 0.0);
+
+    // Sites on the same monomer
+    size_t fi_mon = 0;
+    size_t fi_sites = 0;
+    size_t fi_crd = 0;
+
+    double aDD = 0.055;
+
+    ElectroTensorShort elec_tensor(maxnmon_);
+
+    // Excluded sets
+    excluded_set_type exc12;
+    excluded_set_type exc13;
+    excluded_set_type exc14;
+
+    for (size_t mt = 0; mt < mon_type_count_.size(); mt++) {
+      size_t ns = sites_[fi_mon];
+      size_t nmon = mon_type_count_[mt].second;
+      size_t nmon3 = nmon * 3;
+      std::vector<double> ts2(3*nmon3);
+      std::vector<double> ts1(nmon3);
+      // Get excluded pairs for this monomer
+      systools::GetExcluded(mon_id_[fi_mon], exc12, exc13, exc14);
+      for (size_t i = 0; i < ns-1 ; i++) {
+        size_t inmon3 = 3 * i * nmon;
+        for (size_t j = i+1; j < ns; j++) {
+          size_t jnmon3 = 3 * j * nmon;
+          // Set the proper aDD
+          bool is12 = systools::IsExcluded(exc12, i, j);
+          bool is13 = systools::IsExcluded(exc13, i, j);
+          bool is14 = systools::IsExcluded(exc14, i, j);
+          aDD = systools::GetAdd(is12, is13, is14, mon_id_[fi_mon]);
+
+          double A = polfac_[fi_sites + i] * polfac_[fi_sites + j];
+          if (A > constants::EPS) {
+            A = std::pow(A, 1.0/6.0);
+            double Asqsq = A*A*A*A;
+            for (size_t m = 0; m < nmon; m++) {
+              elec_tensor.CalcT1AndT2WithPolfacNonZero(
+                        xyz_.data() + fi_crd, xyz_.data() + fi_crd, 
+                        m, m, m + 1, nmon, nmon, i, j, Asqsq, aDD, nsites_,
+                        ts1.data(), ts2.data());
+            }
+          } else {
+            for (size_t m = 0; m < nmon; m++) {
+              elec_tensor.CalcT1AndT2WithPolfacZero(
+                        xyz_.data() + fi_crd, xyz_.data() + fi_crd,
+                        m, m, m + 1, nmon, nmon, i, j, nsites_,
+                        ts1.data(), ts2.data());
+            }
+          }
+
+          // Store the 3x3 block of each monomer and its transpose
+          for (size_t a = 0; a < 3; a++) {
+            for (size_t b = 0; b < 3; b++) {
+              size_t ab = (3*a + b) * nmon;
+              for (size_t m = 0; m < nmon; m++) {
+                size_t row = fi_crd + inmon3 + a * nmon + m;
+                size_t col = fi_crd + jnmon3 + b * nmon + m;
+                dip_tensor_[row * nsites3 + col] = ts2[ab + m];
+                dip_tensor_[col * nsites3 + row] = ts2[ab + m];
+              }
+            }
+          }
+        }
+      }
+      // Update first indexes
+      fi_mon += nmon;
+      fi_sites += nmon * ns;
+      fi_crd += nmon * ns * 3;
+    }
+
+    size_t fi_mon1 = 0;
+    size_t fi_mon2 = 0;
+    size_t fi_sites1 = 0;
+    size_t fi_sites2 = 0;
+    size_t fi_crd1 = 0;
+    size_t fi_crd2 = 0;
+    // aDD intermolecular is always 0.055
+    aDD = 0.055;
+    for (size_t mt1 = 0; mt1 < mon_type_count_.size(); mt1++) {
+      size_t ns1 = sites_[fi_mon1];
+      size_t nmon1 = mon_type_count_[mt1].second;
+      fi_mon2 = fi_mon1;
+      fi_sites2 = fi_sites1;
+      fi_crd2 = fi_crd1;
+      for (size_t mt2 = mt1; mt2 < mon_type_count_.size(); mt2++) {
+        size_t ns2 = sites_[fi_mon2];
+        size_t nmon2 = mon_type_count_[mt2].second;
+        size_t nmon23 = nmon2 * 3;
+
+        bool same = (mt1 == mt2);
+        // Prepare for parallelization
+        std::vector<std::shared_ptr<ElectroTensorShort> > elec_tensor_pool;
+        std::vector<std::vector<double> > ts1_pool;
+        std::vector<std::vector<double> > ts2_pool;
+        for (size_t i = 0; i < nthreads; i++) { 
+           elec_tensor_pool.push_back(
+             std::make_shared<ElectroTensorShort>(maxnmon_));
+           ts1_pool.push_back(std::vector<double>(nmon23,0.0));
+           ts2_pool.push_back(std::vector<double>(3*nmon23,0.0));
+        }
+
+        // Each pair of monomers is visited only once (m2 > m1 if they are 
+        // of the same type), so every element of the tensor is written
+        // by a single thread.
+#       ifdef _OPENMP
+#         pragma omp parallel for schedule(dynamic) 
+#       endif
+        for (size_t m1 = 0; m1 < nmon1; m1++) {
+          int rank = 0;
+#         ifdef _OPENMP
+            rank = omp_get_thread_num();
+#         endif
+          std::shared_ptr<ElectroTensorShort> local_elec_tensor 
+            = elec_tensor_pool[rank];
+          double * ts1 = ts1_pool[rank].data();
+          double * ts2 = ts2_pool[rank].data();
+          size_t m2init = same ? m1 + 1 : 0;
+          for (size_t i = 0; i < ns1; i++) {
+            size_t inmon13 = 3 * i * nmon1;
+            for (size_t j = 0; j < ns2; j++) {
+              size_t jnmon23 = 3 * j * nmon2;
+              double A = polfac_[fi_sites1 + i] * polfac_[fi_sites2 + j];
+              if (A > constants::EPS) {
+                A = std::pow(A,1.0/6.0);
+                double Asqsq = A*A*A*A;
+                local_elec_tensor->CalcT1AndT2WithPolfacNonZero(
+                      xyz_.data() + fi_crd1, xyz_.data() + fi_crd2,
+                      m1, m2init, nmon2,
+                      nmon1, nmon2, i, j, Asqsq, aDD, nsites_,
+                      ts1, ts2);
+              } else {
+                local_elec_tensor->CalcT1AndT2WithPolfacZero(
+                      xyz_.data() + fi_crd1, xyz_.data() + fi_crd2,
+                      m1, m2init, nmon2, nmon1, nmon2, i, j, nsites_,
+                      ts1, ts2);
+              }
+
+              // Store the 3x3 blocks and their transpose
+              for (size_t a = 0; a < 3; a++) {
+                size_t row = fi_crd1 + inmon13 + a * nmon1 + m1;
+                for (size_t b = 0; b < 3; b++) {
+                  size_t ab = (3*a + b) * nmon2;
+                  for (size_t m2 = m2init; m2 < nmon2; m2++) {
+                    size_t col = fi_crd2 + jnmon23 + b * nmon2 + m2;
+                    dip_tensor_[row * nsites3 + col] = ts2[ab + m2];
+                    dip_tensor_[col * nsites3 + row] = ts2[ab + m2];
+                  }
+                }
+              }
+            }
+          }
+        }
+
+        // Update first indexes
+        fi_mon2 += nmon2;
+        fi_sites2 += nmon2 * ns2;
+        fi_crd2 += nmon2 * ns2 * 3;
+      }
+      // Update first indexes
+      fi_mon1 += nmon1;
+      fi_sites1 += nmon1 * ns1;
+      fi_crd1 += nmon1 * ns1 * 3;
+    }
+
+    dip_tensor_ready_ = true;
+    // The factor of the polarization matrix was done with the old tensor
+    inv_factor_ready_ = false;
+
+    // Single precision copy for the first iterations, if it fits together
+    // with the double precision tensor
+    if (mixed_precision_ && DipoleTensorMemory(true) <= max_mem_dip_tensor_) {
+      dip_tensor_sp_.assign(dip_tensor_.begin(), dip_tensor_.end());
+    } else {
+      std::vector<float>().swap(dip_tensor_sp_);
+    }
+  }
+
+  void Electrostatics::DipoleTensorTimesVector(const std::vector<double> &in_v,
+                                               std::vector<double> &out_v) {
+    if (use_sp_) {
+      MatrixTimesVector(dip_tensor_sp_, in_v, out_v);
+    } else {
+      MatrixTimesVector(dip_tensor_, in_v, out_v);
+    }
+  }
+
+  void Electrostatics::SetTensorMixedPrecision(bool mixed_precision, 
+                                               double tol_switch) {
+    mixed_precision_ = mixed_precision;
+    tol_mixed_ = tol_switch;
+    // The single precision tensor is built with the double one
+    dip_tensor_ready_ = false;
+    if (!mixed_precision_) std::vector<float>().swap(dip_tensor_sp_);
   }
 
   void Electrostatics::DipolesCGIteration(std::vector<double> &in_v, 
                                           std::vector<double> &out_v) {
+    // If the dipole tensor is stored, the product is a matrix-vector one
+    // out_v = (I - sqrt(pol) T sqrt(pol)) in_v
+    if (UseDipoleTensor()) {
+      size_t inv_size = in_v.size();
+      for (size_t i = 0; i < inv_size; i++) {
+        dip_tensor_tmp_[i] = pol_sqrt_[i] * in_v[i];
+      }
+      DipoleTensorTimesVector(dip_tensor_tmp_, out_v);
+      for (size_t i = 0; i < inv_size; i++) {
+        out_v[i] = in_v[i] - pol_sqrt_[i] * out_v[i];
+      }
+      return;
+    }
+
     // Parallelization
     size_t nthreads = 1;
 #   ifdef _OPENMP
@@ -828,77 +1121,127 @@ namespace elec {
       }
 #   endif
 
-    std::vector<double> ts2v(nsites3);
-    DipolesCGIteration(mu_,ts2v);
-    std::vector<double> rv(nsites3);
-    std::vector<double> pv(nsites3);
-    std::vector<double> r_new(nsites3);
+    // Time spent in the dipole field (T * p) and in the vector updates
+    auto t_start = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> t_field(0.0);
+    std::chrono::duration<double> t_vec(0.0);
+
+    // Residual r, search direction p and A * p. In place, no copies
+    std::vector<double> &ts2v = cg_ap_;
+    std::vector<double> &rv = cg_r_;
+    std::vector<double> &pv = cg_p_;
+    double * RESTRICT mu = mu_.data();
+    double * RESTRICT r = rv.data();
+    double * RESTRICT p = pv.data();
+    double * RESTRICT ap = ts2v.data();
+    const double * RESTRICT efq = Efq_.data();
+    const double * RESTRICT psqrt = pol_sqrt_.data();
+
+    // With mixed precision, the iterations start with the single precision
+    // tensor. Once converged to tol_mixed_, CG is restarted in double 
+    // precision from the true residual of the current dipoles.
+    use_sp_ = UseSinglePrecisionTensor();
 
-//#   ifdef _OPENMP
-//#     pragma omp parallel for schedule(static)
-//#   endif
-    for (size_t i = 0; i < nsites3; i++) {
-      pv[i] = Efq_[i]*pol_sqrt_[i] - ts2v[i];
-    }
-    for (size_t i = 0; i < nsites3; i++) {
-      rv[i] = pv[i];
-    }
-  
-#   ifdef DEBUG
-      for (size_t i = 0; i < nsites3; i++) {
-        std::cout << "ts2v[" << i << "] = " << ts2v[i] << std::endl;
-      }
-      for (size_t i = 0; i < nsites3; i++) {
-        std::cout << "rv[" << i << "] = " << rv[i] << std::endl;
-      }
-#   endif
-
-    // Start iterations
     size_t iter = 1;
-    double rvrv =  DotProduct(rv,rv);
+    double rvrv = 0.0;
     double residual = 0.0;
+    bool restart = true;
+    dip_residual_trace_.clear();
     while (true) {
 
 #     ifdef DEBUG
         std::cout << "Iteration: " << iter << std::endl;
 #     endif
 
-      DipolesCGIteration(pv,ts2v);
-      double pvts2pv = DotProduct(pv,ts2v);
-      if (rvrv < tolerance_) break;
-      double alphak = rvrv / pvts2pv;
-      residual = 0.0;
-      for (size_t i = 0; i < nsites3; i++) {
-        mu_[i] = mu_[i] + alphak * pv[i];
+      auto t1 = std::chrono::high_resolution_clock::now();
+      if (restart) {
+        DipolesCGIteration(mu_,ts2v);
+        auto t2 = std::chrono::high_resolution_clock::now();
+        t_field += t2 - t1;
+
+        // r = p = D Efq - A mu, and r.r in the same pass
+        rvrv = 0.0;
+#       ifdef _OPENMP
+#         pragma omp parallel for simd schedule(static) reduction(+:rvrv) \
+              if(nsites3 > MIN_SIZE_OMP_VECTOR)
+#       endif
+        for (size_t i = 0; i < nsites3; i++) {
+          const double ri = efq[i]*psqrt[i] - ap[i];
+          r[i] = ri;
+          p[i] = ri;
+          rvrv += ri * ri;
+        }
+        dip_residual_trace_.push_back(rvrv);
+        restart = false;
+        t_vec += std::chrono::high_resolution_clock::now() - t2;
+
+#       ifdef DEBUG
+          for (size_t i = 0; i < nsites3; i++) {
+            std::cout << "rv[" << i << "] = " << rv[i] << std::endl;
+          }
+#       endif
       }
-      for (size_t i = 0; i < nsites3; i++) {
-        r_new[i] = rv[i] - alphak*ts2v[i];
+
+      // Check if converged
+      if (use_sp_ && rvrv < std::max(tolerance_, tol_mixed_)) {
+        use_sp_ = false;
+        restart = true;
+        continue;
       }
-      for (size_t i = 0; i < nsites3; i++) {
-        residual += r_new[i] * r_new[i];
+      if (rvrv < tolerance_) break;
+
+      if (iter > maxit_) {
+        std::string text = "Max number of iterations reached ("
+                         + std::to_string(maxit_)
+                         + "). The induced dipoles did not converge.";
+        throw CUException(__func__, __FILE__, __LINE__, text);
       }
 
-      double rvrv_new = residual;
+      t1 = std::chrono::high_resolution_clock::now();
+      DipolesCGIteration(pv,ts2v);
+      auto t2 = std::chrono::high_resolution_clock::now();
+      t_field += t2 - t1;
 
-      // Check if converged
-      if (residual < tolerance_) break;
+      double pvts2pv = DotProduct(pv,ts2v);
+      double alphak = rvrv / pvts2pv;
 
-      if (iter > maxit_) {
-        // Exit with error
-        std::cerr << "Max number of iterations reached" << std::endl;
-        std::exit(EXIT_FAILURE);
+      // Fused update of the dipoles and the residual, and new r.r
+      residual = 0.0;
+#     ifdef _OPENMP
+#       pragma omp parallel for simd schedule(static) reduction(+:residual) \
+            if(nsites3 > MIN_SIZE_OMP_VECTOR)
+#     endif
+      for (size_t i = 0; i < nsites3; i++) {
+        mu[i] += alphak * p[i];
+        const double ri = r[i] - alphak * ap[i];
+        r[i] = ri;
+        residual += ri * ri;
       }
-      
-      // Prepare next iteration
-      double betak = rvrv_new / rvrv;
+      dip_residual_trace_.push_back(residual);
+
+      // New search direction
+      double betak = residual / rvrv;
+#     ifdef _OPENMP
+#       pragma omp parallel for simd schedule(static) \
+            if(nsites3 > MIN_SIZE_OMP_VECTOR)
+#     endif
       for (size_t i = 0; i < nsites3; i++) {
-        pv[i] = r_new[i] + betak * pv[i];
+        p[i] = r[i] + betak * p[i];
       }
-      rvrv = rvrv_new;
-      rv = r_new;
+      rvrv = residual;
       iter++;
+      t_vec += std::chrono::high_resolution_clock::now() - t2;
     }
 
+    std::chrono::duration<double> t_total = 
+        std::chrono::high_resolution_clock::now() - t_start;
+    cg_timings_[0] = t_total.count();
+    cg_timings_[1] = t_field.count();
+    cg_timings_[2] = t_vec.count();
+
+    dip_iter_ = iter;
+    dip_residual_ = rvrv;
+
     // Dipoles are computed
     // Need to recalculate dipole and Efd due to the multiplication of polsqrt
     for (size_t i = 0; i < nsites3; i++) {
@@ -913,9 +1256,18 @@ namespace elec {
 
   void Electrostatics::SetAspcParameters(size_t k) {
 
+    if (k > 4) {
+      std::string text = "ASPC order " + std::to_string(k) 
+                       + " is not available. Valid values are 0 to 4.";
+      throw CUException(__func__, __FILE__, __LINE__, text);
+    }
+
     k_aspc_ = k;
     b_consts_aspc_ = std::vector<double>(k+2,0.0);
-    mu_hist_ = std::vector<double>(mu_.size() * (k + 3),0.0);
+    // History is a ring buffer with the last k+2 dipoles
+    mu_hist_ = std::vector<double>(mu_.size() * (k + 2),0.0);
+    hist_num_aspc_ = 0;
+    hist_head_aspc_ = 0;
 
     if (k == 0) {
       b_consts_aspc_[0] = 2.0;
@@ -948,31 +1300,52 @@ namespace elec {
       b_consts_aspc_[5] = -1.0/42.0;
       omega_aspc_ = 6.0/11.0;
     } 
+  }
 
-    // TODO add exception if k < 0 or k > 4
+  void Electrostatics::SetAspcCorrector(size_t maxit, double tol) {
+    maxit_aspc_ = maxit;
+    tol_aspc_ = tol;
+  }
+
+  size_t Electrostatics::GetDipoleIterations() {
+    return dip_iter_;
+  }
 
+  double Electrostatics::GetDipoleResidual() {
+    return dip_residual_;
+  }
+
+  std::vector<double> Electrostatics::GetDipoleResidualTrace() {
+    return dip_residual_trace_;
+  }
+
+  std::vector<double> Electrostatics::GetCGTimings() {
+    return cg_timings_;
   }
 
   void Electrostatics::ResetAspcHistory() {
     hist_num_aspc_ = 0;
+    hist_head_aspc_ = 0;
   }
 
   void Electrostatics::CalculateDipolesAspc() {
-    if (hist_num_aspc_ < k_aspc_ + 2) {
+    size_t nsites3 = 3 * nsites_;
+    size_t nhist = k_aspc_ + 2;
+
+    if (hist_num_aspc_ < nhist) {
       // TODO do we want to allow iteration?
       CalculateDipolesCG();
-      std::copy(mu_.begin(), mu_.end(),
-                mu_hist_.begin() + hist_num_aspc_ * nsites_ * 3);
       hist_num_aspc_++;
     } else {
       // If we have enough history of the dipoles, 
       // we will use the predictor corrector step
       
       // First we get the predictor
+      // b_consts_aspc_[i] multiplies the dipoles of i steps before the last
       std::fill(mu_pred_.begin(), mu_pred_.end(), 0.0);
-      for (size_t i = 0; i < b_consts_aspc_.size(); i++) {
-        size_t shift = 3*nsites_ * (b_consts_aspc_.size() - i - 1);
-        for (size_t j = 0; j < 3*nsites_; j++) {
+      for (size_t i = 0; i < nhist; i++) {
+        size_t shift = nsites3 * ((hist_head_aspc_ + nhist - i - 1) % nhist);
+        for (size_t j = 0; j < nsites3; j++) {
           mu_pred_[j] += b_consts_aspc_[i] * mu_hist_[shift + j];
         }
       }
@@ -981,62 +1354,221 @@ namespace elec {
       // First we set the dipoles to the predictor
       std::copy(mu_pred_.begin(),mu_pred_.end(),mu_.begin());
 
-      // Now we run a single iteration to get the new Efd
+      // The corrector is applied until the change in the dipoles is 
+      // smaller than the tolerance, or the max number of corrections is 
+      // reached. Standard ASPC uses a single correction.
+      dip_iter_ = 0;
+      while (true) {
+        // Get the new Efd with the current dipoles
+        DipolesIterativeIteration();
+
+        // Now the Electric dipole field is computed, and we update 
+        // the dipoles to get the corrector, mixed with the current
+        // dipoles to get the final dipoles
+        dip_residual_ = 0.0;
+        size_t fi_mon = 0;
+        size_t fi_crd = 0;
+        size_t fi_sites = 0;
+        for (size_t mt = 0; mt < mon_type_count_.size(); mt++) {
+          size_t ns = sites_[fi_mon];
+          size_t nmon = mon_type_count_[mt].second;
+          size_t nmon3 = nmon*3;
+          for (size_t i = 0; i < ns; i++) {
+            // TODO assuming pol not site dependant
+            double p = pol_[fi_sites + i];
+            size_t inmon3 = 3*i*nmon;
+            for (size_t m = 0; m < nmon3; m++) {
+              size_t k = fi_crd + inmon3 + m;
+              double mu_corr = p * (Efq_[k] + Efd_[k]);
+              dip_residual_ += (mu_corr - mu_[k]) * (mu_corr - mu_[k]);
+              mu_[k] = omega_aspc_ * mu_corr + (1 - omega_aspc_) * mu_[k];
+            }
+          }
+          fi_mon += nmon;
+          fi_sites += nmon*ns;
+          fi_crd += nmon*ns*3;
+        }
+        dip_iter_++;
+
+        if (dip_residual_ < tol_aspc_ || dip_iter_ >= maxit_aspc_) break;
+      }
+    } // end if (hist_num_aspc_ < nhist) 
+
+    // And we update the history, overwriting the oldest dipoles
+    std::copy(mu_.begin(), mu_.end(), 
+              mu_hist_.begin() + hist_head_aspc_ * nsites3);
+    hist_head_aspc_ = (hist_head_aspc_ + 1) % nhist;
+  }
+
+  void Electrostatics::SetIelParameters(size_t k) {
+    // Coefficients for the dissipative propagation of the auxiliary
+    // dipoles, taken from Niklasson et al., J. Chem. Phys. 130, 214109 (2009)
+    // mu_aux(t+dt) = 2 mu_aux(t) - mu_aux(t-dt) + kappa (mu(t) - mu_aux(t))
+    //              + alpha sum_{i=0}^{k} c_i mu_aux(t - i dt)
+    if (k == 3) {
+      kappa_iel_ = 1.69;
+      alpha_iel_ = 150E-3;
+      c_iel_ = {-2.0, 3.0, 0.0, -1.0};
+    } else if (k == 4) {
+      kappa_iel_ = 1.75;
+      alpha_iel_ = 57E-3;
+      c_iel_ = {-3.0, 6.0, -2.0, -2.0, 1.0};
+    } else if (k == 5) {
+      kappa_iel_ = 1.82;
+      alpha_iel_ = 18E-3;
+      c_iel_ = {-6.0, 14.0, -8.0, -3.0, 4.0, -1.0};
+    } else if (k == 6) {
+      kappa_iel_ = 1.84;
+      alpha_iel_ = 5.5E-3;
+      c_iel_ = {-14.0, 36.0, -27.0, -2.0, 12.0, -6.0, 1.0};
+    } else if (k == 7) {
+      kappa_iel_ = 1.86;
+      alpha_iel_ = 1.6E-3;
+      c_iel_ = {-36.0, 99.0, -88.0, 11.0, 32.0, -25.0, 8.0, -1.0};
+    } else {
+      std::string text = "Extended Lagrangian dissipation order "
+                       + std::to_string(k) + " is not available. "
+                       + "Valid values are 3 to 7.";
+      throw CUException(__func__, __FILE__, __LINE__, text);
+    }
+
+    k_iel_ = k;
+    mu_iel_hist_ = std::vector<double>(mu_.size() * (k + 1), 0.0);
+    hist_num_iel_ = 0;
+    hist_head_iel_ = 0;
+  }
+
+  void Electrostatics::ResetIelHistory() {
+    hist_num_iel_ = 0;
+    hist_head_iel_ = 0;
+  }
+
+  std::vector<double> Electrostatics::GetIelHistory() {
+    std::vector<double> hist;
+    hist.reserve(3 + mu_iel_next_.size() + mu_iel_hist_.size());
+    hist.push_back(double(hist_num_iel_));
+    hist.push_back(double(k_iel_));
+    hist.push_back(double(hist_head_iel_));
+    hist.insert(hist.end(), mu_iel_next_.begin(), mu_iel_next_.end());
+    hist.insert(hist.end(), mu_iel_hist_.begin(), mu_iel_hist_.end());
+    return hist;
+  }
+
+  void Electrostatics::SetIelHistory(const std::vector<double> &hist) {
+    size_t nsites3 = 3 * nsites_;
+    if (hist.size() < 3) {
+      std::string text = "Extended Lagrangian history is empty.";
+      throw CUException(__func__, __FILE__, __LINE__, text);
+    }
+
+    size_t k = size_t(hist[1]);
+    if (hist.size() != 3 + nsites3 * (k + 2)) {
+      std::string text = "Size of the extended Lagrangian history ("
+                       + std::to_string(hist.size()) 
+                       + ") does not match the system. Expected "
+                       + std::to_string(3 + nsites3 * (k + 2)) + ".";
+      throw CUException(__func__, __FILE__, __LINE__, text);
+    }
+
+    size_t hist_num = size_t(hist[0]);
+    size_t hist_head = size_t(hist[2]);
+    if (hist_num > k + 1 || hist_head > k) {
+      std::string text = "Extended Lagrangian history is corrupted. It has "
+                       + std::to_string(hist_num) + " steps for a maximum of "
+                       + std::to_string(k + 1) + ".";
+      throw CUException(__func__, __FILE__, __LINE__, text);
+    }
+
+    SetIelParameters(k);
+    std::copy(hist.begin() + 3, hist.begin() + 3 + nsites3, 
+              mu_iel_next_.begin());
+    std::copy(hist.begin() + 3 + nsites3, hist.end(), mu_iel_hist_.begin());
+    hist_num_iel_ = hist_num;
+    hist_head_iel_ = hist_head;
+  }
+
+  void Electrostatics::CalculateDipolesIel() {
+    // Inertial extended Lagrangian with no SCF iterations (iEL/0-SCF).
+    // The auxiliary dipoles are propagated with the nuclei, and the induced
+    // dipoles are obtained from them with a single field evaluation.
+    // Albaugh et al., J. Chem. Theory Comput. 12, 5443 (2016)
+    size_t nsites3 = 3 * nsites_;
+
+    if (hist_num_iel_ < k_iel_ + 1) {
+      // Not enough history yet. The dipoles are converged and used
+      // as auxiliary dipoles
+      CalculateDipolesCG();
+      std::copy(mu_.begin(), mu_.end(), mu_iel_next_.begin());
+    } else {
+      // Induced dipoles from the auxiliary ones: mu = pol * (Efq + T mu_aux)
+      std::copy(mu_iel_next_.begin(), mu_iel_next_.end(), mu_.begin());
       DipolesIterativeIteration();
+      dip_iter_ = 1;
+      dip_residual_ = 0.0;
 
-      // Now the Electric dipole field is computed, and we update 
-      // the dipoles to get the corrector 
       size_t fi_mon = 0;
       size_t fi_crd = 0;
       size_t fi_sites = 0;
-
       for (size_t mt = 0; mt < mon_type_count_.size(); mt++) {
         size_t ns = sites_[fi_mon];
         size_t nmon = mon_type_count_[mt].second;
-        size_t nmon2 = nmon*2;
+        size_t nmon3 = nmon*3;
         for (size_t i = 0; i < ns; i++) {
-          // TODO assuming pol not site dependant
           double p = pol_[fi_sites + i];
           size_t inmon3 = 3*i*nmon;
-          for (size_t m = 0; m < nmon; m++) {
-            mu_[fi_crd + inmon3 + m] = p
-                       * (Efq_[fi_crd + inmon3 + m]
-                       +  Efd_[fi_crd + inmon3 + m]);
-            mu_[fi_crd + inmon3 + nmon + m] = p
-                       * (Efq_[fi_crd + inmon3 + nmon + m]
-                       +  Efd_[fi_crd + inmon3 + nmon + m]);
-            mu_[fi_crd + inmon3 + nmon2 + m] = p
-                       * (Efq_[fi_crd + inmon3 + nmon2 + m]
-                       +  Efd_[fi_crd + inmon3 + nmon2 + m]);
+          for (size_t m = 0; m < nmon3; m++) {
+            size_t k = fi_crd + inmon3 + m;
+            mu_[k] = p * (Efq_[k] + Efd_[k]);
+            dip_residual_ += (mu_[k] - mu_iel_next_[k]) 
+                           * (mu_[k] - mu_iel_next_[k]);
           }
         }
         fi_mon += nmon;
         fi_sites += nmon*ns;
         fi_crd += nmon*ns*3;
       }
+    }
 
-      // Now we have the corrector in mu_
-      // We get the final dipole
-
-      for (size_t j = 0; j < 3*nsites_; j++) {
-        mu_[j] = omega_aspc_*mu_[j] + (1 - omega_aspc_) * mu_pred_[j];
+    // Add the auxiliary dipoles of this step to the history, 
+    // overwriting the oldest ones
+    size_t nhist = k_iel_ + 1;
+    std::copy(mu_iel_next_.begin(), mu_iel_next_.end(),
+              mu_iel_hist_.begin() + hist_head_iel_ * nsites3);
+    hist_head_iel_ = (hist_head_iel_ + 1) % nhist;
+    if (hist_num_iel_ < nhist) hist_num_iel_++;
+
+    // If the history is complete, propagate the auxiliary dipoles
+    // Auxiliary dipoles of i steps before are in (head - 1 - i) % nhist
+    if (hist_num_iel_ == nhist) {
+      double * mu_t = mu_iel_hist_.data() 
+                    + nsites3 * ((hist_head_iel_ + nhist - 1) % nhist);
+      double * mu_tm1 = mu_iel_hist_.data() 
+                      + nsites3 * ((hist_head_iel_ + nhist - 2) % nhist);
+      for (size_t j = 0; j < nsites3; j++) {
+        mu_iel_next_[j] = 2.0 * mu_t[j] - mu_tm1[j]
+                        + kappa_iel_ * (mu_[j] - mu_t[j]);
       }
-
-      // And we update the history
-
-      // Add the new dipole at the end
-      std::copy(mu_.begin(), mu_.end(),
-                mu_hist_.begin() + hist_num_aspc_ * nsites_ * 3);
-      // Shift the dipoles one position in the history
-      std::copy(mu_hist_.begin() + nsites_ * 3, mu_hist_.end(),
-                mu_hist_.begin());
-
-      // hist_num_aspc_ must not be touched here, so we are done
-
-    } // end if (hist_num_aspc_ < k_aspc_ + 2) 
+      for (size_t i = 0; i < c_iel_.size(); i++) {
+        double ac = alpha_iel_ * c_iel_[i];
+        double * mu_tmi = mu_iel_hist_.data() 
+                        + nsites3 * ((hist_head_iel_ + nhist - 1 - i) % nhist);
+        for (size_t j = 0; j < nsites3; j++) {
+          mu_iel_next_[j] += ac * mu_tmi[j];
+        }
+      }
+    }
   }
 
   void Electrostatics::DipolesIterativeIteration() {
+    // If the dipole tensor is stored, Efd = T mu. For a single iteration
+    // (ASPC corrector) it is not worth to build it, so it will be used
+    // only if it is already available or if we iterate.
+    if ((dip_tensor_ready_ || dip_method_ == "iter" || dip_method_ == "diis")
+        && UseDipoleTensor()) {
+      DipoleTensorTimesVector(mu_, Efd_);
+      return;
+    }
+
     // Parallelization
     size_t nthreads = 1;
 #   ifdef _OPENMP
@@ -1235,6 +1767,10 @@ namespace elec {
     double eps = 1.0E+50;
     std::vector<double> mu_old(3*nsites_,0.0);
     size_t iter = 0;
+    dip_residual_trace_.clear();
+    // With mixed precision, iterate with the single precision tensor
+    // until the change is below tol_mixed_, then continue in double
+    use_sp_ = UseSinglePrecisionTensor();
 
     while (true) {
 
@@ -1295,22 +1831,32 @@ namespace elec {
         fi_crd += nmon*ns*3;
       }
 
+      dip_iter_ = iter;
+      dip_residual_ = max_eps;
+      dip_residual_trace_.push_back(max_eps);
+
       // Check if convergence achieved
-      if (max_eps < tolerance_) 
+      bool switch_dp = use_sp_ && max_eps < std::max(tolerance_, tol_mixed_);
+      if (switch_dp) {
+        use_sp_ = false;
+      } else if (max_eps < tolerance_) {
         break;
+      }
       // Check if epsilon is increasing
       if (max_eps > eps && iter > 10) {
-        // Exit with error
-        std::cerr << "Dipoles diverged" << std::endl;
-        std::exit(EXIT_FAILURE);
+        std::string text = "Dipoles diverged after "
+                         + std::to_string(iter) + " iterations.";
+        throw CUException(__func__, __FILE__, __LINE__, text);
       } 
-      eps = max_eps;
+      // The change of precision can increase the next epsilon
+      eps = switch_dp ? 1.0E+50 : max_eps;
 
       // If not, check iter number
       if (iter > maxit_) {
-        // Exit with error
-        std::cerr << "Max number of iterations reached" << std::endl;
-        std::exit(EXIT_FAILURE);
+        std::string text = "Max number of iterations reached ("
+                         + std::to_string(maxit_)
+                         + "). The induced dipoles did not converge.";
+        throw CUException(__func__, __FILE__, __LINE__, text);
       }
       iter++;
       
@@ -1319,6 +1865,199 @@ namespace elec {
     }
   }
 
+  void Electrostatics::SetDiisSize(size_t n) {
+    if (n == 0) {
+      std::string text = "The DIIS subspace needs at least one vector";
+      throw CUException(__func__, __FILE__, __LINE__, text);
+    }
+    n_diis_ = n;
+    mu_diis_hist_ = std::vector<double>(n_diis_ * 3 * nsites_, 0.0);
+    res_diis_hist_ = std::vector<double>(n_diis_ * 3 * nsites_, 0.0);
+  }
+
+  void Electrostatics::CalculateDipolesDiis() {
+    // Fixed point iteration mu = G(mu) = pol * (Efq + T mu), accelerated
+    // with DIIS (Pulay mixing). The new dipoles are the combination of the
+    // last n_diis_ G(mu_i) that minimizes the norm of the combined
+    // residuals f_i = G(mu_i) - mu_i, subject to sum c_i = 1.
+    size_t nsites3 = nsites_*3;
+
+    // Initial guess from the permanent field
+    for (size_t i = 0; i < nsites3; i++) {
+      mu_[i] = pol_sqrt_[i] * pol_sqrt_[i] * Efq_[i];
+    }
+
+    std::vector<double> B;
+    std::vector<double> c;
+    // Iterations are counted from 1, as in CG
+    size_t iter = 1;
+    dip_residual_trace_.clear();
+    // With mixed precision, iterate with the single precision tensor
+    // until the residual is below tol_mixed_, then continue in double.
+    // The subspace is restarted at iteration iter0 when switching
+    use_sp_ = UseSinglePrecisionTensor();
+    size_t iter0 = 1;
+
+    while (true) {
+      DipolesIterativeIteration();
+
+      // Store the dipoles and the residual in the ring buffer
+      size_t slot = iter % n_diis_;
+      double * mu_i = mu_diis_hist_.data() + slot * nsites3;
+      double * res_i = res_diis_hist_.data() + slot * nsites3;
+      for (size_t i = 0; i < nsites3; i++) {
+        mu_i[i] = mu_[i];
+        res_i[i] = pol_sqrt_[i] * pol_sqrt_[i] * (Efq_[i] + Efd_[i]) 
+                 - mu_[i];
+      }
+
+      // Maximum residual of a site
+      double max_eps = 0.0;
+      size_t fi_mon = 0;
+      size_t fi_crd = 0;
+      for (size_t mt = 0; mt < mon_type_count_.size(); mt++) {
+        size_t ns = sites_[fi_mon];
+        size_t nmon = mon_type_count_[mt].second;
+        size_t nmon2 = nmon*2;
+        for (size_t i = 0; i < ns; i++) {
+          size_t inmon3 = 3*i*nmon;
+          for (size_t m = 0; m < nmon; m++) {
+            double tmpeps = res_i[fi_crd + inmon3 + m]
+                          * res_i[fi_crd + inmon3 + m]
+                          + res_i[fi_crd + inmon3 + nmon + m]
+                          * res_i[fi_crd + inmon3 + nmon + m]
+                          + res_i[fi_crd + inmon3 + nmon2 + m]
+                          * res_i[fi_crd + inmon3 + nmon2 + m];
+            if (tmpeps > max_eps) max_eps = tmpeps;
+          }
+        }
+        fi_mon += nmon;
+        fi_crd += nmon*ns*3;
+      }
+
+      dip_iter_ = iter;
+      dip_residual_ = max_eps;
+      dip_residual_trace_.push_back(max_eps);
+
+      // Check if convergence achieved
+      if (use_sp_ && max_eps < std::max(tolerance_, tol_mixed_)) {
+        use_sp_ = false;
+        iter0 = iter + 1;
+        iter++;
+        continue;
+      }
+      if (max_eps < tolerance_) break;
+
+      if (iter > maxit_) {
+        std::string text = "Max number of iterations reached ("
+                         + std::to_string(maxit_)
+                         + "). The induced dipoles did not converge.";
+        throw CUException(__func__, __FILE__, __LINE__, text);
+      }
+
+      // Solve the DIIS equations
+      // | B  -1 | | c      |   |  0 |
+      // | -1  0 | | lambda | = | -1 |
+      // with B_ij = f_i . f_j. If B is singular or nearly singular
+      // (nearly dependent residuals), the oldest vectors are dropped
+      // from the subspace
+      size_t nvec = std::min(iter - iter0 + 1, n_diis_);
+      bool solved = false;
+      while (!solved) {
+        size_t n = nvec + 1;
+        B.assign(n*n, 0.0);
+        c.assign(n, 0.0);
+        double bmax = 0.0;
+        for (size_t i = 0; i < nvec; i++) {
+          double * res_a = res_diis_hist_.data() 
+                         + ((iter + n_diis_ - i) % n_diis_) * nsites3;
+          for (size_t j = 0; j <= i; j++) {
+            double * res_b = res_diis_hist_.data()
+                           + ((iter + n_diis_ - j) % n_diis_) * nsites3;
+            double bij = 0.0;
+            for (size_t k = 0; k < nsites3; k++) bij += res_a[k] * res_b[k];
+            B[i*n + j] = bij;
+            B[j*n + i] = bij;
+          }
+          bmax = std::max(bmax, B[i*n + i]);
+        }
+        // Scale B to avoid ill-conditioning when the residuals are small
+        for (size_t i = 0; i < nvec; i++) {
+          for (size_t j = 0; j < nvec; j++) B[i*n + j] /= bmax;
+          B[i*n + nvec] = -1.0;
+          B[nvec*n + i] = -1.0;
+        }
+        c[nvec] = -1.0;
+
+        solved = SolveLinearSystem(B, c, n);
+        if (!solved) nvec--;
+      }
+
+      // New dipoles as the combination of G(mu_i) = mu_i + f_i
+      std::fill(mu_.begin(), mu_.end(), 0.0);
+      for (size_t j = 0; j < nvec; j++) {
+        size_t slot_j = (iter + n_diis_ - j) % n_diis_;
+        double * mu_j = mu_diis_hist_.data() + slot_j * nsites3;
+        double * res_j = res_diis_hist_.data() + slot_j * nsites3;
+        for (size_t i = 0; i < nsites3; i++) {
+          mu_[i] += c[j] * (mu_j[i] + res_j[i]);
+        }
+      }
+
+      iter++;
+    }
+  }
+
+  void Electrostatics::CalculateDipolesInv() {
+    size_t nsites3 = nsites_*3;
+
+    // Large systems, or systems whose dipole tensor does not fit in memory,
+    // are solved iteratively
+    if (nsites3 > max_size_inv_ || !UseDipoleTensor()) {
+      CalculateDipolesCG();
+      return;
+    }
+
+    // Factorize (I - D T D) = L L^T, with D = diag(sqrt(pol)).
+    // The factor is kept until the tensor is rebuilt
+    if (!inv_factor_ready_) {
+      inv_factor_.resize(nsites3 * nsites3);
+#     ifdef _OPENMP
+#       pragma omp parallel for schedule(static)
+#     endif
+      for (size_t i = 0; i < nsites3; i++) {
+        double * fi = inv_factor_.data() + i * nsites3;
+        const double * ti = dip_tensor_.data() + i * nsites3;
+        for (size_t j = 0; j <= i; j++) {
+          fi[j] = -pol_sqrt_[i] * ti[j] * pol_sqrt_[j];
+        }
+        fi[i] += 1.0;
+      }
+
+      if (!CholeskyDecomposition(inv_factor_, nsites3)) {
+        std::string text = "Polarization matrix is not positive definite.";
+        throw CUException(__func__, __FILE__, __LINE__, text);
+      }
+      inv_factor_ready_ = true;
+    }
+
+    // Solve (I - D T D) x = D Efq, and mu = D x
+    for (size_t i = 0; i < nsites3; i++) {
+      mu_[i] = pol_sqrt_[i] * Efq_[i];
+    }
+    CholeskySolve(inv_factor_, mu_, nsites3);
+    for (size_t i = 0; i < nsites3; i++) {
+      mu_[i] *= pol_sqrt_[i];
+    }
+
+    // Dipole field consistent with the final dipoles
+    MatrixTimesVector(dip_tensor_, mu_, Efd_);
+
+    dip_iter_ = 0;
+    dip_residual_ = 0.0;
+    dip_residual_trace_.clear();
+  }
+
   void Electrostatics::CalculateElecEnergy() {
     Eperm_ = 0.0;
     for (size_t i = 0; i < nsites_; i++)
@@ -1338,7 +2077,7 @@ namespace elec {
 
   void Electrostatics::CalculateGradients(std::vector<double> &grad) {
     // Reset grad
-    grad_ = std::vector<double>(3*nsites_,0.0);
+    std::fill(grad_.begin(), grad_.end(), 0.0);
     
     // Max number of monomers
     size_t maxnmon = mon_type_count_.back().second;
@@ -1579,10 +2318,6 @@ namespace elec {
 ////////////////////////////////////////////////////////////////////////////////
 
     // Reorganize field and potential to initial order
-    std::vector<double> tmp1(nsites3,0.0);
-    std::vector<double> tmp2(nsites_,0.0);
-    std::vector<double> tmp3(nsites3,0.0);
-    std::vector<double> tmp4(nsites3,0.0);
     fi_mon = 0;
     fi_crd = 0;
     fi_sites = 0;
@@ -6,6 +6,7 @@
 #include <string>
 #include <cmath>
 #include <memory>
+#include <algorithm>
 
 #ifdef _OPENMP
 # include <omp.h>
@@ -15,6 +16,7 @@
 #include "tools/definitions.h"
 #include "tools/constants.h"
 #include "tools/math_tools.h"
+#include "tools/macros.h"
 #include "potential/electrostatics/gammq.h"
 #include "potential/electrostatics/fields.h"
 #include "potential/electrostatics/electrostatic_tensors.h"
@@ -44,13 +46,57 @@ namespace elec {
       double GetElectrostatics(std::vector<double> &grad);
 
       void ResetAspcHistory();
-      void SetXyzChgPolPolfac(std::vector<double> &xyz,
-                              std::vector<double> &chg,
-                              std::vector<double> &chggrad,
-                              std::vector<double> &pol,
-                              std::vector<double> &polfac,
-                              std::string dip_method,
+      // Sets the order k of the ASPC predictor (0 to 4)
+      void SetAspcParameters(size_t k);
+      // Sets the maximum number of corrector steps of ASPC, and the 
+      // tolerance in the dipole change that stops the corrector
+      void SetAspcCorrector(size_t maxit, double tol);
+      // Number of iterations of the last dipole calculation
+      size_t GetDipoleIterations();
+      // Residual of the last dipole calculation
+      double GetDipoleResidual();
+      // Residual at each iteration of the last dipole calculation
+      // (iter, cg and diis methods)
+      std::vector<double> GetDipoleResidualTrace();
+      // Wall time (s) of the last CG solve: {total, dipole field, vector
+      // updates}
+      std::vector<double> GetCGTimings();
+      // Sets the number of previous dipoles used in the DIIS extrapolation
+      void SetDiisSize(size_t n);
+      void ResetIelHistory();
+      // Returns the state of the auxiliary dipoles of the extended
+      // Lagrangian method, to be able to restart a simulation.
+      // The format is {hist_num, k, hist_head, mu_next, mu_hist}
+      std::vector<double> GetIelHistory();
+      // Sets the state of the auxiliary dipoles of the extended Lagrangian
+      // (as returned by GetIelHistory)
+      void SetIelHistory(const std::vector<double> &hist);
+      // Sets the coordinates, charges and polarizabilities of a new 
+      // configuration, in the system order. They are written directly
+      // in the internal layout, and the buffers are reused, so no 
+      // memory is allocated.
+      void SetXyzChgPolPolfac(const std::vector<double> &xyz,
+                              const std::vector<double> &chg,
+                              const std::vector<double> &chggrad,
+                              const std::vector<double> &pol,
+                              const std::vector<double> &polfac,
+                              const std::string &dip_method,
                               bool do_grads);
+      // Sets the maximum memory (in MB) that can be used to store the
+      // dipole-dipole interaction tensor. If the tensor does not fit,
+      // it will be computed on the fly in every iteration.
+      void SetDipoleTensorMaxMemory(double max_mem);
+      // Sets the maximum number of dipole components (3 * number of sites)
+      // for which the inv method solves the dipoles directly. Larger 
+      // systems are solved with CG.
+      void SetDipoleInvMaxSize(size_t max_size);
+      // Enables the single precision copy of the stored dipole tensor. 
+      // When the dipole tensor is stored, the iterations of cg, iter and
+      // diis use the copy (accumulating in double) until the residual is
+      // below tol_switch, and then continue in double precision. The 
+      // tensor computed on the fly is always in double precision. The copy
+      // is only made if it fits in the memory limit with the tensor.
+      void SetTensorMixedPrecision(bool mixed_precision, double tol_switch);
 
     private:
       void CalculatePermanentElecField();
@@ -60,17 +106,30 @@ namespace elec {
       void DipolesCGIteration(std::vector<double> &in_v,
                               std::vector<double> &out_v);
       void CalculateDipolesAspc();
-      void SetAspcParameters(size_t k);
+      // Memory (in MB) of the stored tensor, with its single precision copy
+      // if with_sp
+      double DipoleTensorMemory(bool with_sp);
+      bool UseDipoleTensor();
+      // True if the tensor is stored and has a single precision copy
+      bool UseSinglePrecisionTensor();
+      void BuildDipoleTensor();
+      // out_v = T in_v with the stored tensor, in single or double precision
+      void DipoleTensorTimesVector(const std::vector<double> &in_v,
+                                   std::vector<double> &out_v);
+      void CalculateDipolesIel();
+      void SetIelParameters(size_t k);
+      void CalculateDipolesDiis();
+      void CalculateDipolesInv();
       void CalculateDipoles();
       void CalculateElecEnergy();
       void CalculateGradients(std::vector<double> &grad);
 
-      void ReorderData();
+      void ReorderData(const std::vector<double> &sys_xyz,
+                       const std::vector<double> &sys_chg,
+                       const std::vector<double> &sys_pol);
 
       // Charges of each site. Order has to follow mon_type_count.
       std::vector<double> chg_;
-      // Charges of each site. Order has to follow mon_type_count.
-      std::vector<double> sys_chg_;
       // Gradients due to site dependent charges
       std::vector<double> sys_chg_grad_;
       // Polfacs of each site. For now assuming not site dependent.
@@ -79,8 +138,6 @@ namespace elec {
       std::vector<double> pol_sqrt_;
       // Polarizabilities of each site. For now assuming not site dependent.
       std::vector<double> pol_;
-      // System xyz, not ordered XYZ. xyzxyz...(mon1)xyzxyz...(mon2) ...
-      std::vector<double> sys_xyz_;
       // System xyz, ordered XYZ. xx..yy..zz(mon1) xx..yy..zz(mon2) ...
       std::vector<double> xyz_;
       // Name of the monomers (h2o, f...)
@@ -99,9 +156,6 @@ namespace elec {
       size_t maxit_;
       // Bool that if true will perform the gradients calculation.
       bool do_grads_;
-      // Gradients in the original order (same as xyz). This is the vector in
-      // which the electrostatics gradients will be added.
-      std::vector<double> sys_grad_;
       // Gradients
       std::vector<double> grad_;
       // Electric potential on each site with sys order
@@ -120,7 +174,7 @@ namespace elec {
       std::vector<double> sys_mu_;
       // Dipoles
       std::vector<double> mu_;
-      // Dipole history for ASPC
+      // Dipole history for ASPC. Ring buffer with the last k+2 dipoles
       std::vector<double> mu_hist_;
       // Dipole predictor
       std::vector<double> mu_pred_;
@@ -130,8 +184,44 @@ namespace elec {
       double omega_aspc_;
       // Number of history steps stored
       size_t hist_num_aspc_;
+      // Position in mu_hist_ where the next dipoles will be stored
+      size_t hist_head_aspc_;
       // Order of ASPC
       size_t k_aspc_; 
+      // Maximum number of corrector steps in ASPC
+      size_t maxit_aspc_;
+      // Tolerance in the dipole change to stop the ASPC corrector
+      double tol_aspc_;
+      // Number of iterations in the last dipole calculation
+      size_t dip_iter_;
+      // Residual in the last dipole calculation
+      double dip_residual_;
+      // Residual at each iteration of the last dipole calculation
+      std::vector<double> dip_residual_trace_;
+      // Residual, search direction and matrix times search direction of CG
+      std::vector<double> cg_r_, cg_p_, cg_ap_;
+      // Timings of the last CG solve (see GetCGTimings)
+      std::vector<double> cg_timings_;
+      // Number of dipole vectors kept in the DIIS subspace
+      size_t n_diis_;
+      // Dipoles and residuals of the DIIS subspace. Ring buffer
+      std::vector<double> mu_diis_hist_;
+      std::vector<double> res_diis_hist_;
+      // Auxiliary dipoles of the extended Lagrangian for the k+1 last steps.
+      // Ring buffer
+      std::vector<double> mu_iel_hist_;
+      // Auxiliary dipoles propagated to the next step
+      std::vector<double> mu_iel_next_;
+      // Dissipation coefficients c_k of the extended Lagrangian
+      std::vector<double> c_iel_;
+      // Coupling (kappa = dt^2 w^2) and dissipation strength (alpha)
+      double kappa_iel_, alpha_iel_;
+      // Number of steps stored in the extended Lagrangian history
+      size_t hist_num_iel_;
+      // Position in mu_iel_hist_ where the next dipoles will be stored
+      size_t hist_head_iel_;
+      // Dissipation order of the extended Lagrangian
+      size_t k_iel_;
       // Total number of electrostatic sites
       size_t nsites_;
       // Thole dampings
@@ -149,6 +239,30 @@ namespace elec {
       double Eind_;
       // Method for dipoles (ITERative, Conjugate Gradient, ASPC, INVersion)
       std::string dip_method_;
+      // Dipole-dipole interaction tensor T (3N x 3N) in the internal order,
+      // such that Efd = T * mu. Only stored if it fits in max_mem_dip_tensor_
+      std::vector<double> dip_tensor_;
+      // True if dip_tensor_ corresponds to the current coordinates
+      bool dip_tensor_ready_;
+      // Maximum memory (in MB) allowed to store the dipole tensor
+      double max_mem_dip_tensor_;
+      // Auxiliary vector for the matrix-vector products with dip_tensor_
+      std::vector<double> dip_tensor_tmp_;
+      // Single precision copy of dip_tensor_, for mixed precision
+      std::vector<float> dip_tensor_sp_;
+      // True if the single precision copy of the tensor is used
+      bool mixed_precision_;
+      // Residual at which the mixed precision solvers switch to double
+      double tol_mixed_;
+      // True while the solvers are using the single precision tensor
+      bool use_sp_;
+      // Cholesky factor of the polarization matrix I - D T D, with 
+      // D = diag(sqrt(pol)). Lower triangle, stored by rows
+      std::vector<double> inv_factor_;
+      // True if inv_factor_ corresponds to the current dip_tensor_
+      bool inv_factor_ready_;
+      // Maximum size (3 * nsites) to use the direct solver in inv
+      size_t max_size_inv_;
   };
 
 ////////////////////////////////////////////////////////////////////////////////
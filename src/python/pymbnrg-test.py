@@ -0,0 +1,88 @@
+#!/usr/bin/env python
+# Checks the Python module against the C++ systems: gradients in a caller
+# buffer, finite differences of the energy, and batch evaluation
+
+import sys
+import numpy as np
+import pymbnrg
+
+# Maximum error of the gradients against finite differences (kcal/mol/A)
+MAX_FD_ERR = 1E-04
+FD_STEP = 1E-05
+
+exit_code = 0
+
+# Chloride and two waters
+xyz = np.array([[-1.58972425,  1.04337922, -0.08780840],
+                [-0.63591971,  0.97898520,  0.00000000],
+                [-1.90066280,  1.74501050, -0.66454990],
+                [ 1.0,         0.5,         3.0       ],
+                [ 1.64924507,  1.08594656,  0.00000000],
+                [ 2.60878026,  1.09587704, -0.02817115],
+                [ 1.33830653,  1.78757784,  0.57674150]])
+sys_ = pymbnrg.System()
+sys_.AddMonomer(xyz[0:3], ["O", "H", "H"], "h2o")
+sys_.AddMonomer(xyz[3:4], ["Cl"], "cl")
+sys_.AddMonomer(xyz[4:7], ["O", "H", "H"], "h2o")
+for i in range(3):
+    sys_.AddMolecule([i])
+sys_.Initialize()
+sys_.SetDipoleMethod("cg")
+
+# Gradients in a caller buffer
+e = sys_.Energy(True)
+grad = np.zeros(3 * sys_.GetNumRealSites())
+sys_.GetRealGrads(grad)
+if not np.array_equal(grad.reshape(-1, 3), sys_.GetRealGrads()):
+    sys.stderr.write(" ** Error ** : gradients in the buffer differ\n")
+    exit_code = 1
+
+# Finite differences, with the coordinates set from an array
+for i in range(xyz.size):
+    e_fd = []
+    for h in (FD_STEP, -FD_STEP):
+        x = xyz.copy()
+        x.flat[i] += h
+        sys_.SetRealXyz(x)
+        e_fd.append(sys_.Energy(False))
+    g_fd = (e_fd[0] - e_fd[1]) / (2 * FD_STEP)
+    if abs(g_fd - grad[i]) > MAX_FD_ERR:
+        sys.stderr.write(" ** Error ** : gradient %d is %f, finite "
+                         "difference is %f\n" % (i, grad[i], g_fd))
+        exit_code = 1
+sys_.SetRealXyz(xyz)
+
+# Batch evaluation of displaced copies
+rng = np.random.RandomState(3)
+systems = []
+for n in range(8):
+    s = pymbnrg.System()
+    x = xyz + 0.02 * rng.uniform(-1, 1, xyz.shape)
+    s.AddMonomer(x[0:3], ["O", "H", "H"], "h2o")
+    s.AddMonomer(x[3:4], ["Cl"], "cl")
+    s.AddMonomer(x[4:7], ["O", "H", "H"], "h2o")
+    for i in range(3):
+        s.AddMolecule([i])
+    s.Initialize()
+    s.SetDipoleMethod("cg")
+    systems.append(s)
+energies = pymbnrg.Energies(systems, True)
+for s, e_batch in zip(systems, energies):
+    if abs(s.Energy(True) - e_batch) > 1E-10:
+        sys.stderr.write(" ** Error ** : batch energy %f differs from %f\n"
+                         % (e_batch, s.Energy(True)))
+        exit_code = 1
+
+# A system twice in the batch would be evaluated by two threads at once
+try:
+    pymbnrg.Energies([systems[0], systems[1], systems[0]])
+    sys.stderr.write(" ** Error ** : repeated system in the batch was "
+                     "accepted\n")
+    exit_code = 1
+except ValueError:
+    pass
+
+if exit_code == 0:
+    print("All tests passed!")
+
+sys.exit(exit_code)
@@ -0,0 +1,179 @@
+#include <string>
+#include <vector>
+#include <set>
+#include <stdexcept>
+#include <exception>
+
+#include <pybind11/pybind11.h>
+#include <pybind11/numpy.h>
+#include <pybind11/stl.h>
+
+#include "bblock/system.h"
+#include "io_tools/read_nrg.h"
+
+namespace py = pybind11;
+
+////////////////////////////////////////////////////////////////////////////////
+
+namespace {
+
+// Input arrays: used in place if they are C contiguous doubles, converted
+// otherwise
+typedef py::array_t<double, py::array::c_style | py::array::forcecast>
+        InArray;
+// Output arrays: must be C contiguous doubles, they are never converted
+typedef py::array_t<double, py::array::c_style> OutArray;
+
+// Checks that array a, of argument name, has n elements
+void CheckSize(const py::array &a, size_t n, const char* name) {
+  if (size_t(a.size()) != n) {
+    throw std::invalid_argument(std::string(name) + " has "
+                                + std::to_string(a.size())
+                                + " elements instead of "
+                                + std::to_string(n));
+  }
+}
+
+// Coordinates of the real sites of sys, in input order
+void SetRealXyz(bblock::System &sys, InArray xyz) {
+  CheckSize(xyz, 3 * sys.GetNumRealSites(), "xyz");
+  sys.SetRealXyz(xyz.data());
+}
+
+// Copies v to a new array of shape (n, 3)
+py::array_t<double> ToArray(const std::vector<double> &v) {
+  py::array_t<double> a({v.size() / 3, size_t(3)});
+  std::copy(v.begin(), v.end(), a.mutable_data());
+  return a;
+}
+
+// Writes the gradients of the real sites of sys, in input order, in grad
+void GetRealGradsInto(bblock::System &sys, OutArray grad) {
+  CheckSize(grad, 3 * sys.GetNumRealSites(), "grad");
+  sys.GetRealGrads(grad.mutable_data());
+}
+
+// Energies of systems, evaluated in parallel without the GIL. Each system
+// is evaluated by one thread, so a system can not be twice in the list
+py::array_t<double> Energies(py::list systems, bool do_grads) {
+  std::vector<bblock::System*> sys;
+  std::set<bblock::System*> seen;
+  for (py::handle s : systems) {
+    sys.push_back(&s.cast<bblock::System&>());
+    if (!seen.insert(sys.back()).second) {
+      throw std::invalid_argument("system " + std::to_string(sys.size() - 1)
+                                  + " is already in the list of systems");
+    }
+  }
+
+  py::array_t<double> energies(sys.size());
+  double* e = energies.mutable_data();
+  std::exception_ptr error;
+  {
+    py::gil_scoped_release release;
+#   ifdef _OPENMP
+#   pragma omp parallel for schedule(dynamic)
+#   endif
+    for (size_t i = 0; i < sys.size(); i++) {
+      try {
+        e[i] = sys[i]->Energy(do_grads);
+      } catch (...) {
+#       ifdef _OPENMP
+#       pragma omp critical
+#       endif
+        error = std::current_exception();
+      }
+    }
+  }
+  if (error) std::rethrow_exception(error);
+  return energies;
+}
+
+// Systems of an NRG file
+std::vector<bblock::System> ReadNrg(const std::string &filename) {
+  std::vector<char> name(filename.begin(), filename.end());
+  name.push_back('\0');
+  std::vector<bblock::System> systems;
+  tools::ReadNrg(name.data(), systems);
+  return systems;
+}
+
+} // namespace
+
+////////////////////////////////////////////////////////////////////////////////
+
+PYBIND11_MODULE(pymbnrg, m) {
+  m.doc() = "Python interface of the MB-nrg potential energy functions. "
+            "Coordinates are in angstrom and energies in kcal/mol.";
+
+  py::class_<bblock::System>(m, "System")
+    .def(py::init<>())
+    .def("AddMonomer",
+         [](bblock::System &sys, InArray xyz,
+            const std::vector<std::string> &atoms, const std::string &id) {
+           CheckSize(xyz, 3 * atoms.size(), "xyz");
+           const double* p = xyz.data();
+           sys.AddMonomer(std::vector<double>(p, p + xyz.size()), atoms, id);
+         },
+         py::arg("xyz"), py::arg("atoms"), py::arg("id"),
+         "Adds a monomer with id, atom names and coordinates (3 per atom)")
+    .def("AddMolecule", &bblock::System::AddMolecule, py::arg("monomers"),
+         "Adds a molecule with the indices of its monomers")
+    .def("Initialize", &bblock::System::Initialize,
+         "Initializes the system. Must be called after adding the monomers")
+    .def("GetNumMon", &bblock::System::GetNumMon)
+    .def("GetNumMol", &bblock::System::GetNumMol)
+    .def("GetNumRealSites", &bblock::System::GetNumRealSites)
+    .def("GetRealAtomNames",
+         [](bblock::System &sys) {return sys.GetRealAtomNames();})
+    .def("GetMonId", &bblock::System::GetMonId, py::arg("n"))
+    .def("Set2bCutoff", &bblock::System::Set2bCutoff, py::arg("cutoff"))
+    .def("Set3bCutoff", &bblock::System::Set3bCutoff, py::arg("cutoff"))
+    .def("SetDipoleMethod", &bblock::System::SetDipoleMethod,
+         py::arg("method"), "iter, cg, aspc, iel, diis or inv")
+    .def("SetDipoleTol", &bblock::System::SetDipoleTol, py::arg("tol"))
+    .def("SetDipoleMaxIt", &bblock::System::SetDipoleMaxIt, py::arg("maxit"))
+    .def("SetAspcOrder", &bblock::System::SetAspcOrder, py::arg("k"))
+    .def("SetAspcCorrector", &bblock::System::SetAspcCorrector,
+         py::arg("maxit"), py::arg("tol"))
+    .def("ResetDipoleHistory", &bblock::System::ResetDipoleHistory)
+    .def("SetDispersionLongRange", &bblock::System::SetDispersionLongRange,
+         py::arg("method"), "none, tail or pme")
+    .def("SetPBC",
+         [](bblock::System &sys, bool use_pbc, InArray box) {
+           CheckSize(box, 9, "box");
+           const double* p = box.data();
+           sys.SetPBC(use_pbc, std::vector<double>(p, p + 9));
+         },
+         py::arg("use_pbc"), py::arg("box"),
+         "Sets periodic boundary conditions with the box vectors (3x3, "
+         "one per row)")
+    .def("SetRealXyz", &SetRealXyz, py::arg("xyz"),
+         "Sets the coordinates of the real sites, in input order")
+    .def("GetRealXyz",
+         [](bblock::System &sys) {return ToArray(sys.GetRealXyz());},
+         "Coordinates of the real sites, in input order, as (n, 3)")
+    .def("Energy",
+         [](bblock::System &sys, bool do_grads) {
+           py::gil_scoped_release release;
+           return sys.Energy(do_grads);
+         },
+         py::arg("do_grads") = false,
+         "Energy of the system, and its gradients if do_grads is True")
+    .def("GetRealGrads",
+         [](bblock::System &sys) {return ToArray(sys.GetRealGrads());},
+         "Gradients of the real sites of the last Energy(True), as (n, 3)")
+    .def("GetRealGrads", &GetRealGradsInto, py::arg("grad").noconvert(),
+         "Writes the gradients of the real sites of the last Energy(True) "
+         "in grad, a C contiguous array of doubles with 3 per site")
+    .def("GetVirial",
+         [](bblock::System &sys) {return ToArray(sys.GetVirial());},
+         "Virial of the last Energy(True), -dE/d(strain), as (3, 3)");
+
+  m.def("ReadNrg", &ReadNrg, py::arg("filename"),
+        "Reads the systems of an NRG file, initialized");
+  m.def("Energies", &Energies, py::arg("systems"),
+        py::arg("do_grads") = false,
+        "Energies of a list of systems, evaluated in parallel without the "
+        "GIL. A system can only be once in the list (ValueError)");
+}
@@ -0,0 +1,95 @@
+#include <cstdlib>
+
+#include <iomanip>
+#include <iostream>
+#include <vector>
+#include <string>
+#include <chrono>
+
+#include "bblock/system.h"
+
+// Sizes of the systems (waters) and number of steps timed for each one
+#define NWAT_SMALL 8
+#define NWAT_LARGE 4096
+#define NSTEPS_SMALL 200000
+#define NSTEPS_LARGE 2000
+// Spacing (A) of the lattice of waters
+#define SPACING 3.1
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Initialized system of nwat waters on a cubic lattice
+void BuildWaters(size_t nwat, bblock::System &sys) {
+  size_t n = 1;
+  while (n * n * n < nwat) n++;
+  const double geom[9] = { 0.0000,  0.0000, 0.0000,
+                           0.7570,  0.5860, 0.0000,
+                          -0.7570,  0.5860, 0.0000};
+  std::vector<std::string> atoms = {"O", "H", "H"};
+  for (size_t w = 0; w < nwat; w++) {
+    double o[3] = {SPACING * (w % n), SPACING * (w / n % n),
+                   SPACING * (w / n / n)};
+    std::vector<double> xyz(9);
+    for (size_t i = 0; i < 9; i++) xyz[i] = o[i % 3] + geom[i];
+    sys.AddMonomer(xyz, atoms, "h2o");
+    sys.AddMolecule(std::vector<size_t>(1, w));
+  }
+  sys.Initialize();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Reports the time per step of the accessors that an MD code calls at
+// every step, around the energy: setting the coordinates of the real
+// sites and getting their gradients. The vector accessors, which allocate
+// and return a copy, are compared with the ones that read from and write
+// to buffers of the caller, for a small and a large system. The energy is
+// not evaluated, so only the overhead of the interface is timed.
+int main(int argc, char** argv)
+{
+  size_t sizes[2] = {NWAT_SMALL, NWAT_LARGE};
+  size_t steps[2] = {NSTEPS_SMALL, NSTEPS_LARGE};
+  if (argc > 1) sizes[0] = std::strtoul(argv[1], 0, 10);
+  if (argc > 2) sizes[1] = std::strtoul(argv[2], 0, 10);
+
+  for (size_t k = 0; k < 2; k++) {
+    bblock::System sys;
+    BuildWaters(sizes[k], sys);
+    std::vector<double> xyz = sys.GetRealXyz();
+    std::vector<double> grad(xyz.size());
+    double sum_vector = 0.0, sum_buffer = 0.0;
+
+    auto t1 = std::chrono::high_resolution_clock::now();
+    for (size_t n = 0; n < steps[k]; n++) {
+      xyz[0] += 1E-12;
+      sys.SetRealXyz(xyz);
+      std::vector<double> g = sys.GetRealGrads();
+      sum_vector += g[0];
+    }
+    auto t2 = std::chrono::high_resolution_clock::now();
+    for (size_t n = 0; n < steps[k]; n++) {
+      xyz[0] -= 1E-12;
+      sys.SetRealXyz(xyz.data());
+      sys.GetRealGrads(grad.data());
+      sum_buffer += grad[0];
+    }
+    auto t3 = std::chrono::high_resolution_clock::now();
+
+    if (sum_vector != sum_buffer) {
+      std::cerr << " ** Error ** : the gradients of the two accessors differ"
+                << std::endl;
+      return 1;
+    }
+
+    std::chrono::duration<double> t_vector = t2 - t1;
+    std::chrono::duration<double> t_buffer = t3 - t2;
+    std::cout << std::scientific << std::setprecision(3)
+              << "waters: " << std::setw(6) << sizes[k]
+              << "  vector: " << t_vector.count() / steps[k] << " s/step"
+              << "  buffer: " << t_buffer.count() / steps[k] << " s/step"
+              << "  speedup: " << std::fixed << std::setprecision(2)
+              << t_vector.count() / t_buffer.count() << std::endl;
+  }
+
+  return 0;
+}
@@ -0,0 +1,266 @@
+#include <cmath>
+#include <cstdio>
+
+#include <iomanip>
+#include <iostream>
+#include <vector>
+#include <random>
+#include <algorithm>
+
+#include "io_tools/read_nrg.h"
+#include "io_tools/write_nrg.h"
+#include "io_tools/binary_nrg.h"
+
+#include "bblock/system.h"
+
+// Number of frames of the trajectory
+#define NFRAMES 6
+// Amplitude of the random displacements of the frames (A)
+#define DISPLACEMENT 0.05
+// Box of the periodic frames (A)
+#define BOX 12.0
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Largest difference between a and b, or infinity if their sizes differ
+double MaxDiff(const std::vector<double> &a, const std::vector<double> &b) {
+  if (a.size() != b.size()) return HUGE_VAL;
+  double d = 0.0;
+  for (size_t i = 0; i < a.size(); i++) d = std::max(d, std::abs(a[i] - b[i]));
+  return d;
+}
+
+// Builds a system with a water dimer in one molecule, a water and a
+// chloride, in input order (ion first)
+void BuildSystem(bblock::System &sys) {
+  sys.AddMonomer({1.0, 0.5, 3.0}, {"Cl"}, "cl");
+  sys.AddMonomer({-1.58972425, 1.04337922, -0.08780840,
+                  -0.63591971, 0.97898520, 0.00000000,
+                  -1.90066280, 1.74501050, -0.66454990}, {"O", "H", "H"},
+                 "h2o");
+  sys.AddMonomer({1.64924507, 1.08594656, 0.00000000,
+                  2.60878026, 1.09587704, -0.02817115,
+                  1.33830653, 1.78757784, 0.57674150}, {"O", "H", "H"},
+                 "h2o");
+  sys.AddMonomer({-0.61315209, 2.46976336, 2.07005086,
+                  0.34684791, 2.46976336, 2.07005086,
+                  -0.93360667, 3.37469919, 2.07005086}, {"O", "H", "H"},
+                 "h2o");
+  sys.AddMolecule({0});
+  sys.AddMolecule({1, 2});
+  sys.AddMolecule({3});
+  sys.Initialize();
+}
+
+// Coordinates of the frames: random displacements of the system
+std::vector<std::vector<double> > Frames(bblock::System &sys) {
+  std::mt19937 gen(13);
+  std::uniform_real_distribution<double> u(-DISPLACEMENT, DISPLACEMENT);
+  std::vector<double> xyz0 = sys.GetRealXyz();
+  std::vector<std::vector<double> > frames;
+  for (size_t n = 0; n < NFRAMES; n++) {
+    std::vector<double> xyz(xyz0);
+    for (size_t i = 0; i < xyz.size(); i++) xyz[i] += u(gen);
+    frames.push_back(xyz);
+  }
+  return frames;
+}
+
+bool SameTopology(bblock::System &a, bblock::System &b) {
+  if (a.GetNumMon() != b.GetNumMon() || a.GetNumMol() != b.GetNumMol())
+    return false;
+  for (size_t m = 0; m < a.GetNumMon(); m++) {
+    if (a.GetMonId(m) != b.GetMonId(m)) return false;
+  }
+  for (size_t k = 0; k < a.GetNumMol(); k++) {
+    if (a.GetMolecule(k) != b.GetMolecule(k)) return false;
+  }
+  return a.GetRealAtomNames() == b.GetRealAtomNames();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int main()
+{
+  const char* bin_file = "binary_nrg-test.bnrg";
+  const char* nrg_file = "binary_nrg-test.nrg";
+  const char* bin_file2 = "binary_nrg-test-2.bnrg";
+  int exit_code = 0;
+
+  bblock::System sys;
+  BuildSystem(sys);
+  std::vector<std::vector<double> > frames = Frames(sys);
+  std::vector<double> box = {BOX, 0.0, 0.0, 0.0, BOX, 0.0, 0.0, 0.0, BOX};
+
+  // Reference energies and gradients, each frame in a new system
+  std::vector<double> ref_e;
+  std::vector<std::vector<double> > ref_g;
+  for (size_t n = 0; n < NFRAMES; n++) {
+    bblock::System fresh;
+    BuildSystem(fresh);
+    fresh.SetRealXyz(frames[n]);
+    fresh.SetPBC(true, box);
+    ref_e.push_back(fresh.Energy(true));
+    ref_g.push_back(fresh.GetRealGrads());
+  }
+
+  try {
+    {
+      tools::BinaryNrgWriter writer(bin_file, sys,
+          tools::BNRG_BOX | tools::BNRG_ENERGY | tools::BNRG_GRADS);
+      for (size_t n = 0; n < NFRAMES; n++) {
+        writer.WriteFrame(frames[n].data(), box.data(), ref_e[n],
+                          ref_g[n].data());
+      }
+      writer.Close();
+    }
+
+    tools::BinaryNrgReader reader(bin_file);
+    if (reader.GetNumFrames() != NFRAMES || !reader.HasBox()
+        || !reader.HasEnergy() || !reader.HasGrads()) {
+      std::cerr << " ** Error ** : "
+                  << "Wrong header" << std::endl;
+      exit_code = 1;
+    }
+    const size_t nat = reader.GetNumRealSites();
+    for (size_t n = 0; n < reader.GetNumFrames(); n++) {
+      if (!std::equal(frames[n].begin(), frames[n].end(), reader.GetXyz(n))
+          || !std::equal(box.begin(), box.end(), reader.GetBox(n))
+          || !std::equal(ref_g[n].begin(), ref_g[n].end(),
+                         reader.GetGrads(n))
+          || reader.GetEnergy(n) != ref_e[n] || 3*nat != frames[n].size()) {
+        std::cerr << " ** Error ** : "
+                  << "Frame " << n << " differs" << std::endl;
+        exit_code = 1;
+      }
+    }
+
+    bblock::System reuse;
+    reader.BuildSystem(reuse);
+    if (!SameTopology(sys, reuse)) {
+      std::cerr << " ** Error ** : "
+                  << "Topology differs" << std::endl;
+      exit_code = 1;
+    }
+
+    for (size_t n = 0; n < reader.GetNumFrames(); n++) {
+      reader.SetFrame(reuse, n);
+      double e = reuse.Energy(true);
+      std::vector<double> g = reuse.GetRealGrads();
+      double max_dg = 0.0;
+      for (size_t i = 0; i < g.size(); i++)
+        max_dg = std::max(max_dg, std::abs(g[i] - ref_g[n][i]));
+      if (std::abs(e - ref_e[n]) > 1E-10 || max_dg > 1E-10) {
+        std::cerr << " ** Error ** : "
+                  << "Frame " << n << ": energy " << e << " vs " << ref_e[n]
+                  << ", max gradient difference " << max_dg << "" << std::endl;
+        exit_code = 1;
+      }
+    }
+    reader.ReleaseFrames(reader.GetNumFrames());
+
+    tools::BinaryToNrg(bin_file, nrg_file);
+    std::vector<bblock::System> systems;
+    tools::ReadNrg(const_cast<char*>(nrg_file), systems);
+    if (systems.size() != NFRAMES) {
+      std::cerr << " ** Error ** : "
+                  << "Wrong number of systems in the NRG file" << std::endl;
+      exit_code = 1;
+    }
+    for (size_t n = 0; n < systems.size(); n++) {
+      if (systems[n].GetRealXyz() != frames[n]
+          || !SameTopology(sys, systems[n])) {
+        std::cerr << " ** Error ** : "
+                  << "System " << n << " of the NRG file differs" << std::endl;
+        exit_code = 1;
+      }
+    }
+
+    // Systems of the NRG file with a repeated topology are copied from
+    // the previous one, and must have the virtual sites and charges of a
+    // system initialized with their coordinates
+    for (size_t n = 0; n < systems.size(); n++) {
+      bblock::System fresh;
+      reader.BuildSystem(fresh, n);
+      if (MaxDiff(systems[n].GetXyz(), fresh.GetXyz()) > 1E-12
+          || MaxDiff(systems[n].GetCharges(), fresh.GetCharges()) > 1E-12) {
+        std::cerr << " ** Error ** : "
+                  << "Sites of system " << n << " of the NRG file differ"
+                  << " from a new system" << std::endl;
+        exit_code = 1;
+      }
+    }
+
+    tools::NrgToBinary(const_cast<char*>(nrg_file), bin_file2, false);
+    tools::BinaryNrgReader reader2(bin_file2);
+    if (reader2.GetNumFrames() != NFRAMES || reader2.HasBox()
+        || reader2.HasEnergy() || reader2.HasGrads()
+        || !tools::IsBinaryNrg(bin_file2) || tools::IsBinaryNrg(nrg_file)) {
+      std::cerr << " ** Error ** : "
+                  << "Wrong header of the converted file" << std::endl;
+      exit_code = 1;
+    }
+    for (size_t n = 0; n < reader2.GetNumFrames(); n++) {
+      if (!std::equal(frames[n].begin(), frames[n].end(), reader2.GetXyz(n))) {
+        std::cerr << " ** Error ** : "
+                  << "Frame " << n << " of the converted file differs"
+                  << std::endl;
+        exit_code = 1;
+      }
+    }
+
+    // A pipe is never taken as binary, and its first bytes are left for
+    // the NRG reader
+    char magic[8], piped[8];
+    FILE* f = std::fopen(bin_file2, "rb");
+    if (!f || std::fread(magic, 1, sizeof(magic), f) != sizeof(magic))
+      throw std::runtime_error("could not read the converted file");
+    std::fclose(f);
+    int fds[2];
+    if (pipe(fds) != 0
+        || write(fds[1], magic, sizeof(magic)) != (ssize_t) sizeof(magic))
+      throw std::runtime_error("could not write the pipe");
+    std::string pipe_name = "/dev/fd/" + std::to_string(fds[0]);
+    bool pipe_is_bin = tools::IsBinaryNrg(pipe_name.c_str());
+    close(fds[1]);
+    bool pipe_kept = read(fds[0], piped, sizeof(piped)) == sizeof(piped)
+                     && std::equal(magic, magic + sizeof(magic), piped);
+    close(fds[0]);
+    if (pipe_is_bin || !pipe_kept) {
+      std::cerr << " ** Error ** : "
+                  << "The format of a pipe was checked by reading it"
+                  << std::endl;
+      exit_code = 1;
+    }
+
+    // A file that ends with a partial frame is an error
+    struct stat st;
+    if (stat(bin_file2, &st) != 0 || truncate(bin_file2, st.st_size - 8) != 0)
+      throw std::runtime_error("could not truncate the converted file");
+    bool truncated_read = true;
+    try {
+      tools::BinaryNrgReader reader3(bin_file2);
+    } catch (const std::runtime_error &) {
+      truncated_read = false;
+    }
+    if (truncated_read) {
+      std::cerr << " ** Error ** : "
+                  << "Partial frame of a truncated file not reported"
+                  << std::endl;
+      exit_code = 1;
+    }
+  } catch (const std::exception& e) {
+    std::cerr << " ** Error ** : " << e.what() << std::endl;
+    exit_code = 1;
+  }
+
+  std::remove(bin_file);
+  std::remove(nrg_file);
+  std::remove(bin_file2);
+
+  if (exit_code == 0) {
+    std::cout << "All tests passed!" << std::endl;
+  }
+
+  return exit_code;
+}
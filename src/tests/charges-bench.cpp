@@ -0,0 +1,69 @@
+#include <cmath>
+
+#include <iomanip>
+#include <iostream>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <cstdlib>
+
+#include "bblock/sys_tools.h"
+
+// Smallest and largest number of water molecules, and total number of
+// waters processed at each size
+#define NWAT_MIN 1024
+#define NWAT_MAX 131072
+#define NWORK 4194304
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Measures the cost of the water charges and their derivatives
+// (systools::SetCharges), which are recomputed at every energy call, for
+// systems of increasing size. The cost is linear in the number of waters
+// if the time per water stays constant.
+int main(int argc, char** argv)
+{
+  size_t nwat_max = NWAT_MAX;
+  if (argc > 1) nwat_max = std::strtoul(argv[1], 0, 10);
+
+  const size_t ns = 4;
+  const double site[4][3] = {{0.0, 0.0, 0.0}, {0.757, 0.586, 0.0},
+                             {-0.757, 0.586, 0.0}, {0.0, 0.0, 0.0}};
+
+  for (size_t nwat = NWAT_MIN; nwat <= nwat_max; nwat *= 2) {
+    // Lattice of slightly distorted waters separated by 3.1 A
+    size_t nside = std::ceil(std::cbrt(double(nwat)));
+    std::vector<double> xyz(3 * ns * nwat);
+    for (size_t m = 0; m < nwat; m++) {
+      double x0 = 3.1 * (m % nside);
+      double y0 = 3.1 * ((m / nside) % nside);
+      double z0 = 3.1 * (m / (nside * nside));
+      double d = 0.01 * std::sin(double(m));
+      for (size_t i = 0; i < ns; i++) {
+        xyz[3 * (ns * m + i)] = x0 + site[i][0] + d;
+        xyz[3 * (ns * m + i) + 1] = y0 + site[i][1];
+        xyz[3 * (ns * m + i) + 2] = z0 + site[i][2] - d;
+      }
+    }
+
+    std::vector<double> chg(ns * nwat);
+    std::vector<double> chggrad;
+    systools::SetCharges(xyz, chg, "h2o", nwat, ns, 0, chggrad);
+
+    size_t nrep = NWORK / nwat;
+    auto t1 = std::chrono::high_resolution_clock::now();
+    for (size_t rep = 0; rep < nrep; rep++) {
+      systools::SetCharges(xyz, chg, "h2o", nwat, ns, 0, chggrad);
+    }
+    auto t2 = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> t = t2 - t1;
+
+    std::cout << std::scientific << std::setprecision(3)
+              << "Waters: " << std::setw(7) << nwat
+              << "  time/call: " << t.count() / nrep << " s"
+              << "  time/water: " << t.count() / nrep / nwat << " s"
+              << std::endl;
+  }
+
+  return 0;
+}
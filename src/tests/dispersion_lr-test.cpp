@@ -0,0 +1,255 @@
+#include <cmath>
+
+#include <iomanip>
+#include <iostream>
+#include <vector>
+#include <random>
+#include <algorithm>
+
+#include "bblock/system.h"
+#include "potential/dispersion/dispersion2b.h"
+
+// Waters per side of the lattice and lattice constant (A)
+#define NSIDE 4
+#define LATTICE 3.1
+// 2B cutoff (A)
+#define CUTOFF 6.0
+// Radius of the direct lattice sum used as reference (A)
+#define RREF 45.0
+// Maximum difference with the lattice sum (kcal/mol)
+#define MAX_ENERGY_ERR 1E-02
+// Maximum spread of the PME energy with beta (kcal/mol)
+#define MAX_BETA_SPREAD 5E-02
+// Maximum relative error of the gradients and virial against
+// finite differences
+#define MAX_FD_ERR 1E-06
+// Absolute error of the finite difference gradients (kcal/mol/A)
+#define MAX_FD_ABS_ERR 1E-03
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Builds a distorted cubic lattice of randomly oriented waters
+void BuildBox(bblock::System &sys) {
+  std::mt19937 gen(7);
+  std::uniform_real_distribution<double> u(-1.0, 1.0);
+  const double half_angle = 0.5 * 104.52 * M_PI / 180.0;
+  for (size_t i = 0; i < NSIDE; i++) {
+    for (size_t j = 0; j < NSIDE; j++) {
+      for (size_t k = 0; k < NSIDE; k++) {
+        double o[3] = {i * LATTICE + 0.3 * u(gen),
+                       j * LATTICE + 0.3 * u(gen),
+                       k * LATTICE + 0.3 * u(gen)};
+        double a[3] = {u(gen), u(gen), u(gen)};
+        double b[3] = {u(gen), u(gen), u(gen)};
+        double na = std::sqrt(a[0]*a[0] + a[1]*a[1] + a[2]*a[2]);
+        double ab = (a[0]*b[0] + a[1]*b[1] + a[2]*b[2]) / (na * na);
+        for (size_t c = 0; c < 3; c++) b[c] -= ab * a[c];
+        double nb = std::sqrt(b[0]*b[0] + b[1]*b[1] + b[2]*b[2]);
+
+        std::vector<double> xyz(o, o + 3);
+        for (int s = -1; s <= 1; s += 2) {
+          for (size_t c = 0; c < 3; c++) {
+            xyz.push_back(o[c] + 0.9572 * (std::cos(half_angle) * a[c] / na
+                          + s * std::sin(half_angle) * b[c] / nb));
+          }
+        }
+        sys.AddMonomer(xyz, {"O", "H", "H"}, "h2o");
+        sys.AddMolecule({sys.GetNumMon() - 1});
+      }
+    }
+  }
+  sys.Initialize();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Sum of the 2B dispersion inside the cutoff, with the same dimer images
+// as the system, and without shift
+double DispersionInCutoff(const std::vector<double> &xyz, double box,
+                          const disp::DispersionParameters &par) {
+  const size_t nmon = xyz.size() / 9;
+  double e = 0.0;
+  for (size_t m1 = 0; m1 < nmon; m1++) {
+    for (size_t m2 = m1 + 1; m2 < nmon; m2++) {
+      double x2[9];
+      std::copy(xyz.begin() + 9*m2, xyz.begin() + 9*m2 + 9, x2);
+      double rsq = 0.0;
+      for (size_t c = 0; c < 3; c++) {
+        double d = x2[c] - xyz[9*m1 + c];
+        d -= box * std::round(d / box);
+        rsq += d * d;
+      }
+      if (rsq > CUTOFF * CUTOFF) continue;
+      // The whole monomer 2 is moved with its oxygen
+      for (size_t c = 0; c < 3; c++) {
+        double d = x2[c] - xyz[9*m1 + c];
+        double shift = 0.0;
+        if (d > 0.5 * box) {
+          shift = -box;
+        } else if (d <= -0.5 * box) {
+          shift = box;
+        }
+        for (size_t j = c; j < 9; j += 3) x2[j] += shift;
+      }
+      for (size_t i = 0; i < 3; i++) {
+        for (size_t j = 0; j < 3; j++) {
+          double r2 = 0.0;
+          for (size_t c = 0; c < 3; c++) {
+            double d = xyz[9*m1 + 3*i + c] - x2[3*j + c];
+            r2 += d * d;
+          }
+          double r = std::sqrt(r2);
+          if (r > CUTOFF) continue;
+          size_t t = par.types1[i] * par.nt2 + par.types2[j];
+          e -= par.C6[t] * disp::tang_toennies6(par.d6[t] * r)
+               / (r2 * r2 * r2);
+        }
+      }
+    }
+  }
+  return e;
+}
+
+// Direct lattice sum of the dispersion up to RREF, plus the tail beyond
+double DispersionLatticeSum(const std::vector<double> &xyz, double box,
+                            const disp::DispersionParameters &par) {
+  const size_t nmon = xyz.size() / 9;
+  const int nimg = int(RREF / box) + 1;
+  double e = 0.0;
+  double c6sum = 0.0;
+  for (size_t i = 0; i < 3; i++) {
+    for (size_t j = 0; j < 3; j++) {
+      size_t t = par.types1[i] * par.nt2 + par.types2[j];
+      c6sum += par.C6[t];
+      for (size_t m1 = 0; m1 < nmon; m1++) {
+        for (size_t m2 = m1; m2 < nmon; m2++) {
+          double w = m1 == m2 ? 0.5 : 1.0;
+          for (int a = -nimg; a <= nimg; a++) {
+            for (int b = -nimg; b <= nimg; b++) {
+              for (int c = -nimg; c <= nimg; c++) {
+                if (m1 == m2 && a == 0 && b == 0 && c == 0) continue;
+                int img[3] = {a, b, c};
+                double r2 = 0.0;
+                for (size_t k = 0; k < 3; k++) {
+                  double d = xyz[9*m1 + 3*i + k] - xyz[9*m2 + 3*j + k]
+                             + img[k] * box;
+                  r2 += d * d;
+                }
+                if (r2 > RREF * RREF) continue;
+                double r = std::sqrt(r2);
+                e -= w * par.C6[t] * disp::tang_toennies6(par.d6[t] * r)
+                     / (r2 * r2 * r2);
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+  double vol = box * box * box;
+  return e - 2.0 * M_PI * nmon * nmon * c6sum / (3.0 * vol * RREF*RREF*RREF);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Checks the dispersion PME of a periodic box of water against a direct
+// lattice sum, its independence of beta, and its gradients and virial
+// against finite differences
+int main()
+{
+  // Declare return code
+  int exit_code = 0;
+
+  bblock::System sys;
+  BuildBox(sys);
+  const double box = NSIDE * LATTICE;
+  std::vector<double> box9 = {box, 0.0, 0.0, 0.0, box, 0.0, 0.0, 0.0, box};
+  sys.SetPBC(true, box9);
+  sys.Set2bCutoff(CUTOFF);
+  std::vector<double> xyz = sys.GetRealXyz();
+  disp::DispersionParameters par = disp::GetDispersionParameters("h2o", "h2o");
+
+  // Without the shift, the polynomials are the 2B energy minus the
+  // dispersion inside the cutoff and the tail
+  sys.SetDispersionLongRange("tail");
+  double e_poly = sys.TwoBodyEnergy(false) - sys.GetDispersionLongRangeEnergy()
+                  - DispersionInCutoff(xyz, box, par);
+  double e_ref = e_poly + DispersionLatticeSum(xyz, box, par);
+
+  // PME with the default beta against the lattice sum
+  sys.SetDispersionLongRange("pme");
+  double e_pme = sys.TwoBodyEnergy(false);
+  std::cerr << std::fixed << std::setprecision(6)
+            << "E2B PME: " << e_pme << " Reference: " << e_ref << std::endl;
+  if (std::abs(e_pme - e_ref) > MAX_ENERGY_ERR) {
+    std::cerr << " ** Error ** : "
+              << "PME energy does not match the lattice sum" << std::endl;
+    exit_code = 1;
+  }
+
+  // Independence of beta
+  const double betas[3] = {0.6, 0.7, 0.8};
+  for (size_t i = 0; i < 3; i++) {
+    sys.SetDispersionPmeParameters(betas[i], 0.0, 6);
+    double e = sys.TwoBodyEnergy(false);
+    if (std::abs(e - e_pme) > MAX_BETA_SPREAD) {
+      std::cerr << " ** Error ** : " << "PME energy with beta = " << betas[i]
+                << " differs by " << e - e_pme << std::endl;
+      exit_code = 1;
+    }
+  }
+  sys.SetDispersionPmeParameters(0.0, 0.0, 6);
+
+  // Gradients
+  sys.TwoBodyEnergy(true);
+  std::vector<double> grad = sys.GetRealGrads();
+  const double h = 1E-05;
+  for (size_t i = 0; i < xyz.size(); i += 37) {
+    std::vector<double> x = xyz;
+    x[i] += h;
+    sys.SetRealXyz(x);
+    double ep = sys.TwoBodyEnergy(false);
+    x[i] -= 2.0 * h;
+    sys.SetRealXyz(x);
+    double em = sys.TwoBodyEnergy(false);
+    double fd = (ep - em) / (2.0 * h);
+    if (std::abs(fd - grad[i])
+        > std::max(MAX_FD_ABS_ERR, MAX_FD_ERR * std::abs(fd))) {
+      std::cerr << " ** Error ** : " << "Gradient " << i << " is " << grad[i]
+                << ", finite difference is " << fd << std::endl;
+      exit_code = 1;
+    }
+  }
+  sys.SetRealXyz(xyz);
+
+  // Virial of the long range part, against a strain of the box and sites
+  sys.TwoBodyEnergy(false);
+  std::vector<double> virial = sys.GetDispersionLongRangeVirial();
+  for (size_t k = 0; k < 3; k++) {
+    double e[2];
+    for (size_t s = 0; s < 2; s++) {
+      double f = s == 0 ? 1.0 - h : 1.0 + h;
+      std::vector<double> x = xyz;
+      for (size_t i = k; i < x.size(); i += 3) x[i] *= f;
+      std::vector<double> b = box9;
+      b[4*k] *= f;
+      sys.SetRealXyz(x);
+      sys.SetPBC(true, b);
+      sys.TwoBodyEnergy(false);
+      e[s] = sys.GetDispersionLongRangeEnergy();
+    }
+    double fd = -(e[1] - e[0]) / (2.0 * h);
+    if (std::abs(fd - virial[4*k])
+        > MAX_FD_ERR * std::max(1.0, std::abs(fd))) {
+      std::cerr << " ** Error ** : " << "Virial " << k << k << " is "
+                << virial[4*k] << ", finite difference is " << fd << std::endl;
+      exit_code = 1;
+    }
+  }
+
+  if (exit_code == 0) {
+    std::cout << "All tests passed!\n";
+  }
+
+  return exit_code;
+}
@@ -0,0 +1,95 @@
+#include <cmath>
+
+#include <iomanip>
+#include <iostream>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <cstdlib>
+
+#include "potential/electrostatics/electrostatics.h"
+
+// Default number of water molecules and number of repetitions
+#define NWAT 131072
+#define NREP 50
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Measures the cost of handing a new configuration to the electrostatics
+// (SetXyzChgPolPolfac), which is done once per energy call. The system is
+// a cubic lattice of 4-site waters. The reported bandwidth counts the bytes
+// read from the system arrays and written to the internal buffers.
+int main(int argc, char** argv)
+{
+  size_t nwat = NWAT;
+  if (argc > 1) nwat = std::strtoul(argv[1], 0, 10);
+
+  const size_t ns = 4;
+  const size_t nsites = nwat * ns;
+
+  // Lattice of waters separated by 3.1 A
+  size_t nside = std::ceil(std::cbrt(double(nwat)));
+  std::vector<double> xyz(3 * nsites);
+  const double site[4][3] = {{0.0, 0.0, 0.0}, {0.757, 0.586, 0.0},
+                             {-0.757, 0.586, 0.0}, {0.0, 0.148, 0.0}};
+  for (size_t m = 0; m < nwat; m++) {
+    double x0 = 3.1 * (m % nside);
+    double y0 = 3.1 * ((m / nside) % nside);
+    double z0 = 3.1 * (m / (nside * nside));
+    for (size_t i = 0; i < ns; i++) {
+      xyz[3 * (ns * m + i)] = x0 + site[i][0];
+      xyz[3 * (ns * m + i) + 1] = y0 + site[i][1];
+      xyz[3 * (ns * m + i) + 2] = z0 + site[i][2];
+    }
+  }
+
+  std::vector<double> chg(nsites), pol(nsites), polfac(nsites);
+  std::vector<double> chggrad(27 * nwat, 0.0);
+  const double q[4] = {0.0, 0.58, 0.58, -1.16};
+  const double p[4] = {1.31, 0.294, 0.294, 0.0};
+  for (size_t m = 0; m < nwat; m++) {
+    for (size_t i = 0; i < ns; i++) {
+      chg[ns * m + i] = q[i];
+      pol[ns * m + i] = p[i];
+      polfac[ns * m + i] = p[i] > 0.0 ? p[i] : 1.31;
+    }
+  }
+
+  std::vector<std::string> mon_id(nwat, "h2o");
+  std::vector<size_t> sites(nwat, ns);
+  std::vector<size_t> first_ind(nwat);
+  for (size_t m = 0; m < nwat; m++) first_ind[m] = ns * m;
+  std::vector<std::pair<std::string, size_t> > mon_type_count;
+  mon_type_count.push_back(std::make_pair("h2o", nwat));
+
+  elec::Electrostatics elec;
+  elec.Initialize(chg, chggrad, polfac, pol, xyz, mon_id, sites, first_ind,
+                  mon_type_count, true, 1E-16, 100, "cg");
+
+  std::string method = "cg";
+  for (size_t do_grads = 0; do_grads < 2; do_grads++) {
+    auto t1 = std::chrono::high_resolution_clock::now();
+    for (size_t rep = 0; rep < NREP; rep++) {
+      xyz[0] += 1E-6;
+      elec.SetXyzChgPolPolfac(xyz, chg, chggrad, pol, polfac, method,
+                              do_grads);
+    }
+    auto t2 = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> t = t2 - t1;
+
+    // xyz: read + write; chg: read + write; pol: read + copy + 3 writes
+    // of sqrt(pol); polfac: copy; zeroed: phi, Efq, Efd, mu;
+    // chggrad: copy if gradients
+    double bytes = sizeof(double) * (6.0 * nsites + 2.0 * nsites
+                 + 5.0 * nsites + 2.0 * nsites + 10.0 * nsites
+                 + (do_grads ? 2.0 * chggrad.size() : 0.0));
+
+    std::cout << std::scientific << std::setprecision(3)
+              << "Waters: " << nwat << "  grads: " << do_grads
+              << "  time/call: " << t.count() / NREP << " s"
+              << "  bandwidth: " << bytes * NREP / t.count() / 1E9
+              << " GB/s" << std::endl;
+  }
+
+  return 0;
+}
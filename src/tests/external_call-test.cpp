@@ -0,0 +1,325 @@
+#include <cmath>
+#include <cstring>
+
+#include <iomanip>
+#include <iostream>
+#include <vector>
+#include <string>
+#include <random>
+#include <algorithm>
+
+#include "bblock/system.h"
+#include "bblock/external_call.h"
+
+// Number of steps with new coordinates
+#define NSTEPS 3
+// Amplitude of the random displacements of each step (A)
+#define DISPLACEMENT 0.02
+// Step of the finite difference strain
+#define STRAIN_STEP 1E-05
+// Maximum difference between the handle and a new system (kcal/mol and
+// kcal/mol/A)
+#define MAX_ERR 1E-10
+// Maximum error of the virial against finite differences, relative to
+// its magnitude (or absolute below 1), limited by the convergence of the
+// induced dipoles
+#define MAX_FD_ERR 1E-04
+// Waters per side and lattice constant (A) of the periodic box
+#define NSIDE 3
+#define LATTICE 3.1
+
+////////////////////////////////////////////////////////////////////////////////
+
+// A chloride and three waters, in the layout of the C/Fortran interface
+struct Cluster {
+  std::vector<double> xyz;
+  std::vector<int> nat;
+  std::vector<std::string> names;
+  std::vector<std::string> ids;
+};
+
+Cluster BuildCluster() {
+  Cluster c;
+  c.xyz = {-1.58972425, 1.04337922, -0.08780840,
+           -0.63591971, 0.97898520, 0.00000000,
+           -1.90066280, 1.74501050, -0.66454990,
+           1.0, 0.5, 3.0,
+           1.64924507, 1.08594656, 0.00000000,
+           2.60878026, 1.09587704, -0.02817115,
+           1.33830653, 1.78757784, 0.57674150,
+           -0.61315209, 2.46976336, 2.07005086,
+           0.34684791, 2.46976336, 2.07005086,
+           -0.93360667, 3.37469919, 2.07005086};
+  c.nat = {3, 1, 3, 3};
+  c.names = {"O", "H", "H", "Cl", "O", "H", "H", "O", "H", "H"};
+  c.ids = {"h2o", "cl", "h2o", "h2o"};
+  return c;
+}
+
+// Builds a periodic lattice of waters, with random orientations
+Cluster BuildBox() {
+  std::mt19937 gen(5);
+  std::uniform_real_distribution<double> u(-1.0, 1.0);
+  const double half_angle = 0.5 * 104.52 * M_PI / 180.0;
+  Cluster c;
+  for (size_t i = 0; i < NSIDE*NSIDE*NSIDE; i++) {
+    double o[3] = {LATTICE * (i % NSIDE) + 0.2 * u(gen),
+                   LATTICE * ((i / NSIDE) % NSIDE) + 0.2 * u(gen),
+                   LATTICE * (i / (NSIDE*NSIDE)) + 0.2 * u(gen)};
+    double a[3] = {u(gen), u(gen), u(gen)};
+    double b[3] = {u(gen), u(gen), u(gen)};
+    double na = std::sqrt(a[0]*a[0] + a[1]*a[1] + a[2]*a[2]);
+    double ab = (a[0]*b[0] + a[1]*b[1] + a[2]*b[2]) / (na * na);
+    for (size_t k = 0; k < 3; k++) b[k] -= ab * a[k];
+    double nb = std::sqrt(b[0]*b[0] + b[1]*b[1] + b[2]*b[2]);
+    c.xyz.insert(c.xyz.end(), o, o + 3);
+    for (int s = -1; s <= 1; s += 2) {
+      for (size_t k = 0; k < 3; k++) {
+        c.xyz.push_back(o[k] + 0.9572 * (std::cos(half_angle) * a[k] / na
+                        + s * std::sin(half_angle) * b[k] / nb));
+      }
+    }
+    c.nat.push_back(3);
+    c.names.insert(c.names.end(), {"O", "H", "H"});
+    c.ids.push_back("h2o");
+  }
+  return c;
+}
+
+// Names in arrays of 5 characters
+std::vector<char> Names5(const std::vector<std::string> &names) {
+  std::vector<char> n5(5 * names.size(), '\0');
+  for (size_t i = 0; i < names.size(); i++)
+    std::strncpy(n5.data() + 5*i, names[i].c_str(), 4);
+  return n5;
+}
+
+// New system with the coordinates xyz, and box if it is not empty
+double NewSystemEnergy(const Cluster &c, const std::vector<double> &xyz,
+                       const std::vector<double> &box, bool do_grads,
+                       std::vector<double> &grad,
+                       std::vector<double> &virial) {
+  bblock::System sys;
+  size_t first = 0;
+  for (size_t m = 0; m < c.nat.size(); m++) {
+    sys.AddMonomer(std::vector<double>(xyz.begin() + 3*first,
+                                       xyz.begin() + 3*(first + c.nat[m])),
+                   std::vector<std::string>(c.names.begin() + first,
+                                            c.names.begin() + first + c.nat[m]),
+                   c.ids[m]);
+    sys.AddMolecule({m});
+    first += c.nat[m];
+  }
+  sys.Initialize();
+  if (!box.empty()) sys.SetPBC(true, box);
+  double e = sys.Energy(do_grads);
+  grad = sys.GetRealGrads();
+  virial = sys.GetVirial();
+  return e;
+}
+
+// Checks the virial of the handle against finite differences of the
+// energy with the strain. Only the diagonal with a box (orthorhombic)
+int CheckVirial(const Cluster &c, const std::vector<double> &xyz,
+                const std::vector<double> &box,
+                const std::vector<double> &virial) {
+  int exit_code = 0;
+  std::vector<double> grad, vir;
+  for (size_t a = 0; a < 3; a++) {
+    for (size_t b = 0; b < 3; b++) {
+      if (!box.empty() && a != b) continue;
+      double e[2];
+      for (size_t s = 0; s < 2; s++) {
+        double h = s == 0 ? STRAIN_STEP : -STRAIN_STEP;
+        std::vector<double> x(xyz);
+        std::vector<double> bx(box);
+        for (size_t i = 0; i < x.size(); i += 3) x[i + a] += h * xyz[i + b];
+        for (size_t i = 0; i < bx.size(); i += 3) bx[i + a] += h * box[i + b];
+        e[s] = NewSystemEnergy(c, x, bx, false, grad, vir);
+      }
+      double fd = -(e[0] - e[1]) / (2.0 * STRAIN_STEP);
+      if (std::abs(fd - virial[3*a + b])
+          > MAX_FD_ERR * std::max(1.0, std::abs(fd))) {
+        std::cerr << " ** Error ** : " << "Virial " << a << b << " is "
+                  << virial[3*a + b] << ", finite difference is " << fd
+                  << std::endl;
+        exit_code = 1;
+      }
+    }
+  }
+  return exit_code;
+}
+
+// Reports a call of the handle interface that did not return expected in
+// ierr
+int CheckIerr(const std::string &call, int ierr, int expected) {
+  if (ierr == expected) return 0;
+  std::cerr << " ** Error ** : " << call << " returned ierr " << ierr
+            << " instead of " << expected << std::endl;
+  return 1;
+}
+
+// Runs NSTEPS steps with the handle interface, and compares each one with
+// a new system. With a box, the system is periodic
+int CheckHandle(const Cluster &c, const std::vector<double> &box) {
+  int exit_code = 0;
+  std::mt19937 gen(3);
+  std::uniform_real_distribution<double> u(-DISPLACEMENT, DISPLACEMENT);
+
+  std::vector<double> xyz(c.xyz);
+  std::vector<char> names = Names5(c.names);
+  std::vector<char> ids = Names5(c.ids);
+  std::vector<int> nat(c.nat);
+  int nmon = nat.size();
+  int handle = -1;
+  int ierr;
+  initsystemf90_(xyz.data(), nat.data(), (char (*)[5]) names.data(),
+                 (char (*)[5]) ids.data(), &nmon, &handle, &ierr);
+  if (CheckIerr("initsystemf90", ierr, CU_EXTERNAL_OK)) return 1;
+  std::vector<double> box9(box);
+  if (!box.empty()) {
+    setboxf90_(&handle, box9.data(), &ierr);
+    exit_code |= CheckIerr("setboxf90", ierr, CU_EXTERNAL_OK);
+  }
+
+  std::vector<double> grad(xyz.size()), virial(9);
+  for (size_t n = 0; n < NSTEPS; n++) {
+    if (n > 0) {
+      for (size_t i = 0; i < xyz.size(); i++) xyz[i] += u(gen);
+      setxyzf90_(&handle, xyz.data(), &ierr);
+      exit_code |= CheckIerr("setxyzf90", ierr, CU_EXTERNAL_OK);
+    }
+    double e;
+    energysysf90gv_(&handle, grad.data(), virial.data(), &e, &ierr);
+    exit_code |= CheckIerr("energysysf90gv", ierr, CU_EXTERNAL_OK);
+
+    std::vector<double> grad_ref, virial_ref;
+    double e_ref = NewSystemEnergy(c, xyz, box, true, grad_ref, virial_ref);
+    double max_dg = 0.0;
+    for (size_t i = 0; i < grad.size(); i++)
+      max_dg = std::max(max_dg, std::abs(grad[i] - grad_ref[i]));
+    if (std::abs(e - e_ref) > MAX_ERR || max_dg > MAX_ERR) {
+      std::cerr << " ** Error ** : " << "Step " << n << ": energy " << e
+                << " vs " << e_ref << ", max gradient difference "
+                << max_dg << std::endl;
+      exit_code = 1;
+    }
+
+    double e_nograd;
+    energysysf90_(&handle, &e_nograd, &ierr);
+    exit_code |= CheckIerr("energysysf90", ierr, CU_EXTERNAL_OK);
+    if (std::abs(e_nograd - e_ref) > MAX_ERR) {
+      std::cerr << " ** Error ** : " << "Step " << n
+                << ": energy without gradients " << e_nograd << " vs "
+                << e_ref << std::endl;
+      exit_code = 1;
+    }
+  }
+
+  if (CheckVirial(c, xyz, box, virial)) exit_code = 1;
+
+  int released = handle;
+  finalizesystemf90_(&handle, &ierr);
+  exit_code |= CheckIerr("finalizesystemf90", ierr, CU_EXTERNAL_OK);
+  if (handle != -1) {
+    std::cerr << " ** Error ** : " << "Handle not released" << std::endl;
+    exit_code = 1;
+  }
+
+  // A released handle is an error, reported in ierr
+  double e;
+  energysysf90g_(&released, grad.data(), &e, &ierr);
+  exit_code |= CheckIerr("energysysf90g of a released handle", ierr,
+                         CU_EXTERNAL_ERROR);
+  finalizesystemf90_(&released, &ierr);
+  exit_code |= CheckIerr("finalizesystemf90 of a released handle", ierr,
+                         CU_EXTERNAL_ERROR);
+  return exit_code;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Checks the persistent C/Fortran interface against new systems, the
+// virial against finite differences, and the per call interface
+int main()
+{
+  int exit_code = 0;
+
+  // Cluster, and periodic box of waters
+  Cluster cluster = BuildCluster();
+  if (CheckHandle(cluster, std::vector<double>())) exit_code = 1;
+
+  Cluster water_box = BuildBox();
+  const double box = NSIDE * LATTICE;
+  std::vector<double> box9 = {box, 0.0, 0.0, 0.0, box, 0.0, 0.0, 0.0, box};
+  if (CheckHandle(water_box, box9)) exit_code = 1;
+
+  // A monomer that is not known is an error, reported in ierr
+  {
+    Cluster c = BuildCluster();
+    c.ids[1] = "xx";
+    std::vector<char> names = Names5(c.names);
+    std::vector<char> ids = Names5(c.ids);
+    int nmon = c.nat.size();
+    int handle = 0;
+    int ierr;
+    initsystemf90_(c.xyz.data(), c.nat.data(), (char (*)[5]) names.data(),
+                   (char (*)[5]) ids.data(), &nmon, &handle, &ierr);
+    if (CheckIerr("initsystemf90 with an unknown monomer", ierr,
+                  CU_EXTERNAL_ERROR) || handle != -1) {
+      exit_code = 1;
+    }
+  }
+
+  // Dipoles that do not converge are an error, reported in ierr, and the
+  // handle can still be used with other coordinates
+  {
+    Cluster c = BuildCluster();
+    std::vector<double> xyz(c.xyz);
+    std::copy(xyz.begin() + 12, xyz.begin() + 21, xyz.begin() + 21);
+    std::vector<char> names = Names5(c.names);
+    std::vector<char> ids = Names5(c.ids);
+    int nmon = c.nat.size();
+    int handle = -1;
+    int ierr;
+    double e;
+    initsystemf90_(xyz.data(), c.nat.data(), (char (*)[5]) names.data(),
+                   (char (*)[5]) ids.data(), &nmon, &handle, &ierr);
+    exit_code |= CheckIerr("initsystemf90", ierr, CU_EXTERNAL_OK);
+    energysysf90_(&handle, &e, &ierr);
+    exit_code |= CheckIerr("energysysf90 of coincident waters", ierr,
+                           CU_EXTERNAL_ERROR);
+    setxyzf90_(&handle, c.xyz.data(), &ierr);
+    exit_code |= CheckIerr("setxyzf90", ierr, CU_EXTERNAL_OK);
+    energysysf90_(&handle, &e, &ierr);
+    exit_code |= CheckIerr("energysysf90 after coincident waters", ierr,
+                           CU_EXTERNAL_OK);
+    finalizesystemf90_(&handle, &ierr);
+    exit_code |= CheckIerr("finalizesystemf90", ierr, CU_EXTERNAL_OK);
+  }
+
+  // Per call interface, twice with the same monomers
+  std::vector<char> names = Names5(cluster.names);
+  std::vector<char> ids = Names5(cluster.ids);
+  std::vector<int> nat(cluster.nat);
+  int nmon = nat.size();
+  std::vector<double> grad_ref, virial_ref;
+  double e_ref = NewSystemEnergy(cluster, cluster.xyz, std::vector<double>(),
+                                 false, grad_ref, virial_ref);
+  for (size_t n = 0; n < 2; n++) {
+    double e;
+    energyf90_(cluster.xyz.data(), nat.data(), (char (*)[5]) names.data(),
+               (char (*)[5]) ids.data(), &nmon, &e);
+    if (std::abs(e - e_ref) > MAX_ERR) {
+      std::cerr << " ** Error ** : " << "energyf90 call " << n << ": "
+                << e << " vs " << e_ref << std::endl;
+      exit_code = 1;
+    }
+  }
+
+  if (exit_code == 0) {
+    std::cout << "All tests passed!\n";
+  }
+
+  return exit_code;
+}
@@ -0,0 +1,106 @@
+#include <cmath>
+
+#include <iomanip>
+#include <iostream>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+
+#include "potential/electrostatics/gammq.h"
+
+// Number of points in the benchmark and number of repetitions
+#define NPOINTS 100000
+#define NREP 20
+// Largest x in the benchmark
+#define XMAX 100.0
+// Maximum relative error allowed for x < XREL. Above it, Q(3/4,x)
+// underflows quickly and the absolute error is checked instead.
+#define XREL 40.0
+#define MAX_REL_ERR 1E-14
+#define MAX_ABS_ERR 1E-16
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Compares the specialized Q(3/4,x) against the general gammq, and
+// reports the throughput of both. The throughput is printed to the
+// standard error, since it depends on the machine.
+int main()
+{
+  // Declare return code
+  int exit_code = 0;
+
+  // Points in [0, XMAX], denser at small x where the Thole screening matters
+  std::vector<double> x(NPOINTS);
+  for (size_t i = 0; i < NPOINTS; i++) {
+    double t = double(i) / (NPOINTS - 1);
+    x[i] = XMAX * t * t;
+  }
+
+  std::vector<double> q_ref(NPOINTS);
+  std::vector<double> q(NPOINTS);
+
+  // Reference
+  auto t1 = std::chrono::high_resolution_clock::now();
+  for (size_t rep = 0; rep < NREP; rep++) {
+    for (size_t i = 0; i < NPOINTS; i++) {
+      q_ref[i] = elec::gammq(0.75, x[i]);
+    }
+  }
+  auto t2 = std::chrono::high_resolution_clock::now();
+
+  // Specialized, in a vectorizable loop
+  for (size_t rep = 0; rep < NREP; rep++) {
+#   ifdef _OPENMP
+#     pragma omp simd
+#   endif
+    for (size_t i = 0; i < NPOINTS; i++) {
+      q[i] = elec::gammq34(x[i]);
+    }
+  }
+  auto t3 = std::chrono::high_resolution_clock::now();
+
+  double max_rel = 0.0;
+  double max_abs = 0.0;
+  for (size_t i = 0; i < NPOINTS; i++) {
+    double err = std::abs(q[i] - q_ref[i]);
+    if (x[i] < XREL) {
+      max_rel = std::max(max_rel, err / q_ref[i]);
+    } else {
+      max_abs = std::max(max_abs, err);
+    }
+  }
+
+  // Derivative against finite differences of the reference
+  double max_der = 0.0;
+  for (size_t i = 1000; i < NPOINTS; i += 1000) {
+    if (x[i] > XREL) break;
+    double h = 1E-6 * x[i];
+    double dq = (elec::gammq(0.75, x[i] + h) - elec::gammq(0.75, x[i] - h))
+              / (2.0 * h);
+    max_der = std::max(max_der, std::abs(elec::dgammq34(x[i]) - dq)
+                                / std::abs(dq));
+  }
+
+  std::chrono::duration<double> t_ref = t2 - t1;
+  std::chrono::duration<double> t_fast = t3 - t2;
+  double neval = double(NPOINTS) * NREP;
+
+  std::cerr << std::scientific << std::setprecision(3)
+            << "gammq(0.75,x): " << neval / t_ref.count() << " evals/s\n"
+            << "gammq34(x)   : " << neval / t_fast.count() << " evals/s\n"
+            << "Max relative error (x < " << XREL << "): " << max_rel << "\n"
+            << "Max absolute error (x > " << XREL << "): " << max_abs << "\n"
+            << "Max relative error derivative: " << max_der << std::endl;
+
+  if (max_rel > MAX_REL_ERR || max_abs > MAX_ABS_ERR || max_der > 1E-08) {
+    std::cerr << " ** Error ** : " << "gammq34 does not match gammq"
+              << std::endl;
+    exit_code = 1;
+  }
+
+  if (exit_code == 0) {
+    std::cout << "All tests passed!\n";
+  }
+
+  return exit_code;
+}
@@ -59,7 +59,17 @@ void CompareGrads(std::vector<double> grad_ref, std::vector<double> grad,
   }
 }
 
-
+// Compares the result of an accessor on a caller buffer with the one of
+// the accessor that returns a vector
+template <typename T>
+void CompareBuffer(const std::vector<T> &ref, const std::vector<T> &buf,
+                   std::string accessor, size_t sys_index, int &exitcode) {
+  if (ref != buf) {
+    std::cerr << " ** Error ** : " << accessor << " on a buffer differs "
+              << "from the vector one for system[" << sys_index << "]\n";
+    exitcode = 1;
+  }
+}
 
 int main(int argc, char** argv)
 {
@@ -107,6 +117,40 @@ int main(int argc, char** argv)
     grads[i] = systems[i].GetGrads();
   }
 
+  // The accessors on caller buffers give the same as the vector ones
+  for (size_t i = 0; i < systems.size(); i++) {
+    size_t n = systems[i].GetNumSites();
+    size_t nr = systems[i].GetNumRealSites();
+    std::vector<double> b3(3*n), br3(3*nr), b(n), br(nr);
+    std::vector<std::string> names(n), rnames(nr);
+    systems[i].GetXyz(b3.data());
+    systems[i].GetRealXyz(br3.data());
+    CompareBuffer(systems[i].GetXyz(), b3, "GetXyz", i, exit_code);
+    CompareBuffer(systems[i].GetRealXyz(), br3, "GetRealXyz", i, exit_code);
+    systems[i].GetGrads(b3.data());
+    systems[i].GetRealGrads(br3.data());
+    CompareBuffer(systems[i].GetGrads(), b3, "GetGrads", i, exit_code);
+    CompareBuffer(systems[i].GetRealGrads(), br3, "GetRealGrads", i,
+                  exit_code);
+    systems[i].GetCharges(b.data());
+    systems[i].GetRealCharges(br.data());
+    CompareBuffer(systems[i].GetCharges(), b, "GetCharges", i, exit_code);
+    CompareBuffer(systems[i].GetRealCharges(), br, "GetRealCharges", i,
+                  exit_code);
+    systems[i].GetPolarizabilities(b.data());
+    systems[i].GetRealPolarizabilities(br.data());
+    CompareBuffer(systems[i].GetPolarizabilities(), b, "GetPolarizabilities",
+                  i, exit_code);
+    CompareBuffer(systems[i].GetRealPolarizabilities(), br,
+                  "GetRealPolarizabilities", i, exit_code);
+    systems[i].GetAtomNames(names.data());
+    systems[i].GetRealAtomNames(rnames.data());
+    CompareBuffer(systems[i].GetAtomNames(), names, "GetAtomNames", i,
+                  exit_code);
+    CompareBuffer(systems[i].GetRealAtomNames(), rnames, "GetRealAtomNames",
+                  i, exit_code);
+  }
+
   // CompareEnergies energies with and without grads
   std::string testcase = "Gradient energies vs. no gradient energies";
   CompareEnergies(energy_nograd, energy_grad, testcase, exit_code);
@@ -167,6 +211,128 @@ int main(int argc, char** argv)
   testcase = "Energies (wgrad) with maller dipole tolerance";
   CompareEnergies(energy_grad, e_grad_test, testcase, exit_code);
 
+  // Dipole tensor computed on the fly instead of stored
+  testcase = "Gradients with dipole tensor computed on the fly";
+  for (size_t i = 0; i < systems.size(); i++) {
+    systems[i].SetDipoleTensorMaxMemory(0.0);
+    e_grad_test[i] = systems[i].Energy(true);
+    grad = systems[i].GetGrads();
+    CompareGrads(grads[i], grad, testcase, i, exit_code);
+  }
+  testcase = "Energies (wgrad) with dipole tensor computed on the fly";
+  CompareEnergies(energy_grad, e_grad_test, testcase, exit_code);
+
+  // Iterative method with and without stored dipole tensor
+  testcase = "Iterative dipoles with dipole tensor stored";
+  for (size_t i = 0; i < systems.size(); i++) {
+    systems[i].SetDipoleMethod("iter");
+    systems[i].SetDipoleTensorMaxMemory(512.0);
+    e_grad_test[i] = systems[i].Energy(true);
+    grad = systems[i].GetGrads();
+    CompareGrads(grads[i], grad, testcase, i, exit_code);
+  }
+  CompareEnergies(energy_grad, e_grad_test, testcase, exit_code);
+
+  testcase = "Iterative dipoles with dipole tensor computed on the fly";
+  for (size_t i = 0; i < systems.size(); i++) {
+    systems[i].SetDipoleTensorMaxMemory(0.0);
+    e_grad_test[i] = systems[i].Energy(true);
+    grad = systems[i].GetGrads();
+    CompareGrads(grads[i], grad, testcase, i, exit_code);
+    systems[i].SetDipoleTensorMaxMemory(512.0);
+  }
+  CompareEnergies(energy_grad, e_grad_test, testcase, exit_code);
+
+  // DIIS accelerated dipoles must converge to the same dipoles, 
+  // in less iterations than the plain iterative method. DIIS counts the
+  // iterations from 1, as CG, and the plain iterative method from 0
+  testcase = "DIIS dipoles with dipole tensor stored";
+  for (size_t i = 0; i < systems.size(); i++) {
+    systems[i].SetDipoleMethod("iter");
+    systems[i].Energy(false);
+    size_t iter_plain = systems[i].GetDipoleIterations() + 1;
+    systems[i].SetDipoleMethod("diis");
+    e_grad_test[i] = systems[i].Energy(true);
+    grad = systems[i].GetGrads();
+    CompareGrads(grads[i], grad, testcase, i, exit_code);
+    std::vector<double> trace = systems[i].GetDipoleResidualTrace();
+    if (systems[i].GetDipoleIterations() > iter_plain
+        || trace.size() != systems[i].GetDipoleIterations()) {
+      std::cerr << " ** Error ** : " << "DIIS took "
+                << systems[i].GetDipoleIterations() << " iterations vs. "
+                << iter_plain << " for system[" << i << "]" << std::endl;
+      exit_code = 1;
+    }
+  }
+  CompareEnergies(energy_grad, e_grad_test, testcase, exit_code);
+
+  testcase = "DIIS dipoles with dipole tensor computed on the fly";
+  for (size_t i = 0; i < systems.size(); i++) {
+    systems[i].SetDipoleTensorMaxMemory(0.0);
+    e_grad_test[i] = systems[i].Energy(true);
+    grad = systems[i].GetGrads();
+    CompareGrads(grads[i], grad, testcase, i, exit_code);
+    systems[i].SetDipoleTensorMaxMemory(512.0);
+  }
+  CompareEnergies(energy_grad, e_grad_test, testcase, exit_code);
+
+  // Direct solution of the dipoles, and fallback to CG for large systems
+  testcase = "Dipoles solved with the Cholesky factorization";
+  for (size_t i = 0; i < systems.size(); i++) {
+    systems[i].SetDipoleMethod("inv");
+    e_grad_test[i] = systems[i].Energy(true);
+    grad = systems[i].GetGrads();
+    CompareGrads(grads[i], grad, testcase, i, exit_code);
+  }
+  CompareEnergies(energy_grad, e_grad_test, testcase, exit_code);
+
+  testcase = "Dipoles with inv above the maximum size";
+  for (size_t i = 0; i < systems.size(); i++) {
+    systems[i].SetDipoleInvMaxSize(0);
+    e_grad_test[i] = systems[i].Energy(true);
+    grad = systems[i].GetGrads();
+    CompareGrads(grads[i], grad, testcase, i, exit_code);
+    systems[i].SetDipoleInvMaxSize(1500);
+  }
+  CompareEnergies(energy_grad, e_grad_test, testcase, exit_code);
+
+  // The single precision tensor must converge to the same dipoles
+  std::vector<std::string> mp_methods = {"cg", "iter", "diis"};
+  for (size_t j = 0; j < mp_methods.size(); j++) {
+    testcase = "Mixed precision dipoles with " + mp_methods[j];
+    for (size_t i = 0; i < systems.size(); i++) {
+      systems[i].SetDipoleMethod(mp_methods[j]);
+      systems[i].SetDipoleTensorMixedPrecision(true);
+      e_grad_test[i] = systems[i].Energy(true);
+      grad = systems[i].GetGrads();
+      CompareGrads(grads[i], grad, testcase, i, exit_code);
+      systems[i].SetDipoleTensorMixedPrecision(false);
+    }
+    CompareEnergies(energy_grad, e_grad_test, testcase, exit_code);
+  }
+
+  // The site properties only follow the coordinates when they change
+  testcase = "Energy after distorting and restoring the coordinates";
+  for (size_t i = 0; i < systems.size(); i++) {
+    systems[i].SetDipoleMethod("cg");
+    std::vector<double> xyz = systems[i].GetXyz();
+    std::vector<double> chg = systems[i].GetCharges();
+    std::vector<double> xyz_d = xyz;
+    xyz_d[0] += 0.05;
+    systems[i].SetXyz(xyz_d);
+    double e_d = systems[i].Energy(false);
+    systems[i].SetXyz(xyz);
+    e_grad_test[i] = systems[i].Energy(true);
+    grad = systems[i].GetGrads();
+    CompareGrads(grads[i], grad, testcase, i, exit_code);
+    if (e_d == e_grad_test[i] || systems[i].GetCharges() != chg) {
+      std::cerr << " ** Error ** : " << "Charges did not follow the "
+                << "coordinates for system[" << i << "]" << std::endl;
+      exit_code = 1;
+    }
+  }
+  CompareEnergies(energy_grad, e_grad_test, testcase, exit_code);
+
   testcase = "ASPC energy for 10 iterations";
   for (size_t i = 0; i < systems.size(); i++) {
     systems[i].SetDipoleMethod("aspc");
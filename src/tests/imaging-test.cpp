@@ -0,0 +1,110 @@
+#include <cmath>
+
+#include <iomanip>
+#include <iostream>
+#include <vector>
+#include <algorithm>
+
+#include "bblock/system.h"
+#include "bblock/sys_tools.h"
+
+// Side of the cubic box, and of a box where the waters are far from
+// half of the box (A)
+#define BOX 10.0
+#define BOX_REF 40.0
+// 2B cutoff, below half of the box so only the closest image counts (A)
+#define CUTOFF 4.95
+// Maximum difference of the coordinates (A) and energies (kcal/mol)
+#define MAX_ERR 1E-10
+
+////////////////////////////////////////////////////////////////////////////////
+
+// A water at the origin, and a water whose oxygen is within half of the
+// box of the first oxygen, and whose first hydrogen is not
+const std::vector<double> water1 = {0.0, 0.0, 0.0,
+                                    0.9572, 0.0, 0.0,
+                                   -0.2400, 0.9266, 0.0};
+const std::vector<double> water2 = {4.9, 0.0, 0.0,
+                                    5.8572, 0.0, 0.0,
+                                    4.6600, 0.9266, 0.0};
+
+// Largest difference between a and b
+double MaxDiff(const std::vector<double> &a, const std::vector<double> &b) {
+  double d = 0.0;
+  for (size_t i = 0; i < a.size(); i++) d = std::max(d, std::abs(a[i] - b[i]));
+  return d;
+}
+
+// Water dimer of the two waters, with water 2 shifted by shift
+void BuildDimer(bblock::System &sys, double shift) {
+  std::vector<double> xyz2(water2);
+  for (size_t j = 0; j < 9; j += 3) xyz2[j] += shift;
+  sys.AddMonomer(water1, {"O", "H", "H"}, "h2o");
+  sys.AddMonomer(xyz2, {"O", "H", "H"}, "h2o");
+  sys.AddMolecule({0});
+  sys.AddMolecule({1});
+  sys.Initialize();
+  sys.Set2bCutoff(CUTOFF);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int main()
+{
+  int exit_code = 0;
+  std::vector<double> box = {BOX, 0.0, 0.0, 0.0, BOX, 0.0, 0.0, 0.0, BOX};
+
+  // The closest image of a monomer is a whole monomer: all its sites are
+  // moved with its first site, also the ones beyond half of the box
+  for (double shift : {0.0, BOX, -BOX}) {
+    std::vector<double> xyz1(water1), xyz2(water2), xyz3(water2);
+    for (size_t j = 0; j < 9; j += 3) {
+      xyz2[j] += shift;
+      xyz3[j] -= shift;
+    }
+    systools::GetCloseDimerImage(box, 3, 3, 1, xyz1.data(), xyz2.data());
+    if (MaxDiff(xyz2, water2) > MAX_ERR) {
+      std::cerr << " ** Error ** : "
+                << "Dimer image of the water shifted by " << shift
+                << " is not the whole water" << std::endl;
+      exit_code = 1;
+    }
+    xyz2 = water2;
+    for (size_t j = 0; j < 9; j += 3) xyz2[j] += shift;
+    systools::GetCloseTrimerImage(box, 3, 3, 3, 1, xyz1.data(), xyz2.data(),
+                                  xyz3.data());
+    if (MaxDiff(xyz2, water2) > MAX_ERR || MaxDiff(xyz3, water2) > MAX_ERR) {
+      std::cerr << " ** Error ** : "
+                << "Trimer images of the waters shifted by " << shift
+                << " are not the whole waters" << std::endl;
+      exit_code = 1;
+    }
+  }
+
+  // With a cutoff below half of the box, the periodic 2B energy of the
+  // dimer is the one in a larger box, wherever its images are
+  std::vector<double> box_ref = {BOX_REF, 0.0, 0.0, 0.0, BOX_REF, 0.0,
+                                 0.0, 0.0, BOX_REF};
+  bblock::System ref;
+  BuildDimer(ref, 0.0);
+  ref.SetPBC(true, box_ref);
+  double e2b_ref = ref.TwoBodyEnergy(true);
+  for (double shift : {0.0, BOX, -BOX}) {
+    bblock::System sys;
+    BuildDimer(sys, shift);
+    sys.SetPBC(true, box);
+    double e2b = sys.TwoBodyEnergy(true);
+    if (std::abs(e2b - e2b_ref) > MAX_ERR) {
+      std::cerr << std::setprecision(10) << " ** Error ** : "
+                << "Periodic 2B energy with the water shifted by " << shift
+                << " is " << e2b << " instead of " << e2b_ref << std::endl;
+      exit_code = 1;
+    }
+  }
+
+  if (exit_code == 0) {
+    std::cout << "All tests passed!" << std::endl;
+  }
+
+  return exit_code;
+}
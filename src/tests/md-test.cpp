@@ -0,0 +1,201 @@
+#include <cmath>
+#include <cassert>
+
+#include <iomanip>
+#include <iostream>
+#include <fstream>
+#include <cstring>
+#include <stdexcept>
+#include <map>
+
+#include "io_tools/read_nrg.h"
+#include "io_tools/write_nrg.h"
+
+#include "bblock/system.h"
+
+// Number of MD steps and timestep (fs)
+#define NSTEPS 2000
+#define DT 0.2
+// Number of steps averaged at the beginning and end of the trajectory
+#define NAVG 200
+// Maximum allowed drift of the total energy (kcal/mol) between the
+// beginning and the end of the NVE trajectory
+#define MAX_DRIFT 5E-04
+// Tolerance for the comparison of restarted and continuous trajectories
+#define REST_TOL 1E-08
+// Tolerance for the comparison of trajectories with converged dipoles
+#define CONV_TOL 1E-06
+// Conversion from kcal/mol/A/amu to A/fs^2
+#define ACC_CONV 4.184E-04
+
+namespace {
+
+static std::vector<bblock::System> systems;
+
+// Masses (amu) of the atoms that can be found in the systems
+static std::map<std::string, double> masses = {
+  {"O", 15.9949}, {"H", 1.0079}, {"F", 18.9984}, {"Cl", 35.453},
+  {"Br", 79.904}, {"I", 126.904}, {"Li", 6.941}, {"Na", 22.9898},
+  {"K", 39.0983}, {"Rb", 85.4678}, {"Cs", 132.905}
+};
+
+} // namespace
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Runs a NVE trajectory with velocity verlet, starting from rest,
+// and returns the total energy at each step.
+// If restart is true, the dipole history is stored at step NSTEPS/2
+// and the trajectory is continued from that point in a copy of the system.
+std::vector<double> RunNVE(bblock::System sys, std::string method,
+                           bool restart) {
+  sys.SetDipoleMethod(method);
+  sys.ResetDipoleHistory();
+
+  std::vector<std::string> atoms = sys.GetRealAtomNames();
+  std::vector<double> xyz = sys.GetRealXyz();
+  std::vector<double> vel(xyz.size(), 0.0);
+  std::vector<double> invm(atoms.size());
+  for (size_t i = 0; i < atoms.size(); i++) {
+    invm[i] = 1.0 / masses[atoms[i]];
+  }
+
+  double epot = sys.Energy(true);
+  std::vector<double> grad = sys.GetRealGrads();
+  std::vector<double> etot;
+
+  for (size_t step = 0; step < NSTEPS; step++) {
+    // Half step in velocities and full step in positions
+    for (size_t i = 0; i < xyz.size(); i++) {
+      vel[i] -= 0.5 * DT * ACC_CONV * grad[i] * invm[i/3];
+      xyz[i] += DT * vel[i];
+    }
+
+    // Checkpoint and restart the auxiliary dipoles in a new system
+    if (restart && step == NSTEPS/2) {
+      std::vector<double> hist = sys.GetDipoleHistory();
+      bblock::System sys_restart = sys;
+      sys_restart.ResetDipoleHistory();
+      sys_restart.SetDipoleHistory(hist);
+      sys = sys_restart;
+    }
+
+    sys.SetRealXyz(xyz);
+    epot = sys.Energy(true);
+    grad = sys.GetRealGrads();
+
+    // Second half step in velocities
+    double ekin = 0.0;
+    for (size_t i = 0; i < xyz.size(); i++) {
+      vel[i] -= 0.5 * DT * ACC_CONV * grad[i] * invm[i/3];
+      ekin += 0.5 * vel[i] * vel[i] / invm[i/3];
+    }
+    ekin /= ACC_CONV;
+
+    etot.push_back(epot + ekin);
+  }
+
+  return etot;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Drift of the total energy, as the difference between the averages 
+// at the end and at the beginning of the trajectory
+double Drift(const std::vector<double> &etot) {
+  double e_start = 0.0;
+  double e_end = 0.0;
+  for (size_t i = 0; i < NAVG; i++) {
+    e_start += etot[i];
+    e_end += etot[etot.size() - NAVG + i];
+  }
+  return std::abs(e_end - e_start) / NAVG;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char** argv)
+{
+
+  if (argc != 2) {
+    std::cerr << "usage: md-test input.nrg"
+              << std::endl;
+    return 0;
+  }
+
+  try {
+    std::ifstream ifs(argv[1]);
+
+    if (!ifs){
+      throw std::runtime_error("could not open the NRG file");
+    }
+
+    tools::ReadNrg(argv[1], systems);
+  } catch (const std::exception& e) {
+    std::cerr << " ** Error ** : " << e.what() << std::endl;
+    return 1;
+  }
+
+  // Declare return code
+  int exit_code = 0;
+
+  // Energy conservation with converged dipoles, ASPC and the
+  // extended Lagrangian dipoles (with and without checkpoint/restart)
+  std::vector<std::string> methods = {"cg", "aspc", "iel"};
+  for (size_t i = 0; i < systems.size(); i++) {
+    std::vector<double> etot_cg;
+    for (size_t j = 0; j < methods.size(); j++) {
+      std::vector<double> etot = RunNVE(systems[i], methods[j], false);
+      double drift = Drift(etot);
+      if (drift > MAX_DRIFT) {
+        std::cerr << " ** Error ** : " << "Total energy drift of "
+                  << drift << " kcal/mol for system[" << i
+                  << "] with method " << methods[j] << std::endl;
+        exit_code = 1;
+      }
+      if (methods[j] == "cg") etot_cg = etot;
+    }
+
+    // Lower order ASPC
+    for (size_t k = 2; k < 4; k++) {
+      bblock::System sys = systems[i];
+      sys.SetAspcOrder(k);
+      double drift = Drift(RunNVE(sys, "aspc", false));
+      if (drift > MAX_DRIFT) {
+        std::cerr << " ** Error ** : " << "Total energy drift of "
+                  << drift << " kcal/mol for system[" << i
+                  << "] with ASPC of order " << k << std::endl;
+        exit_code = 1;
+      }
+    }
+
+    // ASPC with the corrector applied until convergence must follow 
+    // the trajectory with converged dipoles
+    bblock::System sys = systems[i];
+    sys.SetAspcCorrector(1000, 1E-18);
+    std::vector<double> etot_aspc = RunNVE(sys, "aspc", false);
+    if (std::abs(etot_aspc.back() - etot_cg.back()) > CONV_TOL) {
+      std::cerr << " ** Error ** : " << "Converged ASPC trajectory for system["
+                << i << "] does not match CG: " << etot_aspc.back() << " vs. "
+                << etot_cg.back() << std::endl;
+      exit_code = 1;
+    }
+
+    // Restarting from the checkpointed auxiliary dipoles must give
+    // the same trajectory
+    std::vector<double> etot = RunNVE(systems[i], "iel", false);
+    std::vector<double> etot_rest = RunNVE(systems[i], "iel", true);
+    if (std::abs(etot.back() - etot_rest.back()) > REST_TOL) {
+      std::cerr << " ** Error ** : " << "Restarted iel trajectory for system["
+                << i << "] does not match: " << etot.back() << " vs. "
+                << etot_rest.back() << std::endl;
+      exit_code = 1;
+    }
+  }
+
+  if (exit_code == 0) {
+    std::cout << "All tests passed!\n";
+  }
+
+  return exit_code;
+}
@@ -0,0 +1,68 @@
+#include <cmath>
+
+#include <iomanip>
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <chrono>
+
+#include "io_tools/read_nrg.h"
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Reads the NRG file with the stream reader, one line at a time
+void ReadNrgStream(char* filename, std::vector<bblock::System> &systems) {
+  std::ifstream ifs(filename);
+  size_t lineno(0);
+  while (true) {
+    systems.push_back(bblock::System());
+    tools::ReadSystem(lineno, ifs, systems.back());
+
+    std::streampos oldpos = ifs.tellg();
+    std::string line;
+    std::getline(ifs, line);
+    if (ifs.eof() or line.empty()) {
+      break;
+    } else {
+      ifs.seekg(oldpos);
+    }
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Reports the throughput of the memory mapped NRG reader (tools::ReadNrg),
+// and of the stream reader, for the NRG file in the first argument
+int main(int argc, char** argv)
+{
+  if (argc < 2) {
+    std::cerr << "usage: nrg-bench <input.nrg>" << std::endl;
+    return 1;
+  }
+
+  std::ifstream ifs(argv[1], std::ios::binary | std::ios::ate);
+  double mbytes = double(ifs.tellg()) / 1E6;
+  ifs.close();
+
+  for (size_t k = 0; k < 2; k++) {
+    std::vector<bblock::System> systems;
+    auto t1 = std::chrono::high_resolution_clock::now();
+    if (k == 0) {
+      tools::ReadNrg(argv[1], systems);
+    } else {
+      ReadNrgStream(argv[1], systems);
+    }
+    auto t2 = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> t = t2 - t1;
+
+    std::cout << std::scientific << std::setprecision(3)
+              << (k == 0 ? "mmap reader  " : "stream reader")
+              << "  systems: " << systems.size()
+              << "  time: " << t.count() << " s"
+              << "  throughput: " << mbytes / t.count() << " MB/s"
+              << std::endl;
+  }
+
+  return 0;
+}
@@ -0,0 +1,439 @@
+#include <cmath>
+#include <cstdio>
+
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <random>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <functional>
+#include <algorithm>
+#include <set>
+
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "io_tools/read_nrg.h"
+#include "io_tools/nrg_server.h"
+
+#include "bblock/system.h"
+
+// Number of frames evaluated by each client
+#define NFRAMES 4
+// Amplitude of the random displacements of the frames (A)
+#define DISPLACEMENT 0.05
+// Box of the periodic frames (A)
+#define BOX 12.0
+// Maximum difference between the server and a new system (kcal/mol and
+// kcal/mol/A)
+#define MAX_ERR 1E-10
+// Socket of the server, and clients that use it at once
+#define SOCKET "nrg_server-test.sock"
+#define NCLIENTS 2
+// Send timeout of the server whose client does not read (s)
+#define SEND_TIMEOUT 0.5
+
+////////////////////////////////////////////////////////////////////////////////
+
+// A chloride, a water dimer in one molecule and a water, and a water alone
+const std::string cluster_nrg =
+    "SYSTEM\n"
+    "MOLECULE\nMONOMER cl\nCl 1.0 0.5 3.0\nENDMON\nENDMOL\n"
+    "MOLECULE\nMONOMER h2o\n"
+    "O -1.58972425 1.04337922 -0.08780840\n"
+    "H -0.63591971 0.97898520 0.00000000\n"
+    "H -1.90066280 1.74501050 -0.66454990\n"
+    "ENDMON\nMONOMER h2o\n"
+    "O 1.64924507 1.08594656 0.00000000\n"
+    "H 2.60878026 1.09587704 -0.02817115\n"
+    "H 1.33830653 1.78757784 0.57674150\n"
+    "ENDMON\nENDMOL\n"
+    "MOLECULE\nMONOMER h2o\n"
+    "O -0.61315209 2.46976336 2.07005086\n"
+    "H 0.34684791 2.46976336 2.07005086\n"
+    "H -0.93360667 3.37469919 2.07005086\n"
+    "ENDMON\nENDMOL\n"
+    "ENDSYS\n";
+const std::string water_nrg =
+    "SYSTEM\nMOLECULE\nMONOMER h2o\n"
+    "O -1.58972425 1.04337922 -0.08780840\n"
+    "H -0.63591971 0.97898520 0.00000000\n"
+    "H -1.90066280 1.74501050 -0.66454990\n"
+    "ENDMON\nENDMOL\nENDSYS\n";
+// Two waters at the same place, whose dipoles do not converge
+const std::string twin_nrg =
+    "SYSTEM\nMOLECULE\nMONOMER h2o\n"
+    "O -1.58972425 1.04337922 -0.08780840\n"
+    "H -0.63591971 0.97898520 0.00000000\n"
+    "H -1.90066280 1.74501050 -0.66454990\n"
+    "ENDMON\nENDMOL\n"
+    "MOLECULE\nMONOMER h2o\n"
+    "O -1.58972425 1.04337922 -0.08780840\n"
+    "H -0.63591971 0.97898520 0.00000000\n"
+    "H -1.90066280 1.74501050 -0.66454990\n"
+    "ENDMON\nENDMOL\nENDSYS\n";
+
+// Reference energy, gradients and virial of a frame, from a new system,
+// and its energy without gradients, also from a new system
+struct Frame {
+  std::vector<double> xyz;
+  std::vector<double> box;
+  double energy;
+  double energy_nograd;
+  std::vector<double> grad;
+  std::vector<double> virial;
+};
+
+// Frames with random displacements of the cluster. The odd frames are
+// periodic
+std::vector<Frame> Frames() {
+  std::mt19937 gen(17);
+  std::uniform_real_distribution<double> u(-DISPLACEMENT, DISPLACEMENT);
+  std::vector<Frame> frames(NFRAMES);
+  for (size_t n = 0; n < NFRAMES; n++) {
+    Frame &f = frames[n];
+    bblock::System sys;
+    tools::ParseNrgSystem(cluster_nrg.data(),
+                          cluster_nrg.data() + cluster_nrg.size(), 1, sys);
+    f.xyz = sys.GetRealXyz();
+    for (size_t i = 0; i < f.xyz.size(); i++) f.xyz[i] += u(gen);
+    sys.SetRealXyz(f.xyz);
+    if (n % 2 == 1) {
+      f.box = {BOX, 0.0, 0.0, 0.0, BOX, 0.0, 0.0, 0.0, BOX};
+      sys.SetPBC(true, f.box);
+    }
+    bblock::System sys_nograd(sys);
+    f.energy = sys.Energy(true);
+    f.grad = sys.GetRealGrads();
+    f.virial = sys.GetVirial();
+    f.energy_nograd = sys_nograd.Energy(false);
+  }
+  return frames;
+}
+
+// Largest difference between the n values of a and b
+double MaxDiff(const double* a, const double* b, size_t n) {
+  double d = 0.0;
+  for (size_t i = 0; i < n; i++) d = std::max(d, std::abs(a[i] - b[i]));
+  return d;
+}
+
+// Evaluates the frames with the client, and compares them with the
+// reference. Returns the number of errors
+int CheckFrames(tools::EnergyClient &client, const std::vector<Frame> &frames,
+                const std::string &label) {
+  int errors = 0;
+  size_t nat;
+  uint64_t id = client.AddTopology(cluster_nrg, nat);
+  std::vector<double> grad(3*nat), virial(9);
+  for (size_t n = 0; n < frames.size(); n++) {
+    const Frame &f = frames[n];
+    const double* box = f.box.empty() ? 0 : f.box.data();
+    double e = client.Energy(id, f.xyz.data(), nat, grad.data(),
+                             virial.data(), box);
+    double e_nograd = client.Energy(id, f.xyz.data(), nat, 0, 0, box);
+    double dg = MaxDiff(grad.data(), f.grad.data(), grad.size());
+    double dv = MaxDiff(virial.data(), f.virial.data(), 9);
+    if (std::abs(e - f.energy) > MAX_ERR || dg > MAX_ERR || dv > MAX_ERR
+        || std::abs(e_nograd - f.energy_nograd) > MAX_ERR) {
+      std::cerr << std::setprecision(16) << " ** Error ** : " << label << " frame " << n
+                << ": energy " << e << " (" << e_nograd << " without"
+                << " gradients) vs " << f.energy << " ("
+                << f.energy_nograd << ")"
+                << ", max gradient difference " << dg
+                << ", max virial difference " << dv << std::endl;
+      errors++;
+    }
+  }
+  return errors;
+}
+
+// Checks that the request fails with an error of the server
+int CheckFails(const std::string &label, std::function<void()> request) {
+  try {
+    request();
+  } catch (const std::runtime_error &) {
+    return 0;
+  }
+  std::cerr << " ** Error ** : " << label << " did not fail" << std::endl;
+  return 1;
+}
+
+// Writes or reads n bytes of p on fd. Return false if it fails
+bool RawWrite(int fd, const void* p, size_t n) {
+  const char* c = static_cast<const char*>(p);
+  while (n > 0) {
+    ssize_t k = write(fd, c, n);
+    if (k <= 0) return false;
+    c += k;
+    n -= k;
+  }
+  return true;
+}
+bool RawRead(int fd, void* p, size_t n) {
+  char* c = static_cast<char*>(p);
+  while (n > 0) {
+    ssize_t k = read(fd, c, n);
+    if (k <= 0) return false;
+    c += k;
+    n -= k;
+  }
+  return true;
+}
+
+// Sends nreq energy requests of the frame at once, without reading the
+// replies, more than the requests a connection can have in flight. Then
+// reads all the replies. Returns the number of errors
+int CheckPipelined(int fd, uint64_t id, const Frame &f, size_t nreq) {
+  const size_t size = sizeof(double) * (1 + f.xyz.size());
+  std::vector<char> request(sizeof(tools::ServerHeader) + size);
+  std::memcpy(request.data() + sizeof(tools::ServerHeader), &id, sizeof(id));
+  std::memcpy(request.data() + sizeof(tools::ServerHeader) + sizeof(id),
+              f.xyz.data(), sizeof(double) * f.xyz.size());
+
+  // The replies are read by another thread, so the server can always
+  // write them
+  std::atomic<int> errors(0);
+  std::thread reader([&] {
+    std::set<uint64_t> tags;
+    for (size_t n = 0; n < nreq; n++) {
+      tools::ServerHeader h;
+      double e;
+      if (!RawRead(fd, &h, sizeof(h)) || h.flags != tools::SRV_OK
+          || h.size != sizeof(e) || !RawRead(fd, &e, sizeof(e))
+          || std::abs(e - f.energy_nograd) > MAX_ERR) {
+        errors++;
+        return;
+      }
+      tags.insert(h.tag);
+    }
+    if (tags.size() != nreq) errors++;
+  });
+  for (size_t n = 0; n < nreq; n++) {
+    tools::ServerHeader h = {tools::SRV_ENERGY, 0, 1000 + n, size};
+    std::memcpy(request.data(), &h, sizeof(h));
+    if (!RawWrite(fd, request.data(), request.size())) {
+      errors++;
+      break;
+    }
+  }
+  reader.join();
+  if (errors > 0) {
+    std::cerr << " ** Error ** : " << "pipelined requests failed"
+              << std::endl;
+  }
+  return errors;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int main()
+{
+  int exit_code = 0;
+  std::vector<Frame> frames = Frames();
+
+  // Server reading a channel, as the standard input, with two workers
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+    std::cerr << " ** Error ** : could not create the socket pair"
+              << std::endl;
+    return 1;
+  }
+  {
+    tools::EnergyServer server(2);
+    std::thread serve([&server, &sv] { server.Serve(sv[0], sv[0]); });
+    tools::EnergyClient client(sv[1], sv[1]);
+
+    size_t nat, nat_water;
+    uint64_t id = client.AddTopology(cluster_nrg, nat);
+    uint64_t id_water = client.AddTopology(water_nrg, nat_water);
+    uint64_t id_again = client.AddTopology(cluster_nrg, nat);
+    if (nat != 10 || nat_water != 3 || id == id_water || id_again != id) {
+      std::cerr << " ** Error ** : " << "topologies " << id << " ("
+                << nat << " sites), " << id_water << " (" << nat_water
+                << " sites) and " << id_again << std::endl;
+      exit_code = 1;
+    }
+
+    if (CheckFrames(client, frames, "channel")) exit_code = 1;
+
+    // Errors are reported, and the server goes on
+    std::vector<double> xyz(frames[0].xyz);
+    if (CheckFails("unknown topology", [&] {
+          client.Energy(id + 10, xyz.data(), nat);
+        }) ||
+        CheckFails("wrong number of sites", [&] {
+          client.Energy(id, xyz.data(), nat - 1);
+        }) ||
+        CheckFails("wrong NRG block", [&] {
+          client.AddTopology("MOLECULE\nENDMOL\n", nat_water);
+        }) ||
+        CheckFails("dipoles that do not converge", [&] {
+          size_t nat_twin;
+          uint64_t id_twin = client.AddTopology(twin_nrg, nat_twin);
+          std::vector<double> xyz_twin(xyz.begin() + 3, xyz.begin() + 12);
+          xyz_twin.insert(xyz_twin.end(), xyz_twin.begin(), xyz_twin.end());
+          client.Energy(id_twin, xyz_twin.data(), nat_twin);
+        })) {
+      exit_code = 1;
+    }
+    if (CheckFrames(client, frames, "channel after errors")) exit_code = 1;
+
+    // More requests at once than the server keeps in flight
+    if (CheckPipelined(sv[1], id, frames[0], 3*tools::SRV_MAX_PENDING))
+      exit_code = 1;
+
+    client.Shutdown();
+    serve.join();
+    if (server.GetNumTopologies() != 3) {
+      std::cerr << " ** Error ** : " << server.GetNumTopologies()
+                << " topologies instead of 3" << std::endl;
+      exit_code = 1;
+    }
+  }
+  close(sv[0]);
+  close(sv[1]);
+
+  // A request larger than any valid one is rejected before its payload
+  // is read, and ends the connection
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+    std::cerr << " ** Error ** : could not create the socket pair"
+              << std::endl;
+    return 1;
+  }
+  {
+    tools::EnergyServer server(1);
+    bool closed = false;
+    std::thread serve([&server, &sv, &closed] {
+      try {
+        server.Serve(sv[0], sv[0]);
+      } catch (const std::runtime_error &) {
+        closed = true;
+      }
+    });
+    tools::ServerHeader h = {tools::SRV_TOPOLOGY, 0, 1, uint64_t(1) << 40};
+    if (!RawWrite(sv[1], &h, sizeof(h)) || !RawRead(sv[1], &h, sizeof(h))
+        || h.flags != tools::SRV_ERROR) {
+      std::cerr << " ** Error ** : " << "request of 1 TiB not rejected"
+                << std::endl;
+      exit_code = 1;
+    }
+    serve.join();
+    if (!closed) {
+      std::cerr << " ** Error ** : " << "request of 1 TiB did not end the"
+                << " connection" << std::endl;
+      exit_code = 1;
+    }
+  }
+  close(sv[0]);
+  close(sv[1]);
+
+  // A client that does not read its replies has its connection closed
+  // after the send timeout, and the only worker goes on with the other
+  // clients
+  int sv2[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0
+      || socketpair(AF_UNIX, SOCK_STREAM, 0, sv2) != 0) {
+    std::cerr << " ** Error ** : could not create the socket pair"
+              << std::endl;
+    return 1;
+  }
+  {
+    tools::EnergyServer server(1, 1, SEND_TIMEOUT);
+    // The replies fill the smallest send buffer
+    int sndbuf = 1;
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    std::thread serve([&server, &sv] {
+      try {
+        server.Serve(sv[0], sv[0]);
+      } catch (const std::runtime_error &) {
+      }
+    });
+    size_t nat;
+    uint64_t id;
+    {
+      tools::EnergyClient client(sv[1], sv[1]);
+      id = client.AddTopology(cluster_nrg, nat);
+    }
+    const Frame &f = frames[0];
+    const size_t size = sizeof(double) * (1 + f.xyz.size());
+    std::vector<char> request(sizeof(tools::ServerHeader) + size);
+    std::memcpy(request.data() + sizeof(tools::ServerHeader), &id,
+                sizeof(id));
+    std::memcpy(request.data() + sizeof(tools::ServerHeader) + sizeof(id),
+                f.xyz.data(), sizeof(double) * f.xyz.size());
+    for (size_t n = 0; n < tools::SRV_MAX_PENDING; n++) {
+      tools::ServerHeader h = {tools::SRV_ENERGY, tools::SRV_GRADS, n, size};
+      std::memcpy(request.data(), &h, sizeof(h));
+      if (!RawWrite(sv[1], request.data(), request.size())) break;
+    }
+    serve.join();
+
+    std::thread serve2([&server, &sv2] { server.Serve(sv2[0], sv2[0]); });
+    {
+      tools::EnergyClient client(sv2[1], sv2[1]);
+      if (CheckFrames(client, frames, "client after one that does not read"))
+        exit_code = 1;
+    }
+    shutdown(sv2[1], SHUT_WR);
+    serve2.join();
+  }
+  close(sv[0]);
+  close(sv[1]);
+  close(sv2[0]);
+  close(sv2[1]);
+
+  // Server listening on a UNIX domain socket, with several clients at
+  // once
+  {
+    tools::EnergyServer server(NCLIENTS);
+    std::thread listen([&server] { server.Listen(SOCKET); });
+
+    std::atomic<int> errors(0);
+    std::vector<std::thread> clients;
+    for (size_t c = 0; c < NCLIENTS; c++) {
+      clients.push_back(std::thread([&frames, &errors, c] {
+        // Wait for the server to listen
+        for (size_t k = 0; k < 500; k++) {
+          try {
+            tools::EnergyClient client(SOCKET);
+            errors += CheckFrames(client, frames,
+                                  "socket client " + std::to_string(c));
+            return;
+          } catch (const std::runtime_error &e) {
+            if (std::string(e.what()).find("could not connect")
+                == std::string::npos) {
+              std::cerr << " ** Error ** : " << e.what() << std::endl;
+              errors++;
+              return;
+            }
+          }
+          std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        std::cerr << " ** Error ** : could not connect to the server"
+                  << std::endl;
+        errors++;
+      }));
+    }
+    for (size_t c = 0; c < NCLIENTS; c++) clients[c].join();
+    if (errors > 0) exit_code = 1;
+
+    try {
+      tools::EnergyClient client(SOCKET);
+      client.Shutdown();
+    } catch (const std::exception &e) {
+      std::cerr << " ** Error ** : " << e.what() << std::endl;
+      exit_code = 1;
+    }
+    listen.join();
+  }
+
+  if (exit_code == 0) {
+    std::cout << "All tests passed!" << std::endl;
+  }
+  return exit_code;
+}
@@ -0,0 +1,143 @@
+#include <cmath>
+
+#include <iomanip>
+#include <iostream>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+
+#include "potential/dispersion/disptools.h"
+
+// Number of points in the benchmark and number of repetitions
+#define NPOINTS 100000
+#define NREP 20
+// Largest x in the benchmark
+#define XMAX 40.0
+// Maximum relative error allowed against the exact damping
+#define MAX_REL_ERR 1E-13
+// Maximum relative error allowed against the reference implementation,
+// which stops its small x series at a relative term of 1E-08
+#define MAX_REF_ERR 1E-07
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Exact Tang-Toennies damping of order n, in long double. For small x,
+// the series of the terms above n is summed, so there is no cancellation.
+double ExactTT(int n, double xd) {
+  long double x = xd;
+  long double term = 1.0L;
+  long double sum_low = 0.0L;
+  long double sum_high = 0.0L;
+  for (int k = 0; k < 200; k++) {
+    if (k > 0) term *= x / k;
+    if (k <= n) {
+      sum_low += term;
+    } else {
+      sum_high += term;
+    }
+  }
+  if (x < 10.0L) return double(sum_high * std::exp(-x));
+  return double(1.0L - sum_low * std::exp(-x));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Compares the vectorizable TT6 and TT8 dampings against the exact values
+// and the reference implementation, and reports the throughput of both.
+// The throughput is printed to the standard error, since it depends on the
+// machine.
+int main()
+{
+  // Declare return code
+  int exit_code = 0;
+
+  // Points in (0, XMAX], denser at small x where the damping is small
+  std::vector<double> x(NPOINTS);
+  for (size_t i = 0; i < NPOINTS; i++) {
+    double t = double(i + 1) / NPOINTS;
+    x[i] = XMAX * t * t;
+  }
+
+  const int orders[2] = {6, 8};
+  std::vector<double> tt_ref(NPOINTS);
+  std::vector<double> tt(NPOINTS);
+
+  for (size_t o = 0; o < 2; o++) {
+    const int n = orders[o];
+
+    // Reference
+    auto t1 = std::chrono::high_resolution_clock::now();
+    for (size_t rep = 0; rep < NREP; rep++) {
+      for (size_t i = 0; i < NPOINTS; i++) {
+        tt_ref[i] = disp::tang_toennies(n, x[i]);
+      }
+    }
+    auto t2 = std::chrono::high_resolution_clock::now();
+
+    // Branch-free, in a vectorizable loop
+    for (size_t rep = 0; rep < NREP; rep++) {
+      if (n == 6) {
+#       ifdef _OPENMP
+#         pragma omp simd
+#       endif
+        for (size_t i = 0; i < NPOINTS; i++) {
+          tt[i] = disp::tang_toennies6(x[i], ExpSimd(-x[i]));
+        }
+      } else {
+#       ifdef _OPENMP
+#         pragma omp simd
+#       endif
+        for (size_t i = 0; i < NPOINTS; i++) {
+          tt[i] = disp::tang_toennies8(x[i], ExpSimd(-x[i]));
+        }
+      }
+    }
+    auto t3 = std::chrono::high_resolution_clock::now();
+
+    double max_rel = 0.0;
+    double max_ref = 0.0;
+    for (size_t i = 0; i < NPOINTS; i++) {
+      const double exact = ExactTT(n, x[i]);
+      max_rel = std::max(max_rel, std::abs(tt[i] - exact) / exact);
+      max_ref = std::max(max_ref, std::abs(tt[i] - tt_ref[i]) / exact);
+    }
+
+    std::chrono::duration<double> t_ref = t2 - t1;
+    std::chrono::duration<double> t_fast = t3 - t2;
+    double neval = double(NPOINTS) * NREP;
+
+    std::cerr << std::scientific << std::setprecision(3)
+              << "tang_toennies(" << n << ",x): "
+              << neval / t_ref.count() << " evals/s\n"
+              << "tang_toennies" << n << "(x)  : "
+              << neval / t_fast.count() << " evals/s\n"
+              << "Max relative error: " << max_rel << "\n"
+              << "Max relative difference with reference: " << max_ref
+              << std::endl;
+
+    if (max_rel > MAX_REL_ERR || max_ref > MAX_REF_ERR) {
+      std::cerr << " ** Error ** : " << "tang_toennies" << n
+                << " does not match the exact damping" << std::endl;
+      exit_code = 1;
+    }
+  }
+
+  // The vectorizable exponential in the range used by the dampings
+  double max_exp = 0.0;
+  for (size_t i = 0; i < NPOINTS; i++) {
+    const double e = std::exp(-x[i]);
+    max_exp = std::max(max_exp, std::abs(ExpSimd(-x[i]) - e) / e);
+  }
+  std::cerr << "Max relative error ExpSimd: " << max_exp << std::endl;
+  if (max_exp > MAX_REL_ERR) {
+    std::cerr << " ** Error ** : " << "ExpSimd does not match std::exp"
+              << std::endl;
+    exit_code = 1;
+  }
+
+  if (exit_code == 0) {
+    std::cout << "All tests passed!\n";
+  }
+
+  return exit_code;
+}
@@ -0,0 +1,179 @@
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+#include <iomanip>
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <random>
+#include <chrono>
+#include <utility>
+#include <algorithm>
+
+#include "io_tools/read_nrg.h"
+
+// Default number of frames and of waters
+#define NFRAMES 200
+#define NWAT 64
+// Amplitude (A) and period (frames) of the oscillations of the atoms
+#define AMPLITUDE 0.02
+#define PERIOD 40.0
+// Corrector of the ASPC predictions of the dipoles. A single corrector
+// step drifts away along this trajectory
+#define ASPC_MAXIT 100
+#define ASPC_TOL 1E-08
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Writes a trajectory of nwat waters, in which every atom oscillates around
+// its position in the first system of the NRG file input, as an NRG file
+// with one SYSTEM per frame. Returns the number of waters
+size_t WriteTrajectory(char* input, const char* filename, size_t nframes,
+                       size_t nwat) {
+  tools::NrgFile file(input);
+  const char* begin;
+  const char* end;
+  size_t lineno;
+  if (!file.NextSystem(begin, end, lineno))
+    throw std::runtime_error("No SYSTEM found in the NRG file");
+  bblock::System sys0;
+  tools::ParseNrgSystem(begin, end, lineno, sys0);
+
+  // Waters of the system, sorted by the distance of their oxygen to the
+  // oxygen of the first one, so the trajectory is a compact cluster
+  std::vector<double> xyz_all = sys0.GetRealXyz();
+  std::vector<size_t> water_first;
+  size_t first = 0;
+  for (size_t m = 0; m < sys0.GetNumMon(); m++) {
+    if (sys0.GetMonId(m) == "h2o") water_first.push_back(first);
+    first += sys0.GetMonNumAt(m);
+  }
+  if (water_first.empty())
+    throw std::runtime_error("No water in the first SYSTEM");
+  std::vector<std::pair<double, size_t> > waters;
+  const double* o0 = xyz_all.data() + 3*water_first[0];
+  for (size_t i = 0; i < water_first.size(); i++) {
+    const double* o = xyz_all.data() + 3*water_first[i];
+    double r2 = (o[0] - o0[0]) * (o[0] - o0[0])
+              + (o[1] - o0[1]) * (o[1] - o0[1])
+              + (o[2] - o0[2]) * (o[2] - o0[2]);
+    waters.push_back(std::make_pair(r2, water_first[i]));
+  }
+  std::sort(waters.begin(), waters.end());
+  waters.resize(std::min(nwat, waters.size()));
+  std::vector<double> xyz0;
+  for (size_t i = 0; i < waters.size(); i++) {
+    xyz0.insert(xyz0.end(), xyz_all.begin() + 3*waters[i].second,
+                xyz_all.begin() + 3*waters[i].second + 9);
+  }
+
+  std::mt19937 gen(11);
+  std::uniform_real_distribution<double> u(0.0, 2.0 * M_PI);
+  std::vector<double> phase(xyz0.size());
+  for (size_t i = 0; i < phase.size(); i++) phase[i] = u(gen);
+
+  FILE* f = std::fopen(filename, "w");
+  const char* names[3] = {"O", "H", "H"};
+  for (size_t n = 0; n < nframes; n++) {
+    std::fprintf(f, "SYSTEM %zu\n", n);
+    for (size_t i = 0; i < xyz0.size() / 9; i++) {
+      std::fprintf(f, "MOLECULE\nMONOMER h2o\n");
+      for (size_t a = 0; a < 3; a++) {
+        std::fprintf(f, "%s", names[a]);
+        for (size_t c = 0; c < 3; c++) {
+          size_t k = 9*i + 3*a + c;
+          std::fprintf(f, " %20.12f", xyz0[k] + AMPLITUDE
+                       * std::sin(2.0 * M_PI * n / PERIOD + phase[k]));
+        }
+        std::fprintf(f, "\n");
+      }
+      std::fprintf(f, "ENDMON\nENDMOL\n");
+    }
+    std::fprintf(f, "ENDSYS\n");
+  }
+  std::fclose(f);
+  return xyz0.size() / 9;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Reports the time per frame of the setup of the system and of its energy
+// for a many-frame water trajectory, built from the NRG file in the first
+// argument, with a new system for each frame,
+// with one system whose coordinates are updated, and with one system that
+// also carries the history of the dipoles between frames (the ASPC
+// predictor of the default dipole method, with an iterated corrector).
+// Also reports the time of tools::ReadNrg, which copies the systems with
+// the same topology instead of initializing them.
+int main(int argc, char** argv)
+{
+  if (argc < 2) {
+    std::cerr << "usage: trajectory-bench <input.nrg> [nframes] [nwaters]"
+              << std::endl;
+    return 1;
+  }
+  size_t nframes = argc > 2 ? std::strtoul(argv[2], 0, 10) : NFRAMES;
+  size_t nwat = argc > 3 ? std::strtoul(argv[3], 0, 10) : NWAT;
+  const char* filename = "trajectory-bench.nrg";
+  nwat = WriteTrajectory(argv[1], filename, nframes, nwat);
+
+  std::cout << "frames: " << nframes << "  waters: " << nwat << std::endl;
+
+  std::vector<double> ref;
+  const char* labels[3] = {"new system   ", "reused system", "reused + aspc"};
+  for (size_t k = 0; k < 3; k++) {
+    tools::NrgFile file(filename);
+    const char* begin;
+    const char* end;
+    size_t lineno;
+    bblock::System sys;
+    bool have_sys = false;
+    std::chrono::duration<double> t_setup(0), t_energy(0);
+    double max_de = 0.0;
+    size_t iter = 0;
+    for (size_t n = 0; file.NextSystem(begin, end, lineno); n++) {
+      auto t1 = std::chrono::high_resolution_clock::now();
+      if (k == 0) {
+        sys = bblock::System();
+        tools::ParseNrgSystem(begin, end, lineno, sys);
+      } else if (!have_sys
+                 || !tools::SetNrgCoordinates(begin, end, lineno, sys)) {
+        sys = bblock::System();
+        tools::ParseNrgSystem(begin, end, lineno, sys);
+        if (k == 2) sys.SetAspcCorrector(ASPC_MAXIT, ASPC_TOL);
+        have_sys = true;
+      }
+      // Without history, every frame starts the dipoles from scratch, as
+      // a new system does
+      if (k == 1) sys.ResetDipoleHistory();
+      auto t2 = std::chrono::high_resolution_clock::now();
+      double e = sys.Energy(true);
+      auto t3 = std::chrono::high_resolution_clock::now();
+      t_setup += t2 - t1;
+      t_energy += t3 - t2;
+      iter += sys.GetDipoleIterations();
+      if (k == 0) ref.push_back(e);
+      max_de = std::max(max_de, std::abs(e - ref[n]));
+    }
+
+    std::cout << std::scientific << std::setprecision(3) << labels[k]
+              << "  setup: " << t_setup.count() / nframes << " s/frame"
+              << "  energy: " << t_energy.count() / nframes << " s/frame"
+              << "  dipole iterations: " << double(iter) / nframes
+              << "  max |dE|: " << max_de << " kcal/mol" << std::endl;
+  }
+
+  std::vector<bblock::System> systems;
+  auto t1 = std::chrono::high_resolution_clock::now();
+  tools::ReadNrg(const_cast<char*>(filename), systems);
+  auto t2 = std::chrono::high_resolution_clock::now();
+  std::chrono::duration<double> t = t2 - t1;
+  std::cout << std::scientific << std::setprecision(3)
+            << "ReadNrg        time: " << t.count() / nframes << " s/frame"
+            << std::endl;
+
+  std::remove(filename);
+  return 0;
+}
@@ -3,6 +3,11 @@
 
 #include <vector>
 #include <iostream>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
 
 #ifdef _OPENMP
 # include <omp.h>
@@ -15,8 +20,10 @@
 //T DotProduct(std::vector<T> a, std::vector<T> b);
 
 // Vecotr based
-template <typename T>
-void MatrixTimesVector(const std::vector<T> &A, const std::vector<T> &b, std::vector<T> &c) {
+// The matrix can be stored in a lower precision than the vectors (TA = float
+// and T = double). The products are then accumulated in the precision of T.
+template <typename TA, typename T>
+void MatrixTimesVector(const std::vector<TA> &A, const std::vector<T> &b, std::vector<T> &c) {
   // Check indexes match
   if (A.size() % b.size() != 0) {
     std::cerr << "ERROR: Indexes do not match. "
@@ -42,7 +49,7 @@ void MatrixTimesVector(const std::vector<T> &A, const std::vector<T> &b, std::ve
 # ifdef _OPENMP
 #   pragma omp parallel private(istart,iend)
   {
-    int thread_id = omp_get_thread_num();
+    size_t thread_id = omp_get_thread_num();
     size_t size = nrows / nthreads;
     istart = size*thread_id;
     iend = thread_id == nthreads -1 ? nrows : istart + size;
@@ -61,6 +68,10 @@ void MatrixTimesVector(const std::vector<T> &A, const std::vector<T> &b, std::ve
 #endif
 }
 
+// Vectors shorter than this are processed by a single thread, since the
+// overhead of the parallel region is larger than the work
+#define MIN_SIZE_OMP_VECTOR 8192
+
 template <typename T>
 T DotProduct(const std::vector<T> &a, const std::vector<T> &b) {
   // Check that sizes are the same
@@ -70,14 +81,150 @@ T DotProduct(const std::vector<T> &a, const std::vector<T> &b) {
               << b.size() << std::endl;
   }
 
+  const size_t n = b.size();
+  const T * pa = a.data();
+  const T * pb = b.data();
   T c = 0;
-  for (size_t i = 0; i < b.size(); i++) {
-    c += a[i]*b[i];
+# ifdef _OPENMP
+#   pragma omp parallel for simd schedule(static) reduction(+:c) \
+        if(n > MIN_SIZE_OMP_VECTOR)
+# endif
+  for (size_t i = 0; i < n; i++) {
+    c += pa[i]*pb[i];
   }
 
   return c;
 }
 
+// Solves the linear system A x = b, with A a n x n matrix stored by rows, 
+// using Gaussian elimination with partial pivoting. A and b are 
+// overwritten, and the solution is returned in b.
+// Returns false if the matrix is singular or nearly singular: a pivot
+// below rel_tol times the largest element of A. The default tolerance
+// is 1E4 times the machine epsilon of T.
+template <typename T>
+bool SolveLinearSystem(std::vector<T> &A, std::vector<T> &b, size_t n,
+                       T rel_tol = std::numeric_limits<T>::epsilon() * 1E4) {
+  T norm = 0;
+  for (size_t i = 0; i < n*n; i++) norm = std::max(norm, std::abs(A[i]));
+  if (!(norm > 0)) return false;
+  const T min_pivot = rel_tol * norm;
+
+  for (size_t k = 0; k < n; k++) {
+    // Find pivot
+    size_t piv = k;
+    T amax = std::abs(A[k*n + k]);
+    for (size_t i = k + 1; i < n; i++) {
+      if (std::abs(A[i*n + k]) > amax) {
+        amax = std::abs(A[i*n + k]);
+        piv = i;
+      }
+    }
+    if (!(amax >= min_pivot)) return false;
+
+    // Swap rows
+    if (piv != k) {
+      for (size_t j = 0; j < n; j++) std::swap(A[k*n + j], A[piv*n + j]);
+      std::swap(b[k], b[piv]);
+    }
+
+    // Eliminate
+    for (size_t i = k + 1; i < n; i++) {
+      T f = A[i*n + k] / A[k*n + k];
+      for (size_t j = k; j < n; j++) A[i*n + j] -= f * A[k*n + j];
+      b[i] -= f * b[k];
+    }
+  }
+
+  // Back substitution
+  for (size_t k = n; k-- > 0; ) {
+    T s = b[k];
+    for (size_t j = k + 1; j < n; j++) s -= A[k*n + j] * b[j];
+    b[k] = s / A[k*n + k];
+  }
+
+  return true;
+}
+
+// Cholesky decomposition A = L L^T of the symmetric positive definite
+// n x n matrix A, stored by rows. Only the lower triangle of A is used,
+// and it is overwritten by L. The factorization is done by blocks of
+// nb columns, so the panel and the trailing update work on rows of
+// nb contiguous elements.
+// Returns false if A is not positive definite.
+template <typename T>
+bool CholeskyDecomposition(std::vector<T> &A, size_t n, size_t nb = 64) {
+  T * a = A.data();
+  for (size_t kb = 0; kb < n; kb += nb) {
+    size_t ke = std::min(kb + nb, n);
+
+    // Diagonal block
+    for (size_t j = kb; j < ke; j++) {
+      T * aj = a + j*n;
+      T d = aj[j];
+      for (size_t p = kb; p < j; p++) d -= aj[p] * aj[p];
+      if (!(d > 0)) return false;
+      aj[j] = std::sqrt(d);
+      for (size_t i = j + 1; i < ke; i++) {
+        T * ai = a + i*n;
+        T s = ai[j];
+        for (size_t p = kb; p < j; p++) s -= ai[p] * aj[p];
+        ai[j] = s / aj[j];
+      }
+    }
+
+    // Panel below the diagonal block
+#   ifdef _OPENMP
+#     pragma omp parallel for schedule(static)
+#   endif
+    for (size_t i = ke; i < n; i++) {
+      T * ai = a + i*n;
+      for (size_t j = kb; j < ke; j++) {
+        const T * aj = a + j*n;
+        T s = ai[j];
+        for (size_t p = kb; p < j; p++) s -= ai[p] * aj[p];
+        ai[j] = s / aj[j];
+      }
+    }
+
+    // Trailing update of the lower triangle
+#   ifdef _OPENMP
+#     pragma omp parallel for schedule(dynamic)
+#   endif
+    for (size_t i = ke; i < n; i++) {
+      T * ai = a + i*n;
+      for (size_t j = ke; j <= i; j++) {
+        const T * aj = a + j*n;
+        T s = 0;
+        for (size_t p = kb; p < ke; p++) s += ai[p] * aj[p];
+        ai[j] -= s;
+      }
+    }
+  }
+
+  return true;
+}
+
+// Solves L L^T x = b, with L the lower triangle of the n x n matrix
+// returned by CholeskyDecomposition. b is overwritten by the solution.
+template <typename T>
+void CholeskySolve(const std::vector<T> &L, std::vector<T> &b, size_t n) {
+  const T * l = L.data();
+  // L y = b
+  for (size_t i = 0; i < n; i++) {
+    const T * li = l + i*n;
+    T s = b[i];
+    for (size_t p = 0; p < i; p++) s -= li[p] * b[p];
+    b[i] = s / li[i];
+  }
+  // L^T x = y, going through the rows of L
+  for (size_t i = n; i-- > 0; ) {
+    const T * li = l + i*n;
+    b[i] /= li[i];
+    for (size_t p = 0; p < i; p++) b[p] -= li[p] * b[i];
+  }
+}
+
 // Pointer based
 //void MatrixTimesVector(const double * A, const double * b, double * c, 
 //                       size_t sizeA, size_t sizeb) {
@@ -121,4 +268,39 @@ void MatrixTimesVector(const T * A, const T * b, T * c, size_t sizeA, size_t siz
   }
 }
 
+// Exponential that vectorizes in simd loops, where std::exp is a call to
+// the scalar library function. x is clamped to [-708, 708]. The argument
+// is reduced to x = k ln2 + r, with |r| <= ln2/2, and exp(r) is evaluated
+// with its Taylor series to degree 13. Relative error is below 1E-15.
+#ifdef _OPENMP
+# pragma omp declare simd
+#endif
+inline double ExpSimd(double x) {
+  const double log2e = 1.44269504088896341;
+  // ln2 split in two parts, the first one exact in k*ln2_hi
+  const double ln2_hi = 6.93145751953125000e-01;
+  const double ln2_lo = 1.42860682030941723e-06;
+  // 1.5*2^52 + 1023. Adding it rounds to the nearest integer and leaves
+  // k + 1023 in the low bits of the mantissa.
+  const double shifter = 6755399441056767.0;
+
+  x = std::min(std::max(x, -708.0), 708.0);
+  const double t = x*log2e + shifter;
+  const double k = t - shifter;
+  const double r = (x - k*ln2_hi) - k*ln2_lo;
+
+  double p = 1.0/6227020800.0;
+  const double c[13] = {1.00000000000000000e+00, 1.00000000000000000e+00, 5.00000000000000000e-01, 1.66666666666666657e-01, 4.16666666666666644e-02, 8.33333333333333322e-03, 1.38888888888888894e-03, 1.98412698412698413e-04, 2.48015873015873016e-05, 2.75573192239858925e-06, 2.75573192239858883e-07, 2.50521083854417202e-08, 2.08767569878681002e-09};
+  for (int i = 12; i >= 0; i--) p = p*r + c[i];
+
+  // 2^k from the exponent bits
+  uint64_t bits;
+  std::memcpy(&bits, &t, sizeof(double));
+  bits <<= 52;
+  double scale;
+  std::memcpy(&scale, &bits, sizeof(double));
+
+  return p*scale;
+}
+
 #endif
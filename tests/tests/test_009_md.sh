@@ -0,0 +1,9 @@
+#!/bin/bash
+
+filename=$(basename "$0")
+filename="${filename%.*}"
+
+mkdir -p outputs
+
+../../install/bin/md-test inputs/${filename}.nrg > outputs/${filename}.out
+
@@ -0,0 +1,8 @@
+#!/bin/bash
+
+filename=$(basename "$0")
+filename="${filename%.*}"
+
+mkdir -p outputs
+
+../../install/bin/gammq34-test > outputs/${filename}.out
@@ -0,0 +1,8 @@
+#!/bin/bash
+
+filename=$(basename "$0")
+filename="${filename%.*}"
+
+mkdir -p outputs
+
+../../install/bin/tang_toennies-test > outputs/${filename}.out
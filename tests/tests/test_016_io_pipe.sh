@@ -0,0 +1,8 @@
+#!/bin/bash
+
+filename=$(basename "$0")
+filename="${filename%.*}"
+
+mkdir -p outputs
+
+cat inputs/test_001_io.nrg | ../../install/bin/io-test /dev/stdin outputs/${filename}.out 